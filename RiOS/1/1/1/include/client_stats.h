@@ -1,5 +1,7 @@
 #pragma once
 
+#include "sync_auth.h"
+
 enum ClientState {
     CONNECTED,
     DISCONNECTED
@@ -10,4 +12,5 @@ struct ClientStats {
     int totalCorrection = 0;
     double averageCorrection = 0.0;
     ClientState state = DISCONNECTED;
+    SyncAuthBinding auth; // --keys
 };
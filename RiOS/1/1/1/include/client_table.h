@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#include "correction_filter.h"
+#include "net_address.h"
+#include "slab_arena.h"
+#include "sync_auth.h"
+
+const int32_t CLIENT_DISCONNECTED = 0;
+const int32_t CLIENT_CONNECTED = 1;
+
+// Growable array on 64-byte aligned storage so the sweeps can use full-width
+// aligned loads from the first element.
+template<typename T>
+class AlignedColumn {
+public:
+    AlignedColumn() = default;
+    AlignedColumn(const AlignedColumn &) = delete;
+    AlignedColumn &operator=(const AlignedColumn &) = delete;
+
+    ~AlignedColumn() { free(values); }
+
+    void push_back(T value) {
+        if (count == capacity) {
+            reserve(capacity == 0 ? 1024 : capacity * 2);
+        }
+        values[count++] = value;
+    }
+
+    void pop_back() { count--; }
+
+    void reserve(size_t newCapacity) {
+        if (newCapacity <= capacity) {
+            return;
+        }
+        size_t bytes = (newCapacity * sizeof(T) + 63) / 64 * 64;
+        T *grown = static_cast<T *>(aligned_alloc(64, bytes));
+        if (grown == nullptr) {
+            throw std::bad_alloc();
+        }
+        if (count > 0) {
+            memcpy(grown, values, count * sizeof(T));
+        }
+        free(values);
+        values = grown;
+        capacity = newCapacity;
+    }
+
+    T &operator[](size_t i) { return values[i]; }
+    const T &operator[](size_t i) const { return values[i]; }
+    T &back() { return values[count - 1]; }
+    const T *data() const { return values; }
+    size_t size() const { return count; }
+
+private:
+    T *values = nullptr;
+    size_t count = 0;
+    size_t capacity = 0;
+};
+
+struct FleetStats {
+    size_t clients = 0;
+    size_t connected = 0;
+    int64_t requests = 0;
+    int64_t totalCorrection = 0;
+    int32_t minCorrection = INT32_MAX;
+    int32_t maxCorrection = INT32_MIN;
+};
+
+// ptp_server's per-client state, one column per field. Rows are found through
+// the key index; removal moves the last row into the hole. The periodic
+// passes (idle expiry, fleet statistics) walk the columns linearly and use
+// AVX2 when the CPU has it. Each client's filter history and index node are
+// slab slots. Under a memory ceiling the columns and the index buckets are
+// sized for as many clients as the ceiling pays for when it is set, so
+// admitting a client touches no heap and the ceiling covers all of it;
+// without one they grow by doubling.
+class ClientTable {
+public:
+    static const uint32_t FULL = UINT32_MAX;
+
+    explicit ClientTable(size_t expectedClients = 0, const ArenaOptions &memory = ArenaOptions());
+
+    // Row of the client; a new row starts disconnected with no requests.
+    // FULL if a new client does not fit under the memory ceiling.
+    uint32_t findOrInsert(const ClientKey &key, bool &inserted);
+
+    // -1 for unknown clients.
+    int64_t find(const ClientKey &key) const;
+
+    // Moves the last row into `row`.
+    void remove(uint32_t row);
+
+    size_t size() const { return keys.size(); }
+
+    // Rows last seen before cutoffMs, in ascending order.
+    void collectIdle(int32_t cutoffMs, std::vector<uint32_t> &rows) const;
+    // The same for rows [begin, end), for a walk done a slice at a time.
+    void collectIdle(int32_t cutoffMs, size_t begin, size_t end, std::vector<uint32_t> &rows) const;
+
+    // Rows in the disconnected state, in ascending order.
+    void collectDisconnected(std::vector<uint32_t> &rows) const;
+
+    FleetStats aggregate() const;
+
+    // Applies to memory mapped from now on. The ceiling is divided by what
+    // one client costs in slots, column entries and an index bucket; the
+    // columns and the index are reserved for that many rows now.
+    void setMemoryOptions(const ArenaOptions &memory);
+    ArenaCounters memory() const;
+
+    // Off forces the scalar sweeps, e.g. to compare them in a benchmark.
+    static void setSimd(bool enabled);
+    static bool simdActive();
+
+    std::vector<ClientKey> keys;
+    AlignedColumn<int32_t> state;
+    AlignedColumn<int32_t> lastSeenMs;
+    AlignedColumn<int32_t> requestCount;
+    AlignedColumn<int32_t> minCorrection;
+    AlignedColumn<int32_t> maxCorrection;
+    AlignedColumn<int32_t> lastCorrection;
+    AlignedColumn<int64_t> totalCorrection;
+    AlignedColumn<CorrectionHistory *> history; // recent raw corrections for the filter
+    AlignedColumn<SyncAuthBinding> auth;        // --keys
+
+private:
+    using IndexAllocator = SlabAllocator<std::pair<const ClientKey, uint32_t>>;
+
+    // Grows every column and the index to `rows`; throws bad_alloc.
+    void reserveRows(size_t rows);
+    size_t columnBytes() const;
+
+    SlabArena historyArena;
+    SlabArena nodeArena;
+    std::unordered_map<ClientKey, uint32_t, ClientKeyHash, std::equal_to<ClientKey>, IndexAllocator> index;
+    size_t rowCapacity = 0; // what every column has room for
+    bool bounded = false;   // under a ceiling, rowCapacity is all the table gets
+    uint64_t refusedRows = 0;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct ClockSample {
+    double offsetMs = 0;
+    double delayMs = 0;
+    int64_t timeNs = 0; // local monotonic time the sample was taken
+};
+
+// NTP-style clock filter. Keeps the last `stages` samples and selects the one
+// with the smallest synchronization distance, delay / 2 + dispersion, where a
+// sample's dispersion starts at the clock precision and grows by phiPpm with
+// age. The least-delayed sample of a burst wins; an old one loses to fresh
+// samples once it has aged by more than their extra delay.
+class ClockFilter {
+public:
+    explicit ClockFilter(int stages = 8, double precisionMs = 1.0, double phiPpm = 15.0);
+
+    void add(const ClockSample &sample);
+
+    // False while the filter is empty.
+    bool select(int64_t nowNs, ClockSample &best) const;
+
+    double dispersionMs(const ClockSample &sample, int64_t nowNs) const;
+
+    // RMS offset difference of the kept samples against the selected one.
+    double jitterMs(int64_t nowNs) const;
+
+    void clear();
+
+    size_t size() const { return samples.size(); }
+
+private:
+    std::vector<ClockSample> samples;
+    size_t stages;
+    double precisionMs;
+    double phi;
+};
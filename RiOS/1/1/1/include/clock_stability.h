@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Frequency and time stability of a phase (time error) series x in seconds,
+// sampled every tau0 seconds, at averaging times tau = m * tau0.
+struct StabilityPoint {
+    uint32_t m;
+    double tau;
+    double adev; // overlapping Allan deviation
+    double tdev; // time deviation
+    double mtie; // maximum time interval error
+};
+
+// Averaging factors for a series of n samples, up to n / 3 so that every
+// statistic has at least one term: log-spaced with perDecade per decade, or
+// every m when perDecade is 0.
+std::vector<uint32_t> averagingFactors(size_t n, int perDecade);
+
+// A phase series with the prefix sums TDEV needs, built once and shared by
+// all averaging times.
+class PhaseSeries {
+public:
+    PhaseSeries(std::vector<double> phase, double tau0);
+
+    size_t size() const { return x.size(); }
+    double tau0() const { return interval; }
+
+    double overlappingAdev(uint32_t m) const;
+    double timeDeviation(uint32_t m) const;
+    double maxTimeIntervalError(uint32_t m) const;
+
+    StabilityPoint at(uint32_t m) const;
+
+private:
+    std::vector<double> x;
+    std::vector<double> prefix; // prefix[k] = sum of x[0..k) less the mean
+    double interval;
+};
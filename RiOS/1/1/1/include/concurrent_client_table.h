@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+#include "client_table.h"
+#include "net_address.h"
+#include "sync_auth.h"
+
+// One client's counters, the row ClientTable keeps in columns.
+struct ClientRecord {
+    int32_t state = CLIENT_DISCONNECTED;
+    int32_t lastSeenMs = 0;
+    int32_t requestCount = 0;
+    int32_t minCorrection = INT32_MAX;
+    int32_t maxCorrection = INT32_MIN;
+    int32_t lastCorrection = 0;
+    int64_t totalCorrection = 0;
+    SyncAuthBinding auth; // --keys
+};
+
+// Epoch-based reclamation. A thread pins the global epoch while it holds
+// pointers into a shared structure; memory retired in epoch e is freed once
+// the epoch has reached e + 2, i.e. when no pinned thread can still see it.
+class EpochReclaimer {
+public:
+    static const size_t MAX_THREADS = 128;
+
+    EpochReclaimer() = default;
+    ~EpochReclaimer(); // frees everything still retired
+
+    EpochReclaimer(const EpochReclaimer &) = delete;
+    EpochReclaimer &operator=(const EpochReclaimer &) = delete;
+
+    // Slot for the calling thread. Slots are never given back.
+    size_t registerThread();
+
+    void pin(size_t slot);
+    void unpin(size_t slot);
+
+    // Queues object for destroy(); only the slot's own thread calls this.
+    void retire(size_t slot, void *object, void (*destroy)(void *));
+
+    // Advances the epoch if every pinned thread has seen it, then frees what
+    // the slot retired long enough ago.
+    void collect(size_t slot);
+
+    uint64_t epoch() const { return globalEpoch.load(std::memory_order_acquire); }
+    uint64_t pendingCount() const { return pending.load(std::memory_order_relaxed); }
+    uint64_t freedCount() const { return freed.load(std::memory_order_relaxed); }
+
+private:
+    struct Retired {
+        void *object;
+        void (*destroy)(void *);
+        uint64_t epoch;
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> pinned{0}; // epoch while pinned, 0 when quiescent
+        std::deque<Retired> limbo;       // in retirement order, so oldest first
+        uint32_t sinceCollect = 0;
+    };
+
+    bool tryAdvance();
+
+    std::atomic<uint64_t> globalEpoch{1};
+    std::atomic<size_t> slotCount{0};
+    std::atomic<uint64_t> pending{0};
+    std::atomic<uint64_t> freed{0};
+    Slot slots[MAX_THREADS];
+};
+
+// ptp_server's per-client state for deployments where one client's packets
+// reach several threads (one socket read by all workers, XDP queues). Any
+// number of threads look up, insert, update and evict concurrently:
+//
+//  - lookups are lock-free: they walk the bucket chain without writing;
+//  - inserts and removals lock one bucket, using the low bit of its head;
+//  - each entry has a seqlock: writers of the same client exclude each other,
+//    readers (reports, sweeps) take consistent copies without blocking them;
+//  - the bucket array doubles incrementally: every insert or removal moves a
+//    few buckets, a moved bucket forwards readers to the new array;
+//  - removed entries, chain nodes and drained arrays are freed through
+//    EpochReclaimer.
+//
+// Every call that returns or visits entries must run under a Guard of the
+// calling thread; entries stay valid until the guard is released.
+class ConcurrentClientTable {
+public:
+    struct Entry {
+        explicit Entry(const ClientKey &key) : key(key) {}
+
+        const ClientKey key;
+        ClientRecord record;      // written between lock() and unlock()
+        std::vector<int> history; // only touched between lock() and unlock()
+
+        void lock();
+        void unlock();
+
+        // Consistent copy of record without taking the lock.
+        ClientRecord read() const;
+
+        bool removed() const { return gone.load(std::memory_order_acquire); }
+
+    private:
+        friend class ConcurrentClientTable;
+        std::atomic<uint32_t> sequence{0}; // odd while a writer holds the entry
+        std::atomic<bool> gone{false};
+    };
+
+    class Guard {
+    public:
+        Guard(ConcurrentClientTable &table, size_t thread) : reclaimer(table.reclaimer), thread(thread) {
+            reclaimer.pin(thread);
+        }
+
+        ~Guard() { reclaimer.unpin(thread); }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+    private:
+        EpochReclaimer &reclaimer;
+        size_t thread;
+    };
+
+    explicit ConcurrentClientTable(size_t expectedClients = 0);
+    ~ConcurrentClientTable();
+
+    ConcurrentClientTable(const ConcurrentClientTable &) = delete;
+    ConcurrentClientTable &operator=(const ConcurrentClientTable &) = delete;
+
+    // Each thread registers once and passes its id to the calls below.
+    size_t registerThread() { return reclaimer.registerThread(); }
+
+    Entry *find(const ClientKey &key) const;
+
+    // A new entry starts disconnected with no requests.
+    Entry *findOrInsert(size_t thread, const ClientKey &key, bool &inserted);
+
+    bool remove(size_t thread, const ClientKey &key);
+
+    // Calls visit(Entry &) once for every entry present throughout the walk;
+    // entries inserted or removed meanwhile may or may not be visited.
+    template<typename F>
+    void forEach(F &&visit) const {
+        const BucketArray *array = current.load(std::memory_order_acquire);
+        for (size_t i = 0; i <= array->mask; i++) {
+            visitBucket(array, i, visit);
+        }
+    }
+
+    // forEach() over buckets [begin, end) only, for a walk done a slice at
+    // a time. Returns the bucket count, which a resize may change between
+    // slices; the walk is done once begin reaches it.
+    template<typename F>
+    size_t forEachBucket(size_t begin, size_t end, F &&visit) const {
+        const BucketArray *array = current.load(std::memory_order_acquire);
+        end = std::min(end, array->mask + 1);
+        for (size_t i = begin; i < end; i++) {
+            visitBucket(array, i, visit);
+        }
+        return array->mask + 1;
+    }
+
+    size_t size() const { return count.load(std::memory_order_relaxed); }
+    size_t bucketCount() const { return current.load(std::memory_order_acquire)->mask + 1; }
+    bool resizing() const { return current.load(std::memory_order_acquire)->next.load() != nullptr; }
+    uint64_t resizes() const { return resizeCount.load(std::memory_order_relaxed); }
+    const EpochReclaimer &epochs() const { return reclaimer; }
+
+private:
+    struct Node {
+        Entry *entry;
+        uint64_t hash;
+        std::atomic<Node *> next;
+    };
+
+    // Heads hold a Node pointer with LOCKED in the low bit while a writer
+    // holds the bucket, or MOVED once the bucket lives in `next`.
+    struct BucketArray {
+        explicit BucketArray(size_t buckets);
+
+        size_t mask;
+        std::unique_ptr<std::atomic<uintptr_t>[]> heads;
+        std::atomic<BucketArray *> next{nullptr};
+        std::atomic<size_t> cursor{0};   // next bucket to move
+        std::atomic<size_t> moved{0};
+    };
+
+    static const uintptr_t LOCKED = 1;
+    static const uintptr_t MOVED = 2;
+
+    static Node *chain(uintptr_t head) { return reinterpret_cast<Node *>(head & ~LOCKED); }
+
+    template<typename F>
+    static void visitBucket(const BucketArray *array, size_t index, F &visit) {
+        uintptr_t head = array->heads[index].load(std::memory_order_acquire);
+        if (head == MOVED) {
+            const BucketArray *next = array->next.load(std::memory_order_acquire);
+            visitBucket(next, index, visit);
+            visitBucket(next, index + array->mask + 1, visit);
+            return;
+        }
+        for (Node *node = chain(head); node != nullptr; node = node->next.load(std::memory_order_acquire)) {
+            if (!node->entry->removed()) {
+                visit(*node->entry);
+            }
+        }
+    }
+
+    static uintptr_t lockBucket(BucketArray *array, size_t index);
+
+    // Locks the bucket that owns hash, moving it forward first if its array
+    // is being drained. Returns the array; head receives the unlocked head.
+    BucketArray *lockOwner(size_t thread, uint64_t hash, uintptr_t &head);
+
+    void moveBucket(size_t thread, BucketArray *array, size_t index, uintptr_t head);
+    void helpResize(size_t thread);
+    void startResize(BucketArray *array);
+
+    std::atomic<BucketArray *> current;
+    std::atomic<size_t> count{0};
+    std::atomic<uint64_t> resizeCount{0};
+    mutable EpochReclaimer reclaimer;
+};
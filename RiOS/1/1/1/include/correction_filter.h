@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct FilterParams {
+    int historyWindow = 5;
+    double outlierThreshold = 2.5;
+    double alpha = 0.3;
+};
+
+// A client's recent raw corrections, oldest first, in 32 bytes. Windows
+// longer than CAPACITY are cut to CAPACITY.
+struct CorrectionHistory {
+    static const int CAPACITY = 7;
+
+    int32_t count = 0;
+    int32_t values[CAPACITY];
+
+    void clear() { count = 0; }
+};
+
+// ptp_server's correction filter: outlier rejection against the recent
+// history, exponential smoothing otherwise. requestCount and lastCorrection
+// are the client's values before this request is counted.
+int advancedCorrection(int rawCorrection, int requestCount, int lastCorrection,
+                       std::vector<int> &history, const FilterParams &params);
+int advancedCorrection(int rawCorrection, int requestCount, int lastCorrection,
+                       CorrectionHistory &history, const FilterParams &params);
+
+// Median of the collected corrections, as the NTP client and server apply it
+// once at least three samples are available.
+int64_t correctionMedian(const std::vector<int64_t> &corrections);
+
+// Per-client correction filter as used by the servers, for offline replay.
+class CorrectionFilter {
+public:
+    virtual ~CorrectionFilter() = default;
+    virtual int apply(int rawCorrection) = 0;
+};
+
+// "raw" (server), "advanced" (ptp_server). Returns nullptr for unknown names.
+std::unique_ptr<CorrectionFilter> makeCorrectionFilter(const std::string &name, const FilterParams &params);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+
+struct DisciplineParams {
+    double timeConstantS = 4;     // PLL time constant; never shorter than the update interval
+    double fllIntervalS = 64;     // update intervals this long are steered by the FLL alone
+    double stepThresholdMs = 128; // larger offsets are stepped instead of slewed
+    double maxSlewPpm = 500;
+    double maxFreqPpm = 500;
+};
+
+// The clock from its last update on, as two linear pieces: rate 1 +
+// slewingRate until slewEndNs, then 1 + rate. For publishing the clock to
+// readers on other threads. Like read(), a reader must not go below floorNs.
+struct DisciplinedSegment {
+    int64_t baseLocalNs = 0;
+    int64_t baseValueNs = 0;
+    int64_t slewEndNs = 0;
+    double slewingRate = 0;
+    double rate = 0;
+    int64_t floorNs = INT64_MIN;
+
+    int64_t value(int64_t localNs) const;
+};
+
+// Virtual clock disciplined by a stream of offset measurements, in the manner
+// of NTP's hybrid PLL/FLL. Between updates it runs at the local rate plus the
+// estimated frequency correction and slews the remaining phase offset away at
+// a bounded rate, so it never jumps except for a step beyond the threshold.
+// read() never goes backwards: after a backward step the clock holds until
+// real time catches up.
+//
+// Not thread-safe; all times are nanoseconds.
+class DisciplinedClock {
+public:
+    explicit DisciplinedClock(const DisciplineParams &params = DisciplineParams());
+
+    // offsetNs is reference minus this clock, measured at local time localNs.
+    // The first update sets the clock.
+    void update(int64_t offsetNs, int64_t localNs);
+
+    int64_t read(int64_t localNs);
+
+    bool synchronized() const { return updates > 0; }
+
+    double frequencyPpm() const { return frequency * 1e6; }
+
+    // Phase offset still to be slewed away at localNs.
+    int64_t pendingNs(int64_t localNs) const;
+
+    uint64_t steps() const { return stepCount; }
+
+    // Only meaningful once synchronized().
+    DisciplinedSegment segment() const;
+
+private:
+    int64_t value(int64_t localNs) const;
+    double slewed(int64_t elapsedNs) const;
+
+    DisciplineParams params;
+    int64_t baseLocalNs = 0;
+    int64_t baseValueNs = 0;
+    double frequency = 0;
+    double phaseNs = 0;   // offset being slewed since baseLocalNs
+    double slewRate = 0;  // ns of phase per ns of local time, signed
+    int64_t lastReadNs = INT64_MIN;
+    uint64_t updates = 0;
+    uint64_t stepCount = 0;
+};
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 struct GetSync {
   char cmd[4];
   int currentValue;
+  uint32_t sequence; // echoed in the reply; older clients send only the first 8 bytes
 };
+
+const size_t GET_SYNC_LEGACY_SIZE = offsetof(GetSync, sequence);
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Hot upgrade. The running server listens on a Unix socket; a new binary
+// started with the same path connects, receives the bound UDP sockets
+// (SCM_RIGHTS) and the serialized client state, acknowledges, and starts
+// serving once the old process has exited. Requests that arrive in between
+// wait in the shared socket buffers, so none is lost.
+//
+// Both ends are the same program on the same host: state is exchanged in the
+// host's native layout.
+
+const uint32_t HANDOFF_MAGIC = 0x46444E48; // "HNDF"
+const uint32_t HANDOFF_VERSION = 2;
+const uint32_t HANDOFF_SERVER = 1;  // server
+const uint32_t HANDOFF_SYNC2 = 2;   // ptp_server
+const size_t HANDOFF_MAX_FDS = 64;
+
+// Listening socket for successors, non-blocking. Replaces a stale socket
+// file at path. Returns -1 on failure.
+int listenForHandoff(const std::string &path);
+
+// Accepted successor, or -1 when none is waiting.
+int acceptHandoff(int listener);
+
+// Predecessor side: sends the sockets and the state, then waits up to
+// timeoutMs for the successor's acknowledgement. On false the caller still
+// owns everything and keeps serving.
+bool sendHandoff(int conn, uint32_t kind, const std::vector<int> &fds, const std::string &state, int timeoutMs);
+
+// Successor side: connects to path and receives. The predecessor keeps
+// serving until acknowledgeHandoff(), so the state can be checked first;
+// closing conn instead aborts the upgrade.
+bool receiveHandoff(const std::string &path, uint32_t kind, std::vector<int> &fds, std::string &state, int &conn);
+
+bool acknowledgeHandoff(int conn);
+
+// Blocks until the predecessor closes the connection by exiting, up to
+// timeoutMs, then closes conn.
+void awaitPredecessorExit(int conn, int timeoutMs);
+
+class StateWriter {
+public:
+    template<typename T>
+    void put(const T &value) {
+        static_assert(std::is_trivially_copyable<T>::value, "state is copied byte-wise");
+        data.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    void putInts(const std::vector<int> &values) {
+        put(static_cast<uint32_t>(values.size()));
+        if (!values.empty()) {
+            data.append(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(int));
+        }
+    }
+
+    std::string data;
+};
+
+class StateReader {
+public:
+    explicit StateReader(const std::string &data) : data(data) {}
+
+    template<typename T>
+    bool get(T &value) {
+        static_assert(std::is_trivially_copyable<T>::value, "state is copied byte-wise");
+        if (data.size() - pos < sizeof(T)) {
+            return false;
+        }
+        memcpy(&value, data.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    bool getInts(std::vector<int> &values) {
+        uint32_t count;
+        if (!get(count) || (data.size() - pos) / sizeof(int) < count) {
+            return false;
+        }
+        values.resize(count);
+        if (count > 0) {
+            memcpy(values.data(), data.data() + pos, count * sizeof(int));
+        }
+        pos += count * sizeof(int);
+        return true;
+    }
+
+    bool done() const { return pos == data.size(); }
+
+private:
+    const std::string &data;
+    size_t pos = 0;
+};
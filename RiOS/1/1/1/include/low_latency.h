@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+struct LowLatencyOptions {
+    bool enabled = false;
+    int cpu = -1;            // pin the packet thread, -1 = leave to the scheduler
+    int fifoPriority = 0;    // SCHED_FIFO priority, 0 = stay SCHED_OTHER
+    bool lockMemory = true;  // mlockall + pre-faulted stack/heap
+    int busyPollUs = 50;     // SO_BUSY_POLL, 0 = off
+    int spinUs = 200;        // Reactor::setSpin(): polling without sleeping before each wait
+};
+
+// Consumes one of --low-latency, --cpu N, --fifo PRIO, --busy-poll US, --spin US
+// at argv[i]. Returns false if argv[i] is not a low-latency option.
+bool parseLowLatencyOption(int &i, int argc, char *argv[], LowLatencyOptions &options);
+
+const char *lowLatencyUsage();
+
+// Applies the options to the calling thread and the socket, and logs every
+// setting that could not be applied (missing privileges, unsupported kernel).
+void applyLowLatency(int fd, const LowLatencyOptions &options);
+
+// Log-linear histogram of nanosecond latencies: 8 sub-buckets per power of two.
+class LatencyHistogram {
+public:
+    void record(int64_t ns);
+    void merge(const LatencyHistogram &other);
+    uint64_t count() const { return total; }
+    int64_t percentile(double fraction) const;
+    void print(std::ostream &out, const std::string &title) const;
+
+private:
+    static const int SUB_BUCKETS = 8;
+    static const int BUCKETS = 64 * SUB_BUCKETS;
+
+    static int bucketOf(uint64_t ns);
+    static int64_t upperBound(int bucket);
+
+    uint64_t buckets[BUCKETS] = {};
+    uint64_t total = 0;
+    int64_t minNs = INT64_MAX;
+    int64_t maxNs = 0;
+    double sumNs = 0;
+};
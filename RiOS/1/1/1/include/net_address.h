@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Fixed-size client identity: 128-bit address (IPv4 as v4-mapped IPv6) and
+// port in network byte order, plus the logical client behind a gateway (0
+// for direct clients). Built straight from the socket address and hashed as
+// two 64-bit words, so no string is formatted on the packet path.
+struct ClientKey {
+    uint8_t addr[16];
+    uint16_t port;
+    uint16_t logicalId;
+
+    bool operator==(const ClientKey &other) const {
+        return memcmp(this, &other, sizeof(ClientKey)) == 0;
+    }
+
+    bool operator!=(const ClientKey &other) const {
+        return !(*this == other);
+    }
+};
+
+struct ClientKeyHash {
+    size_t operator()(const ClientKey &key) const {
+        uint64_t high;
+        uint64_t low;
+        memcpy(&high, key.addr, 8);
+        memcpy(&low, key.addr + 8, 8);
+        uint64_t h = (high ^ (low * 0x9E3779B97F4A7C15ULL)) + key.port +
+                     (static_cast<uint64_t>(key.logicalId) << 16);
+        h ^= h >> 32;
+        h *= 0xD6E8FEB86659FD93ULL;
+        h ^= h >> 32;
+        return static_cast<size_t>(h);
+    }
+};
+
+ClientKey makeClientKey(const sockaddr_storage &addr);
+
+// "1.2.3.4:5678" for IPv4 clients, "[2001:db8::1]:5678" otherwise, with
+// "#id" appended for a logical client behind a gateway.
+std::string formatClientKey(const ClientKey &key);
+
+std::string formatAddress(const sockaddr_storage &addr);
+
+inline std::ostream &operator<<(std::ostream &out, const ClientKey &key) {
+    return out << formatClientKey(key);
+}
+
+// UDP socket bound to the wildcard address: AF_INET6 with IPV6_V6ONLY off so
+// IPv4 clients arrive as v4-mapped addresses, or plain AF_INET when the host
+// has no IPv6. With reusePort several sockets can share the port and the
+// kernel spreads the clients across them. Returns -1 on failure.
+int openServerSocket(uint16_t port, bool reusePort = false);
+
+// Resolves "1.2.3.4", "2001:db8::1", "[2001:db8::1]" or a host name.
+bool resolveAddress(const std::string &host, uint16_t port, sockaddr_storage &addr, socklen_t &addrLen);
+
+// Splits "host", "host:port", "[v6]" or "[v6]:port"; a bare IPv6 address has
+// no port. Keeps defaultPort when none is given.
+bool splitHostPort(const std::string &spec, std::string &host, uint16_t &port, uint16_t defaultPort);
+
+bool sameAddress(const sockaddr_storage &a, const sockaddr_storage &b);
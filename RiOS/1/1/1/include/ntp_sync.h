@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+// Sequenced request to ntp_time_server. Older clients send the bare "GET" and
+// get back only the 64-bit big-endian time.
+struct NtpSyncRequest {
+    char cmd[4]; // "GET\0"
+    uint32_t sequence;
+};
+
+struct __attribute__((packed)) NtpSyncReply {
+    uint64_t serverTime; // big-endian, ms since the Unix epoch
+    uint32_t sequence;   // copied from the request
+};
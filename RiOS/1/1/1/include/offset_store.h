@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "net_address.h"
+#include "spsc_ring.h"
+
+// One offset measurement. timeNs is CLOCK_REALTIME; offset and delay are in
+// the units the store was opened with. A client records its offset to the
+// server and the round trip; a server records the correction it sent and its
+// residence time (request received to reply sent).
+struct OffsetSample {
+    ClientKey key;
+    int64_t timeNs;
+    int64_t offset;
+    int64_t delay;
+};
+
+const uint32_t OFFSET_STORE_MAGIC = 0x5453534F; // "OSST"
+const uint32_t OFFSET_STORE_VERSION = 1;
+const size_t OFFSET_BLOCK_SIZE = 512;
+
+struct OffsetStoreHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blockSize;
+    uint32_t offsetUnitNs;
+    uint32_t delayUnitNs;
+    uint32_t reserved[3];
+};
+
+// Every block is OFFSET_BLOCK_SIZE bytes: this header followed by a bit
+// stream with `count` samples of one client. Sample times are stored in
+// microseconds.
+struct OffsetBlockHeader {
+    ClientKey key;
+    uint32_t count;
+    int64_t firstUs;
+    int64_t lastUs;
+    uint32_t payloadBits;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(OffsetStoreHeader) == 32, "store header layout is part of the file format");
+static_assert(sizeof(OffsetBlockHeader) == 48, "block header layout is part of the file format");
+
+const size_t OFFSET_BLOCK_PAYLOAD = OFFSET_BLOCK_SIZE - sizeof(OffsetBlockHeader);
+
+// Builds one block. Times are coded as the change of the interval between
+// samples (delta-of-delta), offset and delay as the zigzagged change from the
+// previous sample; all three use the same prefix code, so a steady poll
+// interval with an unchanged value costs a few bits.
+class OffsetBlockEncoder {
+public:
+    explicit OffsetBlockEncoder(const ClientKey &key);
+
+    // False when the sample does not fit; the block is then complete.
+    bool append(int64_t timeUs, int64_t offset, int64_t delay);
+
+    uint32_t count() const { return header.count; }
+    int64_t firstUs() const { return header.firstUs; }
+
+    // The whole block, header and zero-padded payload.
+    void finish(uint8_t out[OFFSET_BLOCK_SIZE]) const;
+
+private:
+    void writeBits(uint64_t value, int bits);
+    void writeCode(int64_t value);
+    int codeBits(int64_t value) const;
+
+    OffsetBlockHeader header{};
+    uint8_t payload[OFFSET_BLOCK_PAYLOAD] = {};
+    uint32_t bitPos = 0;
+    int64_t lastDeltaUs = 0;
+    int64_t lastOffset = 0;
+    int64_t lastDelay = 0;
+};
+
+// Decodes a block produced by OffsetBlockEncoder. Returns false if the block
+// is malformed; samples decoded up to that point are kept.
+bool decodeOffsetBlock(const uint8_t *block, std::vector<OffsetSample> &samples);
+
+// Append-only store written from a background thread. record() is meant for
+// the packet thread: it copies into a ring and never blocks; samples that do
+// not fit are counted as dropped. The writer keeps one open block per client
+// and writes it when full, when it is older than maxBlockAgeS, or on close().
+class OffsetStore {
+public:
+    OffsetStore() = default;
+    ~OffsetStore();
+
+    OffsetStore(const OffsetStore &) = delete;
+    OffsetStore &operator=(const OffsetStore &) = delete;
+
+    // Appends to an existing store if its units match.
+    bool open(const std::string &path, uint32_t offsetUnitNs, uint32_t delayUnitNs, int maxBlockAgeS = 600);
+    void close();
+
+    bool isOpen() const { return file != nullptr; }
+
+    void record(const OffsetSample &sample) {
+        if (!ring->push(sample)) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t samplesWritten() const { return samples.load(); }
+    uint64_t blocksWritten() const { return blocks.load(); }
+    uint64_t droppedCount() const { return dropped.load(); }
+
+private:
+    void writerLoop();
+    void add(const OffsetSample &sample);
+    void writeBlock(const OffsetBlockEncoder &encoder);
+    void writeAged(int64_t nowUs);
+
+    FILE *file = nullptr;
+    int64_t maxBlockAgeUs = 0;
+    std::unique_ptr<SpscRing<OffsetSample>> ring;
+    std::unordered_map<ClientKey, OffsetBlockEncoder, ClientKeyHash> openBlocks; // writer thread only
+    std::thread writer;
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> samples{0};
+    std::atomic<uint64_t> blocks{0};
+    std::atomic<uint64_t> dropped{0};
+};
+
+// Read-only view of a store through mmap. Blocks have a fixed size, so a
+// query walks the block headers and decodes only the blocks of the wanted
+// client that overlap the time window. A block cut short by a crash at the
+// end of the file is ignored.
+class OffsetStoreReader {
+public:
+    OffsetStoreReader() = default;
+    ~OffsetStoreReader();
+
+    OffsetStoreReader(const OffsetStoreReader &) = delete;
+    OffsetStoreReader &operator=(const OffsetStoreReader &) = delete;
+
+    bool open(const std::string &path);
+
+    const OffsetStoreHeader &header() const { return *reinterpret_cast<const OffsetStoreHeader *>(base); }
+    size_t blockCount() const { return count; }
+    const OffsetBlockHeader &block(size_t i) const {
+        return *reinterpret_cast<const OffsetBlockHeader *>(blockData(i));
+    }
+    const uint8_t *blockData(size_t i) const {
+        return base + sizeof(OffsetStoreHeader) + i * OFFSET_BLOCK_SIZE;
+    }
+    size_t fileSize() const { return size; }
+
+    // Samples with fromNs <= timeNs < toNs of one client, or of all clients
+    // when key is null, in file order. Returns how many were added.
+    size_t query(const ClientKey *key, int64_t fromNs, int64_t toNs, std::vector<OffsetSample> &out) const;
+
+private:
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+    size_t count = 0;
+};
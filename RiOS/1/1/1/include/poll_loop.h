@@ -0,0 +1,93 @@
+#pragma once
+
+#include <csignal>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// A request in flight. The loop fills in the sequence, the send time and the
+// deadline; value and stampNs are the client's, handed back with the reply.
+struct PollRequest {
+    uint32_t sequence = 0;
+    int64_t sentNs = 0;     // CLOCK_MONOTONIC, read just before the send
+    int64_t deadlineNs = 0;
+    int64_t value = 0;
+    int64_t stampNs = 0;
+};
+
+// The clients' event loop. Polls start on the grid start + k * period of
+// CLOCK_MONOTONIC no matter how long the previous exchange took, and missed
+// grid points (e.g. the process was stopped) are skipped. A poll is a burst
+// of requests, each with its own deadline; a lost request is re-sent only if
+// the retry can still be answered before the next poll, and the poll
+// finishes once every request has been answered or has expired. The wire
+// format is the client's, through the handlers.
+class PollLoop {
+public:
+    // Sends one request. False if it could not be sent.
+    typedef std::function<bool(PollRequest &request)> SendHandler;
+    // Reads what is queued on the socket, calling take() for each reply.
+    typedef std::function<void()> ReceiveHandler;
+    // The poll is over with this many of its requests answered.
+    typedef std::function<void(int replies)> FinishHandler;
+
+    struct Params {
+        int64_t periodNs = 0;
+        int64_t timeoutNs = 0;
+        int burst = 1;
+        int retries = 1;
+    };
+
+    PollLoop() = default;
+    ~PollLoop() { close(); }
+
+    PollLoop(const PollLoop &) = delete;
+    PollLoop &operator=(const PollLoop &) = delete;
+
+    // Watches sockfd, which stays the caller's. False with errno set.
+    bool open(int sockfd, const Params &params, SendHandler send, ReceiveHandler receive, FinishHandler finish);
+    void close();
+
+    // Polls until running is cleared, by a signal handler. False if
+    // epoll_wait() failed, with errno set.
+    bool run(const volatile sig_atomic_t &running);
+
+    // From the receive handler: takes the request a reply answers out of the
+    // poll. False, and counted as stale, if it already expired or was
+    // answered.
+    bool take(uint32_t sequence, PollRequest &request);
+
+    uint64_t polls() const { return pollCount; }
+    uint64_t replies() const { return replyCount; }
+    uint64_t timeouts() const { return timeoutCount; }
+    uint64_t retries() const { return retryCount; }
+    uint64_t staleReplies() const { return staleCount; }
+
+private:
+    bool send();
+    void startPoll();
+    void finishPoll();
+    void expireRequests(int64_t nowNs);
+    void armTimer();
+
+    int sockfd = -1;
+    int epollFd = -1;
+    int timerFd = -1;
+    Params params;
+    SendHandler onSend;
+    ReceiveHandler onReceive;
+    FinishHandler onFinish;
+
+    uint32_t nextSequence = 1;
+    int64_t nextPollNs = 0;
+    bool pollActive = false;
+    int pollReplies = 0;
+    int retriesLeft = 0;
+    std::vector<PollRequest> pending;
+
+    uint64_t pollCount = 0;
+    uint64_t replyCount = 0;
+    uint64_t timeoutCount = 0;
+    uint64_t retryCount = 0;
+    uint64_t staleCount = 0;
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// One thread's event loop: file descriptors through epoll, timers on one
+// timerfd, signals through a signalfd and wake-ups from other threads
+// through an eventfd. Handlers run one at a time on the thread calling
+// runOnce() and must not block: a socket handler reads what is queued up to
+// a budget, a periodic task does a bounded slice of its work and leaves the
+// rest to its next turn.
+class Reactor {
+public:
+    typedef std::function<void(uint32_t events)> FdHandler;
+    typedef std::function<void()> Task;
+    typedef std::function<void(int signal)> SignalHandler;
+
+    Reactor() = default;
+    ~Reactor() { close(); }
+
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    // Creates the epoll, timer and wake descriptors. False with errno set.
+    bool open();
+    void close();
+    bool isOpen() const { return epollFd >= 0; }
+
+    // events are EPOLLIN etc.; level-triggered, so a handler that stops at
+    // its budget is called again on the next round.
+    bool watch(int fd, uint32_t events, FdHandler handler);
+    void unwatch(int fd);
+
+    // Blocks the signals in the calling thread and takes them from a
+    // signalfd instead. Threads inherit the mask, so call this before
+    // starting any.
+    bool handleSignals(std::initializer_list<int> signals, SignalHandler handler);
+
+    // Runs task after delayNs on CLOCK_MONOTONIC, then every periodNs if
+    // that is positive. Returns the id for cancel(). A periodic task that
+    // falls behind skips the missed turns rather than running them back to
+    // back.
+    uint64_t schedule(int64_t delayNs, int64_t periodNs, Task task);
+    void cancel(uint64_t id);
+
+    // Polls without sleeping for spinUs before every wait, for the
+    // low-latency packet threads. 0 = always sleep in epoll_wait().
+    void setSpin(int spinUs) { spinNs = static_cast<int64_t>(spinUs) * 1000; }
+
+    // Waits up to timeoutMs (-1 = until something is ready) and runs the
+    // handlers of what is. Returns the number of ready descriptors, -1 on
+    // error other than EINTR.
+    int runOnce(int timeoutMs);
+
+    // Makes a runOnce() in another thread return. Safe from any thread.
+    void wake();
+
+private:
+    struct Watch {
+        int fd;
+        FdHandler handler;
+        bool active;
+    };
+
+    struct Timer {
+        int64_t periodNs;
+        Task task;
+    };
+
+    struct Due {
+        int64_t atNs;
+        uint64_t id;
+        bool operator>(const Due &other) const { return atNs > other.atNs; }
+    };
+
+    static const int MAX_EVENTS = 32;
+
+    void runTimers();
+    void armTimer();
+    void drainWake();
+    void drainSignals();
+
+    int epollFd = -1;
+    int timerFd = -1;
+    int wakeFd = -1;
+    int signalFd = -1;
+    int64_t spinNs = 0;
+
+    std::unordered_map<int, std::unique_ptr<Watch>> watches;
+    std::vector<std::unique_ptr<Watch>> retired; // unwatched during a round, freed after it
+    SignalHandler onSignal;
+
+    std::unordered_map<uint64_t, Timer> timers;
+    std::vector<Due> due; // min-heap; entries of cancelled timers are skipped
+    uint64_t nextTimerId = 1;
+    int64_t armedNs = 0;  // what the timerfd is set to, 0 = disarmed
+};
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 struct SetSync {
     char cmd[4];
     int correction;
+    uint32_t sequence; // only sent in reply to a sequenced GetSync
 };
+
+const size_t SET_SYNC_LEGACY_SIZE = offsetof(SetSync, sequence);
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Discrete-event stand-ins for the socket and clock layer, used by sync_sim.
+// All times are true (simulation) time in nanoseconds unless named local.
+
+struct LinkModel {
+    double delayMs = 0.5;        // one-way base delay
+    double jitterMs = 0.2;       // mean of the exponential queueing delay
+    double asymmetryMs = 0;      // extra delay on the client -> server direction
+    double lossRate = 0;         // per packet
+    double reorderRate = 0;      // per packet, held back by up to reorderDelayMs
+    double reorderDelayMs = 5;
+};
+
+// A free-running oscillator: local = offset + true * (1 + drift).
+class SimClock {
+public:
+    SimClock() = default;
+    SimClock(double driftPpm, int64_t offsetNs) : rate(1.0 + driftPpm * 1e-6), offsetNs(offsetNs) {}
+
+    int64_t localNs(int64_t trueNs) const {
+        return offsetNs + static_cast<int64_t>(static_cast<double>(trueNs) * rate);
+    }
+
+    // True duration of a local interval, e.g. a sleep or a socket timeout.
+    int64_t trueDurationNs(int64_t localDurationNs) const {
+        return static_cast<int64_t>(static_cast<double>(localDurationNs) / rate);
+    }
+
+private:
+    double rate = 1.0;
+    int64_t offsetNs = 0;
+};
+
+// Per-client view of the network. Each client owns its RNG so a run is
+// reproducible regardless of how clients are spread over threads.
+class SimLink {
+public:
+    SimLink(const LinkModel &model, uint64_t seed) : model(model), rng(seed) {}
+
+    // Returns false if the packet is lost, otherwise its one-way delay.
+    bool transit(bool toServer, int64_t &delayNs);
+
+    double uniform(double from, double to) {
+        return std::uniform_real_distribution<double>(from, to)(rng);
+    }
+
+private:
+    LinkModel model;
+    std::mt19937_64 rng;
+};
+
+enum SimEventType : uint8_t {
+    SIM_POLL,
+    SIM_REQUEST_ARRIVE,
+    SIM_REPLY_ARRIVE,
+    SIM_TIMEOUT
+};
+
+struct SimEvent {
+    int64_t timeNs;
+    uint64_t order;     // tie-break so equal timestamps keep insertion order
+    uint32_t client;
+    SimEventType type;
+    int64_t value;      // request value, reply value
+    int64_t extra;      // request sequence / send time
+};
+
+class SimEventQueue {
+public:
+    void push(int64_t timeNs, uint32_t client, SimEventType type, int64_t value = 0, int64_t extra = 0);
+    bool pop(SimEvent &event);
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+
+private:
+    std::vector<SimEvent> heap;
+    uint64_t nextOrder = 0;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+struct ArenaOptions {
+    size_t slabBytes = 2 << 20; // one huge page
+    size_t ceilingBytes = 0;    // 0: no limit
+    bool hugePages = false;     // MAP_HUGETLB, else transparent huge pages
+};
+
+struct ArenaCounters {
+    uint64_t slabs = 0;
+    uint64_t hugeSlabs = 0;   // slabs on MAP_HUGETLB pages
+    uint64_t mappedBytes = 0;
+    uint64_t slotsInUse = 0;
+    uint64_t slotsFree = 0;   // released or not handed out yet
+    uint64_t refused = 0;     // allocations over the ceiling
+    uint64_t columnBytes = 0; // a ClientTable's columns and index buckets, outside the slabs
+
+    void add(const ArenaCounters &other) {
+        slabs += other.slabs;
+        columnBytes += other.columnBytes;
+        hugeSlabs += other.hugeSlabs;
+        mappedBytes += other.mappedBytes;
+        slotsInUse += other.slotsInUse;
+        slotsFree += other.slotsFree;
+        refused += other.refused;
+    }
+};
+
+// Fixed-size slots carved from large mmap'd slabs. Released slots go on a
+// free list and are handed out before a new slab is mapped; slabs are only
+// unmapped with the arena, so the footprint follows the peak client count
+// and churn does not fragment the heap. One thread per arena.
+class SlabArena {
+public:
+    // slotSize is rounded up to 16 bytes.
+    explicit SlabArena(size_t slotSize, const ArenaOptions &options = ArenaOptions());
+    ~SlabArena();
+
+    SlabArena(const SlabArena &) = delete;
+    SlabArena &operator=(const SlabArena &) = delete;
+
+    // Applies to slabs mapped from now on.
+    void setOptions(const ArenaOptions &options);
+
+    // nullptr if a new slab would go over the ceiling.
+    void *allocate();
+    void release(void *slot);
+
+    size_t slotSize() const { return slot; }
+    const ArenaCounters &counters() const { return stats; }
+
+private:
+    struct Slab {
+        void *base;
+        size_t bytes;
+    };
+
+    bool mapSlab();
+
+    size_t slot;
+    ArenaOptions options;
+    std::vector<Slab> slabs;
+    void *freeList = nullptr;
+    char *unused = nullptr;    // the newest slab's slots not handed out yet
+    char *unusedEnd = nullptr;
+    ArenaCounters stats;
+};
+
+// Allocator for node-based containers: single objects that fit a slot come
+// from the arena, anything else (bucket arrays) from the heap. Throws
+// bad_alloc when the arena is at its ceiling.
+template<typename T>
+class SlabAllocator {
+public:
+    using value_type = T;
+
+    explicit SlabAllocator(SlabArena &arena) : arena(&arena) {}
+
+    template<typename U>
+    SlabAllocator(const SlabAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) {
+        if (!fits(n)) {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+        void *slot = arena->allocate();
+        if (slot == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(slot);
+    }
+
+    void deallocate(T *object, size_t n) {
+        if (fits(n)) {
+            arena->release(object);
+        } else {
+            ::operator delete(object);
+        }
+    }
+
+    template<typename U>
+    bool operator==(const SlabAllocator<U> &other) const { return arena == other.arena; }
+
+    template<typename U>
+    bool operator!=(const SlabAllocator<U> &other) const { return arena != other.arena; }
+
+private:
+    template<typename U>
+    friend class SlabAllocator;
+
+    bool fits(size_t n) const { return n == 1 && sizeof(T) <= arena->slotSize() && alignof(T) <= 16; }
+
+    SlabArena *arena;
+};
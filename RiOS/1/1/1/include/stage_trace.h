@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "low_latency.h"
+#include "sync_trace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Runtime switch for all StageRecorders, e.g. flipped from a signal handler.
+extern std::atomic<bool> stageTracing;
+
+inline uint64_t readTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(realtimeNs());
+#endif
+}
+
+// TSC ticks per nanosecond, measured once against CLOCK_MONOTONIC.
+double tscTicksPerNs();
+
+struct StageEvent {
+    uint64_t startTsc;
+    uint32_t ticks;
+    uint16_t stage;
+};
+
+// One thread's probes around the stages of the request path: the last
+// CAPACITY events in a ring for the timeline, and a latency histogram per
+// stage. With tracing off a probe costs one relaxed load and a branch.
+class StageRecorder {
+public:
+    static const int MAX_STAGES = 16;
+    static const size_t CAPACITY = 1 << 16;
+
+    // Allocates the ring; until then nothing is recorded.
+    void open(uint16_t thread);
+    bool isOpen() const { return !events.empty(); }
+
+    // 0 while tracing is off, which end() ignores.
+    static uint64_t begin() { return stageTracing.load(std::memory_order_relaxed) ? readTsc() : 0; }
+
+    void end(int stage, uint64_t start) {
+        if (start != 0 && isOpen()) {
+            record(stage, start, readTsc());
+        }
+    }
+
+    // A stage that started at a CLOCK_REALTIME timestamp, such as the
+    // kernel's receive time of the packet.
+    void endSinceRealtime(int stage, int64_t startNs);
+
+    void record(int stage, uint64_t start, uint64_t stop);
+
+    uint16_t thread() const { return threadId; }
+    uint64_t recorded() const { return next; }
+    const LatencyHistogram &histogram(int stage) const { return histograms[stage]; }
+
+    // The ring's events, oldest first.
+    void collect(std::vector<StageEvent> &out) const;
+
+private:
+    std::vector<StageEvent> events;
+    uint64_t next = 0;
+    uint16_t threadId = 0;
+    LatencyHistogram histograms[MAX_STAGES];
+};
+
+// Chrome / Perfetto trace JSON ("X" events, one track per thread).
+bool writeChromeTrace(const std::string &path, const std::vector<const StageRecorder *> &recorders,
+                      const char *const names[], int stageCount);
+
+// One line per stage: count and p50/p90/p99/p99.9 in ns, all threads merged.
+void printStageHistograms(std::ostream &out, const std::vector<const StageRecorder *> &recorders,
+                          const char *const names[], int stageCount);
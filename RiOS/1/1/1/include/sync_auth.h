@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Authenticated server and ptp_server packets (--keys on the server, --key on the
+// clients). Such a datagram is the plain one followed by a SyncAuthTrailer
+// whose tag is SipHash-2-4, under the client's pre-shared key, of all the
+// bytes before the tag, key id and counter included. Each sender counts its
+// packets; the server binds a client's row to the key of its first
+// authenticated packet and then takes only that key with a counter past the
+// last one it took, so another key holder cannot speak for the client and a
+// captured packet cannot be replayed. Replies carry the key id and counter
+// of the request and are tagged with the same key. Host byte order like
+// GetSync.
+struct SyncAuthTrailer {
+    uint32_t keyId;
+    uint32_t counter;
+    uint64_t tag;
+};
+
+static_assert(sizeof(SyncAuthTrailer) == 16, "layout is part of the protocol");
+
+const size_t SYNC_AUTH_BYTES = sizeof(SyncAuthTrailer);
+
+// A SipHash-2-4 key as its initial state: the key words are mixed with the
+// constants once, when the key is loaded, not for every packet.
+struct SipKey {
+    uint64_t v0 = 0;
+    uint64_t v1 = 0;
+    uint64_t v2 = 0;
+    uint64_t v3 = 0;
+
+    static SipKey fromBytes(const uint8_t bytes[16]);
+};
+
+uint64_t sipHash24(const SipKey &key, const void *data, size_t length);
+
+// Four messages of the same length, hashed two at a time. The rounds of one
+// message are a serial dependency chain; interleaving two keeps more of the
+// ALUs busy.
+void sipHash24x4(const SipKey *const keys[4], const uint8_t *const data[4], size_t length, uint64_t tags[4]);
+
+// Appends the trailer to the `length` bytes at packet, which must have room
+// for it. Returns the new length.
+size_t signPacket(const SipKey &key, uint32_t keyId, uint32_t counter, void *packet, size_t length);
+
+// The length without the trailer when the packet carries keyId and a good
+// tag, otherwise 0.
+size_t verifyPacket(const SipKey &key, uint32_t keyId, const void *packet, size_t length);
+
+// The counter of a verified packet; plainLength is what verification
+// returned, the trailer still follows it.
+uint32_t syncAuthCounter(const void *packet, size_t plainLength);
+
+// A first counter for a new sender: the realtime clock in ms, so a client
+// restarted on the same address starts past what its old row has taken
+// unless it sent more than one packet per ms.
+uint32_t initialSyncAuthCounter();
+
+// What a client row keeps of its authenticated packets.
+struct SyncAuthBinding {
+    static const uint32_t UNBOUND = UINT32_MAX; // above every key id
+
+    uint32_t keyId = UNBOUND;
+    uint32_t counter = 0; // the last one taken
+
+    // An unbound row is bound to keyId. A bound one takes only its own key
+    // with a counter after the last, in serial number order, and remembers
+    // it. Checked before the packet changes anything.
+    bool admit(uint32_t packetKeyId, uint32_t packetCounter);
+};
+
+// Parses "<id>:<32 hex digits>", the form --key takes.
+bool parseSyncKey(const std::string &text, uint32_t &id, SipKey &key);
+
+// The server's keys, indexed by id so that the lookup before verification
+// costs no hashing.
+class SyncKeyRing {
+public:
+    static const uint32_t MAX_KEY_ID = 1u << 20;
+
+    // Lines of "<id> <32 hex digits>"; '#' starts a comment.
+    bool load(const std::string &path, std::string &error);
+    void add(uint32_t id, const SipKey &key);
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const SipKey *find(uint32_t id) const {
+        return id < keys.size() && present[id] ? &keys[id] : nullptr;
+    }
+
+    // verifyPacket() with the key named in the trailer, which is returned in
+    // keyId.
+    size_t verify(const void *packet, size_t length, uint32_t &keyId) const;
+
+    // verify() for count packets. Runs of four with the same length go
+    // through sipHash24x4().
+    void verifyBatch(const uint8_t *const packets[], const size_t lengths[], size_t count, size_t results[],
+                     uint32_t keyIds[]) const;
+
+private:
+    std::vector<SipKey> keys;
+    std::vector<uint8_t> present;
+    size_t count = 0;
+};
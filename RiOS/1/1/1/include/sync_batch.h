@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// GETB carries the requests of up to SYNC_BATCH_MAX logical clients behind
+// one gateway socket; the server keeps state per (address, port, logical id)
+// as for separate clients and answers with one SYNB of the same size, entry
+// for entry. Logical ids start at 1: 0 is the gateway's own key as a direct
+// client, and entries with it are answered SYNC_BATCH_IGNORED. Fields are in
+// host byte order like GetSync2.
+const size_t SYNC_BATCH_MAX = 128;
+
+const uint16_t SYNC_BATCH_DISCONNECT = 1; // request flag: the entry is a DISC
+
+const uint16_t SYNC_BATCH_OK = 0;
+const uint16_t SYNC_BATCH_IGNORED = 1;     // disconnected, over the memory ceiling or logical id 0
+const uint16_t SYNC_BATCH_DISCONNECTED = 2;
+
+struct SyncBatchHeader {
+    char cmd[4];        // "GETB" or "SYNB"
+    uint32_t sequence;  // echoed in the reply
+    uint16_t count;
+    uint16_t reserved;
+    int32_t serverTime; // SYNB: server uptime in ms
+};
+
+struct SyncBatchRequest {
+    uint16_t logicalId;
+    uint16_t flags;
+    int32_t currentValue;
+};
+
+struct SyncBatchReply {
+    uint16_t logicalId;
+    uint16_t status;
+    int32_t correction;
+};
+
+static_assert(sizeof(SyncBatchRequest) == sizeof(SyncBatchReply), "SYNB is answered in place of GETB");
+
+const size_t SYNC_BATCH_BYTES = sizeof(SyncBatchHeader) + SYNC_BATCH_MAX * sizeof(SyncBatchRequest);
+
+inline size_t syncBatchSize(size_t count) {
+    return sizeof(SyncBatchHeader) + count * sizeof(SyncBatchRequest);
+}
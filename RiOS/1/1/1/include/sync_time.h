@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// GETT asks ptp_server for timestamps instead of a correction: the server
+// answers from its clock alone, keeps nothing about the client and leaves
+// all filtering to it. The client works out offset and delay from the four
+// timestamps as NTP does. Server times are ns of server uptime, the clock
+// GetSync2's serverTime counts in ms. The request is padded to the size of
+// the reply so a forged source address gains nothing. Host byte order like
+// GetSync2.
+const uint16_t SYNC_TIME_SOURCE_KERNEL = 0; // server clock read through clock_gettime()
+const uint16_t SYNC_TIME_SOURCE_TSC = 1;    // calibrated TSC, see Timebase
+
+const uint16_t SYNC_TIME_STATELESS = 1;     // server runs --stateless: GET corrections are unfiltered
+
+struct SyncTimeRequest {
+    char cmd[4];        // "GETT"
+    uint32_t sequence;  // echoed in the reply
+    int64_t originNs;   // client's time at transmit, echoed
+    uint8_t padding[32];
+};
+
+struct SyncTimeReply {
+    char cmd[4];                // "TIME"
+    uint32_t sequence;
+    int64_t originNs;
+    int64_t receiveNs;          // request received, from the kernel timestamp where there is one
+    int64_t transmitNs;         // taken as the reply is built
+    int64_t realtimeOffsetNs;   // the server's CLOCK_REALTIME minus its uptime clock
+    uint32_t clockErrorNs;      // last calibration error of the server's timebase
+    uint16_t clockSource;
+    uint16_t flags;
+};
+
+static_assert(sizeof(SyncTimeRequest) == sizeof(SyncTimeReply), "TIME is answered in place of GETT");
+static_assert(sizeof(SyncTimeReply) == 48, "layout is part of the protocol");
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include "spsc_ring.h"
+#include "net_address.h"
+
+enum TraceSource : uint8_t {
+    TRACE_SERVER = 1,
+    TRACE_CLIENT = 2
+};
+
+enum TraceProtocol : uint8_t {
+    TRACE_SYNC = 1,  // server / client
+    TRACE_SYNC2 = 2, // ptp_server / ptp_client
+    TRACE_NTP = 3    // ntp_time_server / ntp_time_client
+};
+
+// One request/reply exchange. Timestamps are CLOCK_REALTIME nanoseconds;
+// rxNs is the kernel receive timestamp of the request (server) or of the
+// reply (client), txNs is taken right after sendto().
+struct TraceRecord {
+    int64_t rxNs;
+    int64_t txNs;
+    int64_t replyValue;     // correction, serverTime (SYNC2) or NTP time in ms
+    uint8_t address[16];    // peer address, IPv4 stored as v4-mapped IPv6
+    int32_t requestValue;   // currentValue carried by the request
+    int32_t rawCorrection;  // server: uptime - requestValue before filtering
+    int32_t correction;     // server: correction sent; client: correction applied
+    uint16_t port;          // peer port, host byte order
+    uint8_t source;
+    uint8_t protocol;
+};
+
+static_assert(sizeof(TraceRecord) == 56, "trace record layout is part of the file format");
+
+const uint32_t TRACE_MAGIC = 0x43525453; // "STRC"
+const uint32_t TRACE_VERSION = 1;
+
+struct TraceFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t reserved;
+};
+
+// Appends records to a trace file from a background thread. record() is meant
+// for the packet thread: it copies into a ring and never blocks; records that
+// do not fit are counted as dropped.
+class TraceWriter {
+public:
+    TraceWriter() = default;
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+    bool open(const std::string &path);
+    void close();
+
+    bool isOpen() const { return file != nullptr; }
+
+    void record(const TraceRecord &rec) {
+        if (!ring->push(rec)) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t written() const { return writtenCount.load(); }
+    uint64_t droppedCount() const { return dropped.load(); }
+
+private:
+    void writerLoop();
+
+    FILE *file = nullptr;
+    std::unique_ptr<SpscRing<TraceRecord>> ring;
+    std::thread writer;
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> writtenCount{0};
+    std::atomic<uint64_t> dropped{0};
+};
+
+bool readTrace(const std::string &path, std::vector<TraceRecord> &records);
+
+void traceAddress(const sockaddr_storage &addr, TraceRecord &rec);
+void traceAddress(const ClientKey &key, TraceRecord &rec);
+
+int64_t realtimeNs();
+
+// Turns on SO_TIMESTAMPNS so recvWithTimestamp() reports kernel receive time.
+void enableKernelTimestamps(int fd);
+
+// recvfrom() that also returns the kernel receive timestamp (CLOCK_REALTIME
+// ns), or the current time when the socket did not provide one.
+ssize_t recvWithTimestamp(int fd, void *buffer, size_t size, int flags,
+                          sockaddr *addr, socklen_t *addrLen, int64_t &rxNs);
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <time.h>
+#include "stage_trace.h"
+
+struct TimebaseStats {
+    bool tsc = false;           // reads come from the TSC
+    std::string reason;         // why not, when they do not
+    double ticksPerNs = 0;
+    uint64_t calibrations = 0;
+    uint64_t steps = 0;         // corrections too large to slew, always forward
+    int64_t lastErrorNs = 0;    // TSC time minus CLOCK_MONOTONIC at the last calibration
+};
+
+// CLOCK_MONOTONIC and CLOCK_REALTIME in ns from rdtsc: ns = base +
+// (tsc - tscBase) * scale, with scale and offsets recalibrated against the
+// kernel clocks by a background thread and swapped under a seqlock. Each
+// calibration slews the error away over the next interval. An error beyond
+// 1 ms is stepped if the TSC time is behind and slewed at the maximum rate
+// if it is ahead, so monotonicNs() never jumps backwards. Without an
+// invariant TSC the kernel uses as its clocksource, and until the first
+// calibration, reads go to clock_gettime() (the vDSO); if the TSC is given
+// up later, those reads are held at the last TSC time until they pass it.
+class Timebase {
+public:
+    Timebase() = default;
+    ~Timebase() { stop(); }
+
+    Timebase(const Timebase &) = delete;
+    Timebase &operator=(const Timebase &) = delete;
+
+    // Checks the TSC and starts the calibration thread. Returns whether the
+    // TSC will be used.
+    bool start();
+    void stop();
+
+    int64_t monotonicNs() const {
+        Params params;
+        if (!load(params)) {
+            int64_t kernel = kernelNs(CLOCK_MONOTONIC);
+            int64_t floor = fallbackFloor.load(std::memory_order_relaxed);
+            return kernel > floor ? kernel : floor;
+        }
+        return params.monoBase + scaled(readTsc() - params.tscBase, params.scale);
+    }
+
+    int64_t realtimeNs() const {
+        Params params;
+        if (!load(params)) {
+            return kernelNs(CLOCK_REALTIME);
+        }
+        return params.monoBase + scaled(readTsc() - params.tscBase, params.scale) + params.realtimeOffset;
+    }
+
+    bool usingTsc() const { return active.load(std::memory_order_relaxed); }
+    TimebaseStats stats() const;
+
+    static int64_t kernelNs(clockid_t clock) {
+        timespec ts{};
+        clock_gettime(clock, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+    }
+
+private:
+    struct Params {
+        uint64_t tscBase;
+        int64_t monoBase;
+        uint64_t scale;          // ns per tick, 32.32 fixed point
+        int64_t realtimeOffset;  // CLOCK_REALTIME - CLOCK_MONOTONIC
+    };
+
+    struct Sample {
+        uint64_t tsc;
+        int64_t mono;
+        int64_t real;
+    };
+
+    static int64_t scaled(uint64_t ticks, uint64_t scale) {
+        return static_cast<int64_t>((static_cast<unsigned __int128>(ticks) * scale) >> 32);
+    }
+
+    bool load(Params &params) const {
+        if (!active.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        while (true) {
+            uint32_t before = sequence.load(std::memory_order_acquire);
+            if ((before & 1) == 0) {
+                params.tscBase = tscBase.load(std::memory_order_relaxed);
+                params.monoBase = monoBase.load(std::memory_order_relaxed);
+                params.scale = scale.load(std::memory_order_relaxed);
+                params.realtimeOffset = realtimeOffset.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (sequence.load(std::memory_order_relaxed) == before) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    static bool tscUsable(std::string &reason);
+    static Sample takeSample();
+    void publish(const Params &params);
+    void calibrate();
+    void fallBack(double ticksPerNs);
+
+    std::atomic<bool> active{false};
+    std::atomic<uint32_t> sequence{0};
+    std::atomic<uint64_t> tscBase{0};
+    std::atomic<int64_t> monoBase{0};
+    std::atomic<uint64_t> scale{0};
+    std::atomic<int64_t> realtimeOffset{0};
+    std::atomic<int64_t> fallbackFloor{INT64_MIN}; // monotonicNs() once the TSC is given up
+
+    std::atomic<bool> running{false};
+    std::thread calibrator;
+
+    // Written by the calibrator, read by stats().
+    std::atomic<uint64_t> calibrations{0};
+    std::atomic<uint64_t> steps{0};
+    std::atomic<int64_t> lastError{0};
+    std::atomic<double> ticksPerNs{0};
+    std::atomic<const char *> failure{nullptr};
+    std::string reason; // set by start() before the thread runs
+};
+
+// The process-wide timebase used by the packet paths.
+Timebase &timebase();
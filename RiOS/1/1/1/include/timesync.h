@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace timesync {
+
+enum class Protocol {
+    // server / ptp_server: GetSync -> SetSync, server uptime timebase. The
+    // wire carries int milliseconds, so a server is only usable for the
+    // first 24.8 days of its uptime.
+    Sync,
+    Ntp   // ntp_time_server: "GET" -> 64-bit big-endian Unix time in ms
+};
+
+struct Policy {
+    Protocol protocol = Protocol::Sync;
+    int pollPeriodMs = 1000;
+    int timeoutMs = 2000;
+    int maxRatePpm = 500;
+};
+
+struct Stats {
+    uint64_t polls = 0;
+    uint64_t requests = 0;
+    uint64_t replies = 0;
+    uint64_t timeouts = 0;
+    int64_t lastOffsetNs = 0;
+    int64_t lastDelayNs = 0;
+    double ratePpm = 0;
+    bool synchronized = false;
+};
+
+// Servers are "host", "host:port", "[v6]" or "[v6]:port" (default port 8080).
+// Returns false if the library is already running or no server address could
+// be parsed.
+bool start(const std::vector<std::string> &servers, const Policy &policy = Policy());
+
+void stop();
+
+bool running();
+
+// Corrected time in nanoseconds in the server's timebase. One clock read
+// (vDSO) and a copy of the published clock, wait-free: it never waits for
+// or retries against the sync thread. New estimates are slewed in, not stepped, unless the
+// error is beyond 128 ms, and on a given thread the result never goes
+// backwards while the library runs. Before the first successful exchange it
+// returns the local clock.
+int64_t now();
+
+int64_t nowMs();
+
+Stats stats();
+
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "net_address.h"
+
+struct WorstClient {
+    ClientKey key;
+    int32_t correction; // ranked by magnitude
+};
+
+// What one packet thread saw since the last report. Only the owning thread
+// writes it; the reporter reads copies published through StatsEpochs.
+struct WorkerStats {
+    static const int TOP_CLIENTS = 8;
+    // |correction| in ms: bucket 0 holds 0, bucket b holds [2^(b-1), 2^b).
+    static const int CORRECTION_BUCKETS = 32;
+
+    uint64_t requests = 0;
+    uint64_t newClients = 0;
+    uint64_t disconnects = 0;
+    uint64_t ignored = 0;
+    uint64_t refused = 0;    // new clients over the memory ceiling
+    uint64_t batches = 0;    // GETB datagrams, their entries count as requests
+    uint64_t unauthenticated = 0; // dropped with --keys: no trailer, unknown key or bad tag
+    uint64_t rejected = 0;        // with --keys: not the client's key, or a replayed counter
+    int64_t correctionSum = 0;
+    int32_t minCorrection = INT32_MAX;
+    int32_t maxCorrection = INT32_MIN;
+    uint64_t correctionBuckets[CORRECTION_BUCKETS] = {};
+    WorstClient worst[TOP_CLIENTS] = {};
+    int worstCount = 0;
+    uint32_t worstFloor = 0; // smallest magnitude in a full list
+    size_t clients = 0;      // gauge, not reset between intervals
+
+    void recordCorrection(const ClientKey &key, int32_t correction) {
+        requests++;
+        correctionSum += correction;
+        if (correction < minCorrection) minCorrection = correction;
+        if (correction > maxCorrection) maxCorrection = correction;
+        uint32_t magnitude = correction < 0 ? 0u - static_cast<uint32_t>(correction)
+                                            : static_cast<uint32_t>(correction);
+        correctionBuckets[bucketOf(magnitude)]++;
+        if (worstCount < TOP_CLIENTS || magnitude > worstFloor) {
+            offerWorst(key, correction);
+        }
+    }
+
+    void merge(const WorkerStats &other);
+
+    // Clears everything but the gauge.
+    void resetInterval();
+
+    // Upper bound in ms of |correction| for the given fraction of requests.
+    int64_t correctionPercentile(double fraction) const;
+
+    // Worst clients ordered by descending magnitude.
+    int sortedWorst(WorstClient out[TOP_CLIENTS]) const;
+
+    static int bucketOf(uint32_t magnitude) {
+        return magnitude == 0 ? 0 : 32 - __builtin_clz(magnitude);
+    }
+
+private:
+    void offerWorst(const ClientKey &key, int32_t correction);
+};
+
+// Epoch handshake between the packet threads and the reporter. The reporter
+// opens an epoch; each worker notices it between packets, publishes its
+// interval into its own slot and starts a new one. Workers never wait or
+// lock: the packet path pays two atomic loads per packet and one copy per
+// report. A worker that misses the reporter's deadline publishes late and
+// its interval is folded into the next report.
+class StatsEpochs {
+public:
+    explicit StatsEpochs(size_t workers);
+
+    void checkpoint(size_t worker, WorkerStats &current) {
+        uint64_t epoch = requested.load(std::memory_order_acquire);
+        if (slots[worker].epoch.load(std::memory_order_relaxed) != epoch) {
+            publish(slots[worker], current, epoch);
+        }
+    }
+
+    // Opens an epoch and merges the workers that publish within timeoutMs.
+    // Returns how many did. Called from one reporter thread only.
+    size_t snapshot(WorkerStats &merged, int timeoutMs);
+
+    size_t workers() const { return count; }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{0};
+        std::atomic<bool> pending{false}; // published but not yet merged
+        WorkerStats published;
+    };
+
+    static void publish(Slot &slot, WorkerStats &current, uint64_t epoch);
+
+    alignas(64) std::atomic<uint64_t> requested{0};
+    std::unique_ptr<Slot[]> slots;
+    size_t count;
+};
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "net_address.h"
+
+// AF_XDP fast path for the sync servers. An XDP program on the interface
+// sends UDP packets for the server port into AF_XDP sockets, one per
+// receive queue, and passes everything else to the kernel. Requests are
+// parsed straight from the UMEM frame, rewritten in place into the reply and
+// put on the TX ring: the frame that came in goes back out.
+//
+// Generic (SKB) mode works on any interface, veth and lo included; native
+// mode needs driver support and then tries zero-copy. No libbpf: the program
+// is assembled here and loaded with the bpf() syscall.
+
+struct XdpOptions {
+    std::string interface; // empty = off
+    uint32_t queue = 0;    // first queue; worker i uses queue + i
+    bool native = false;
+};
+
+// Consumes one of --xdp IFACE, --xdp-queue N, --xdp-native at argv[i].
+// Returns false if argv[i] is not an XDP option.
+bool parseXdpOption(int &i, int argc, char *argv[], XdpOptions &options);
+
+const char *xdpUsage();
+
+// The XDP program and its socket map, attached to one interface for as long
+// as the object lives.
+class XdpProgram {
+public:
+    XdpProgram() = default;
+    ~XdpProgram();
+
+    XdpProgram(const XdpProgram &) = delete;
+    XdpProgram &operator=(const XdpProgram &) = delete;
+
+    // Logs the reason (with the verifier log) and returns false on failure.
+    bool attach(const XdpOptions &options, uint16_t port);
+    void detach();
+
+    // Sends the program's packets for queue to the AF_XDP socket fd.
+    bool addSocket(uint32_t queue, int fd) const;
+
+    bool attached() const { return linkFd >= 0; }
+    int ifindex() const { return interfaceIndex; }
+    int mapFd() const { return socketMapFd; }
+
+private:
+    int socketMapFd = -1;
+    int programFd = -1;
+    int linkFd = -1;
+    int interfaceIndex = 0;
+};
+
+// A request as it sits in the UMEM frame.
+struct XdpPacket {
+    uint64_t addr;       // frame offset in the UMEM
+    uint8_t *frame;
+    uint32_t frameLength;
+    uint8_t *payload;    // UDP payload
+    uint32_t payloadLength;
+    uint32_t capacity;   // room for the reply payload
+    ClientKey key;
+    int64_t rxNs;        // CLOCK_REALTIME when taken off the ring
+};
+
+struct XdpCounters {
+    uint64_t received = 0;
+    uint64_t replied = 0;
+    uint64_t dropped = 0;    // malformed, unanswered, or TX ring full
+};
+
+// One AF_XDP socket bound to a queue, with its UMEM and the four rings.
+// Single-threaded: one packet thread per socket.
+class XdpSocket {
+public:
+    XdpSocket() = default;
+    ~XdpSocket();
+
+    XdpSocket(const XdpSocket &) = delete;
+    XdpSocket &operator=(const XdpSocket &) = delete;
+
+    bool open(const XdpProgram &program, uint32_t queue, bool native);
+    void close();
+
+    int fd() const { return xskFd; }
+    uint32_t queue() const { return boundQueue; }
+
+    // Up to max requests from the RX ring. Each one must be answered with
+    // reply() or given back with drop(); flush() then sends the replies.
+    size_t receive(XdpPacket *packets, size_t max);
+
+    // Turns the request frame into a reply carrying `length` payload bytes,
+    // already written at packet.payload, and queues it. False if it had to be
+    // dropped instead.
+    bool reply(const XdpPacket &packet, size_t length);
+    void drop(const XdpPacket &packet);
+    void flush();
+
+    const XdpCounters &counters() const { return stats; }
+
+private:
+    struct Ring {
+        uint32_t *producer = nullptr;
+        uint32_t *consumer = nullptr;
+        void *descriptors = nullptr;
+        uint32_t mask = 0;
+        uint32_t cachedProducer = 0;
+        uint32_t cachedConsumer = 0;
+        void *map = nullptr;
+        size_t mapSize = 0;
+    };
+
+    bool mapRing(Ring &ring, uint64_t pgoff, uint64_t producer, uint64_t consumer, uint64_t desc, size_t itemSize);
+    void reclaim();
+    void refill();
+    void recycle(uint64_t addr) { freeFrames.push_back(addr); }
+
+    int xskFd = -1;
+    uint32_t boundQueue = 0;
+    uint8_t *umem = nullptr;
+    size_t umemSize = 0;
+    Ring fill;
+    Ring completion;
+    Ring rx;
+    Ring tx;
+    uint32_t txPending = 0;
+    std::vector<uint64_t> freeFrames;
+    XdpCounters stats;
+};
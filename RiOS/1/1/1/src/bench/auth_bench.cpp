@@ -0,0 +1,132 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "sync_auth.h"
+
+using namespace std;
+
+volatile size_t sink;
+
+template<typename F>
+double nsPerPacket(size_t packets, F &&body) {
+    auto start = chrono::steady_clock::now();
+    body();
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / packets;
+}
+
+// The reference vectors of the SipHash paper: key 00..0f, message 00..(n-1).
+bool checkVectors() {
+    uint8_t bytes[16];
+    for (int i = 0; i < 16; i++) bytes[i] = static_cast<uint8_t>(i);
+    SipKey key = SipKey::fromBytes(bytes);
+    uint8_t message[15];
+    for (int i = 0; i < 15; i++) message[i] = static_cast<uint8_t>(i);
+
+    const SipKey *keys[4] = {&key, &key, &key, &key};
+    const uint8_t *data[4] = {message, message, message, message};
+    uint64_t tags[4];
+    sipHash24x4(keys, data, 15, tags);
+    return sipHash24(key, message, 0) == 0x726fdb47dd0e0e31ULL && sipHash24(key, message, 15) == 0xa129ca6149be45e5ULL &&
+           tags[0] == 0xa129ca6149be45e5ULL && tags[3] == tags[0];
+}
+
+// One XDP batch worth of signed packets of the given plain size, each under
+// a random client's key; every fourth one forged when `forged` is set.
+void buildBatch(const SyncKeyRing &ring, size_t keyCount, size_t plain, size_t batch, mt19937_64 &rng,
+                vector<vector<uint8_t>> &packets) {
+    packets.assign(batch, vector<uint8_t>(plain + SYNC_AUTH_BYTES));
+    for (auto &packet: packets) {
+        for (size_t i = 0; i < plain; i++) packet[i] = static_cast<uint8_t>(rng());
+        uint32_t id = static_cast<uint32_t>(rng() % keyCount);
+        signPacket(*ring.find(id), id, 1, packet.data(), plain);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    size_t keyCount = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+    const size_t batch = 64;
+    const size_t rounds = 40000;
+
+    if (!checkVectors()) {
+        cerr << "SipHash-2-4 does not match the reference vectors" << endl;
+        return 1;
+    }
+
+    mt19937_64 rng(42);
+    SyncKeyRing ring;
+    for (uint32_t id = 0; id < keyCount; id++) {
+        uint8_t bytes[16];
+        for (uint8_t &b: bytes) b = static_cast<uint8_t>(rng());
+        ring.add(id, SipKey::fromBytes(bytes));
+    }
+
+    cout << "Packet authentication, " << keyCount << " client keys, batches of " << batch << endl;
+    // GET, GETT and a GETB of 32 entries.
+    for (size_t plain: {size_t(12), size_t(48), size_t(268)}) {
+        vector<vector<uint8_t>> packets;
+        buildBatch(ring, keyCount, plain, batch, rng, packets);
+        vector<const uint8_t *> pointers(batch);
+        vector<size_t> lengths(batch), results(batch);
+        vector<uint32_t> ids(batch);
+        for (size_t i = 0; i < batch; i++) {
+            pointers[i] = packets[i].data();
+            lengths[i] = packets[i].size();
+        }
+
+        size_t good = 0;
+        double scalarNs = nsPerPacket(rounds * batch, [&]() {
+            for (size_t round = 0; round < rounds; round++) {
+                for (size_t i = 0; i < batch; i++) {
+                    uint32_t id;
+                    good += ring.verify(pointers[i], lengths[i], id) != 0;
+                }
+            }
+        });
+        double batchNs = nsPerPacket(rounds * batch, [&]() {
+            for (size_t round = 0; round < rounds; round++) {
+                ring.verifyBatch(pointers.data(), lengths.data(), batch, results.data(), ids.data());
+                good += results[round % batch] != 0;
+            }
+        });
+        vector<uint8_t> reply(plain + SYNC_AUTH_BYTES);
+        double signNs = nsPerPacket(rounds * batch, [&]() {
+            for (size_t n = 0; n < rounds * batch; n++) {
+                reply[0] = static_cast<uint8_t>(n);
+                const SipKey &key = *ring.find(static_cast<uint32_t>(n % keyCount));
+                good += signPacket(key, 0, static_cast<uint32_t>(n), reply.data(), plain);
+            }
+        });
+        sink = good;
+
+        cout << "  " << setw(3) << plain << " + " << SYNC_AUTH_BYTES << " bytes: verify " << fixed << setprecision(1)
+             << setw(5) << scalarNs << " ns, batched " << setw(5) << batchNs << " ns, sign " << setw(5) << signNs
+             << " ns per packet" << defaultfloat << setprecision(6) << endl;
+    }
+
+    // A forged tag must fail in both paths.
+    vector<vector<uint8_t>> packets;
+    buildBatch(ring, keyCount, 12, 8, rng, packets);
+    packets[5][3] ^= 1;
+    vector<const uint8_t *> pointers;
+    vector<size_t> lengths;
+    for (auto &packet: packets) {
+        pointers.push_back(packet.data());
+        lengths.push_back(packet.size());
+    }
+    size_t results[8];
+    uint32_t ids[8];
+    ring.verifyBatch(pointers.data(), lengths.data(), 8, results, ids);
+    uint32_t id;
+    for (size_t i = 0; i < 8; i++) {
+        bool accepted = ring.verify(pointers[i], lengths[i], id) != 0;
+        if (accepted != (i != 5) || (results[i] != 0) != accepted) {
+            cerr << "Packet " << i << " verified wrongly" << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "client_table.h"
+
+using namespace std;
+
+const FilterParams filterParams{5, 2.5, 0.3};
+const int REQUESTS_PER_CLIENT = 8;
+
+// Per-client state as ptp_server kept it in node-based maps.
+struct LegacyClient {
+    int requestCount = 0;
+    int lastCorrection = 0;
+    vector<int> history;
+};
+
+double residentMiB() {
+    long pages = 0;
+    long resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != nullptr) {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE) / 1048576.0;
+}
+
+ClientKey randomKey(mt19937_64 &rng) {
+    ClientKey key{};
+    uint64_t words[2] = {rng(), rng()};
+    memcpy(key.addr, words, 16);
+    key.port = static_cast<uint16_t>(rng());
+    return key;
+}
+
+class LegacyTable {
+public:
+    bool admit(const ClientKey &key, int correction) {
+        LegacyClient &client = clients[key];
+        for (int i = 0; i < REQUESTS_PER_CLIENT; i++) {
+            client.lastCorrection = advancedCorrection(correction + i, client.requestCount, client.lastCorrection,
+                                                       client.history, filterParams);
+            client.requestCount++;
+        }
+        return true;
+    }
+
+    void evict(const ClientKey &key) { clients.erase(key); }
+
+private:
+    unordered_map<ClientKey, LegacyClient, ClientKeyHash> clients;
+};
+
+class ArenaTable {
+public:
+    explicit ArenaTable(const ArenaOptions &memory) : table(0, memory) {}
+
+    bool admit(const ClientKey &key, int correction) {
+        bool inserted;
+        uint32_t row = table.findOrInsert(key, inserted);
+        if (row == ClientTable::FULL) {
+            return false;
+        }
+        for (int i = 0; i < REQUESTS_PER_CLIENT; i++) {
+            table.lastCorrection[row] = advancedCorrection(correction + i, table.requestCount[row],
+                                                           table.lastCorrection[row], *table.history[row],
+                                                           filterParams);
+            table.requestCount[row]++;
+        }
+        return true;
+    }
+
+    void evict(const ClientKey &key) {
+        int64_t row = table.find(key);
+        if (row >= 0) table.remove(static_cast<uint32_t>(row));
+    }
+
+    ClientTable table;
+};
+
+// Fills the table, then each round evicts half of the clients at random and
+// admits as many new ones: source-port churn at a constant client count.
+template<typename Table>
+void runChurn(Table &table, size_t clientCount, int rounds) {
+    mt19937_64 rng(42);
+    vector<ClientKey> live;
+    live.reserve(clientCount);
+    size_t refused = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < clientCount; i++) {
+        live.push_back(randomKey(rng));
+        refused += !table.admit(live.back(), static_cast<int>(rng() % 200));
+    }
+    double fillMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << "  fill     " << fixed << setprecision(1) << setw(8) << residentMiB() << " MiB resident, "
+         << setprecision(0) << fillMs * 1e6 / clientCount << " ns per new client" << endl;
+
+    for (int round = 1; round <= rounds; round++) {
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < clientCount / 2; i++) {
+            size_t victim = rng() % live.size();
+            table.evict(live[victim]);
+            live[victim] = randomKey(rng);
+            refused += !table.admit(live[victim], static_cast<int>(rng() % 200));
+        }
+        double churnMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "  round " << setw(2) << round << setprecision(1) << setw(8) << residentMiB() << " MiB resident, "
+             << setprecision(0) << churnMs * 1e6 / (clientCount / 2) << " ns per replaced client" << endl;
+    }
+    cout << defaultfloat << setprecision(6);
+    if (refused > 0) {
+        cout << "  " << refused << " clients refused at the ceiling" << endl;
+    }
+}
+
+// Each variant runs in its own process so the resident sizes do not mix.
+template<typename F>
+void inChild(F &&body) {
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        body();
+        cout.flush();
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char *argv[]) {
+    size_t clientCount = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 6;
+    bool hugePages = argc > 3 && string(argv[3]) == "huge";
+
+    cout << clientCount << " clients, " << REQUESTS_PER_CLIENT << " requests each, " << rounds
+         << " rounds replacing half of them" << endl;
+
+    cout << "Node-based map with vector history:" << endl;
+    inChild([&]() {
+        LegacyTable table;
+        runChurn(table, clientCount, rounds);
+    });
+
+    ArenaOptions memory;
+    memory.hugePages = hugePages;
+    cout << "ClientTable on a slab arena" << (hugePages ? " (huge pages)" : "") << ":" << endl;
+    inChild([&]() {
+        ArenaTable table(memory);
+        runChurn(table, clientCount, rounds);
+        const ArenaCounters &counters = table.table.memory();
+        cout << "  arena: " << counters.slotsInUse << " slots in use, " << counters.slotsFree << " free, "
+             << counters.slabs << " slabs (" << counters.hugeSlabs << " on huge pages), "
+             << counters.mappedBytes / 1048576 << " MiB mapped, " << counters.columnBytes / 1048576 << " MiB columns"
+             << endl;
+    });
+    return 0;
+}
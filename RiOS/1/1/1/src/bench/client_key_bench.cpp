@@ -0,0 +1,78 @@
+#include <iostream>
+#include <arpa/inet.h>
+#include <chrono>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "net_address.h"
+
+using namespace std;
+
+// The string key the servers used to build for every packet.
+string legacyKey(const sockaddr_in &addr) {
+    stringstream ss;
+    ss << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port);
+    return ss.str();
+}
+
+template<typename F>
+double nsPerOp(size_t ops, F &&body) {
+    auto start = chrono::steady_clock::now();
+    body();
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ops;
+}
+
+int main(int argc, char *argv[]) {
+    size_t clientCount = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+    size_t lookups = 2000000;
+    mt19937_64 rng(42);
+
+    vector<sockaddr_storage> v4(clientCount);
+    vector<sockaddr_storage> v6(clientCount);
+    for (size_t i = 0; i < clientCount; i++) {
+        sockaddr_in &in4 = reinterpret_cast<sockaddr_in &>(v4[i]);
+        in4.sin_family = AF_INET;
+        in4.sin_addr.s_addr = static_cast<uint32_t>(rng());
+        in4.sin_port = static_cast<uint16_t>(rng());
+
+        sockaddr_in6 &in6 = reinterpret_cast<sockaddr_in6 &>(v6[i]);
+        in6.sin6_family = AF_INET6;
+        uint64_t words[2] = {0x20010db800000000ULL | (rng() & 0xffffffff), rng()};
+        memcpy(&in6.sin6_addr, words, 16);
+        in6.sin6_port = static_cast<uint16_t>(rng());
+    }
+
+    vector<size_t> order(lookups);
+    for (size_t &index: order) {
+        index = rng() % clientCount;
+    }
+
+    map<string, int> legacy;
+    unordered_map<ClientKey, int, ClientKeyHash> keyed4;
+    unordered_map<ClientKey, int, ClientKeyHash> keyed6;
+    for (size_t i = 0; i < clientCount; i++) {
+        legacy[legacyKey(reinterpret_cast<sockaddr_in &>(v4[i]))] = 0;
+        keyed4[makeClientKey(v4[i])] = 0;
+        keyed6[makeClientKey(v6[i])] = 0;
+    }
+
+    long sink = 0;
+    double legacyNs = nsPerOp(lookups, [&]() {
+        for (size_t index: order) sink += ++legacy[legacyKey(reinterpret_cast<sockaddr_in &>(v4[index]))];
+    });
+    double v4Ns = nsPerOp(lookups, [&]() {
+        for (size_t index: order) sink += ++keyed4[makeClientKey(v4[index])];
+    });
+    double v6Ns = nsPerOp(lookups, [&]() {
+        for (size_t index: order) sink += ++keyed6[makeClientKey(v6[index])];
+    });
+
+    cout << "Client lookup, " << clientCount << " clients, " << lookups << " lookups" << endl;
+    cout << "  string key + map (IPv4):  " << legacyNs << " ns" << endl;
+    cout << "  ClientKey + hash (IPv4):  " << v4Ns << " ns" << endl;
+    cout << "  ClientKey + hash (IPv6):  " << v6Ns << " ns" << endl;
+    return sink == 42 ? 1 : 0;
+}
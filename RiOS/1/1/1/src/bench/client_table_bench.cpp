@@ -0,0 +1,138 @@
+#include <iostream>
+#include <chrono>
+#include <climits>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "client_table.h"
+
+using namespace std;
+
+// Per-client record as ptp_server kept it before the column store.
+struct LegacyStats {
+    int state = CLIENT_DISCONNECTED;
+    int requestCount = 0;
+    int totalCorrection = 0;
+    double averageCorrection = 0;
+    int minCorrection = INT_MAX;
+    int maxCorrection = INT_MIN;
+    int lastCorrection = 0;
+    int lastSeenMs = 0;
+};
+
+template<typename F>
+double msPerSweep(int sweeps, F &&body) {
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < sweeps; i++) {
+        body();
+    }
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / sweeps;
+}
+
+int main(int argc, char *argv[]) {
+    size_t clientCount = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    const int sweeps = 20;
+    const int32_t cutoffMs = 1000;
+    mt19937_64 rng(42);
+
+    unordered_map<ClientKey, LegacyStats, ClientKeyHash> legacy;
+    legacy.reserve(clientCount);
+    ClientTable table(clientCount);
+
+    for (size_t i = 0; i < clientCount; i++) {
+        ClientKey key{};
+        uint64_t words[2] = {rng(), rng()};
+        memcpy(key.addr, words, 16);
+        key.port = static_cast<uint16_t>(rng());
+
+        LegacyStats stats;
+        stats.state = rng() % 10 == 0 ? CLIENT_DISCONNECTED : CLIENT_CONNECTED;
+        stats.requestCount = static_cast<int>(rng() % 1000) + 1;
+        stats.lastCorrection = static_cast<int>(rng() % 200) - 100;
+        stats.minCorrection = stats.lastCorrection - static_cast<int>(rng() % 50);
+        stats.maxCorrection = stats.lastCorrection + static_cast<int>(rng() % 50);
+        stats.totalCorrection = stats.lastCorrection * stats.requestCount;
+        stats.lastSeenMs = static_cast<int>(rng() % 100000);
+        legacy[key] = stats;
+
+        bool inserted;
+        uint32_t row = table.findOrInsert(key, inserted);
+        table.state[row] = stats.state;
+        table.requestCount[row] = stats.requestCount;
+        table.lastCorrection[row] = stats.lastCorrection;
+        table.minCorrection[row] = stats.minCorrection;
+        table.maxCorrection[row] = stats.maxCorrection;
+        table.totalCorrection[row] = stats.totalCorrection;
+        table.lastSeenMs[row] = stats.lastSeenMs;
+    }
+
+    int64_t sink = 0;
+    vector<uint32_t> rows;
+    vector<ClientKey> keys;
+    rows.reserve(clientCount);
+    keys.reserve(clientCount);
+
+    double legacyStatsMs = msPerSweep(sweeps, [&]() {
+        FleetStats fleet;
+        for (const auto &[key, stats]: legacy) {
+            fleet.connected += stats.state == CLIENT_CONNECTED;
+            fleet.requests += stats.requestCount;
+            fleet.totalCorrection += stats.totalCorrection;
+            fleet.minCorrection = min(fleet.minCorrection, stats.minCorrection);
+            fleet.maxCorrection = max(fleet.maxCorrection, stats.maxCorrection);
+        }
+        sink += fleet.requests + fleet.minCorrection;
+    });
+    double legacyIdleMs = msPerSweep(sweeps, [&]() {
+        keys.clear();
+        for (const auto &[key, stats]: legacy) {
+            if (stats.lastSeenMs < cutoffMs) keys.push_back(key);
+        }
+        sink += keys.size();
+    });
+
+    ClientTable::setSimd(false);
+    double scalarStatsMs = msPerSweep(sweeps, [&]() {
+        FleetStats fleet = table.aggregate();
+        sink += fleet.requests + fleet.minCorrection;
+    });
+    double scalarIdleMs = msPerSweep(sweeps, [&]() {
+        rows.clear();
+        table.collectIdle(cutoffMs, rows);
+        sink += rows.size();
+    });
+
+    FleetStats scalarFleet = table.aggregate();
+    vector<uint32_t> scalarRows = rows;
+
+    ClientTable::setSimd(true);
+    bool simd = ClientTable::simdActive();
+    double simdStatsMs = msPerSweep(sweeps, [&]() {
+        FleetStats fleet = table.aggregate();
+        sink += fleet.requests + fleet.minCorrection;
+    });
+    double simdIdleMs = msPerSweep(sweeps, [&]() {
+        rows.clear();
+        table.collectIdle(cutoffMs, rows);
+        sink += rows.size();
+    });
+
+    FleetStats simdFleet = table.aggregate();
+    bool match = rows == scalarRows && simdFleet.connected == scalarFleet.connected &&
+                 simdFleet.requests == scalarFleet.requests &&
+                 simdFleet.totalCorrection == scalarFleet.totalCorrection &&
+                 simdFleet.minCorrection == scalarFleet.minCorrection &&
+                 simdFleet.maxCorrection == scalarFleet.maxCorrection;
+
+    cout << "Full-table sweeps, " << clientCount << " clients (ms per sweep)" << endl;
+    cout << "                        fleet stats   idle scan" << endl;
+    cout << "  unordered_map nodes:  " << legacyStatsMs << "     " << legacyIdleMs << endl;
+    cout << "  columns, scalar:      " << scalarStatsMs << "     " << scalarIdleMs << endl;
+    if (simd) {
+        cout << "  columns, AVX2:        " << simdStatsMs << "     " << simdIdleMs << endl;
+    } else {
+        cout << "  columns, AVX2:        not supported by this CPU" << endl;
+    }
+    cout << "  scalar and vector results " << (match ? "match" : "DIFFER") << endl;
+    return match && sink != 42 ? 0 : 1;
+}
@@ -0,0 +1,217 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "concurrent_client_table.h"
+
+using namespace std;
+
+// The mix a shared-socket server sees: mostly requests from known clients,
+// some first requests, some evictions and report reads.
+const int UPDATE_PERCENT = 90;
+const int REMOVE_PERCENT = 3;
+const int READ_PERCENT = 7;
+
+struct MixCounts {
+    uint64_t ops = 0;
+    uint64_t updates = 0;
+};
+
+void updateRecord(ClientRecord &record, int correction) {
+    record.state = CLIENT_CONNECTED;
+    record.requestCount++;
+    record.lastCorrection = correction;
+    record.totalCorrection += correction;
+    if (correction < record.minCorrection) record.minCorrection = correction;
+    if (correction > record.maxCorrection) record.maxCorrection = correction;
+}
+
+// The same operations on unordered_map behind one mutex.
+class LockedTable {
+public:
+    void attach() {}
+
+    void update(const ClientKey &key, int correction) {
+        lock_guard<mutex> lock(guard);
+        updateRecord(records[key], correction);
+    }
+
+    void remove(const ClientKey &key) {
+        lock_guard<mutex> lock(guard);
+        records.erase(key);
+    }
+
+    int64_t read(const ClientKey &key) {
+        lock_guard<mutex> lock(guard);
+        auto it = records.find(key);
+        return it == records.end() ? 0 : it->second.totalCorrection;
+    }
+
+    uint64_t requestSum() {
+        uint64_t sum = 0;
+        for (const auto &entry: records) sum += entry.second.requestCount;
+        return sum;
+    }
+
+private:
+    mutex guard;
+    unordered_map<ClientKey, ClientRecord, ClientKeyHash> records;
+};
+
+class SharedTable {
+public:
+    void attach() { thread = table.registerThread(); }
+
+    void update(const ClientKey &key, int correction) {
+        ConcurrentClientTable::Guard guard(table, thread);
+        bool inserted;
+        ConcurrentClientTable::Entry *entry = table.findOrInsert(thread, key, inserted);
+        entry->lock();
+        updateRecord(entry->record, correction);
+        entry->unlock();
+    }
+
+    void remove(const ClientKey &key) {
+        ConcurrentClientTable::Guard guard(table, thread);
+        table.remove(thread, key);
+    }
+
+    int64_t read(const ClientKey &key) {
+        ConcurrentClientTable::Guard guard(table, thread);
+        ConcurrentClientTable::Entry *entry = table.find(key);
+        return entry == nullptr ? 0 : entry->read().totalCorrection;
+    }
+
+    uint64_t requestSum() {
+        ConcurrentClientTable::Guard guard(table, thread);
+        uint64_t sum = 0;
+        table.forEach([&](const ConcurrentClientTable::Entry &entry) { sum += entry.read().requestCount; });
+        return sum;
+    }
+
+    ConcurrentClientTable table;
+
+private:
+    static thread_local size_t thread;
+};
+
+thread_local size_t SharedTable::thread = 0;
+
+// Runs `threads` threads over keys for `seconds`; returns the total counts.
+template<typename Table>
+MixCounts runMix(Table &table, const vector<ClientKey> &keys, int threads, double seconds, bool removals,
+                 int64_t &sink) {
+    atomic<bool> go(false);
+    atomic<bool> stop(false);
+    atomic<int> ready(0);
+    vector<MixCounts> counts(threads);
+    vector<int64_t> sinks(threads);
+    vector<thread> pool;
+
+    for (int t = 0; t < threads; t++) {
+        pool.emplace_back([&, t]() {
+            table.attach();
+            mt19937_64 rng(1000 + t);
+            MixCounts local;
+            int64_t localSink = 0;
+            ready++;
+            while (!go) this_thread::yield();
+            while (!stop.load(memory_order_relaxed)) {
+                for (int i = 0; i < 256; i++) {
+                    uint64_t r = rng();
+                    const ClientKey &key = keys[(r >> 8) % keys.size()];
+                    int dice = static_cast<int>(r % 100);
+                    if (dice < UPDATE_PERCENT || (!removals && dice < UPDATE_PERCENT + REMOVE_PERCENT)) {
+                        table.update(key, static_cast<int>(r >> 48) - 32768);
+                        local.updates++;
+                    } else if (dice < UPDATE_PERCENT + REMOVE_PERCENT) {
+                        table.remove(key);
+                    } else {
+                        localSink += table.read(key);
+                    }
+                }
+                local.ops += 256;
+            }
+            counts[t] = local;
+            sinks[t] = localSink;
+        });
+    }
+
+    while (ready < threads) this_thread::yield();
+    go = true;
+    this_thread::sleep_for(chrono::duration<double>(seconds));
+    stop = true;
+    for (thread &worker: pool) worker.join();
+
+    MixCounts total;
+    for (int t = 0; t < threads; t++) {
+        total.ops += counts[t].ops;
+        total.updates += counts[t].updates;
+        sink += sinks[t];
+    }
+    return total;
+}
+
+vector<ClientKey> makeKeys(size_t count, uint64_t seed) {
+    mt19937_64 rng(seed);
+    vector<ClientKey> keys(count);
+    for (ClientKey &key: keys) {
+        memset(&key, 0, sizeof(key));
+        uint64_t words[2] = {rng(), rng()};
+        memcpy(key.addr, words, 16);
+        key.port = static_cast<uint16_t>(rng());
+    }
+    return keys;
+}
+
+int main(int argc, char *argv[]) {
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 64;
+    size_t clientCount = argc > 2 ? strtoul(argv[2], nullptr, 10) : 200000;
+    double seconds = argc > 3 ? atof(argv[3]) : 0.3;
+
+    vector<ClientKey> spread = makeKeys(clientCount, 42);
+    vector<ClientKey> hot = makeKeys(64, 7);
+    int64_t sink = 0;
+
+    cout << "Shared client table, " << UPDATE_PERCENT << "% updates / " << REMOVE_PERCENT << "% evictions / "
+         << READ_PERCENT << "% reads, " << seconds << " s per run, " << thread::hardware_concurrency()
+         << " CPUs (Mops/s)" << endl;
+    cout << "  threads   " << clientCount << " clients: mutex  lock-free     64 hot clients: mutex  lock-free"
+         << endl;
+
+    uint64_t resizes = 0;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        double rates[4];
+        int column = 0;
+        for (const vector<ClientKey> *keys: {&spread, &hot}) {
+            LockedTable locked;
+            rates[column++] = runMix(locked, *keys, threads, seconds, true, sink).ops / seconds / 1e6;
+            SharedTable shared;
+            rates[column++] = runMix(shared, *keys, threads, seconds, true, sink).ops / seconds / 1e6;
+            resizes += shared.table.resizes();
+        }
+        cout << fixed << setprecision(2) << "  " << setw(7) << threads << setw(24) << rates[0] << setw(11)
+             << rates[1] << setw(28) << rates[2] << setw(11) << rates[3] << defaultfloat << endl;
+    }
+    cout << "  " << resizes << " incremental resizes during the lock-free runs" << endl;
+
+    // Without evictions every update must be counted exactly once.
+    SharedTable check;
+    MixCounts counts = runMix(check, spread, maxThreads, seconds, false, sink);
+    check.attach();
+    uint64_t counted = check.requestSum();
+    const EpochReclaimer &epochs = check.table.epochs();
+    cout << "  check at " << maxThreads << " threads: " << counts.updates << " updates, " << counted
+         << " counted, " << check.table.size() << " clients in " << check.table.bucketCount() << " buckets, "
+         << epochs.freedCount() << " freed / " << epochs.pendingCount() << " pending retirements -> "
+         << (counted == counts.updates ? "match" : "DIFFER") << endl;
+    return counted == counts.updates && sink != 42 ? 0 : 1;
+}
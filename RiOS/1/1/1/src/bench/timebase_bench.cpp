@@ -0,0 +1,90 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include "timebase.h"
+
+using namespace std;
+
+volatile int64_t sink;
+
+template<typename F>
+void timeReads(const char *name, size_t reads, F &&read) {
+    auto start = chrono::steady_clock::now();
+    int64_t sum = 0;
+    for (size_t i = 0; i < reads; i++) {
+        sum += read();
+    }
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    sink = sum;
+    cout << "  " << left << setw(28) << name << right << fixed << setprecision(1) << setw(7) << ns / reads
+         << " ns per read" << defaultfloat << setprecision(6) << endl;
+}
+
+// Each second: the kernel clock read between two timebase reads, off from
+// their midpoint by at most half the bracket.
+void measureAccuracy(Timebase &clock, int seconds) {
+    cout << "Timebase minus kernel clock, sampled every ms:" << endl;
+    int64_t lastMono = clock.monotonicNs();
+    uint64_t backwards = 0;
+    for (int second = 1; second <= seconds; second++) {
+        int64_t worstMono = 0, worstReal = 0, sumMono = 0;
+        int samples = 0;
+        auto until = chrono::steady_clock::now() + chrono::seconds(1);
+        while (chrono::steady_clock::now() < until) {
+            int64_t before = clock.monotonicNs();
+            int64_t kernel = Timebase::kernelNs(CLOCK_MONOTONIC);
+            int64_t after = clock.monotonicNs();
+            int64_t beforeReal = clock.realtimeNs();
+            int64_t kernelReal = Timebase::kernelNs(CLOCK_REALTIME);
+            int64_t afterReal = clock.realtimeNs();
+            backwards += before < lastMono;
+            lastMono = after;
+
+            int64_t mono = (before + after) / 2 - kernel;
+            int64_t real = (beforeReal + afterReal) / 2 - kernelReal;
+            worstMono = max<int64_t>(worstMono, llabs(mono));
+            worstReal = max<int64_t>(worstReal, llabs(real));
+            sumMono += mono;
+            samples++;
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        TimebaseStats stats = clock.stats();
+        cout << "  second " << setw(2) << second << ": monotonic mean " << setw(6) << sumMono / max(1, samples)
+             << " ns, worst " << setw(6) << worstMono << " ns; realtime worst " << setw(6) << worstReal << " ns; "
+             << stats.calibrations << " calibrations" << endl;
+    }
+    cout << "  " << backwards << " reads went backwards" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    size_t reads = argc > 1 ? strtoul(argv[1], nullptr, 10) : 10000000;
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+
+    Timebase &clock = timebase();
+    if (!clock.start()) {
+        cout << "TSC not usable (" << clock.stats().reason << "), timebase reads go to clock_gettime()" << endl;
+    }
+    this_thread::sleep_for(chrono::milliseconds(200)); // past the first two calibrations
+
+    cout << reads << " reads each:" << endl;
+    timeReads("rdtsc", reads, []() { return static_cast<int64_t>(readTsc()); });
+    timeReads("timebase monotonicNs()", reads, [&]() { return clock.monotonicNs(); });
+    timeReads("timebase realtimeNs()", reads, [&]() { return clock.realtimeNs(); });
+    timeReads("clock_gettime(MONOTONIC)", reads, []() { return Timebase::kernelNs(CLOCK_MONOTONIC); });
+    timeReads("clock_gettime(REALTIME)", reads, []() { return Timebase::kernelNs(CLOCK_REALTIME); });
+    timeReads("steady_clock::now()", reads,
+              []() { return static_cast<int64_t>(chrono::steady_clock::now().time_since_epoch().count()); });
+
+    measureAccuracy(clock, seconds);
+
+    TimebaseStats stats = clock.stats();
+    if (stats.tsc) {
+        cout << "TSC at " << fixed << setprecision(6) << stats.ticksPerNs << " ticks per ns, " << stats.calibrations
+             << " calibrations, " << stats.steps << " steps" << endl;
+    } else {
+        cout << "Timebase on clock_gettime(): " << stats.reason << endl;
+    }
+    return 0;
+}
@@ -4,126 +4,251 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <cstring>
-#include <chrono>
-#include <thread>
+#include <cerrno>
+#include <ctime>
 #include <csignal>
+#include <string>
+#include <cmath>
+#include <algorithm>
 #include "get_sync.h"
 #include "set_sync.h"
+#include "sync_trace.h"
+#include "net_address.h"
+#include "clock_filter.h"
+#include "disciplined_clock.h"
+#include "sync_auth.h"
+#include "poll_loop.h"
 
 using namespace std;
 
 int sockfd = -1;
-sockaddr_in serverAddr{};
-chrono::steady_clock::time_point startTime;
+sockaddr_storage serverAddr{};
+socklen_t serverAddrLen = 0;
+int64_t startNs = 0;
 int currentTime = 0;
-int requestCount = 0;
-bool running = true;
+volatile sig_atomic_t running = 1;
+TraceWriter trace;
+
+const int MAX_BURST = 8;
+PollLoop::Params pollParams;
+PollLoop pollLoop;
+ClockFilter clockFilter;
+DisciplineParams disciplineParams;
+DisciplinedClock disciplinedClock;
+
+uint64_t forgedReplies = 0;
+
+// --key: requests and the disconnect are tagged with this pre-shared key and
+// replies without a good tag under it are dropped unread.
+bool useAuth = false;
+SipKey authKey;
+uint32_t authKeyId = 0;
+uint32_t authCounter = initialSyncAuthCounter();
+
+int64_t monotonicNs() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// Local timebase: time since the client started.
+int64_t getElapsedNs() {
+    return monotonicNs() - startNs;
+}
 
-int getElapsedTime() {
-    auto now = chrono::steady_clock::now();
-    return chrono::duration_cast<chrono::milliseconds>(now - startTime).count();
+// The client's time in ms: the local timebase disciplined towards the server.
+int readClockMs(int64_t elapsedNs) {
+    return static_cast<int>(disciplinedClock.read(elapsedNs) / 1000000);
 }
 
-bool sendSyncRequest() {
+// Sends a request, with the trailer under --key.
+bool sendRequest(const GetSync &request) {
+    char packet[sizeof(request) + SYNC_AUTH_BYTES];
+    memcpy(packet, &request, sizeof(request));
+    size_t length = useAuth ? signPacket(authKey, authKeyId, ++authCounter, packet, sizeof(request)) : sizeof(request);
+    return sendto(sockfd, packet, length, 0, (struct sockaddr *) &serverAddr, serverAddrLen) ==
+           static_cast<ssize_t>(length);
+}
+
+// The request carries the disciplined time at its own send; value keeps it
+// and stampNs the send on the trace's clock.
+bool sendSyncRequest(PollRequest &pollRequest) {
+    currentTime = readClockMs(pollRequest.sentNs - startNs);
+
     GetSync request{};
     strncpy(request.cmd, "GET", 3);
     request.currentValue = currentTime;
+    request.sequence = pollRequest.sequence;
+
+    if (!sendRequest(request)) {
+        cerr << "Failed to send sync request #" << pollLoop.polls() << endl;
+        return false;
+    }
 
-    ssize_t sent = sendto(sockfd, &request, sizeof(request), 0,
-                          (struct sockaddr *) &serverAddr, sizeof(serverAddr));
-    return sent == sizeof(request);
+    pollRequest.value = request.currentValue;
+    pollRequest.stampNs = realtimeNs();
+    return true;
 }
 
-bool receiveCorrection() {
-    SetSync response{};
-    ssize_t received = recv(sockfd, &response, sizeof(response), 0);
+void recordSample(const PollRequest &request, const SetSync &response, int64_t rxNs) {
+    TraceRecord rec{};
+    rec.rxNs = rxNs;
+    rec.txNs = request.stampNs;
+    rec.replyValue = response.correction;
+    traceAddress(serverAddr, rec);
+    rec.requestValue = static_cast<int32_t>(request.value);
+    rec.rawCorrection = response.correction;
+    rec.correction = response.correction;
+    rec.source = TRACE_CLIENT;
+    rec.protocol = TRACE_SYNC;
+    trace.record(rec);
+}
 
-    if (received != sizeof(response) || strncmp(response.cmd, "SYNC", 4) != 0) {
-        return false;
+void finishPoll(int pollReplies) {
+    ClockSample best;
+    if (pollReplies == 0 || !clockFilter.select(monotonicNs(), best)) {
+        cerr << "Failed to receive correction for request #" << pollLoop.polls() << endl;
+        return;
     }
 
-    int correction = response.correction;
+    // Samples hold the server's offset against the local timebase; the clock
+    // is steered by its offset against the disciplined time.
+    int64_t elapsedNs = getElapsedNs();
+    double offsetMs = best.offsetMs - (disciplinedClock.read(elapsedNs) - elapsedNs) / 1e6;
+    bool synchronized = disciplinedClock.synchronized();
+    uint64_t steps = disciplinedClock.steps();
+    disciplinedClock.update(llround(offsetMs * 1e6), elapsedNs);
+
+    cout << "Request #" << pollLoop.polls();
+    if (pollParams.burst > 1) {
+        cout << " - Burst " << pollReplies << "/" << pollParams.burst << ", min delay " << best.delayMs << " ms";
+    }
+    cout << " - Offset: " << offsetMs << " ms";
+    if (!synchronized) {
+        cout << " (set)";
+    } else {
+        cout << (disciplinedClock.steps() != steps ? " (stepped)" : " (slewing)");
+    }
+    cout << " - Frequency: " << disciplinedClock.frequencyPpm() << " ppm";
 
-    cout << "Request #" << requestCount;
-    cout << " - Applied correction: " << correction;
+    currentTime = readClockMs(getElapsedNs());
 
-    currentTime += correction;
+    cout << " - Time: " << currentTime << endl;
+}
 
-    cout << " - New time: " << currentTime << endl;
+void receiveReplies() {
+    while (true) {
+        char buffer[sizeof(SetSync) + SYNC_AUTH_BYTES];
+        int64_t rxNs = 0;
+        ssize_t received = recvWithTimestamp(sockfd, buffer, sizeof(buffer), MSG_DONTWAIT, nullptr, nullptr, rxNs);
+        if (received < 0) {
+            break;
+        }
+        if (useAuth) {
+            received = static_cast<ssize_t>(verifyPacket(authKey, authKeyId, buffer, received));
+            if (received == 0) {
+                forgedReplies++;
+                continue;
+            }
+        }
+        int64_t nowNs = monotonicNs();
 
-    return true;
+        SetSync response{};
+        if (received != sizeof(response)) {
+            continue;
+        }
+        memcpy(&response, buffer, sizeof(response));
+        if (strncmp(response.cmd, "SYNC", 4) != 0) {
+            continue;
+        }
+
+        PollRequest request;
+        if (!pollLoop.take(response.sequence, request)) {
+            continue; // answer to a request that already timed out
+        }
+
+        // requestValue + correction is the server's time in whole ms when the
+        // request arrived, half a round trip after the send; take the middle of
+        // that tick.
+        ClockSample sample;
+        double sentMs = (request.sentNs - startNs) / 1e6;
+        sample.delayMs = (nowNs - request.sentNs) / 1e6;
+        sample.offsetMs = request.value + response.correction + 0.5 - (sentMs + sample.delayMs / 2);
+        sample.timeNs = nowNs;
+        clockFilter.add(sample);
+
+        if (trace.isOpen()) {
+            recordSample(request, response, rxNs);
+        }
+    }
 }
 
 void sendDisconnect() {
     GetSync request{};
     strncpy(request.cmd, "DISC", 4);
-    request.currentValue = currentTime;
-    sendto(sockfd, &request, sizeof(request), 0,
-           (struct sockaddr *) &serverAddr, sizeof(serverAddr));
+    request.currentValue = readClockMs(getElapsedNs());
+    sendRequest(request);
 }
 
 bool initialize(const char *serverIP) {
-    startTime = chrono::steady_clock::now();
+    startNs = monotonicNs();
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (!resolveAddress(serverIP, 8080, serverAddr, serverAddrLen)) {
+        cerr << "Invalid server address: " << serverIP << endl;
+        return false;
+    }
+
+    sockfd = socket(serverAddr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
     if (sockfd < 0) {
         cerr << "Socket creation failed" << endl;
         return false;
     }
 
-    struct timeval timeout{2, 0}; // 2 seconds
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(8080);
-    inet_pton(AF_INET, serverIP, &serverAddr.sin_addr);
+    if (!pollLoop.open(sockfd, pollParams, sendSyncRequest, receiveReplies, finishPoll)) {
+        cerr << "Event loop setup failed" << endl;
+        return false;
+    }
 
     cout << "Time sync client initialized" << endl;
     return true;
 }
 
-void run(int syncPeriodMs) {
-    while (running) {
-        int baseTime = getElapsedTime();
-        if (requestCount == 0) {
-            currentTime = baseTime;
-        }
-
-        requestCount++;
-
-        if (sendSyncRequest()) {
-            if (!receiveCorrection()) {
-                cerr << "Failed to receive correction for request #" << requestCount << endl;
-            }
-        } else {
-            cerr << "Failed to send sync request #" << requestCount << endl;
-        }
-
-        this_thread::sleep_for(chrono::milliseconds(syncPeriodMs));
-        currentTime += syncPeriodMs;
+void run() {
+    if (!pollLoop.run(running)) {
+        cerr << "epoll_wait failed: " << strerror(errno) << endl;
     }
 
+    cout << "\nShutting down..." << endl;
     sendDisconnect();
-    cout << "Client disconnected after " << requestCount << " requests" << endl;
+    cout << "Client disconnected after " << pollLoop.polls() << " requests" << endl;
+    cout << "Replies: " << pollLoop.replies() << ", timeouts: " << pollLoop.timeouts() << ", retries: "
+         << pollLoop.retries() << ", stale replies dropped: " << pollLoop.staleReplies();
+    if (useAuth) {
+        cout << ", unauthenticated replies dropped: " << forgedReplies;
+    }
+    cout << endl;
 }
 
-void stop() { running = false; }
+void stop() { running = 0; }
 
 void signalHandler(int sig) {
-    cout << "\nShutting down..." << endl;
     stop();
 }
 
 void cleanup() {
+    pollLoop.close();
     if (sockfd >= 0) {
         close(sockfd);
     }
+    if (trace.isOpen()) {
+        trace.close();
+    }
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        cout << "Usage: " << argv[0] << " <server_IP> <sync_period_ms>" << endl;
+    if (argc < 3) {
+        cout << "Usage: " << argv[0] << " <server_IP> <sync_period_ms> [--trace <file>] [--burst K]"
+             << " [--timeout ms] [--retries N] [--step ms] [--key <id>:<32 hex digits>]" << endl;
         return -1;
     }
 
@@ -135,15 +260,64 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    // A third of the period, so the default retry still fits before the next poll.
+    int timeoutMs = max(1, min(2000, syncPeriod / 3));
+
+    string tracePath;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--burst" && i + 1 < argc) {
+            pollParams.burst = atoi(argv[++i]);
+            if (pollParams.burst < 1 || pollParams.burst > MAX_BURST) {
+                cerr << "Burst size must be between 1 and " << MAX_BURST << endl;
+                return -1;
+            }
+        } else if (arg == "--timeout" && i + 1 < argc) {
+            timeoutMs = atoi(argv[++i]);
+            if (timeoutMs <= 0) {
+                cerr << "Timeout must be positive" << endl;
+                return -1;
+            }
+        } else if (arg == "--retries" && i + 1 < argc) {
+            pollParams.retries = max(0, atoi(argv[++i]));
+        } else if (arg == "--step" && i + 1 < argc) {
+            disciplineParams.stepThresholdMs = atof(argv[++i]);
+        } else if (arg == "--key" && i + 1 < argc) {
+            if (!parseSyncKey(argv[++i], authKeyId, authKey)) {
+                cerr << "Key must be <id>:<32 hex digits>" << endl;
+                return -1;
+            }
+            useAuth = true;
+        } else {
+            cerr << "Unknown option: " << arg << endl;
+            return -1;
+        }
+    }
+    pollParams.periodNs = syncPeriod * 1000000LL;
+    pollParams.timeoutNs = timeoutMs * 1000000LL;
+    disciplinedClock = DisciplinedClock(disciplineParams);
+
     signal(SIGINT, signalHandler);
     signal(SIGTERM, signalHandler);
 
     if (!initialize(serverIP)) {
+        cleanup();
         return -1;
     }
 
+    if (!tracePath.empty()) {
+        if (!trace.open(tracePath)) {
+            cerr << "Cannot open trace file " << tracePath << endl;
+            cleanup();
+            return -1;
+        }
+        enableKernelTimestamps(sockfd);
+    }
+
     cout << "Starting sync with period " << syncPeriod << "ms. Press Ctrl+C to stop." << endl;
-    run(syncPeriod);
+    run();
 
     cleanup();
     return 0;
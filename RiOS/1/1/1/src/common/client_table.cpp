@@ -0,0 +1,349 @@
+#include "client_table.h"
+
+#include <algorithm>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CLIENT_TABLE_AVX2 1
+#endif
+
+using namespace std;
+
+namespace {
+
+atomic<bool> simdEnabled(true);
+
+// An unordered_map node: next pointer, key and row, cached hash.
+const size_t INDEX_NODE_BYTES = sizeof(void *) + sizeof(pair<const ClientKey, uint32_t>) + sizeof(size_t);
+
+// One row across the columns, plus its index bucket at load factor 1.
+const size_t ROW_BYTES = sizeof(ClientKey) + 6 * sizeof(int32_t) + sizeof(int64_t) + sizeof(CorrectionHistory *) +
+                         sizeof(SyncAuthBinding) + sizeof(void *);
+
+void idleScalar(const int32_t *lastSeen, size_t begin, size_t end, int32_t cutoffMs, vector<uint32_t> &rows) {
+    for (size_t i = begin; i < end; i++) {
+        if (lastSeen[i] < cutoffMs) {
+            rows.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+void disconnectedScalar(const int32_t *state, size_t begin, size_t end, vector<uint32_t> &rows) {
+    for (size_t i = begin; i < end; i++) {
+        if (state[i] == CLIENT_DISCONNECTED) {
+            rows.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+void aggregateScalar(const ClientTable &table, size_t begin, size_t end, FleetStats &stats) {
+    for (size_t i = begin; i < end; i++) {
+        stats.connected += table.state[i] == CLIENT_CONNECTED;
+        stats.requests += table.requestCount[i];
+        stats.totalCorrection += table.totalCorrection[i];
+        stats.minCorrection = min(stats.minCorrection, table.minCorrection[i]);
+        stats.maxCorrection = max(stats.maxCorrection, table.maxCorrection[i]);
+    }
+}
+
+#ifdef CLIENT_TABLE_AVX2
+
+bool cpuHasAvx2() {
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    return hasAvx2;
+}
+
+// Eight rows per step; the bits of the match mask become row numbers.
+__attribute__((target("avx2")))
+size_t idleAvx2(const int32_t *lastSeen, size_t begin, size_t end, int32_t cutoffMs, vector<uint32_t> &rows) {
+    const __m256i cutoff = _mm256_set1_epi32(cutoffMs);
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256i seen = _mm256_load_si256(reinterpret_cast<const __m256i *>(lastSeen + i));
+        __m256i match = _mm256_cmpgt_epi32(cutoff, seen);
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(match)));
+        while (mask != 0) {
+            rows.push_back(static_cast<uint32_t>(i + __builtin_ctz(mask)));
+            mask &= mask - 1;
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t disconnectedAvx2(const int32_t *state, size_t count, vector<uint32_t> &rows) {
+    const __m256i disconnected = _mm256_set1_epi32(CLIENT_DISCONNECTED);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_load_si256(reinterpret_cast<const __m256i *>(state + i));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpeq_epi32(s, disconnected))));
+        while (mask != 0) {
+            rows.push_back(static_cast<uint32_t>(i + __builtin_ctz(mask)));
+            mask &= mask - 1;
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+int64_t horizontalSum64(__m256i v) {
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1);
+}
+
+// 32-bit columns are widened to 64-bit lanes before summing so a fleet of
+// long-lived clients cannot overflow the request total.
+__attribute__((target("avx2")))
+size_t aggregateAvx2(const ClientTable &table, size_t count, FleetStats &stats) {
+    const __m256i connected = _mm256_set1_epi32(CLIENT_CONNECTED);
+    __m256i connectedCount = _mm256_setzero_si256();
+    __m256i requests = _mm256_setzero_si256();
+    __m256i corrections = _mm256_setzero_si256();
+    __m256i minimum = _mm256_set1_epi32(INT32_MAX);
+    __m256i maximum = _mm256_set1_epi32(INT32_MIN);
+
+    const int32_t *state = table.state.data();
+    const int32_t *requestCount = table.requestCount.data();
+    const int32_t *minCorrection = table.minCorrection.data();
+    const int32_t *maxCorrection = table.maxCorrection.data();
+    const int64_t *totalCorrection = table.totalCorrection.data();
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i s = _mm256_load_si256(reinterpret_cast<const __m256i *>(state + i));
+        connectedCount = _mm256_sub_epi32(connectedCount, _mm256_cmpeq_epi32(s, connected));
+
+        __m256i r = _mm256_load_si256(reinterpret_cast<const __m256i *>(requestCount + i));
+        requests = _mm256_add_epi64(requests, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(r)));
+        requests = _mm256_add_epi64(requests, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(r, 1)));
+
+        corrections = _mm256_add_epi64(corrections,
+                                       _mm256_load_si256(reinterpret_cast<const __m256i *>(totalCorrection + i)));
+        corrections = _mm256_add_epi64(corrections,
+                                       _mm256_load_si256(reinterpret_cast<const __m256i *>(totalCorrection + i + 4)));
+
+        minimum = _mm256_min_epi32(minimum, _mm256_load_si256(reinterpret_cast<const __m256i *>(minCorrection + i)));
+        maximum = _mm256_max_epi32(maximum, _mm256_load_si256(reinterpret_cast<const __m256i *>(maxCorrection + i)));
+    }
+
+    alignas(32) int32_t lanes[8];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), connectedCount);
+    for (int32_t lane: lanes) stats.connected += static_cast<size_t>(lane);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), minimum);
+    for (int32_t lane: lanes) stats.minCorrection = min(stats.minCorrection, lane);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), maximum);
+    for (int32_t lane: lanes) stats.maxCorrection = max(stats.maxCorrection, lane);
+
+    stats.requests += horizontalSum64(requests);
+    stats.totalCorrection += horizontalSum64(corrections);
+    return i;
+}
+
+#endif
+
+bool useAvx2() {
+#ifdef CLIENT_TABLE_AVX2
+    return simdEnabled.load(memory_order_relaxed) && cpuHasAvx2();
+#else
+    return false;
+#endif
+}
+
+}
+
+ClientTable::ClientTable(size_t expectedClients, const ArenaOptions &memory)
+        : historyArena(sizeof(CorrectionHistory)), nodeArena(INDEX_NODE_BYTES),
+          index(0, ClientKeyHash(), equal_to<ClientKey>(), IndexAllocator(nodeArena)) {
+    setMemoryOptions(memory);
+    reserveRows(expectedClients);
+}
+
+void ClientTable::reserveRows(size_t rows) {
+    if (rows <= rowCapacity) {
+        return;
+    }
+    keys.reserve(rows);
+    state.reserve(rows);
+    lastSeenMs.reserve(rows);
+    requestCount.reserve(rows);
+    minCorrection.reserve(rows);
+    maxCorrection.reserve(rows);
+    lastCorrection.reserve(rows);
+    totalCorrection.reserve(rows);
+    history.reserve(rows);
+    auth.reserve(rows);
+    index.reserve(rows);
+    rowCapacity = rows;
+}
+
+// Looks up first: emplace would take a node from the arena on every call.
+// Room in the columns is made before anything changes, so the push_backs
+// after a successful emplace cannot throw and leave the index pointing past
+// the last row.
+uint32_t ClientTable::findOrInsert(const ClientKey &key, bool &inserted) {
+    inserted = false;
+    auto it = index.find(key);
+    if (it != index.end()) {
+        return it->second;
+    }
+
+    if (keys.size() == rowCapacity) {
+        if (bounded) {
+            refusedRows++;
+            return FULL;
+        }
+        try {
+            reserveRows(max<size_t>(1024, 2 * rowCapacity));
+        } catch (const bad_alloc &) {
+            return FULL;
+        }
+    }
+
+    void *slot = historyArena.allocate();
+    if (slot == nullptr) {
+        return FULL;
+    }
+    uint32_t row = static_cast<uint32_t>(keys.size());
+    try {
+        index.emplace(key, row);
+    } catch (const bad_alloc &) {
+        historyArena.release(slot);
+        return FULL;
+    }
+    inserted = true;
+
+    keys.push_back(key);
+    state.push_back(CLIENT_DISCONNECTED);
+    lastSeenMs.push_back(0);
+    requestCount.push_back(0);
+    minCorrection.push_back(INT32_MAX);
+    maxCorrection.push_back(INT32_MIN);
+    lastCorrection.push_back(0);
+    totalCorrection.push_back(0);
+    history.push_back(new (slot) CorrectionHistory());
+    auth.push_back(SyncAuthBinding());
+    return row;
+}
+
+int64_t ClientTable::find(const ClientKey &key) const {
+    auto it = index.find(key);
+    return it == index.end() ? -1 : static_cast<int64_t>(it->second);
+}
+
+void ClientTable::remove(uint32_t row) {
+    uint32_t last = static_cast<uint32_t>(keys.size() - 1);
+    index.erase(keys[row]);
+    historyArena.release(history[row]);
+
+    if (row != last) {
+        keys[row] = keys[last];
+        state[row] = state[last];
+        lastSeenMs[row] = lastSeenMs[last];
+        requestCount[row] = requestCount[last];
+        minCorrection[row] = minCorrection[last];
+        maxCorrection[row] = maxCorrection[last];
+        lastCorrection[row] = lastCorrection[last];
+        totalCorrection[row] = totalCorrection[last];
+        history[row] = history[last];
+        auth[row] = auth[last];
+        index[keys[row]] = row;
+    }
+
+    keys.pop_back();
+    state.pop_back();
+    lastSeenMs.pop_back();
+    requestCount.pop_back();
+    minCorrection.pop_back();
+    maxCorrection.pop_back();
+    lastCorrection.pop_back();
+    totalCorrection.pop_back();
+    history.pop_back();
+    auth.pop_back();
+}
+
+void ClientTable::collectIdle(int32_t cutoffMs, vector<uint32_t> &rows) const {
+    collectIdle(cutoffMs, 0, size(), rows);
+}
+
+// The columns are aligned from row 0, so the vector loads start at the
+// first multiple of 8.
+void ClientTable::collectIdle(int32_t cutoffMs, size_t begin, size_t end, vector<uint32_t> &rows) const {
+    end = min(end, size());
+    if (begin >= end) {
+        return;
+    }
+    size_t done = begin;
+#ifdef CLIENT_TABLE_AVX2
+    if (useAvx2()) {
+        done = min(end, (begin + 7) & ~static_cast<size_t>(7));
+        idleScalar(lastSeenMs.data(), begin, done, cutoffMs, rows);
+        done = idleAvx2(lastSeenMs.data(), done, end, cutoffMs, rows);
+    }
+#endif
+    idleScalar(lastSeenMs.data(), done, end, cutoffMs, rows);
+}
+
+void ClientTable::collectDisconnected(vector<uint32_t> &rows) const {
+    size_t done = 0;
+#ifdef CLIENT_TABLE_AVX2
+    if (useAvx2()) {
+        done = disconnectedAvx2(state.data(), size(), rows);
+    }
+#endif
+    disconnectedScalar(state.data(), done, size(), rows);
+}
+
+FleetStats ClientTable::aggregate() const {
+    FleetStats stats;
+    stats.clients = size();
+    size_t done = 0;
+#ifdef CLIENT_TABLE_AVX2
+    if (useAvx2()) {
+        done = aggregateAvx2(*this, size(), stats);
+    }
+#endif
+    aggregateScalar(*this, done, size(), stats);
+    return stats;
+}
+
+void ClientTable::setMemoryOptions(const ArenaOptions &memory) {
+    ArenaOptions histories = memory;
+    ArenaOptions nodes = memory;
+    bounded = memory.ceilingBytes > 0;
+    if (bounded) {
+        size_t slots = historyArena.slotSize() + nodeArena.slotSize();
+        reserveRows(memory.ceilingBytes / (slots + ROW_BYTES));
+        // The arenas get what the reservation left, which the bucket count
+        // (rounded up to a prime) may have made less than planned.
+        size_t left = memory.ceilingBytes - min<size_t>(memory.ceilingBytes, columnBytes());
+        histories.ceilingBytes = left / slots * historyArena.slotSize();
+        nodes.ceilingBytes = left - histories.ceilingBytes;
+        if (histories.ceilingBytes == 0 || nodes.ceilingBytes == 0) {
+            histories.ceilingBytes = nodes.ceilingBytes = 1; // too small for one client: refuse all
+        }
+    }
+    historyArena.setOptions(histories);
+    nodeArena.setOptions(nodes);
+}
+
+ArenaCounters ClientTable::memory() const {
+    ArenaCounters counters = historyArena.counters();
+    counters.add(nodeArena.counters());
+    counters.refused += refusedRows;
+    counters.columnBytes = columnBytes();
+    return counters;
+}
+
+size_t ClientTable::columnBytes() const {
+    return rowCapacity * (ROW_BYTES - sizeof(void *)) + index.bucket_count() * sizeof(void *);
+}
+
+void ClientTable::setSimd(bool enabled) {
+    simdEnabled = enabled;
+}
+
+bool ClientTable::simdActive() {
+    return useAvx2();
+}
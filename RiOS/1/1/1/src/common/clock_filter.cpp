@@ -0,0 +1,54 @@
+#include "clock_filter.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+ClockFilter::ClockFilter(int stages, double precisionMs, double phiPpm)
+        : stages(static_cast<size_t>(max(1, stages))), precisionMs(precisionMs), phi(phiPpm * 1e-6) {}
+
+void ClockFilter::add(const ClockSample &sample) {
+    if (samples.size() == stages) {
+        samples.erase(samples.begin());
+    }
+    samples.push_back(sample);
+}
+
+double ClockFilter::dispersionMs(const ClockSample &sample, int64_t nowNs) const {
+    double ageMs = max<int64_t>(0, nowNs - sample.timeNs) / 1e6;
+    return precisionMs + phi * ageMs;
+}
+
+bool ClockFilter::select(int64_t nowNs, ClockSample &best) const {
+    if (samples.empty()) {
+        return false;
+    }
+
+    double bestDistance = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        double distance = samples[i].delayMs / 2 + dispersionMs(samples[i], nowNs);
+        if (i == 0 || distance < bestDistance) {
+            bestDistance = distance;
+            best = samples[i];
+        }
+    }
+    return true;
+}
+
+double ClockFilter::jitterMs(int64_t nowNs) const {
+    ClockSample best;
+    if (!select(nowNs, best) || samples.size() < 2) {
+        return 0;
+    }
+
+    double sum = 0;
+    for (const ClockSample &sample: samples) {
+        sum += pow(sample.offsetMs - best.offsetMs, 2);
+    }
+    return sqrt(sum / (samples.size() - 1));
+}
+
+void ClockFilter::clear() {
+    samples.clear();
+}
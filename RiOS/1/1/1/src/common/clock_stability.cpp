@@ -0,0 +1,125 @@
+#include "clock_stability.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+
+// Four independent partial sums keep the loop free of a serial dependency,
+// so the compiler can vectorize it without reassociating floating point.
+template<typename Term>
+double sumSquares(size_t count, Term term) {
+    double acc[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        for (size_t lane = 0; lane < 4; lane++) {
+            double value = term(i + lane);
+            acc[lane] += value * value;
+        }
+    }
+    for (; i < count; i++) {
+        double value = term(i);
+        acc[0] += value * value;
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+}
+
+vector<uint32_t> averagingFactors(size_t n, int perDecade) {
+    vector<uint32_t> factors;
+    size_t largest = n / 3;
+    if (perDecade <= 0) {
+        for (size_t m = 1; m <= largest; m++) {
+            factors.push_back(static_cast<uint32_t>(m));
+        }
+        return factors;
+    }
+    for (int k = 0;; k++) {
+        size_t m = static_cast<size_t>(llround(pow(10.0, static_cast<double>(k) / perDecade)));
+        if (m > largest) break;
+        if (factors.empty() || factors.back() != m) {
+            factors.push_back(static_cast<uint32_t>(m));
+        }
+    }
+    return factors;
+}
+
+PhaseSeries::PhaseSeries(vector<double> phase, double tau0) : x(move(phase)), interval(tau0) {
+    double mean = 0;
+    for (double value: x) {
+        mean += value;
+    }
+    mean = x.empty() ? 0 : mean / x.size();
+
+    prefix.resize(x.size() + 1);
+    prefix[0] = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+        prefix[i + 1] = prefix[i] + (x[i] - mean);
+    }
+}
+
+// sigma^2(tau) = sum (x[i+2m] - 2x[i+m] + x[i])^2 / (2 tau^2 (N - 2m))
+double PhaseSeries::overlappingAdev(uint32_t m) const {
+    if (x.size() < 2 * static_cast<size_t>(m) + 1) return NAN;
+    size_t terms = x.size() - 2 * static_cast<size_t>(m);
+    const double *data = x.data();
+    double sum = sumSquares(terms, [data, m](size_t i) { return data[i + 2 * m] - 2 * data[i + m] + data[i]; });
+    double tau = m * interval;
+    return sqrt(sum / (2 * tau * tau * terms));
+}
+
+// TVAR = tau^2 / 3 * MVAR. The inner sum of MVAR over m second differences
+// is P[j+3m] - 3P[j+2m] + 3P[j+m] - P[j] of the prefix sums, so each
+// averaging time costs O(N).
+double PhaseSeries::timeDeviation(uint32_t m) const {
+    if (x.size() < 3 * static_cast<size_t>(m)) return NAN;
+    size_t terms = x.size() - 3 * static_cast<size_t>(m) + 1;
+    const double *p = prefix.data();
+    double sum = sumSquares(terms, [p, m](size_t j) { return p[j + 3 * m] - 3 * p[j + 2 * m] + 3 * p[j + m] - p[j]; });
+    return sqrt(sum / (6.0 * m * m * terms));
+}
+
+// Largest peak-to-peak phase over any window of w = m + 1 samples. The
+// van Herk / Gil-Werman scheme cuts the series into blocks of w: a window
+// covers the tail of one block and the head of the next, so its maximum is
+// max(suffixMax[i], prefixMax[i + w - 1]), and likewise the minimum. Three
+// branch-free passes, independent of m.
+double PhaseSeries::maxTimeIntervalError(uint32_t m) const {
+    size_t n = x.size();
+    size_t w = static_cast<size_t>(m) + 1;
+    if (n < w) return NAN;
+
+    thread_local vector<double> prefixMax, prefixMin, suffixMax, suffixMin;
+    prefixMax.resize(n);
+    prefixMin.resize(n);
+    suffixMax.resize(n);
+    suffixMin.resize(n);
+    for (size_t start = 0; start < n; start += w) {
+        size_t end = min(n, start + w);
+        prefixMax[start] = prefixMin[start] = x[start];
+        for (size_t i = start + 1; i < end; i++) {
+            prefixMax[i] = max(prefixMax[i - 1], x[i]);
+            prefixMin[i] = min(prefixMin[i - 1], x[i]);
+        }
+        suffixMax[end - 1] = suffixMin[end - 1] = x[end - 1];
+        for (size_t i = end - 1; i > start; i--) {
+            suffixMax[i - 1] = max(suffixMax[i], x[i - 1]);
+            suffixMin[i - 1] = min(suffixMin[i], x[i - 1]);
+        }
+    }
+
+    double worst = 0;
+    for (size_t i = 0; i + w <= n; i++) {
+        double high = max(suffixMax[i], prefixMax[i + w - 1]);
+        double low = min(suffixMin[i], prefixMin[i + w - 1]);
+        worst = max(worst, high - low);
+    }
+    return worst;
+}
+
+StabilityPoint PhaseSeries::at(uint32_t m) const {
+    return StabilityPoint{m, m * interval, overlappingAdev(m), timeDeviation(m), maxTimeIntervalError(m)};
+}
@@ -0,0 +1,361 @@
+#include "concurrent_client_table.h"
+
+#include <stdexcept>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX() do {} while (0)
+#endif
+
+using namespace std;
+
+namespace {
+
+const size_t MIN_BUCKETS = 1024;
+const size_t MOVE_STEP = 16;      // buckets moved per insert or removal while resizing
+const uint32_t COLLECT_EVERY = 64; // retirements between collection attempts
+const int SPINS_BEFORE_YIELD = 64;
+
+// Spins briefly, then yields: a holder that was preempted (more threads
+// than CPUs) gets to run instead of being spun against.
+void backoff(int &spins) {
+    if (++spins < SPINS_BEFORE_YIELD) {
+        CPU_RELAX();
+    } else {
+        spins = 0;
+        this_thread::yield();
+    }
+}
+
+template<typename T>
+void destroyObject(void *object) {
+    delete static_cast<T *>(object);
+}
+
+}
+
+EpochReclaimer::~EpochReclaimer() {
+    size_t used = slotCount.load();
+    for (size_t i = 0; i < used; i++) {
+        for (const Retired &item: slots[i].limbo) {
+            item.destroy(item.object);
+        }
+    }
+}
+
+size_t EpochReclaimer::registerThread() {
+    size_t slot = slotCount.fetch_add(1);
+    if (slot >= MAX_THREADS) {
+        throw runtime_error("too many threads for the epoch reclaimer");
+    }
+    return slot;
+}
+
+// The seq_cst store orders the announcement before any read of the shared
+// structure, which is what tryAdvance() relies on.
+void EpochReclaimer::pin(size_t slot) {
+    slots[slot].pinned.store(globalEpoch.load(memory_order_relaxed), memory_order_seq_cst);
+}
+
+void EpochReclaimer::unpin(size_t slot) {
+    slots[slot].pinned.store(0, memory_order_release);
+}
+
+void EpochReclaimer::retire(size_t slot, void *object, void (*destroy)(void *)) {
+    Slot &s = slots[slot];
+    s.limbo.push_back(Retired{object, destroy, globalEpoch.load(memory_order_acquire)});
+    pending.fetch_add(1, memory_order_relaxed);
+    if (++s.sinceCollect >= COLLECT_EVERY) {
+        collect(slot);
+    }
+}
+
+bool EpochReclaimer::tryAdvance() {
+    uint64_t epoch = globalEpoch.load(memory_order_seq_cst);
+    size_t used = slotCount.load(memory_order_acquire);
+    for (size_t i = 0; i < used; i++) {
+        uint64_t pinned = slots[i].pinned.load(memory_order_seq_cst);
+        if (pinned != 0 && pinned != epoch) {
+            return false;
+        }
+    }
+    return globalEpoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+void EpochReclaimer::collect(size_t slot) {
+    Slot &s = slots[slot];
+    s.sinceCollect = 0;
+    tryAdvance();
+
+    uint64_t safe = globalEpoch.load(memory_order_acquire);
+    size_t released = 0;
+    while (!s.limbo.empty() && s.limbo.front().epoch + 2 <= safe) {
+        s.limbo.front().destroy(s.limbo.front().object);
+        s.limbo.pop_front();
+        released++;
+    }
+    pending.fetch_sub(released, memory_order_relaxed);
+    freed.fetch_add(released, memory_order_relaxed);
+}
+
+// Writers bump the sequence to odd before touching the record and back to
+// even after; the release fence keeps the record writes after the bump for
+// any reader that sees them.
+void ConcurrentClientTable::Entry::lock() {
+    uint32_t seq = sequence.load(memory_order_relaxed);
+    int spins = 0;
+    while (true) {
+        if ((seq & 1) == 0 &&
+            sequence.compare_exchange_weak(seq, seq + 1, memory_order_acquire, memory_order_relaxed)) {
+            break;
+        }
+        backoff(spins);
+        seq = sequence.load(memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_release);
+}
+
+void ConcurrentClientTable::Entry::unlock() {
+    sequence.store(sequence.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+ClientRecord ConcurrentClientTable::Entry::read() const {
+    ClientRecord copy;
+    int spins = 0;
+    while (true) {
+        uint32_t before = sequence.load(memory_order_acquire);
+        if ((before & 1) == 0) {
+            copy = record;
+            atomic_thread_fence(memory_order_acquire);
+            if (sequence.load(memory_order_relaxed) == before) {
+                return copy;
+            }
+        }
+        backoff(spins);
+    }
+}
+
+ConcurrentClientTable::BucketArray::BucketArray(size_t buckets)
+        : mask(buckets - 1), heads(new atomic<uintptr_t>[buckets]) {
+    for (size_t i = 0; i < buckets; i++) {
+        heads[i].store(0, memory_order_relaxed);
+    }
+}
+
+ConcurrentClientTable::ConcurrentClientTable(size_t expectedClients) {
+    size_t buckets = MIN_BUCKETS;
+    while (buckets < expectedClients) buckets <<= 1;
+    current.store(new BucketArray(buckets));
+}
+
+// No other thread may use the table any more: free the live chains; the
+// reclaimer frees what was retired.
+ConcurrentClientTable::~ConcurrentClientTable() {
+    BucketArray *array = current.load();
+    while (array != nullptr) {
+        for (size_t i = 0; i <= array->mask; i++) {
+            uintptr_t head = array->heads[i].load();
+            if (head == MOVED) {
+                continue;
+            }
+            Node *node = chain(head);
+            while (node != nullptr) {
+                Node *next = node->next.load();
+                delete node->entry;
+                delete node;
+                node = next;
+            }
+        }
+        BucketArray *next = array->next.load();
+        delete array;
+        array = next;
+    }
+}
+
+ConcurrentClientTable::Entry *ConcurrentClientTable::find(const ClientKey &key) const {
+    uint64_t hash = ClientKeyHash()(key);
+    const BucketArray *array = current.load(memory_order_acquire);
+    while (true) {
+        uintptr_t head = array->heads[hash & array->mask].load(memory_order_acquire);
+        if (head == MOVED) {
+            array = array->next.load(memory_order_acquire);
+            continue;
+        }
+        for (Node *node = chain(head); node != nullptr; node = node->next.load(memory_order_acquire)) {
+            if (node->hash == hash && node->entry->key == key && !node->entry->removed()) {
+                return node->entry;
+            }
+        }
+        return nullptr;
+    }
+}
+
+uintptr_t ConcurrentClientTable::lockBucket(BucketArray *array, size_t index) {
+    atomic<uintptr_t> &slot = array->heads[index];
+    uintptr_t head = slot.load(memory_order_relaxed);
+    int spins = 0;
+    while (true) {
+        if (head == MOVED) {
+            return MOVED;
+        }
+        if ((head & LOCKED) == 0 &&
+            slot.compare_exchange_weak(head, head | LOCKED, memory_order_acquire, memory_order_relaxed)) {
+            return head;
+        }
+        backoff(spins);
+        head = slot.load(memory_order_relaxed);
+    }
+}
+
+ConcurrentClientTable::BucketArray *ConcurrentClientTable::lockOwner(size_t thread, uint64_t hash,
+                                                                       uintptr_t &head) {
+    BucketArray *array = current.load(memory_order_acquire);
+    while (true) {
+        size_t index = hash & array->mask;
+        head = lockBucket(array, index);
+        if (head == MOVED) {
+            array = array->next.load(memory_order_acquire);
+            continue;
+        }
+        BucketArray *next = array->next.load(memory_order_acquire);
+        if (next == nullptr) {
+            return array;
+        }
+        moveBucket(thread, array, index, head);
+        array = next;
+    }
+}
+
+// With the source bucket locked: copy its nodes into the two buckets of the
+// doubled array it splits into, then mark it MOVED, which also unlocks it.
+// Readers still in the old chain finish on the old nodes, which are retired.
+void ConcurrentClientTable::moveBucket(size_t thread, BucketArray *array, size_t index, uintptr_t head) {
+    BucketArray *next = array->next.load(memory_order_acquire);
+    size_t low = index;
+    size_t high = index + array->mask + 1;
+    uintptr_t lowHead = lockBucket(next, low);
+    uintptr_t highHead = lockBucket(next, high);
+
+    for (Node *node = chain(head); node != nullptr; node = node->next.load(memory_order_relaxed)) {
+        uintptr_t &target = (node->hash & next->mask) == low ? lowHead : highHead;
+        Node *copy = new Node{node->entry, node->hash, {chain(target)}};
+        target = reinterpret_cast<uintptr_t>(copy);
+    }
+
+    next->heads[low].store(lowHead, memory_order_release);
+    next->heads[high].store(highHead, memory_order_release);
+    array->heads[index].store(MOVED, memory_order_release);
+
+    for (Node *node = chain(head); node != nullptr;) {
+        Node *following = node->next.load(memory_order_relaxed);
+        reclaimer.retire(thread, node, destroyObject<Node>);
+        node = following;
+    }
+
+    if (array->moved.fetch_add(1, memory_order_acq_rel) == array->mask) {
+        BucketArray *expected = array;
+        current.compare_exchange_strong(expected, next, memory_order_acq_rel);
+        reclaimer.retire(thread, array, destroyObject<BucketArray>);
+    }
+}
+
+void ConcurrentClientTable::helpResize(size_t thread) {
+    BucketArray *array = current.load(memory_order_acquire);
+    if (array->next.load(memory_order_acquire) == nullptr) {
+        return;
+    }
+    for (size_t i = 0; i < MOVE_STEP; i++) {
+        size_t index = array->cursor.fetch_add(1, memory_order_relaxed);
+        if (index > array->mask) {
+            return;
+        }
+        uintptr_t head = lockBucket(array, index);
+        if (head != MOVED) {
+            moveBucket(thread, array, index, head);
+        }
+    }
+}
+
+// Only the current array grows, so at most two arrays are live.
+void ConcurrentClientTable::startResize(BucketArray *array) {
+    if (current.load(memory_order_acquire) != array || array->next.load(memory_order_acquire) != nullptr) {
+        return;
+    }
+    BucketArray *grown = new BucketArray((array->mask + 1) * 2);
+    BucketArray *expected = nullptr;
+    if (array->next.compare_exchange_strong(expected, grown, memory_order_acq_rel)) {
+        resizeCount.fetch_add(1, memory_order_relaxed);
+    } else {
+        delete grown;
+    }
+}
+
+ConcurrentClientTable::Entry *ConcurrentClientTable::findOrInsert(size_t thread, const ClientKey &key,
+                                                                  bool &inserted) {
+    inserted = false;
+    if (Entry *entry = find(key)) {
+        return entry;
+    }
+
+    helpResize(thread);
+
+    uint64_t hash = ClientKeyHash()(key);
+    uintptr_t head;
+    BucketArray *array = lockOwner(thread, hash, head);
+    size_t index = hash & array->mask;
+
+    for (Node *node = chain(head); node != nullptr; node = node->next.load(memory_order_relaxed)) {
+        if (node->hash == hash && node->entry->key == key) {
+            array->heads[index].store(head, memory_order_release);
+            return node->entry;
+        }
+    }
+
+    Entry *entry = new Entry(key);
+    Node *node = new Node{entry, hash, {chain(head)}};
+    array->heads[index].store(reinterpret_cast<uintptr_t>(node), memory_order_release);
+    inserted = true;
+
+    if (count.fetch_add(1, memory_order_relaxed) + 1 > array->mask + 1) {
+        startResize(array);
+    }
+    return entry;
+}
+
+bool ConcurrentClientTable::remove(size_t thread, const ClientKey &key) {
+    helpResize(thread);
+
+    uint64_t hash = ClientKeyHash()(key);
+    uintptr_t head;
+    BucketArray *array = lockOwner(thread, hash, head);
+    size_t index = hash & array->mask;
+
+    Node *previous = nullptr;
+    Node *node = chain(head);
+    while (node != nullptr && !(node->hash == hash && node->entry->key == key)) {
+        previous = node;
+        node = node->next.load(memory_order_relaxed);
+    }
+    if (node == nullptr) {
+        array->heads[index].store(head, memory_order_release);
+        return false;
+    }
+
+    // The unlinked node keeps its next pointer for readers still on it.
+    Node *following = node->next.load(memory_order_relaxed);
+    node->entry->gone.store(true, memory_order_release);
+    if (previous == nullptr) {
+        array->heads[index].store(reinterpret_cast<uintptr_t>(following), memory_order_release);
+    } else {
+        previous->next.store(following, memory_order_release);
+        array->heads[index].store(head, memory_order_release);
+    }
+
+    count.fetch_sub(1, memory_order_relaxed);
+    reclaimer.retire(thread, node->entry, destroyObject<Entry>);
+    reclaimer.retire(thread, node, destroyObject<Node>);
+    return true;
+}
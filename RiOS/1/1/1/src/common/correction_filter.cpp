@@ -0,0 +1,124 @@
+#include "correction_filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+// The filter proper, on the window after this request was added.
+int filterWindow(int rawCorrection, int requestCount, int lastCorrection, const int *history, size_t count,
+                 const FilterParams &params) {
+    if (count < 3) {
+        return rawCorrection;
+    }
+
+    double sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += history[i];
+    }
+    double mean = sum / count;
+
+    double variance = 0;
+    for (size_t i = 0; i < count; i++) {
+        variance += pow(history[i] - mean, 2);
+    }
+    double stddev = sqrt(variance / count);
+
+    if (stddev > 0 && abs(rawCorrection - mean) > params.outlierThreshold * stddev) {
+        vector<int> sorted(history, history + count);
+        sort(sorted.begin(), sorted.end());
+        return sorted[sorted.size() / 2];
+    }
+
+    double smoothed = lastCorrection;
+
+    if (requestCount == 2) {
+        smoothed = rawCorrection;
+    } else {
+        smoothed = params.alpha * rawCorrection + (1 - params.alpha) * smoothed;
+    }
+
+    return static_cast<int>(smoothed);
+}
+
+}
+
+int advancedCorrection(int rawCorrection, int requestCount, int lastCorrection,
+                       vector<int> &history, const FilterParams &params) {
+    if (requestCount < 2) {
+        return rawCorrection;
+    }
+
+    history.push_back(rawCorrection);
+
+    if (history.size() > static_cast<size_t>(params.historyWindow)) {
+        history.erase(history.begin());
+    }
+
+    return filterWindow(rawCorrection, requestCount, lastCorrection, history.data(), history.size(), params);
+}
+
+int advancedCorrection(int rawCorrection, int requestCount, int lastCorrection,
+                       CorrectionHistory &history, const FilterParams &params) {
+    if (requestCount < 2) {
+        return rawCorrection;
+    }
+
+    int window = min(params.historyWindow, CorrectionHistory::CAPACITY);
+    if (history.count >= window) {
+        int dropped = history.count - window + 1;
+        history.count -= dropped;
+        memmove(history.values, history.values + dropped, history.count * sizeof(int32_t));
+    }
+    history.values[history.count++] = rawCorrection;
+
+    return filterWindow(rawCorrection, requestCount, lastCorrection, history.values, history.count, params);
+}
+
+int64_t correctionMedian(const vector<int64_t> &corrections) {
+    vector<int64_t> sorted = corrections;
+    nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    return sorted[sorted.size() / 2];
+}
+
+namespace {
+
+class RawFilter : public CorrectionFilter {
+public:
+    int apply(int rawCorrection) override {
+        return rawCorrection;
+    }
+};
+
+class AdvancedFilter : public CorrectionFilter {
+public:
+    explicit AdvancedFilter(const FilterParams &params) : params(params) {}
+
+    int apply(int rawCorrection) override {
+        int correction = advancedCorrection(rawCorrection, requestCount, lastCorrection, history, params);
+        requestCount++;
+        lastCorrection = correction;
+        return correction;
+    }
+
+private:
+    FilterParams params;
+    int requestCount = 0;
+    int lastCorrection = 0;
+    vector<int> history;
+};
+
+}
+
+unique_ptr<CorrectionFilter> makeCorrectionFilter(const string &name, const FilterParams &params) {
+    if (name == "raw") {
+        return unique_ptr<CorrectionFilter>(new RawFilter());
+    }
+    if (name == "advanced") {
+        return unique_ptr<CorrectionFilter>(new AdvancedFilter(params));
+    }
+    return nullptr;
+}
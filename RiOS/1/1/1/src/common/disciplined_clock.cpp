@@ -0,0 +1,97 @@
+#include "disciplined_clock.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+DisciplinedClock::DisciplinedClock(const DisciplineParams &params) : params(params) {}
+
+double DisciplinedClock::slewed(int64_t elapsedNs) const {
+    double amount = fabs(slewRate) * elapsedNs;
+    return phaseNs < 0 ? -min(amount, -phaseNs) : min(amount, phaseNs);
+}
+
+int64_t DisciplinedClock::value(int64_t localNs) const {
+    if (updates == 0) {
+        return localNs;
+    }
+    int64_t elapsedNs = localNs - baseLocalNs;
+    return baseValueNs + elapsedNs + llround(frequency * elapsedNs + slewed(elapsedNs));
+}
+
+int64_t DisciplinedClock::pendingNs(int64_t localNs) const {
+    return llround(phaseNs - slewed(localNs - baseLocalNs));
+}
+
+void DisciplinedClock::update(int64_t offsetNs, int64_t localNs) {
+    int64_t now = value(localNs);
+    int64_t previousLocalNs = baseLocalNs;
+
+    if (updates == 0) {
+        baseLocalNs = localNs;
+        baseValueNs = now + offsetNs;
+        phaseNs = 0;
+        slewRate = 0;
+        updates++;
+        return;
+    }
+
+    baseLocalNs = localNs;
+    baseValueNs = now;
+
+    // A step says nothing about the frequency; it only resets the phase.
+    if (fabs(static_cast<double>(offsetNs)) > params.stepThresholdMs * 1e6) {
+        baseValueNs += offsetNs;
+        phaseNs = 0;
+        slewRate = 0;
+        stepCount++;
+        updates++;
+        return;
+    }
+
+    // The phase not yet slewed since the last update is part of this offset;
+    // what the offset grew beyond it is frequency error (FLL). The PLL turns
+    // the offset itself into a frequency adjustment.
+    double offset = static_cast<double>(offsetNs);
+    double remaining = phaseNs - slewed(localNs - previousLocalNs);
+    double intervalS = max(1e-3, (localNs - previousLocalNs) / 1e9);
+    double tau = max(params.timeConstantS, intervalS);
+    double fllWeight = min(1.0, intervalS / params.fllIntervalS);
+    double fllAdjust = (offset - remaining) / (intervalS * 1e9) * 0.25;
+    double pllAdjust = offset / 1e9 * intervalS / (16 * tau * tau);
+
+    frequency += fllWeight * fllAdjust + (1 - fllWeight) * pllAdjust;
+    double maxFrequency = params.maxFreqPpm * 1e-6;
+    frequency = max(-maxFrequency, min(maxFrequency, frequency));
+
+    phaseNs = offset;
+    slewRate = min(params.maxSlewPpm * 1e-6, fabs(offset) / (tau * 1e9));
+    updates++;
+}
+
+int64_t DisciplinedClock::read(int64_t localNs) {
+    lastReadNs = max(lastReadNs, value(localNs));
+    return lastReadNs;
+}
+
+DisciplinedSegment DisciplinedClock::segment() const {
+    DisciplinedSegment segment;
+    segment.baseLocalNs = baseLocalNs;
+    segment.baseValueNs = baseValueNs;
+    segment.slewEndNs = baseLocalNs;
+    if (slewRate > 0) {
+        segment.slewEndNs += static_cast<int64_t>(fabs(phaseNs) / slewRate);
+    }
+    segment.slewingRate = frequency + (phaseNs < 0 ? -slewRate : slewRate);
+    segment.rate = frequency;
+    segment.floorNs = lastReadNs;
+    return segment;
+}
+
+int64_t DisciplinedSegment::value(int64_t localNs) const {
+    int64_t elapsedNs = localNs - baseLocalNs;
+    int64_t slewingNs = min(elapsedNs, slewEndNs - baseLocalNs);
+    int64_t v = baseValueNs + elapsedNs + llround(slewingRate * slewingNs + rate * (elapsedNs - slewingNs));
+    return max(v, floorNs);
+}
@@ -0,0 +1,186 @@
+#include "handoff.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+
+using namespace std;
+
+namespace {
+
+struct HandoffHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t kind;
+    uint32_t fdCount;
+    uint64_t stateBytes;
+};
+
+const char HANDOFF_ACK = 'A';
+
+bool unixAddress(const string &path, sockaddr_un &addr) {
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    addr = sockaddr_un{};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+bool sendAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool receiveAll(int fd, char *data, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(fd, data, size, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        size -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+}
+
+int listenForHandoff(const string &path) {
+    sockaddr_un addr;
+    if (!unixAddress(path, addr)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int acceptHandoff(int listener) {
+    return accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+}
+
+bool sendHandoff(int conn, uint32_t kind, const vector<int> &fds, const string &state, int timeoutMs) {
+    if (fds.empty() || fds.size() > HANDOFF_MAX_FDS) {
+        return false;
+    }
+
+    HandoffHeader header{HANDOFF_MAGIC, HANDOFF_VERSION, kind, static_cast<uint32_t>(fds.size()), state.size()};
+    iovec iov{&header, sizeof(header)};
+
+    vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(header)) ||
+        !sendAll(conn, state.data(), state.size())) {
+        return false;
+    }
+
+    pollfd pfd{conn, POLLIN, 0};
+    char ack = 0;
+    return poll(&pfd, 1, timeoutMs) == 1 && recv(conn, &ack, 1, 0) == 1 && ack == HANDOFF_ACK;
+}
+
+bool receiveHandoff(const string &path, uint32_t kind, vector<int> &fds, string &state, int &conn) {
+    sockaddr_un addr;
+    if (!unixAddress(path, addr)) {
+        return false;
+    }
+
+    conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn < 0) {
+        return false;
+    }
+
+    // The predecessor answers from its packet loop, so a few hundred ms is
+    // plenty; a wedged one must not hang the deployment.
+    timeval timeout{5, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    HandoffHeader header{};
+    iovec iov{&header, sizeof(header)};
+    vector<char> control(CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    if (connect(conn, (sockaddr *) &addr, sizeof(addr)) != 0 ||
+        recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != static_cast<ssize_t>(sizeof(header))) {
+        close(conn);
+        conn = -1;
+        return false;
+    }
+
+    fds.clear();
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            fds.resize(count);
+            memcpy(fds.data(), CMSG_DATA(cmsg), count * sizeof(int));
+        }
+    }
+
+    bool valid = header.magic == HANDOFF_MAGIC && header.version == HANDOFF_VERSION && header.kind == kind &&
+                 header.fdCount == fds.size() && !fds.empty() && (msg.msg_flags & MSG_CTRUNC) == 0;
+    if (valid) {
+        state.resize(header.stateBytes);
+        valid = receiveAll(conn, &state[0], state.size());
+    }
+
+    if (!valid) {
+        for (int fd: fds) {
+            close(fd);
+        }
+        fds.clear();
+        close(conn);
+        conn = -1;
+        return false;
+    }
+    return true;
+}
+
+bool acknowledgeHandoff(int conn) {
+    return send(conn, &HANDOFF_ACK, 1, MSG_NOSIGNAL) == 1;
+}
+
+void awaitPredecessorExit(int conn, int timeoutMs) {
+    pollfd pfd{conn, POLLIN, 0};
+    char byte;
+    while (poll(&pfd, 1, timeoutMs) == 1 && recv(conn, &byte, 1, 0) > 0) {
+    }
+    close(conn);
+}
@@ -0,0 +1,191 @@
+#include "low_latency.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+
+using namespace std;
+
+namespace {
+
+// Touch the stack the packet path will use so it is resident before mlockall
+// pins it and no request pays for the first-touch fault.
+void prefaultStack() {
+    const size_t size = 256 * 1024;
+    char stack[size];
+    for (size_t i = 0; i < size; i += 4096) {
+        stack[i] = 0;
+    }
+    // Keeps the stores, which nothing reads back.
+    asm volatile("" : : "r"(stack) : "memory");
+}
+
+// Keep freed heap memory mapped so later allocations do not fault pages back
+// in, then grow and release the heap once to pre-fault it.
+void prefaultHeap() {
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    const size_t size = 16 * 1024 * 1024;
+    char *heap = static_cast<char *>(malloc(size));
+    if (heap != nullptr) {
+        for (size_t i = 0; i < size; i += 4096) {
+            heap[i] = 0;
+        }
+        free(heap);
+    }
+}
+
+}
+
+bool parseLowLatencyOption(int &i, int argc, char *argv[], LowLatencyOptions &options) {
+    string arg = argv[i];
+    if (arg == "--low-latency") {
+        options.enabled = true;
+        return true;
+    }
+
+    if (i + 1 >= argc) {
+        return false;
+    }
+
+    int value = atoi(argv[i + 1]);
+    if (arg == "--cpu") {
+        options.cpu = value;
+    } else if (arg == "--fifo") {
+        options.fifoPriority = value;
+    } else if (arg == "--busy-poll") {
+        options.busyPollUs = value;
+    } else if (arg == "--spin") {
+        options.spinUs = value;
+    } else {
+        return false;
+    }
+
+    options.enabled = true;
+    i++;
+    return true;
+}
+
+const char *lowLatencyUsage() {
+    return "[--low-latency] [--cpu N] [--fifo PRIO] [--busy-poll US] [--spin US]";
+}
+
+void applyLowLatency(int fd, const LowLatencyOptions &options) {
+    if (!options.enabled) {
+        return;
+    }
+
+    if (options.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(options.cpu, &set);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rc != 0) {
+            cerr << "[LOW LATENCY] Cannot pin to CPU " << options.cpu << ": " << strerror(rc) << endl;
+        }
+    }
+
+    if (options.fifoPriority > 0) {
+        sched_param param{};
+        param.sched_priority = options.fifoPriority;
+        int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (rc != 0) {
+            cerr << "[LOW LATENCY] Cannot switch to SCHED_FIFO: " << strerror(rc) << endl;
+        }
+    }
+
+    if (options.lockMemory) {
+        prefaultHeap();
+        prefaultStack();
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+            cerr << "[LOW LATENCY] mlockall failed: " << strerror(errno) << endl;
+        }
+    }
+
+    if (options.busyPollUs > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &options.busyPollUs, sizeof(options.busyPollUs)) != 0) {
+        cerr << "[LOW LATENCY] SO_BUSY_POLL not available: " << strerror(errno) << endl;
+    }
+
+    cout << "[LOW LATENCY] cpu " << options.cpu << ", fifo " << options.fifoPriority
+         << ", mlock " << (options.lockMemory ? "on" : "off") << ", busy poll "
+         << options.busyPollUs << " us, spin " << options.spinUs << " us" << endl;
+}
+
+void LatencyHistogram::record(int64_t ns) {
+    if (ns < 0) ns = 0;
+    buckets[bucketOf(static_cast<uint64_t>(ns))]++;
+    total++;
+    sumNs += ns;
+    if (ns < minNs) minNs = ns;
+    if (ns > maxNs) maxNs = ns;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+    for (int i = 0; i < BUCKETS; i++) {
+        buckets[i] += other.buckets[i];
+    }
+    total += other.total;
+    sumNs += other.sumNs;
+    if (other.minNs < minNs) minNs = other.minNs;
+    if (other.maxNs > maxNs) maxNs = other.maxNs;
+}
+
+int LatencyHistogram::bucketOf(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+        return static_cast<int>(ns);
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = static_cast<int>((ns >> (exponent - 3)) & (SUB_BUCKETS - 1));
+    return (exponent - 2) * SUB_BUCKETS + sub;
+}
+
+int64_t LatencyHistogram::upperBound(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = bucket / SUB_BUCKETS + 2;
+    int sub = bucket % SUB_BUCKETS;
+    int64_t lower = static_cast<int64_t>(SUB_BUCKETS + sub) << (exponent - 3);
+    return lower + (1LL << (exponent - 3)) - 1;
+}
+
+int64_t LatencyHistogram::percentile(double fraction) const {
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t target = static_cast<uint64_t>(fraction * (total - 1));
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > target) {
+            return min(upperBound(i), maxNs);
+        }
+    }
+    return maxNs;
+}
+
+void LatencyHistogram::print(ostream &out, const string &title) const {
+    out << "========================================" << endl;
+    out << title << " (" << total << " samples)" << endl;
+    if (total == 0) {
+        out << "========================================" << endl;
+        return;
+    }
+    out << fixed << setprecision(2);
+    out << "  min " << minNs / 1000.0 << " us | mean " << sumNs / total / 1000.0 << " us | max "
+        << maxNs / 1000.0 << " us" << endl;
+    out << "  p50 " << percentile(0.5) / 1000.0 << " us | p90 " << percentile(0.9) / 1000.0
+        << " us | p99 " << percentile(0.99) / 1000.0 << " us | p99.9 " << percentile(0.999) / 1000.0
+        << " us" << endl;
+    out << defaultfloat << setprecision(6);
+    out << "========================================" << endl;
+}
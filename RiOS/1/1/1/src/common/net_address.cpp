@@ -0,0 +1,163 @@
+#include "net_address.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+
+using namespace std;
+
+ClientKey makeClientKey(const sockaddr_storage &addr) {
+    ClientKey key{};
+    if (addr.ss_family == AF_INET6) {
+        const sockaddr_in6 &in6 = reinterpret_cast<const sockaddr_in6 &>(addr);
+        memcpy(key.addr, &in6.sin6_addr, 16);
+        key.port = in6.sin6_port;
+    } else if (addr.ss_family == AF_INET) {
+        const sockaddr_in &in4 = reinterpret_cast<const sockaddr_in &>(addr);
+        key.addr[10] = 0xff;
+        key.addr[11] = 0xff;
+        memcpy(key.addr + 12, &in4.sin_addr, 4);
+        key.port = in4.sin_port;
+    }
+    return key;
+}
+
+string formatClientKey(const ClientKey &key) {
+    static const uint8_t v4Prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    char text[INET6_ADDRSTRLEN];
+    string result;
+
+    if (memcmp(key.addr, v4Prefix, sizeof(v4Prefix)) == 0) {
+        inet_ntop(AF_INET, key.addr + 12, text, sizeof(text));
+        result = text;
+    } else {
+        inet_ntop(AF_INET6, key.addr, text, sizeof(text));
+        result = string("[") + text + "]";
+    }
+    result += ":" + to_string(ntohs(key.port));
+    if (key.logicalId != 0) {
+        result += "#" + to_string(key.logicalId);
+    }
+    return result;
+}
+
+string formatAddress(const sockaddr_storage &addr) {
+    return formatClientKey(makeClientKey(addr));
+}
+
+int openServerSocket(uint16_t port, bool reusePort) {
+    int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (fd >= 0) {
+        int off = 0;
+        int on = 1;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (reusePort) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        }
+
+        sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        if (bind(fd, (sockaddr *) &addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        return -1;
+    }
+
+    if (errno != EAFNOSUPPORT) {
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reusePort) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool resolveAddress(const string &host, uint16_t port, sockaddr_storage &addr, socklen_t &addrLen) {
+    string name = host;
+    if (name.size() > 2 && name.front() == '[' && name.back() == ']') {
+        name = name.substr(1, name.size() - 2);
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    addrinfo *result = nullptr;
+    if (getaddrinfo(name.c_str(), nullptr, &hints, &result) != 0 || result == nullptr) {
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, result->ai_addr, result->ai_addrlen);
+    addrLen = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    if (addr.ss_family == AF_INET6) {
+        reinterpret_cast<sockaddr_in6 &>(addr).sin6_port = htons(port);
+    } else {
+        reinterpret_cast<sockaddr_in &>(addr).sin_port = htons(port);
+    }
+    return true;
+}
+
+bool splitHostPort(const string &spec, string &host, uint16_t &port, uint16_t defaultPort) {
+    port = defaultPort;
+    string portText;
+
+    if (!spec.empty() && spec.front() == '[') {
+        size_t bracket = spec.find(']');
+        if (bracket == string::npos) {
+            return false;
+        }
+        host = spec.substr(1, bracket - 1);
+        if (bracket + 1 < spec.size()) {
+            if (spec[bracket + 1] != ':') {
+                return false;
+            }
+            portText = spec.substr(bracket + 2);
+        }
+    } else if (count(spec.begin(), spec.end(), ':') == 1) {
+        size_t colon = spec.find(':');
+        host = spec.substr(0, colon);
+        portText = spec.substr(colon + 1);
+    } else {
+        host = spec;
+    }
+
+    if (!portText.empty()) {
+        int value = atoi(portText.c_str());
+        if (value <= 0 || value > 65535) {
+            return false;
+        }
+        port = static_cast<uint16_t>(value);
+    }
+    return !host.empty();
+}
+
+bool sameAddress(const sockaddr_storage &a, const sockaddr_storage &b) {
+    return makeClientKey(a) == makeClientKey(b);
+}
@@ -0,0 +1,385 @@
+#include "offset_store.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+
+using namespace std;
+
+namespace {
+
+uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>((value >> 1) ^ (0 - (value & 1)));
+}
+
+// Prefix code: 0 | 10 + 8 bits | 110 + 12 bits | 1110 + 20 bits | 1111 + 64 bits.
+const int CODE_CLASSES = 4;
+const int CODE_PREFIX[CODE_CLASSES] = {2, 3, 4, 4};
+const int CODE_WIDTH[CODE_CLASSES] = {8, 12, 20, 64};
+const uint64_t CODE_MARK[CODE_CLASSES] = {0x2, 0x6, 0xE, 0xF};
+
+int codeClass(uint64_t zz) {
+    if (zz < (1ULL << 8)) return 0;
+    if (zz < (1ULL << 12)) return 1;
+    if (zz < (1ULL << 20)) return 2;
+    return 3;
+}
+
+class BitReader {
+public:
+    BitReader(const uint8_t *data, uint32_t bits) : data(data), bits(bits) {}
+
+    bool read(int count, uint64_t &value) {
+        if (pos + count > bits) {
+            return false;
+        }
+        value = 0;
+        while (count > 0) {
+            int free = 8 - static_cast<int>(pos & 7);
+            int n = min(free, count);
+            uint64_t chunk = (data[pos >> 3] >> (free - n)) & ((1u << n) - 1);
+            value = (value << n) | chunk;
+            pos += n;
+            count -= n;
+        }
+        return true;
+    }
+
+    bool readCode(int64_t &value) {
+        uint64_t bit;
+        if (!read(1, bit)) return false;
+        if (bit == 0) {
+            value = 0;
+            return true;
+        }
+        int cls = 0;
+        while (cls < CODE_CLASSES - 1) {
+            if (!read(1, bit)) return false;
+            if (bit == 0) break;
+            cls++;
+        }
+        uint64_t zz;
+        if (!read(CODE_WIDTH[cls], zz)) return false;
+        value = unzigzag(zz);
+        return true;
+    }
+
+private:
+    const uint8_t *data;
+    uint32_t bits;
+    uint32_t pos = 0;
+};
+
+int64_t realtimeUs() {
+    timespec ts{};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000LL + ts.tv_nsec / 1000;
+}
+
+}
+
+OffsetBlockEncoder::OffsetBlockEncoder(const ClientKey &key) {
+    header.key = key;
+}
+
+int OffsetBlockEncoder::codeBits(int64_t value) const {
+    uint64_t zz = zigzag(value);
+    if (zz == 0) {
+        return 1;
+    }
+    int cls = codeClass(zz);
+    return CODE_PREFIX[cls] + CODE_WIDTH[cls];
+}
+
+void OffsetBlockEncoder::writeBits(uint64_t value, int bits) {
+    while (bits > 0) {
+        int free = 8 - static_cast<int>(bitPos & 7);
+        int n = min(free, bits);
+        uint64_t chunk = (value >> (bits - n)) & ((1u << n) - 1);
+        payload[bitPos >> 3] |= static_cast<uint8_t>(chunk << (free - n));
+        bitPos += n;
+        bits -= n;
+    }
+}
+
+void OffsetBlockEncoder::writeCode(int64_t value) {
+    uint64_t zz = zigzag(value);
+    if (zz == 0) {
+        writeBits(0, 1);
+        return;
+    }
+    int cls = codeClass(zz);
+    writeBits(CODE_MARK[cls], CODE_PREFIX[cls]);
+    writeBits(zz, CODE_WIDTH[cls]);
+}
+
+bool OffsetBlockEncoder::append(int64_t timeUs, int64_t offset, int64_t delay) {
+    int64_t deltaUs = header.count == 0 ? 0 : timeUs - header.lastUs;
+    int64_t dod = deltaUs - lastDeltaUs;
+
+    int bits = codeBits(offset - lastOffset) + codeBits(delay - lastDelay);
+    if (header.count > 0) {
+        bits += codeBits(dod);
+    }
+    if (bitPos + bits > OFFSET_BLOCK_PAYLOAD * 8) {
+        return false;
+    }
+
+    if (header.count == 0) {
+        header.firstUs = timeUs;
+    } else {
+        writeCode(dod);
+    }
+    writeCode(offset - lastOffset);
+    writeCode(delay - lastDelay);
+
+    header.lastUs = timeUs;
+    header.count++;
+    header.payloadBits = bitPos;
+    lastDeltaUs = deltaUs;
+    lastOffset = offset;
+    lastDelay = delay;
+    return true;
+}
+
+void OffsetBlockEncoder::finish(uint8_t out[OFFSET_BLOCK_SIZE]) const {
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), payload, sizeof(payload));
+}
+
+bool decodeOffsetBlock(const uint8_t *block, vector<OffsetSample> &samples) {
+    OffsetBlockHeader header;
+    memcpy(&header, block, sizeof(header));
+    if (header.payloadBits > OFFSET_BLOCK_PAYLOAD * 8) {
+        return false;
+    }
+
+    BitReader reader(block + sizeof(header), header.payloadBits);
+    int64_t timeUs = header.firstUs;
+    int64_t deltaUs = 0;
+    int64_t offset = 0;
+    int64_t delay = 0;
+
+    for (uint32_t i = 0; i < header.count; i++) {
+        int64_t dod = 0;
+        int64_t offsetChange;
+        int64_t delayChange;
+        if (i > 0 && !reader.readCode(dod)) return false;
+        if (!reader.readCode(offsetChange) || !reader.readCode(delayChange)) return false;
+
+        deltaUs += dod;
+        timeUs += deltaUs;
+        offset += offsetChange;
+        delay += delayChange;
+        samples.push_back(OffsetSample{header.key, timeUs * 1000, offset, delay});
+    }
+    return true;
+}
+
+OffsetStore::~OffsetStore() {
+    close();
+}
+
+bool OffsetStore::open(const string &path, uint32_t offsetUnitNs, uint32_t delayUnitNs, int maxBlockAgeS) {
+    if (file != nullptr) {
+        return false;
+    }
+
+    OffsetStoreHeader header{OFFSET_STORE_MAGIC, OFFSET_STORE_VERSION, OFFSET_BLOCK_SIZE,
+                             offsetUnitNs, delayUnitNs, {}};
+
+    FILE *existing = fopen(path.c_str(), "rb");
+    if (existing != nullptr) {
+        OffsetStoreHeader found{};
+        bool valid = fread(&found, sizeof(found), 1, existing) == 1;
+        fseek(existing, 0, SEEK_END);
+        long length = ftell(existing);
+        fclose(existing);
+
+        if (valid && memcmp(&found, &header, sizeof(header)) != 0) {
+            return false;
+        }
+        if (valid) {
+            // Cut a block torn by a crash so the new blocks stay aligned.
+            long whole = static_cast<long>(sizeof(header)) +
+                         (length - static_cast<long>(sizeof(header))) / OFFSET_BLOCK_SIZE * OFFSET_BLOCK_SIZE;
+            if (whole != length && truncate(path.c_str(), whole) != 0) {
+                return false;
+            }
+            file = fopen(path.c_str(), "ab");
+        } else if (length > 0) {
+            return false;
+        }
+    }
+
+    if (file == nullptr) {
+        file = fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        fwrite(&header, sizeof(header), 1, file);
+    }
+
+    maxBlockAgeUs = static_cast<int64_t>(maxBlockAgeS) * 1000000LL;
+    ring.reset(new SpscRing<OffsetSample>());
+    stopping = false;
+    writer = thread(&OffsetStore::writerLoop, this);
+    return true;
+}
+
+void OffsetStore::close() {
+    if (file == nullptr) {
+        return;
+    }
+
+    stopping = true;
+    if (writer.joinable()) {
+        writer.join();
+    }
+
+    fclose(file);
+    file = nullptr;
+}
+
+void OffsetStore::writeBlock(const OffsetBlockEncoder &encoder) {
+    uint8_t block[OFFSET_BLOCK_SIZE];
+    encoder.finish(block);
+    fwrite(block, sizeof(block), 1, file);
+    samples += encoder.count();
+    blocks++;
+}
+
+void OffsetStore::add(const OffsetSample &sample) {
+    int64_t timeUs = sample.timeNs / 1000;
+    auto it = openBlocks.find(sample.key);
+    if (it == openBlocks.end()) {
+        it = openBlocks.emplace(sample.key, OffsetBlockEncoder(sample.key)).first;
+    }
+
+    if (!it->second.append(timeUs, sample.offset, sample.delay)) {
+        writeBlock(it->second);
+        it->second = OffsetBlockEncoder(sample.key);
+        it->second.append(timeUs, sample.offset, sample.delay);
+    }
+}
+
+// Bounds what a crash can lose for clients that report rarely.
+void OffsetStore::writeAged(int64_t nowUs) {
+    for (auto it = openBlocks.begin(); it != openBlocks.end();) {
+        if (nowUs - it->second.firstUs() >= maxBlockAgeUs) {
+            writeBlock(it->second);
+            it = openBlocks.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void OffsetStore::writerLoop() {
+    OffsetSample sample{};
+    int64_t lastAgeCheckUs = realtimeUs();
+
+    while (true) {
+        bool finishing = stopping.load();
+
+        size_t taken = 0;
+        while (taken < 4096 && ring->pop(sample)) {
+            add(sample);
+            taken++;
+        }
+        if (taken > 0) {
+            continue;
+        }
+
+        if (finishing) {
+            break;
+        }
+
+        int64_t nowUs = realtimeUs();
+        if (nowUs - lastAgeCheckUs >= 1000000) {
+            writeAged(nowUs);
+            lastAgeCheckUs = nowUs;
+        }
+        fflush(file);
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    for (auto &entry: openBlocks) {
+        writeBlock(entry.second);
+    }
+    openBlocks.clear();
+    fflush(file);
+}
+
+OffsetStoreReader::~OffsetStoreReader() {
+    if (base != nullptr) {
+        munmap(const_cast<uint8_t *>(base), size);
+    }
+}
+
+bool OffsetStoreReader::open(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info{};
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(OffsetStoreHeader)) {
+        ::close(fd);
+        return false;
+    }
+
+    void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    base = static_cast<const uint8_t *>(mapped);
+    size = static_cast<size_t>(info.st_size);
+    const OffsetStoreHeader &h = header();
+    if (h.magic != OFFSET_STORE_MAGIC || h.version != OFFSET_STORE_VERSION || h.blockSize != OFFSET_BLOCK_SIZE) {
+        munmap(mapped, size);
+        base = nullptr;
+        size = 0;
+        return false;
+    }
+
+    count = (size - sizeof(OffsetStoreHeader)) / OFFSET_BLOCK_SIZE;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    return true;
+}
+
+size_t OffsetStoreReader::query(const ClientKey *key, int64_t fromNs, int64_t toNs,
+                                vector<OffsetSample> &out) const {
+    size_t before = out.size();
+    vector<OffsetSample> decoded;
+
+    for (size_t i = 0; i < count; i++) {
+        const OffsetBlockHeader &h = block(i);
+        if (key != nullptr && h.key != *key) {
+            continue;
+        }
+        if (h.lastUs * 1000 < fromNs || h.firstUs * 1000 >= toNs) {
+            continue;
+        }
+
+        decoded.clear();
+        decodeOffsetBlock(blockData(i), decoded);
+        for (const OffsetSample &sample: decoded) {
+            if (sample.timeNs >= fromNs && sample.timeNs < toNs) {
+                out.push_back(sample);
+            }
+        }
+    }
+    return out.size() - before;
+}
@@ -0,0 +1,188 @@
+#include "poll_loop.h"
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+int64_t monotonicNow() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+}
+
+bool PollLoop::open(int fd, const Params &loopParams, SendHandler send, ReceiveHandler receive,
+                    FinishHandler finish) {
+    sockfd = fd;
+    params = loopParams;
+    onSend = move(send);
+    onReceive = move(receive);
+    onFinish = move(finish);
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    bool ready = epollFd >= 0 && timerFd >= 0;
+    for (int watched: {sockfd, timerFd}) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = watched;
+        ready = ready && epoll_ctl(epollFd, EPOLL_CTL_ADD, watched, &event) == 0;
+    }
+    if (!ready) {
+        int error = errno;
+        close();
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+void PollLoop::close() {
+    for (int *fd: {&timerFd, &epollFd}) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    pending.clear();
+    pollActive = false;
+}
+
+bool PollLoop::run(const volatile sig_atomic_t &running) {
+    nextPollNs = monotonicNow();
+
+    epoll_event events[4];
+    while (running) {
+        int64_t nowNs = monotonicNow();
+
+        expireRequests(nowNs);
+
+        if (nowNs >= nextPollNs) {
+            nextPollNs += ((nowNs - nextPollNs) / params.periodNs + 1) * params.periodNs;
+            startPoll();
+        }
+
+        armTimer();
+
+        int n = epoll_wait(epollFd, events, 4, -1);
+        if (n < 0 && errno != EINTR) {
+            return false;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == sockfd) {
+                onReceive();
+                if (pending.empty() && pollActive) {
+                    finishPoll();
+                }
+            } else {
+                uint64_t expirations;
+                if (read(timerFd, &expirations, sizeof(expirations)) < 0) {
+                    // Nothing to consume; the deadlines are re-checked anyway.
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool PollLoop::take(uint32_t sequence, PollRequest &request) {
+    auto it = find_if(pending.begin(), pending.end(), [&](const PollRequest &entry) {
+        return entry.sequence == sequence;
+    });
+    if (it == pending.end()) {
+        staleCount++;
+        return false;
+    }
+
+    request = *it;
+    pending.erase(it);
+    pollReplies++;
+    replyCount++;
+    return true;
+}
+
+// Each request of a burst is timed from its own send, not from the start of
+// the poll.
+bool PollLoop::send() {
+    PollRequest request;
+    request.sequence = nextSequence++;
+    request.sentNs = monotonicNow();
+    request.deadlineNs = request.sentNs + params.timeoutNs;
+    if (!onSend(request)) {
+        return false;
+    }
+    pending.push_back(request);
+    return true;
+}
+
+void PollLoop::startPoll() {
+    if (pollActive) {
+        finishPoll();
+    }
+    pending.clear();
+
+    pollCount++;
+    pollActive = true;
+    pollReplies = 0;
+    retriesLeft = params.retries;
+
+    for (int i = 0; i < params.burst; i++) {
+        send();
+    }
+    if (pending.empty()) {
+        finishPoll();
+    }
+}
+
+void PollLoop::finishPoll() {
+    pollActive = false;
+    onFinish(pollReplies);
+}
+
+void PollLoop::expireRequests(int64_t nowNs) {
+    size_t expired = 0;
+    for (auto it = pending.begin(); it != pending.end();) {
+        if (it->deadlineNs <= nowNs) {
+            it = pending.erase(it);
+            expired++;
+            timeoutCount++;
+        } else {
+            ++it;
+        }
+    }
+
+    for (size_t i = 0; i < expired; i++) {
+        if (retriesLeft == 0 || nowNs + params.timeoutNs > nextPollNs) {
+            break;
+        }
+        retriesLeft--;
+        if (send()) {
+            retryCount++;
+        }
+    }
+
+    if (expired > 0 && pending.empty() && pollActive) {
+        finishPoll();
+    }
+}
+
+void PollLoop::armTimer() {
+    int64_t wakeNs = nextPollNs;
+    for (const PollRequest &request: pending) {
+        wakeNs = min(wakeNs, request.deadlineNs);
+    }
+
+    itimerspec spec{};
+    spec.it_value.tv_sec = wakeNs / 1000000000LL;
+    spec.it_value.tv_nsec = wakeNs % 1000000000LL;
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
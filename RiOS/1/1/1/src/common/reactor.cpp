@@ -0,0 +1,205 @@
+#include "reactor.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <functional>
+#include <pthread.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+// The timerfd runs on the kernel's CLOCK_MONOTONIC, so due times are taken
+// from the same clock rather than from the TSC timebase.
+int64_t monotonicNow() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+}
+
+bool Reactor::open() {
+    if (isOpen()) {
+        return true;
+    }
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd < 0 || timerFd < 0 || wakeFd < 0 ||
+        !watch(timerFd, EPOLLIN, [this](uint32_t) { runTimers(); }) ||
+        !watch(wakeFd, EPOLLIN, [this](uint32_t) { drainWake(); })) {
+        int error = errno;
+        close();
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+void Reactor::close() {
+    for (int *fd: {&signalFd, &wakeFd, &timerFd, &epollFd}) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    watches.clear();
+    retired.clear();
+    timers.clear();
+    due.clear();
+    armedNs = 0;
+}
+
+bool Reactor::watch(int fd, uint32_t events, FdHandler handler) {
+    unique_ptr<Watch> entry(new Watch{fd, move(handler), true});
+    epoll_event event{};
+    event.events = events;
+    event.data.ptr = entry.get();
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        return false;
+    }
+    watches[fd] = move(entry);
+    return true;
+}
+
+// The handler may be the one running, so it is kept until the round ends.
+void Reactor::unwatch(int fd) {
+    auto it = watches.find(fd);
+    if (it == watches.end()) {
+        return;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    it->second->active = false;
+    retired.push_back(move(it->second));
+    watches.erase(it);
+}
+
+bool Reactor::handleSignals(initializer_list<int> signals, SignalHandler handler) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int signal: signals) {
+        sigaddset(&mask, signal);
+    }
+    if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+        return false;
+    }
+    signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signalFd < 0) {
+        return false;
+    }
+    onSignal = move(handler);
+    return watch(signalFd, EPOLLIN, [this](uint32_t) { drainSignals(); });
+}
+
+uint64_t Reactor::schedule(int64_t delayNs, int64_t periodNs, Task task) {
+    uint64_t id = nextTimerId++;
+    timers[id] = Timer{periodNs, move(task)};
+    due.push_back(Due{monotonicNow() + max<int64_t>(delayNs, 1), id});
+    push_heap(due.begin(), due.end(), greater<Due>());
+    armTimer();
+    return id;
+}
+
+void Reactor::cancel(uint64_t id) {
+    timers.erase(id);
+}
+
+int Reactor::runOnce(int timeoutMs) {
+    epoll_event events[MAX_EVENTS];
+    int ready = 0;
+    if (spinNs > 0) {
+        int64_t spinUntil = monotonicNow() + spinNs;
+        while ((ready = epoll_wait(epollFd, events, MAX_EVENTS, 0)) == 0 && monotonicNow() < spinUntil) {
+        }
+    }
+    if (ready == 0) {
+        ready = epoll_wait(epollFd, events, MAX_EVENTS, timeoutMs);
+    }
+    if (ready < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < ready; i++) {
+        Watch *entry = static_cast<Watch *>(events[i].data.ptr);
+        if (entry->active) {
+            entry->handler(events[i].events);
+        }
+    }
+    retired.clear();
+    return ready;
+}
+
+void Reactor::wake() {
+    uint64_t one = 1;
+    ssize_t ignored = write(wakeFd, &one, sizeof(one));
+    (void) ignored;
+}
+
+// Tasks are copied out before they run: a task may cancel itself or
+// schedule others, which changes `timers`.
+void Reactor::runTimers() {
+    uint64_t expirations;
+    ssize_t ignored = read(timerFd, &expirations, sizeof(expirations));
+    (void) ignored;
+    armedNs = 0;
+
+    int64_t now = monotonicNow();
+    while (!due.empty() && due.front().atNs <= now) {
+        Due next = due.front();
+        pop_heap(due.begin(), due.end(), greater<Due>());
+        due.pop_back();
+
+        auto it = timers.find(next.id);
+        if (it == timers.end()) {
+            continue;
+        }
+        Task task = it->second.task;
+        if (it->second.periodNs > 0) {
+            int64_t period = it->second.periodNs;
+            next.atNs += ((now - next.atNs) / period + 1) * period;
+            due.push_back(next);
+            push_heap(due.begin(), due.end(), greater<Due>());
+        } else {
+            timers.erase(it);
+        }
+        task();
+    }
+    armTimer();
+}
+
+void Reactor::armTimer() {
+    while (!due.empty() && timers.count(due.front().id) == 0) {
+        pop_heap(due.begin(), due.end(), greater<Due>());
+        due.pop_back();
+    }
+    int64_t at = due.empty() ? 0 : due.front().atNs;
+    if (at == armedNs) {
+        return;
+    }
+    itimerspec spec{};
+    spec.it_value.tv_sec = at / 1000000000LL;
+    spec.it_value.tv_nsec = at % 1000000000LL;
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    armedNs = at;
+}
+
+void Reactor::drainWake() {
+    uint64_t count;
+    while (read(wakeFd, &count, sizeof(count)) > 0) {
+    }
+}
+
+void Reactor::drainSignals() {
+    signalfd_siginfo info;
+    while (read(signalFd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info))) {
+        onSignal(static_cast<int>(info.ssi_signo));
+    }
+}
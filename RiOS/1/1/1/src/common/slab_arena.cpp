@@ -0,0 +1,90 @@
+#include "slab_arena.h"
+
+#include <sys/mman.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+const size_t PAGE_BYTES = 4096;
+const size_t HUGE_PAGE_BYTES = 2 << 20;
+
+}
+
+SlabArena::SlabArena(size_t slotSize, const ArenaOptions &options)
+        : slot((max(slotSize, sizeof(void *)) + 15) / 16 * 16), options(options) {}
+
+SlabArena::~SlabArena() {
+    for (const Slab &slab: slabs) {
+        munmap(slab.base, slab.bytes);
+    }
+}
+
+void SlabArena::setOptions(const ArenaOptions &newOptions) {
+    options = newOptions;
+}
+
+// Slabs are at least a page and a slot. Under a ceiling smaller than the
+// slab size the last slab is cut to what is left.
+bool SlabArena::mapSlab() {
+    size_t bytes = max(options.slabBytes, slot);
+    bytes = (bytes + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+    if (options.ceilingBytes > 0) {
+        size_t left = options.ceilingBytes > stats.mappedBytes ? options.ceilingBytes - stats.mappedBytes : 0;
+        bytes = min(bytes, left / PAGE_BYTES * PAGE_BYTES);
+        if (bytes < slot) {
+            return false;
+        }
+    }
+
+    void *base = MAP_FAILED;
+    bool huge = false;
+    if (options.hugePages && bytes % HUGE_PAGE_BYTES == 0) {
+        base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge = base != MAP_FAILED;
+    }
+    if (base == MAP_FAILED) {
+        base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return false;
+        }
+        if (options.hugePages) {
+            madvise(base, bytes, MADV_HUGEPAGE);
+        }
+    }
+
+    slabs.push_back(Slab{base, bytes});
+    unused = static_cast<char *>(base);
+    unusedEnd = unused + bytes / slot * slot;
+    stats.slabs++;
+    stats.hugeSlabs += huge;
+    stats.mappedBytes += bytes;
+    stats.slotsFree += bytes / slot;
+    return true;
+}
+
+void *SlabArena::allocate() {
+    void *object;
+    if (freeList != nullptr) {
+        object = freeList;
+        freeList = *static_cast<void **>(freeList);
+    } else {
+        if (unused == unusedEnd && !mapSlab()) {
+            stats.refused++;
+            return nullptr;
+        }
+        object = unused;
+        unused += slot;
+    }
+    stats.slotsInUse++;
+    stats.slotsFree--;
+    return object;
+}
+
+void SlabArena::release(void *object) {
+    *static_cast<void **>(object) = freeList;
+    freeList = object;
+    stats.slotsInUse--;
+    stats.slotsFree++;
+}
@@ -0,0 +1,110 @@
+#include "stage_trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+atomic<bool> stageTracing(false);
+
+double tscTicksPerNs() {
+    static const double ticksPerNs = []() {
+        auto startTime = chrono::steady_clock::now();
+        uint64_t startTsc = readTsc();
+        this_thread::sleep_for(chrono::milliseconds(20));
+        uint64_t stopTsc = readTsc();
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - startTime).count();
+        return (stopTsc - startTsc) / ns;
+    }();
+    return ticksPerNs;
+}
+
+void StageRecorder::open(uint16_t thread) {
+    tscTicksPerNs(); // calibrate before the first probe, not inside it
+    events.assign(CAPACITY, StageEvent{});
+    next = 0;
+    threadId = thread;
+}
+
+void StageRecorder::endSinceRealtime(int stage, int64_t startNs) {
+    if (!stageTracing.load(memory_order_relaxed) || !isOpen()) {
+        return;
+    }
+    uint64_t stop = readTsc();
+    int64_t elapsedNs = max<int64_t>(0, realtimeNs() - startNs);
+    record(stage, stop - static_cast<uint64_t>(elapsedNs * tscTicksPerNs()), stop);
+}
+
+void StageRecorder::record(int stage, uint64_t start, uint64_t stop) {
+    uint64_t ticks = stop - start;
+    events[next++ & (CAPACITY - 1)] = StageEvent{start, static_cast<uint32_t>(min<uint64_t>(ticks, UINT32_MAX)),
+                                                 static_cast<uint16_t>(stage)};
+    histograms[stage].record(static_cast<int64_t>(ticks / tscTicksPerNs()));
+}
+
+void StageRecorder::collect(vector<StageEvent> &out) const {
+    uint64_t first = next > CAPACITY ? next - CAPACITY : 0;
+    for (uint64_t i = first; i < next; i++) {
+        out.push_back(events[i & (CAPACITY - 1)]);
+    }
+}
+
+// Timestamps in us relative to the earliest event, as the viewers expect.
+bool writeChromeTrace(const string &path, const vector<const StageRecorder *> &recorders,
+                      const char *const names[], int stageCount) {
+    ofstream out(path);
+    if (!out) {
+        return false;
+    }
+
+    vector<vector<StageEvent>> perThread(recorders.size());
+    uint64_t origin = UINT64_MAX;
+    for (size_t i = 0; i < recorders.size(); i++) {
+        recorders[i]->collect(perThread[i]);
+        for (const StageEvent &event: perThread[i]) {
+            origin = min(origin, event.startTsc);
+        }
+    }
+
+    double ticksPerUs = tscTicksPerNs() * 1000;
+    int pid = getpid();
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    out << fixed << setprecision(3);
+    for (size_t i = 0; i < recorders.size(); i++) {
+        for (const StageEvent &event: perThread[i]) {
+            if (event.stage >= stageCount) {
+                continue;
+            }
+            out << (first ? "\n" : ",\n") << "{\"name\":\"" << names[event.stage] << "\",\"ph\":\"X\",\"pid\":" << pid
+                << ",\"tid\":" << recorders[i]->thread() << ",\"ts\":" << (event.startTsc - origin) / ticksPerUs
+                << ",\"dur\":" << event.ticks / ticksPerUs << "}";
+            first = false;
+        }
+    }
+    out << "\n]}" << endl;
+    return static_cast<bool>(out);
+}
+
+void printStageHistograms(ostream &out, const vector<const StageRecorder *> &recorders,
+                          const char *const names[], int stageCount) {
+    out << "Request path stages (ns, upper bounds):" << endl;
+    out << "  " << left << setw(10) << "stage" << right << setw(12) << "count" << setw(10) << "p50"
+        << setw(10) << "p90" << setw(10) << "p99" << setw(10) << "p99.9" << endl;
+    for (int stage = 0; stage < stageCount; stage++) {
+        LatencyHistogram merged;
+        for (const StageRecorder *recorder: recorders) {
+            merged.merge(recorder->histogram(stage));
+        }
+        out << "  " << left << setw(10) << names[stage] << right << setw(12) << merged.count();
+        if (merged.count() > 0) {
+            out << setw(10) << merged.percentile(0.5) << setw(10) << merged.percentile(0.9) << setw(10)
+                << merged.percentile(0.99) << setw(10) << merged.percentile(0.999);
+        }
+        out << endl;
+    }
+}
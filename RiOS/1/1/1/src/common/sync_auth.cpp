@@ -0,0 +1,307 @@
+#include "sync_auth.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+
+inline uint64_t rotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+inline uint64_t load64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// The last 0..7 bytes with the length in the top byte.
+inline uint64_t finalWord(const uint8_t *tail, size_t length) {
+    uint64_t b = static_cast<uint64_t>(length) << 56;
+    for (size_t i = 0; i < (length & 7); i++) {
+        b |= static_cast<uint64_t>(tail[i]) << (8 * i);
+    }
+    return b;
+}
+
+inline void sipRound(uint64_t &v0, uint64_t &v1, uint64_t &v2, uint64_t &v3) {
+    v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+    v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+
+int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool parseKeyBytes(const string &hex, SipKey &key) {
+    if (hex.size() != 32) {
+        return false;
+    }
+    uint8_t bytes[16];
+    for (size_t i = 0; i < 16; i++) {
+        int high = hexDigit(hex[2 * i]);
+        int low = hexDigit(hex[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        bytes[i] = static_cast<uint8_t>(high << 4 | low);
+    }
+    key = SipKey::fromBytes(bytes);
+    return true;
+}
+
+bool parseKeyId(const string &text, uint32_t &id) {
+    char *end = nullptr;
+    unsigned long value = strtoul(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || value >= SyncKeyRing::MAX_KEY_ID) {
+        return false;
+    }
+    id = static_cast<uint32_t>(value);
+    return true;
+}
+
+SyncAuthTrailer readTrailer(const uint8_t *packet, size_t length) {
+    SyncAuthTrailer trailer;
+    memcpy(&trailer, packet + length - SYNC_AUTH_BYTES, sizeof(trailer));
+    return trailer;
+}
+
+}
+
+SipKey SipKey::fromBytes(const uint8_t bytes[16]) {
+    uint64_t k0 = load64(bytes);
+    uint64_t k1 = load64(bytes + 8);
+    SipKey key;
+    key.v0 = k0 ^ 0x736f6d6570736575ULL;
+    key.v1 = k1 ^ 0x646f72616e646f6dULL;
+    key.v2 = k0 ^ 0x6c7967656e657261ULL;
+    key.v3 = k1 ^ 0x7465646279746573ULL;
+    return key;
+}
+
+uint64_t sipHash24(const SipKey &key, const void *data, size_t length) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    uint64_t v0 = key.v0, v1 = key.v1, v2 = key.v2, v3 = key.v3;
+
+    const uint8_t *end = p + (length & ~static_cast<size_t>(7));
+    for (; p != end; p += 8) {
+        uint64_t m = load64(p);
+        v3 ^= m;
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    uint64_t b = finalWord(p, length);
+    v3 ^= b;
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++) {
+        sipRound(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+namespace {
+
+// Two messages in lockstep, lanes in separate variables: eight words of
+// state fit the registers, which four lanes' sixteen do not, and as arrays
+// the compiler turns them into SSE vectors, which have no 64-bit rotate.
+void sipHash24x2(const SipKey &keyA, const SipKey &keyB, const uint8_t *dataA, const uint8_t *dataB, size_t length,
+                 uint64_t &tagA, uint64_t &tagB) {
+    uint64_t a0 = keyA.v0, a1 = keyA.v1, a2 = keyA.v2, a3 = keyA.v3;
+    uint64_t b0 = keyB.v0, b1 = keyB.v1, b2 = keyB.v2, b3 = keyB.v3;
+
+    size_t blocks = length / 8;
+    for (size_t offset = 0; offset < 8 * blocks; offset += 8) {
+        uint64_t ma = load64(dataA + offset), mb = load64(dataB + offset);
+        a3 ^= ma; b3 ^= mb;
+        sipRound(a0, a1, a2, a3); sipRound(b0, b1, b2, b3);
+        sipRound(a0, a1, a2, a3); sipRound(b0, b1, b2, b3);
+        a0 ^= ma; b0 ^= mb;
+    }
+
+    uint64_t ma = finalWord(dataA + 8 * blocks, length), mb = finalWord(dataB + 8 * blocks, length);
+    a3 ^= ma; b3 ^= mb;
+    sipRound(a0, a1, a2, a3); sipRound(b0, b1, b2, b3);
+    sipRound(a0, a1, a2, a3); sipRound(b0, b1, b2, b3);
+    a0 ^= ma; b0 ^= mb;
+
+    a2 ^= 0xff; b2 ^= 0xff;
+    for (int i = 0; i < 4; i++) {
+        sipRound(a0, a1, a2, a3); sipRound(b0, b1, b2, b3);
+    }
+    tagA = a0 ^ a1 ^ a2 ^ a3;
+    tagB = b0 ^ b1 ^ b2 ^ b3;
+}
+
+}
+
+void sipHash24x4(const SipKey *const keys[4], const uint8_t *const data[4], size_t length, uint64_t tags[4]) {
+    sipHash24x2(*keys[0], *keys[1], data[0], data[1], length, tags[0], tags[1]);
+    sipHash24x2(*keys[2], *keys[3], data[2], data[3], length, tags[2], tags[3]);
+}
+
+size_t signPacket(const SipKey &key, uint32_t keyId, uint32_t counter, void *packet, size_t length) {
+    uint8_t *bytes = static_cast<uint8_t *>(packet);
+    SyncAuthTrailer trailer{keyId, counter, 0};
+    memcpy(bytes + length, &trailer, sizeof(trailer));
+    trailer.tag = sipHash24(key, bytes, length + offsetof(SyncAuthTrailer, tag));
+    memcpy(bytes + length + offsetof(SyncAuthTrailer, tag), &trailer.tag, sizeof(trailer.tag));
+    return length + SYNC_AUTH_BYTES;
+}
+
+size_t verifyPacket(const SipKey &key, uint32_t keyId, const void *packet, size_t length) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(packet);
+    if (length < SYNC_AUTH_BYTES) {
+        return 0;
+    }
+    SyncAuthTrailer trailer = readTrailer(bytes, length);
+    if (trailer.keyId != keyId || sipHash24(key, bytes, length - sizeof(trailer.tag)) != trailer.tag) {
+        return 0;
+    }
+    return length - SYNC_AUTH_BYTES;
+}
+
+uint32_t syncAuthCounter(const void *packet, size_t plainLength) {
+    return readTrailer(static_cast<const uint8_t *>(packet), plainLength + SYNC_AUTH_BYTES).counter;
+}
+
+uint32_t initialSyncAuthCounter() {
+    timespec ts{};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint32_t>(static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000);
+}
+
+bool SyncAuthBinding::admit(uint32_t packetKeyId, uint32_t packetCounter) {
+    if (keyId == UNBOUND) {
+        keyId = packetKeyId;
+    } else if (packetKeyId != keyId || static_cast<int32_t>(packetCounter - counter) <= 0) {
+        return false;
+    }
+    counter = packetCounter;
+    return true;
+}
+
+bool parseSyncKey(const string &text, uint32_t &id, SipKey &key) {
+    size_t colon = text.find(':');
+    return colon != string::npos && parseKeyId(text.substr(0, colon), id) &&
+           parseKeyBytes(text.substr(colon + 1), key);
+}
+
+bool SyncKeyRing::load(const string &path, string &error) {
+    ifstream in(path);
+    if (!in) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    string line;
+    for (int number = 1; getline(in, line); number++) {
+        line = line.substr(0, line.find('#'));
+        istringstream fields(line);
+        string idText, hex, extra;
+        if (!(fields >> idText)) {
+            continue;
+        }
+        uint32_t id;
+        SipKey key;
+        if (!(fields >> hex) || (fields >> extra) || !parseKeyId(idText, id) || !parseKeyBytes(hex, key)) {
+            error = path + ":" + to_string(number) + ": expected <id> <32 hex digits>, id below " +
+                    to_string(MAX_KEY_ID);
+            return false;
+        }
+        add(id, key);
+    }
+    return true;
+}
+
+void SyncKeyRing::add(uint32_t id, const SipKey &key) {
+    if (id >= keys.size()) {
+        keys.resize(id + 1);
+        present.resize(id + 1, 0);
+    }
+    count += present[id] ? 0 : 1;
+    keys[id] = key;
+    present[id] = 1;
+}
+
+size_t SyncKeyRing::verify(const void *packet, size_t length, uint32_t &keyId) const {
+    if (length < SYNC_AUTH_BYTES) {
+        return 0;
+    }
+    keyId = readTrailer(static_cast<const uint8_t *>(packet), length).keyId;
+    const SipKey *key = find(keyId);
+    return key != nullptr ? verifyPacket(*key, keyId, packet, length) : 0;
+}
+
+// Packets are gathered into lanes as long as their lengths agree; a full
+// set of four is hashed together, a partial one (a length change, the end
+// of the batch) one by one.
+void SyncKeyRing::verifyBatch(const uint8_t *const packets[], const size_t lengths[], size_t count,
+                              size_t results[], uint32_t keyIds[]) const {
+    size_t lanes[4];
+    const SipKey *laneKeys[4];
+    const uint8_t *laneData[4];
+    size_t laneCount = 0;
+    size_t laneLength = 0;
+
+    auto flush = [&]() {
+        uint64_t tags[4];
+        if (laneCount == 4) {
+            sipHash24x4(laneKeys, laneData, laneLength, tags);
+        } else {
+            for (size_t lane = 0; lane < laneCount; lane++) {
+                tags[lane] = sipHash24(*laneKeys[lane], laneData[lane], laneLength);
+            }
+        }
+        for (size_t lane = 0; lane < laneCount; lane++) {
+            size_t i = lanes[lane];
+            if (readTrailer(packets[i], lengths[i]).tag == tags[lane]) {
+                results[i] = lengths[i] - SYNC_AUTH_BYTES;
+            }
+        }
+        laneCount = 0;
+    };
+
+    for (size_t i = 0; i < count; i++) {
+        results[i] = 0;
+        keyIds[i] = 0;
+        if (lengths[i] < SYNC_AUTH_BYTES) {
+            continue;
+        }
+        uint32_t id = readTrailer(packets[i], lengths[i]).keyId;
+        const SipKey *key = find(id);
+        if (key == nullptr) {
+            continue;
+        }
+        keyIds[i] = id;
+
+        size_t hashed = lengths[i] - sizeof(uint64_t);
+        if (laneCount > 0 && hashed != laneLength) {
+            flush();
+        }
+        lanes[laneCount] = i;
+        laneKeys[laneCount] = key;
+        laneData[laneCount] = packets[i];
+        laneLength = hashed;
+        if (++laneCount == 4) {
+            flush();
+        }
+    }
+    flush();
+}
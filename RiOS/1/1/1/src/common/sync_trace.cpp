@@ -0,0 +1,153 @@
+#include "sync_trace.h"
+#include "net_address.h"
+#include "timebase.h"
+
+#include <sys/socket.h>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+
+using namespace std;
+
+TraceWriter::~TraceWriter() {
+    close();
+}
+
+bool TraceWriter::open(const string &path) {
+    if (file != nullptr) {
+        return false;
+    }
+
+    file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    TraceFileHeader header{TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord), 0};
+    fwrite(&header, sizeof(header), 1, file);
+
+    ring.reset(new SpscRing<TraceRecord>());
+    stopping = false;
+    writer = thread(&TraceWriter::writerLoop, this);
+    return true;
+}
+
+void TraceWriter::close() {
+    if (file == nullptr) {
+        return;
+    }
+
+    stopping = true;
+    if (writer.joinable()) {
+        writer.join();
+    }
+
+    fclose(file);
+    file = nullptr;
+}
+
+void TraceWriter::writerLoop() {
+    vector<TraceRecord> batch;
+    batch.reserve(4096);
+    TraceRecord rec{};
+
+    while (true) {
+        bool finishing = stopping.load();
+
+        while (batch.size() < batch.capacity() && ring->pop(rec)) {
+            batch.push_back(rec);
+        }
+
+        if (!batch.empty()) {
+            fwrite(batch.data(), sizeof(TraceRecord), batch.size(), file);
+            writtenCount += batch.size();
+            batch.clear();
+            continue;
+        }
+
+        if (finishing) {
+            break;
+        }
+
+        fflush(file);
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    fflush(file);
+}
+
+bool readTrace(const string &path, vector<TraceRecord> &records) {
+    FILE *in = fopen(path.c_str(), "rb");
+    if (in == nullptr) {
+        return false;
+    }
+
+    TraceFileHeader header{};
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != TRACE_MAGIC ||
+        header.version != TRACE_VERSION || header.recordSize != sizeof(TraceRecord)) {
+        fclose(in);
+        return false;
+    }
+
+    TraceRecord buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, sizeof(TraceRecord), 4096, in)) > 0) {
+        records.insert(records.end(), buffer, buffer + n);
+    }
+
+    fclose(in);
+    return true;
+}
+
+void traceAddress(const sockaddr_storage &addr, TraceRecord &rec) {
+    traceAddress(makeClientKey(addr), rec);
+}
+
+void traceAddress(const ClientKey &key, TraceRecord &rec) {
+    memcpy(rec.address, key.addr, sizeof(rec.address));
+    rec.port = ntohs(key.port);
+}
+
+int64_t realtimeNs() {
+    return timebase().realtimeNs();
+}
+
+void enableKernelTimestamps(int fd) {
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+}
+
+ssize_t recvWithTimestamp(int fd, void *buffer, size_t size, int flags,
+                          sockaddr *addr, socklen_t *addrLen, int64_t &rxNs) {
+    iovec iov{buffer, size};
+    char control[CMSG_SPACE(sizeof(timespec))];
+
+    msghdr msg{};
+    msg.msg_name = addr;
+    msg.msg_namelen = addrLen != nullptr ? *addrLen : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(fd, &msg, flags);
+    if (received < 0) {
+        return received;
+    }
+    if (addrLen != nullptr) {
+        *addrLen = msg.msg_namelen;
+    }
+
+    rxNs = 0;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            timespec ts{};
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            rxNs = static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+        }
+    }
+    if (rxNs == 0) {
+        rxNs = realtimeNs();
+    }
+    return received;
+}
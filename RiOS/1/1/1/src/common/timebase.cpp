@@ -0,0 +1,185 @@
+#include "timebase.h"
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+const int64_t FIRST_INTERVAL_NS = 10000000;    // 10 ms, then 100 ms
+const int64_t LONGEST_INTERVAL_NS = 1000000000;
+const int64_t STEP_THRESHOLD_NS = 1000000;     // larger errors are stepped forward, or slewed at MAX_SLEW
+const int64_t FALLBACK_GRACE_NS = 1000000;    // readers still on the TSC when it is given up
+const double MAX_SLEW = 500e-6;                // of the interval
+const double MAX_RATE_CHANGE = 1000e-6;        // between calibrations, else the TSC is not trusted
+const int SAMPLE_TRIES = 7;
+
+}
+
+Timebase &timebase() {
+    static Timebase instance;
+    return instance;
+}
+
+// Invariant TSC (CPUID 0x80000007 EDX bit 8) and, where sysfs says so, the
+// kernel's own clocksource: if the kernel does not trust the TSC, neither do
+// we.
+bool Timebase::tscUsable(string &reason) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || (edx & (1u << 8)) == 0) {
+        reason = "no invariant TSC";
+        return false;
+    }
+    ifstream clocksource("/sys/devices/system/clocksource/clocksource0/current_clocksource");
+    string name;
+    if (clocksource >> name && name != "tsc") {
+        reason = "kernel clocksource is " + name;
+        return false;
+    }
+    return true;
+#else
+    reason = "no TSC on this architecture";
+    return false;
+#endif
+}
+
+// The pair with the shortest rdtsc window around clock_gettime(), the TSC
+// taken at its middle.
+Timebase::Sample Timebase::takeSample() {
+    Sample best{};
+    uint64_t bestGap = UINT64_MAX;
+    for (int i = 0; i < SAMPLE_TRIES; i++) {
+        uint64_t before = readTsc();
+        int64_t mono = kernelNs(CLOCK_MONOTONIC);
+        uint64_t after = readTsc();
+        int64_t real = kernelNs(CLOCK_REALTIME);
+        if (after - before < bestGap) {
+            bestGap = after - before;
+            best = Sample{before + (after - before) / 2, mono, real - mono};
+        }
+    }
+    best.real += best.mono;
+    return best;
+}
+
+void Timebase::publish(const Params &params) {
+    uint32_t current = sequence.load(memory_order_relaxed);
+    sequence.store(current + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    tscBase.store(params.tscBase, memory_order_relaxed);
+    monoBase.store(params.monoBase, memory_order_relaxed);
+    scale.store(params.scale, memory_order_relaxed);
+    realtimeOffset.store(params.realtimeOffset, memory_order_relaxed);
+    sequence.store(current + 2, memory_order_release);
+}
+
+bool Timebase::start() {
+    if (running.load() || active.load()) {
+        return active.load();
+    }
+    if (!tscUsable(reason)) {
+        return false;
+    }
+    running = true;
+    calibrator = thread(&Timebase::calibrate, this);
+    return true;
+}
+
+void Timebase::stop() {
+    running = false;
+    if (calibrator.joinable()) {
+        calibrator.join();
+    }
+}
+
+// The rate comes from the whole run since the first sample, so it gets more
+// precise the longer the process lives. Each update starts the new mapping
+// where the old one stands at that instant and tilts it so the error is gone
+// by the next calibration.
+void Timebase::calibrate() {
+    auto sleepNs = [this](int64_t ns) {
+        auto until = chrono::steady_clock::now() + chrono::nanoseconds(ns);
+        while (running.load() && chrono::steady_clock::now() < until) {
+            this_thread::sleep_for(min(chrono::nanoseconds(10000000), chrono::nanoseconds(ns)));
+        }
+    };
+
+    Sample origin = takeSample();
+    Sample last = origin;
+    double rate = 0;
+    int64_t interval = FIRST_INTERVAL_NS;
+    sleepNs(interval);
+
+    while (running.load()) {
+        Sample now = takeSample();
+        if (now.tsc <= last.tsc || now.mono <= last.mono) {
+            failure = "TSC went backwards";
+            break;
+        }
+        double newRate = static_cast<double>(now.tsc - origin.tsc) / (now.mono - origin.mono);
+        if (rate > 0 && fabs(newRate / rate - 1) > MAX_RATE_CHANGE) {
+            failure = "TSC rate unstable";
+            break;
+        }
+        rate = newRate;
+        interval = min(interval * 10, LONGEST_INTERVAL_NS);
+
+        Params params{now.tsc, now.mono, 0, now.real - now.mono};
+        int64_t error = 0;
+        double slew = 0;
+        if (active.load(memory_order_relaxed)) {
+            int64_t mapped = monoBase.load(memory_order_relaxed)
+                             + scaled(now.tsc - tscBase.load(memory_order_relaxed), scale.load(memory_order_relaxed));
+            error = mapped - now.mono;
+            if (error < -STEP_THRESHOLD_NS) {
+                steps++;
+            } else {
+                params.monoBase = mapped;
+                slew = max(-MAX_SLEW, min(MAX_SLEW, -static_cast<double>(error) / interval));
+            }
+        }
+        params.scale = static_cast<uint64_t>(ldexp((1 + slew) / rate, 32));
+        publish(params);
+        active.store(true, memory_order_release);
+
+        lastError = error;
+        ticksPerNs = rate;
+        calibrations++;
+        last = now;
+        sleepNs(interval);
+    }
+    fallBack(rate);
+}
+
+// The kernel clock may be behind the TSC time already handed out. Reads are
+// held at where the TSC mapping will stand FALLBACK_GRACE_NS from now, which
+// covers a reader that checked `active` just before it is cleared.
+void Timebase::fallBack(double ticksPerNs) {
+    if (active.load(memory_order_relaxed)) {
+        uint64_t grace = static_cast<uint64_t>(ticksPerNs * FALLBACK_GRACE_NS);
+        fallbackFloor = monoBase.load(memory_order_relaxed) +
+                        scaled(readTsc() + grace - tscBase.load(memory_order_relaxed), scale.load(memory_order_relaxed));
+    }
+    active = false;
+}
+
+TimebaseStats Timebase::stats() const {
+    TimebaseStats out;
+    out.tsc = usingTsc();
+    const char *failed = failure.load();
+    if (!out.tsc) {
+        out.reason = failed != nullptr ? failed : reason.empty() ? "not started" : reason;
+    }
+    out.ticksPerNs = ticksPerNs.load();
+    out.calibrations = calibrations.load();
+    out.steps = steps.load();
+    out.lastErrorNs = lastError.load();
+    return out;
+}
@@ -0,0 +1,144 @@
+#include "worker_stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+uint32_t magnitudeOf(int32_t correction) {
+    return correction < 0 ? 0u - static_cast<uint32_t>(correction) : static_cast<uint32_t>(correction);
+}
+
+}
+
+void WorkerStats::offerWorst(const ClientKey &key, int32_t correction) {
+    uint32_t magnitude = magnitudeOf(correction);
+
+    int slot = -1;
+    for (int i = 0; i < worstCount; i++) {
+        if (worst[i].key == key) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot >= 0) {
+        if (magnitude <= magnitudeOf(worst[slot].correction)) {
+            return;
+        }
+    } else if (worstCount < TOP_CLIENTS) {
+        slot = worstCount++;
+    } else {
+        slot = 0;
+        for (int i = 1; i < worstCount; i++) {
+            if (magnitudeOf(worst[i].correction) < magnitudeOf(worst[slot].correction)) {
+                slot = i;
+            }
+        }
+    }
+    worst[slot] = WorstClient{key, correction};
+
+    if (worstCount == TOP_CLIENTS) {
+        worstFloor = UINT32_MAX;
+        for (int i = 0; i < worstCount; i++) {
+            worstFloor = min(worstFloor, magnitudeOf(worst[i].correction));
+        }
+    }
+}
+
+void WorkerStats::merge(const WorkerStats &other) {
+    requests += other.requests;
+    newClients += other.newClients;
+    disconnects += other.disconnects;
+    ignored += other.ignored;
+    refused += other.refused;
+    batches += other.batches;
+    unauthenticated += other.unauthenticated;
+    rejected += other.rejected;
+    correctionSum += other.correctionSum;
+    minCorrection = min(minCorrection, other.minCorrection);
+    maxCorrection = max(maxCorrection, other.maxCorrection);
+    for (int i = 0; i < CORRECTION_BUCKETS; i++) {
+        correctionBuckets[i] += other.correctionBuckets[i];
+    }
+    for (int i = 0; i < other.worstCount; i++) {
+        if (worstCount < TOP_CLIENTS || magnitudeOf(other.worst[i].correction) > worstFloor) {
+            offerWorst(other.worst[i].key, other.worst[i].correction);
+        }
+    }
+    clients += other.clients;
+}
+
+void WorkerStats::resetInterval() {
+    size_t gauge = clients;
+    *this = WorkerStats();
+    clients = gauge;
+}
+
+int64_t WorkerStats::correctionPercentile(double fraction) const {
+    if (requests == 0) {
+        return 0;
+    }
+    uint64_t target = static_cast<uint64_t>(fraction * (requests - 1));
+    uint64_t seen = 0;
+    for (int i = 0; i < CORRECTION_BUCKETS; i++) {
+        seen += correctionBuckets[i];
+        if (seen > target) {
+            return i == 0 ? 0 : (1LL << i) - 1;
+        }
+    }
+    return (1LL << CORRECTION_BUCKETS) - 1;
+}
+
+int WorkerStats::sortedWorst(WorstClient out[TOP_CLIENTS]) const {
+    copy(worst, worst + worstCount, out);
+    sort(out, out + worstCount, [](const WorstClient &a, const WorstClient &b) {
+        return magnitudeOf(a.correction) > magnitudeOf(b.correction);
+    });
+    return worstCount;
+}
+
+StatsEpochs::StatsEpochs(size_t workers) : slots(new Slot[workers]), count(workers) {}
+
+// The reporter clears `pending` after merging a slot and before it opens the
+// next epoch, so a worker that finds it still set knows its last publication
+// was never read and adds to it instead of overwriting it.
+void StatsEpochs::publish(Slot &slot, WorkerStats &current, uint64_t epoch) {
+    if (slot.pending.load(memory_order_acquire)) {
+        size_t gauge = current.clients;
+        slot.published.merge(current);
+        slot.published.clients = gauge;
+    } else {
+        slot.published = current;
+        slot.pending.store(true, memory_order_relaxed);
+    }
+    current.resetInterval();
+    slot.epoch.store(epoch, memory_order_release);
+}
+
+size_t StatsEpochs::snapshot(WorkerStats &merged, int timeoutMs) {
+    uint64_t epoch = requested.fetch_add(1, memory_order_acq_rel) + 1;
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+
+    vector<bool> done(count, false);
+    size_t published = 0;
+    while (true) {
+        for (size_t i = 0; i < count; i++) {
+            if (!done[i] && slots[i].epoch.load(memory_order_acquire) == epoch) {
+                merged.merge(slots[i].published);
+                slots[i].pending.store(false, memory_order_release);
+                done[i] = true;
+                published++;
+            }
+        }
+        if (published == count || chrono::steady_clock::now() >= deadline) {
+            return published;
+        }
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
@@ -0,0 +1,571 @@
+#include "xdp_backend.h"
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include "sync_trace.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+using namespace std;
+
+namespace {
+
+const uint32_t FRAME_SIZE = 2048;
+const uint32_t FRAME_COUNT = 4096;
+const uint32_t RING_SIZE = 2048;
+const uint32_t MAX_QUEUES = 64;
+const int BIND_ATTEMPTS = 40;
+const int BIND_RETRY_US = 50000;
+
+const size_t ETH_HEADER = 14;
+const size_t IPV6_HEADER = 40;
+const size_t UDP_HEADER = 8;
+
+long bpf(int cmd, bpf_attr &attr) {
+    return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+}
+
+// Just enough of an assembler for the filter below: instructions, labels,
+// and forward jumps patched at the end.
+class BpfAssembler {
+public:
+    void emit(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+        bpf_insn insn{};
+        insn.code = code;
+        insn.dst_reg = dst;
+        insn.src_reg = src;
+        insn.off = off;
+        insn.imm = imm;
+        program.push_back(insn);
+    }
+
+    void load(uint8_t size, uint8_t dst, uint8_t src, int16_t off) {
+        emit(BPF_LDX | BPF_MEM | size, dst, src, off, 0);
+    }
+
+    void jump(uint8_t op, uint8_t dst, int32_t imm, const string &target) {
+        fixups.emplace_back(program.size(), target);
+        emit(BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+    }
+
+    void jumpIfAbove(uint8_t dst, uint8_t src, const string &target) {
+        fixups.emplace_back(program.size(), target);
+        emit(BPF_JMP | BPF_JGT | BPF_X, dst, src, 0, 0);
+    }
+
+    void label(const string &name) {
+        labels[name] = program.size();
+    }
+
+    vector<bpf_insn> finish() {
+        for (const auto &fixup: fixups) {
+            program[fixup.first].off = static_cast<int16_t>(labels.at(fixup.second) - fixup.first - 1);
+        }
+        return program;
+    }
+
+private:
+    vector<bpf_insn> program;
+    vector<pair<size_t, string>> fixups;
+    map<string, size_t> labels;
+};
+
+// UDP to `port` over IPv4 (no options, not fragmented) or IPv6 (UDP as the
+// first header) goes to the socket of the receive queue; everything else,
+// and packets on queues without a socket, go to the kernel.
+vector<bpf_insn> assembleFilter(int mapFd, uint16_t port) {
+    // Packet fields are loaded as little-endian words.
+    const int32_t portWord = ((port & 0xff) << 8) | (port >> 8);
+    const int32_t ethIpv4 = 0x0008;
+    const int32_t ethIpv6 = 0xDD86;
+    const int32_t fragmentMask = 0xff3f;
+
+    BpfAssembler a;
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+    a.load(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(xdp_md, data));
+    a.load(BPF_W, BPF_REG_3, BPF_REG_1, offsetof(xdp_md, data_end));
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    a.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HEADER + 20 + UDP_HEADER);
+    a.jumpIfAbove(BPF_REG_4, BPF_REG_3, "pass");
+    a.load(BPF_H, BPF_REG_5, BPF_REG_2, 12);
+    a.jump(BPF_JEQ, BPF_REG_5, ethIpv4, "ipv4");
+    a.jump(BPF_JNE, BPF_REG_5, ethIpv6, "pass");
+
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    a.emit(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, ETH_HEADER + IPV6_HEADER + UDP_HEADER);
+    a.jumpIfAbove(BPF_REG_4, BPF_REG_3, "pass");
+    a.load(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HEADER + 6);
+    a.jump(BPF_JNE, BPF_REG_5, IPPROTO_UDP, "pass");
+    a.load(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HEADER + IPV6_HEADER + 2);
+    a.jump(BPF_JNE, BPF_REG_5, portWord, "pass");
+    a.jump(BPF_JA, 0, 0, "redirect");
+
+    a.label("ipv4");
+    a.load(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HEADER);
+    a.jump(BPF_JNE, BPF_REG_5, 0x45, "pass");
+    a.load(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HEADER + 9);
+    a.jump(BPF_JNE, BPF_REG_5, IPPROTO_UDP, "pass");
+    a.load(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HEADER + 6);
+    a.emit(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, fragmentMask);
+    a.jump(BPF_JNE, BPF_REG_5, 0, "pass");
+    a.load(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HEADER + 20 + 2);
+    a.jump(BPF_JNE, BPF_REG_5, portWord, "pass");
+
+    a.label("redirect");
+    a.load(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(xdp_md, rx_queue_index));
+    a.emit(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, mapFd);
+    a.emit(0, 0, 0, 0, 0);
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+    a.emit(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    a.emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    a.label("pass");
+    a.emit(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+    a.emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    return a.finish();
+}
+
+uint32_t checksumAdd(uint32_t sum, const uint8_t *data, size_t length) {
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        sum += (static_cast<uint32_t>(data[i]) << 8) | data[i + 1];
+    }
+    if (length & 1) {
+        sum += static_cast<uint32_t>(data[length - 1]) << 8;
+    }
+    return sum;
+}
+
+uint16_t checksumFold(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return static_cast<uint16_t>(~sum);
+}
+
+void put16(uint8_t *at, uint16_t value) {
+    at[0] = static_cast<uint8_t>(value >> 8);
+    at[1] = static_cast<uint8_t>(value);
+}
+
+uint16_t get16(const uint8_t *at) {
+    return static_cast<uint16_t>((at[0] << 8) | at[1]);
+}
+
+template<size_t N>
+void swapBytes(uint8_t *a, uint8_t *b) {
+    uint8_t tmp[N];
+    memcpy(tmp, a, N);
+    memcpy(a, b, N);
+    memcpy(b, tmp, N);
+}
+
+// UDP checksum over the pseudo header, the UDP header and the payload.
+void setUdpChecksum(uint8_t *udp, size_t udpLength, const uint8_t *src, const uint8_t *dst, size_t addrLength) {
+    put16(udp + 6, 0);
+    uint32_t sum = checksumAdd(0, src, addrLength);
+    sum = checksumAdd(sum, dst, addrLength);
+    sum += IPPROTO_UDP + static_cast<uint32_t>(udpLength);
+    sum = checksumAdd(sum, udp, udpLength);
+    uint16_t checksum = checksumFold(sum);
+    put16(udp + 6, checksum == 0 ? 0xffff : checksum);
+}
+
+}
+
+bool parseXdpOption(int &i, int argc, char *argv[], XdpOptions &options) {
+    string arg = argv[i];
+    if (arg == "--xdp-native") {
+        options.native = true;
+        return true;
+    }
+    if (i + 1 >= argc) {
+        return false;
+    }
+    if (arg == "--xdp") {
+        options.interface = argv[++i];
+    } else if (arg == "--xdp-queue") {
+        options.queue = static_cast<uint32_t>(atoi(argv[++i]));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *xdpUsage() {
+    return "[--xdp IFACE] [--xdp-queue N] [--xdp-native]";
+}
+
+XdpProgram::~XdpProgram() {
+    detach();
+}
+
+bool XdpProgram::attach(const XdpOptions &options, uint16_t port) {
+    interfaceIndex = static_cast<int>(if_nametoindex(options.interface.c_str()));
+    if (interfaceIndex == 0) {
+        cerr << "[XDP] No interface " << options.interface << endl;
+        return false;
+    }
+
+    bpf_attr attr{};
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = MAX_QUEUES;
+    strncpy(attr.map_name, "sync_xsks", sizeof(attr.map_name) - 1);
+    socketMapFd = static_cast<int>(bpf(BPF_MAP_CREATE, attr));
+    if (socketMapFd < 0) {
+        cerr << "[XDP] Cannot create the socket map: " << strerror(errno) << endl;
+        return false;
+    }
+
+    vector<bpf_insn> program = assembleFilter(socketMapFd, port);
+    static char verifierLog[65536];
+    static const char license[] = "GPL";
+    attr = bpf_attr{};
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = reinterpret_cast<uint64_t>(program.data());
+    attr.insn_cnt = static_cast<uint32_t>(program.size());
+    attr.license = reinterpret_cast<uint64_t>(license);
+    attr.log_buf = reinterpret_cast<uint64_t>(verifierLog);
+    attr.log_size = sizeof(verifierLog);
+    attr.log_level = 1;
+    strncpy(attr.prog_name, "sync_filter", sizeof(attr.prog_name) - 1);
+    programFd = static_cast<int>(bpf(BPF_PROG_LOAD, attr));
+    if (programFd < 0) {
+        cerr << "[XDP] Program rejected: " << strerror(errno) << endl << verifierLog << endl;
+        detach();
+        return false;
+    }
+
+    attr = bpf_attr{};
+    attr.link_create.prog_fd = static_cast<uint32_t>(programFd);
+    attr.link_create.target_ifindex = static_cast<uint32_t>(interfaceIndex);
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = options.native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+    linkFd = static_cast<int>(bpf(BPF_LINK_CREATE, attr));
+    if (linkFd < 0) {
+        cerr << "[XDP] Cannot attach to " << options.interface << " in " << (options.native ? "native" : "generic")
+             << " mode: " << strerror(errno) << endl;
+        detach();
+        return false;
+    }
+    return true;
+}
+
+// Closing the link detaches the program.
+void XdpProgram::detach() {
+    if (linkFd >= 0) ::close(linkFd);
+    if (programFd >= 0) ::close(programFd);
+    if (socketMapFd >= 0) ::close(socketMapFd);
+    linkFd = programFd = socketMapFd = -1;
+}
+
+bool XdpProgram::addSocket(uint32_t queue, int fd) const {
+    bpf_attr attr{};
+    uint32_t value = static_cast<uint32_t>(fd);
+    attr.map_fd = static_cast<uint32_t>(socketMapFd);
+    attr.key = reinterpret_cast<uint64_t>(&queue);
+    attr.value = reinterpret_cast<uint64_t>(&value);
+    if (bpf(BPF_MAP_UPDATE_ELEM, attr) != 0) {
+        cerr << "[XDP] Cannot register the socket for queue " << queue << ": " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+XdpSocket::~XdpSocket() {
+    close();
+}
+
+bool XdpSocket::mapRing(Ring &ring, uint64_t pgoff, uint64_t producer, uint64_t consumer, uint64_t desc,
+                        size_t itemSize) {
+    ring.mapSize = desc + RING_SIZE * itemSize;
+    ring.map = mmap(nullptr, ring.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xskFd,
+                    static_cast<off_t>(pgoff));
+    if (ring.map == MAP_FAILED) {
+        ring.map = nullptr;
+        return false;
+    }
+    uint8_t *base = static_cast<uint8_t *>(ring.map);
+    ring.producer = reinterpret_cast<uint32_t *>(base + producer);
+    ring.consumer = reinterpret_cast<uint32_t *>(base + consumer);
+    ring.descriptors = base + desc;
+    ring.mask = RING_SIZE - 1;
+    return true;
+}
+
+bool XdpSocket::open(const XdpProgram &program, uint32_t queue, bool native) {
+    xskFd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xskFd < 0) {
+        cerr << "[XDP] Cannot create an AF_XDP socket: " << strerror(errno) << endl;
+        return false;
+    }
+
+    umemSize = static_cast<size_t>(FRAME_SIZE) * FRAME_COUNT;
+    void *area = mmap(nullptr, umemSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (area == MAP_FAILED) {
+        cerr << "[XDP] Cannot allocate the UMEM" << endl;
+        close();
+        return false;
+    }
+    umem = static_cast<uint8_t *>(area);
+
+    xdp_umem_reg reg{};
+    reg.addr = reinterpret_cast<uint64_t>(umem);
+    reg.len = umemSize;
+    reg.chunk_size = FRAME_SIZE;
+    reg.headroom = 0;
+    uint32_t ringSize = RING_SIZE;
+    xdp_mmap_offsets offsets{};
+    socklen_t offsetsLength = sizeof(offsets);
+    if (setsockopt(xskFd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0 ||
+        setsockopt(xskFd, SOL_XDP, XDP_UMEM_FILL_RING, &ringSize, sizeof(ringSize)) != 0 ||
+        setsockopt(xskFd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringSize, sizeof(ringSize)) != 0 ||
+        setsockopt(xskFd, SOL_XDP, XDP_RX_RING, &ringSize, sizeof(ringSize)) != 0 ||
+        setsockopt(xskFd, SOL_XDP, XDP_TX_RING, &ringSize, sizeof(ringSize)) != 0 ||
+        getsockopt(xskFd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsetsLength) != 0) {
+        cerr << "[XDP] Cannot set up the UMEM and rings: " << strerror(errno) << endl;
+        close();
+        return false;
+    }
+
+    if (!mapRing(fill, XDP_UMEM_PGOFF_FILL_RING, offsets.fr.producer, offsets.fr.consumer, offsets.fr.desc,
+                 sizeof(uint64_t)) ||
+        !mapRing(completion, XDP_UMEM_PGOFF_COMPLETION_RING, offsets.cr.producer, offsets.cr.consumer,
+                 offsets.cr.desc, sizeof(uint64_t)) ||
+        !mapRing(rx, XDP_PGOFF_RX_RING, offsets.rx.producer, offsets.rx.consumer, offsets.rx.desc,
+                 sizeof(xdp_desc)) ||
+        !mapRing(tx, XDP_PGOFF_TX_RING, offsets.tx.producer, offsets.tx.consumer, offsets.tx.desc,
+                 sizeof(xdp_desc))) {
+        cerr << "[XDP] Cannot map the rings: " << strerror(errno) << endl;
+        close();
+        return false;
+    }
+
+    freeFrames.clear();
+    for (uint32_t i = 0; i < FRAME_COUNT; i++) {
+        freeFrames.push_back(static_cast<uint64_t>(i) * FRAME_SIZE);
+    }
+    fill.cachedProducer = *fill.producer;
+    tx.cachedProducer = *tx.producer;
+    rx.cachedConsumer = *rx.consumer;
+    completion.cachedConsumer = *completion.consumer;
+    refill();
+
+    // Zero-copy needs driver support; fall back to copy mode quietly. A queue
+    // whose previous socket was just closed (a hot upgrade) is released by the
+    // kernel a little later, so EBUSY is retried for a while.
+    sockaddr_xdp addr{};
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = static_cast<uint32_t>(program.ifindex());
+    addr.sxdp_queue_id = queue;
+    int bound = -1;
+    for (int attempt = 0; attempt < BIND_ATTEMPTS; attempt++) {
+        addr.sxdp_flags = native ? XDP_ZEROCOPY : XDP_COPY;
+        bound = bind(xskFd, (sockaddr *) &addr, sizeof(addr));
+        if (bound != 0 && native && errno != EBUSY) {
+            addr.sxdp_flags = XDP_COPY;
+            bound = bind(xskFd, (sockaddr *) &addr, sizeof(addr));
+        }
+        if (bound == 0 || errno != EBUSY) {
+            break;
+        }
+        usleep(BIND_RETRY_US);
+    }
+    if (bound != 0) {
+        cerr << "[XDP] Cannot bind to queue " << queue << ": " << strerror(errno) << endl;
+        close();
+        return false;
+    }
+
+    boundQueue = queue;
+    if (!program.addSocket(queue, xskFd)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void XdpSocket::close() {
+    Ring *rings[] = {&fill, &completion, &rx, &tx};
+    for (Ring *ring: rings) {
+        if (ring->map != nullptr) {
+            munmap(ring->map, ring->mapSize);
+        }
+        *ring = Ring();
+    }
+    if (xskFd >= 0) {
+        ::close(xskFd);
+        xskFd = -1;
+    }
+    if (umem != nullptr) {
+        munmap(umem, umemSize);
+        umem = nullptr;
+    }
+}
+
+// Frames the kernel has finished sending.
+void XdpSocket::reclaim() {
+    uint32_t producer = __atomic_load_n(completion.producer, __ATOMIC_ACQUIRE);
+    uint32_t consumer = completion.cachedConsumer;
+    const uint64_t *addrs = static_cast<const uint64_t *>(completion.descriptors);
+    for (; consumer != producer; consumer++) {
+        recycle(addrs[consumer & completion.mask] & ~static_cast<uint64_t>(FRAME_SIZE - 1));
+    }
+    completion.cachedConsumer = consumer;
+    __atomic_store_n(completion.consumer, consumer, __ATOMIC_RELEASE);
+}
+
+void XdpSocket::refill() {
+    uint32_t consumer = __atomic_load_n(fill.consumer, __ATOMIC_ACQUIRE);
+    uint32_t room = RING_SIZE - (fill.cachedProducer - consumer);
+    uint64_t *addrs = static_cast<uint64_t *>(fill.descriptors);
+    uint32_t count = 0;
+    while (count < room && !freeFrames.empty()) {
+        addrs[(fill.cachedProducer + count) & fill.mask] = freeFrames.back();
+        freeFrames.pop_back();
+        count++;
+    }
+    if (count > 0) {
+        fill.cachedProducer += count;
+        __atomic_store_n(fill.producer, fill.cachedProducer, __ATOMIC_RELEASE);
+    }
+}
+
+size_t XdpSocket::receive(XdpPacket *packets, size_t max) {
+    reclaim();
+    refill();
+
+    uint32_t producer = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE);
+    uint32_t consumer = rx.cachedConsumer;
+    const xdp_desc *descriptors = static_cast<const xdp_desc *>(rx.descriptors);
+    int64_t nowNs = producer != consumer ? realtimeNs() : 0;
+
+    size_t count = 0;
+    for (; consumer != producer && count < max; consumer++) {
+        const xdp_desc &desc = descriptors[consumer & rx.mask];
+        stats.received++;
+
+        XdpPacket &packet = packets[count];
+        packet.addr = desc.addr;
+        packet.frame = umem + desc.addr;
+        packet.frameLength = desc.len;
+        packet.rxNs = nowNs;
+
+        // The filter only lets well-formed UDP through, but a frame can still
+        // be truncated or lie about its lengths.
+        const uint8_t *frame = packet.frame;
+        size_t udp = 0;
+        bool valid = desc.len >= ETH_HEADER + 20 + UDP_HEADER;
+        packet.key = ClientKey{};
+        if (valid && get16(frame + 12) == 0x0800) {
+            size_t ipLength = (frame[ETH_HEADER] & 0x0f) * 4u;
+            udp = ETH_HEADER + ipLength;
+            valid = ipLength >= 20 && frame[ETH_HEADER + 9] == IPPROTO_UDP && udp + UDP_HEADER <= desc.len;
+            packet.key.addr[10] = 0xff;
+            packet.key.addr[11] = 0xff;
+            memcpy(packet.key.addr + 12, frame + ETH_HEADER + 12, 4);
+        } else if (valid && get16(frame + 12) == 0x86DD) {
+            udp = ETH_HEADER + IPV6_HEADER;
+            valid = frame[ETH_HEADER + 6] == IPPROTO_UDP && udp + UDP_HEADER <= desc.len;
+            memcpy(packet.key.addr, frame + ETH_HEADER + 8, 16);
+        } else {
+            valid = false;
+        }
+
+        size_t udpLength = valid ? get16(frame + udp + 4) : 0;
+        if (!valid || udpLength < UDP_HEADER || udp + udpLength > desc.len) {
+            stats.dropped++;
+            recycle(desc.addr & ~static_cast<uint64_t>(FRAME_SIZE - 1));
+            continue;
+        }
+
+        memcpy(&packet.key.port, frame + udp, 2);
+        packet.payload = packet.frame + udp + UDP_HEADER;
+        packet.payloadLength = static_cast<uint32_t>(udpLength - UDP_HEADER);
+        packet.capacity = FRAME_SIZE - static_cast<uint32_t>(desc.addr & (FRAME_SIZE - 1)) -
+                          static_cast<uint32_t>(udp + UDP_HEADER);
+        count++;
+    }
+
+    rx.cachedConsumer = consumer;
+    __atomic_store_n(rx.consumer, consumer, __ATOMIC_RELEASE);
+    return count;
+}
+
+bool XdpSocket::reply(const XdpPacket &packet, size_t length) {
+    uint32_t consumer = __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE);
+    if (tx.cachedProducer - consumer >= RING_SIZE || length > packet.capacity) {
+        drop(packet);
+        return false;
+    }
+
+    uint8_t *frame = packet.frame;
+    swapBytes<6>(frame, frame + 6);
+
+    uint8_t *udp;
+    if (get16(frame + 12) == 0x0800) {
+        uint8_t *ip = frame + ETH_HEADER;
+        size_t ipLength = (ip[0] & 0x0f) * 4u;
+        udp = ip + ipLength;
+        swapBytes<4>(ip + 12, ip + 16);
+        put16(ip + 2, static_cast<uint16_t>(ipLength + UDP_HEADER + length));
+        ip[8] = 64;
+        put16(ip + 10, 0);
+        put16(ip + 10, checksumFold(checksumAdd(0, ip, ipLength)));
+        swapBytes<2>(udp, udp + 2);
+        put16(udp + 4, static_cast<uint16_t>(UDP_HEADER + length));
+        setUdpChecksum(udp, UDP_HEADER + length, ip + 12, ip + 16, 4);
+    } else {
+        uint8_t *ip = frame + ETH_HEADER;
+        udp = ip + IPV6_HEADER;
+        swapBytes<16>(ip + 8, ip + 24);
+        put16(ip + 4, static_cast<uint16_t>(UDP_HEADER + length));
+        ip[7] = 64;
+        swapBytes<2>(udp, udp + 2);
+        put16(udp + 4, static_cast<uint16_t>(UDP_HEADER + length));
+        setUdpChecksum(udp, UDP_HEADER + length, ip + 8, ip + 24, 16);
+    }
+
+    xdp_desc &desc = static_cast<xdp_desc *>(tx.descriptors)[tx.cachedProducer & tx.mask];
+    desc.addr = packet.addr;
+    desc.len = static_cast<uint32_t>(udp + UDP_HEADER + length - frame);
+    desc.options = 0;
+    tx.cachedProducer++;
+    txPending++;
+    stats.replied++;
+    return true;
+}
+
+void XdpSocket::drop(const XdpPacket &packet) {
+    stats.dropped++;
+    recycle(packet.addr & ~static_cast<uint64_t>(FRAME_SIZE - 1));
+}
+
+// In copy and generic mode the kick sends synchronously.
+void XdpSocket::flush() {
+    if (txPending == 0) {
+        return;
+    }
+    __atomic_store_n(tx.producer, tx.cachedProducer, __ATOMIC_RELEASE);
+    txPending = 0;
+    sendto(xskFd, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+}
@@ -2,7 +2,8 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <cstring>
-#include <thread>
+#include <cerrno>
+#include <ctime>
 #include <chrono>
 #include <csignal>
 #include <vector>
@@ -10,24 +11,58 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <algorithm>
+#include <string>
+#include "sync_trace.h"
+#include "offset_store.h"
+#include "net_address.h"
+#include "correction_filter.h"
+#include "clock_filter.h"
+#include "disciplined_clock.h"
+#include "ntp_sync.h"
+#include "poll_loop.h"
 
 using namespace std;
 
-bool running = true;
+volatile sig_atomic_t running = 1;
 int sockfd = -1;
-sockaddr_in serverAddr{};
+sockaddr_storage serverAddr{};
+socklen_t serverAddrLen = 0;
 uint64_t OStime = 0;
 uint64_t Cc = 0;
+TraceWriter trace;
+OffsetStore store; // offset and round trip of every reply, in us
+ClientKey serverKey{};
+
+const int MAX_BURST = 8;
+PollLoop::Params pollParams;
+PollLoop pollLoop;
+ClockFilter clockFilter;
+DisciplineParams disciplineParams;
+DisciplinedClock disciplinedClock; // Cc: the system clock disciplined towards the server
+
+ClockSample lastSample;
+uint64_t lastServerTime = 0;
+
+vector<int64_t> corrections;
+vector<int64_t> timeDifferences;
+vector<int64_t> networkDelays;
+int syncCount = 0;
 
 void cleanup() {
-    running = false;
+    running = 0;
+    pollLoop.close();
     if (sockfd >= 0) close(sockfd);
+    if (trace.isOpen()) trace.close();
+    if (store.isOpen()) {
+        store.close();
+        cout << "[CLIENT] Stored " << store.samplesWritten() << " samples, " << store.droppedCount()
+             << " dropped" << endl;
+    }
     cout << "\n[CLIENT] Cleanup complete." << endl;
 }
 
 void signalHandler(int sig) {
-    cleanup();
-    exit(0);
+    running = 0;
 }
 
 uint64_t getCurrentTimeMs() {
@@ -35,32 +70,49 @@ uint64_t getCurrentTimeMs() {
             chrono::system_clock::now().time_since_epoch()).count();
 }
 
-uint64_t getServerTime() {
-    const char *request = "GET";
-
-    if (sendto(sockfd, request, strlen(request), 0,
-               (sockaddr *) &serverAddr, sizeof(serverAddr)) < 0) {
-        throw runtime_error("Send failed");
-    }
-
-    uint64_t serverTime;
-    sockaddr_in fromAddr;
-    socklen_t fromLen = sizeof(fromAddr);
-
-    ssize_t n = recvfrom(sockfd, &serverTime, sizeof(serverTime), 0,
-                         (sockaddr *) &fromAddr, &fromLen);
+int64_t monotonicNs() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
 
-    if (n != sizeof(serverTime)) {
-        throw runtime_error("Invalid response");
+// stampNs is the send on CLOCK_REALTIME, the clock being corrected.
+bool sendTimeRequest(PollRequest &pollRequest) {
+    NtpSyncRequest request{};
+    strncpy(request.cmd, "GET", 3);
+    request.sequence = pollRequest.sequence;
+
+    pollRequest.stampNs = realtimeNs();
+    if (sendto(sockfd, &request, sizeof(request), 0,
+               (sockaddr *) &serverAddr, serverAddrLen) != sizeof(request)) {
+        cerr << "[ERROR] Send failed" << endl;
+        return false;
     }
+    return true;
+}
 
-    return be64toh(serverTime);
+void recordSample(const PollRequest &request, uint64_t serverTime, int64_t rxNs, int64_t correction) {
+    TraceRecord rec{};
+    rec.rxNs = rxNs;
+    rec.txNs = request.stampNs;
+    rec.replyValue = static_cast<int64_t>(serverTime);
+    traceAddress(serverAddr, rec);
+    rec.rawCorrection = static_cast<int32_t>(correction);
+    rec.correction = rec.rawCorrection;
+    rec.source = TRACE_CLIENT;
+    rec.protocol = TRACE_NTP;
+    trace.record(rec);
 }
 
 void applyTimeCorrection(int64_t correction) {
     cout << "[OS TIME] Would apply correction: " << correction << " ms" << endl;
-    OStime = getCurrentTimeMs() + correction;
-    Cc = OStime;
+    int64_t localNs = realtimeNs();
+    OStime = localNs / 1000000 + correction;
+
+    // Cc slews towards OStime instead of jumping to it.
+    int64_t offsetNs = correction * 1000000LL - (disciplinedClock.read(localNs) - localNs);
+    disciplinedClock.update(offsetNs, localNs);
+    Cc = disciplinedClock.read(localNs) / 1000000;
 }
 
 void printStats(const vector<int64_t> &corrections, const vector<int64_t> &timeDiffs) {
@@ -115,100 +167,201 @@ void printStats(const vector<int64_t> &corrections, const vector<int64_t> &timeD
     cout << "========================================" << endl;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        cerr << "Usage: " << argv[0] << " <server_ip> <sync_period_ms>" << endl;
-        return -1;
+void finishPoll(int pollReplies) {
+    ClockSample best = lastSample;
+    if (pollReplies == 0 || (pollParams.burst > 1 && !clockFilter.select(monotonicNs(), best))) {
+        cerr << "[ERROR] Sync failed: no reply before the deadline" << endl;
+
+        // Cc keeps running on the last frequency estimate.
+        OStime = getCurrentTimeMs();
+        Cc = disciplinedClock.read(realtimeNs()) / 1000000;
+        return;
     }
 
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
+    uint64_t localAfter = getCurrentTimeMs();
+    int64_t networkDelay = llround(best.delayMs / 2);
+    int64_t correction = llround(best.offsetMs);
+    uint64_t serverTime = pollParams.burst > 1 ? localAfter + correction : lastServerTime;
 
-    const char *serverIP = argv[1];
-    int syncPeriod = atoi(argv[2]);
+    networkDelays.push_back(networkDelay);
+    corrections.push_back(correction);
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        cerr << "[ERROR] Socket creation failed" << endl;
-        return -1;
+    // With bursts the clock filter already rejects delayed samples; apply its pick as is.
+    if (pollParams.burst == 1 && corrections.size() >= 3) {
+        int64_t medianCorrection = correctionMedian(corrections);
+        applyTimeCorrection(medianCorrection);
+    } else {
+        applyTimeCorrection(correction);
     }
 
-    struct timeval timeout;
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int64_t timeDiff = Cc - getCurrentTimeMs();
+    timeDifferences.push_back(timeDiff);
 
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(8080);
-    if (inet_pton(AF_INET, serverIP, &serverAddr.sin_addr) <= 0) {
-        cerr << "[ERROR] Invalid IP address" << endl;
-        close(sockfd);
-        return -1;
+    syncCount++;
+
+    cout << "[SYNC #" << syncCount << "]" << endl;
+    if (pollParams.burst > 1) {
+        cout << "  Burst: " << pollReplies << "/" << pollParams.burst << " replies, min delay "
+             << best.delayMs << " ms" << endl;
+    }
+    cout << "  Server time: " << serverTime << " ms" << endl;
+    cout << "  Local time: " << localAfter << " ms" << endl;
+    cout << "  Network delay: " << networkDelay << " ms" << endl;
+    cout << "  Correction: " << correction << " ms" << endl;
+    cout << "  Corrected OS time (OStime): " << OStime << " ms" << endl;
+    cout << "  Client corrected time (Cc): " << Cc << " ms" << endl;
+    cout << "  Frequency: " << disciplinedClock.frequencyPpm() << " ppm, steps: "
+         << disciplinedClock.steps() << endl;
+    cout << "  Difference (Cc - current): " << timeDiff << " ms" << endl;
+
+    if (syncCount % 10 == 0) {
+        printStats(corrections, timeDifferences);
+        corrections.clear();
+        timeDifferences.clear();
     }
+}
 
-    cout << "[CLIENT] Syncing with " << serverIP << " every " << syncPeriod << " ms" << endl;
+void receiveReplies() {
+    while (true) {
+        NtpSyncReply reply{};
+        int64_t rxNs = 0;
+        ssize_t n = recvWithTimestamp(sockfd, &reply, sizeof(reply), MSG_DONTWAIT, nullptr, nullptr, rxNs);
+        if (n < 0) {
+            break;
+        }
+        int64_t receivedNs = realtimeNs();
 
-    vector<int64_t> corrections;
-    vector<int64_t> timeDifferences;
-    vector<int64_t> networkDelays;
-    int syncCount = 0;
-    uint64_t lastLocalTime = getCurrentTimeMs();
+        if (n != sizeof(reply)) {
+            continue;
+        }
 
-    OStime = getCurrentTimeMs();
-    Cc = OStime;
+        PollRequest request;
+        if (!pollLoop.take(reply.sequence, request)) {
+            continue;
+        }
 
-    while (running) {
-        try {
-            uint64_t localBefore = getCurrentTimeMs();
-            uint64_t serverTime = getServerTime();
-            uint64_t localAfter = getCurrentTimeMs();
-
-            int64_t networkDelay = (localAfter - localBefore) / 2;
-            networkDelays.push_back(networkDelay);
-
-            int64_t correction = (serverTime + networkDelay) - localAfter;
-            corrections.push_back(correction);
-
-            if (corrections.size() >= 3) {
-                vector<int64_t> sorted = corrections;
-                sort(sorted.begin(), sorted.end());
-                int64_t medianCorrection = sorted[sorted.size() / 2];
-                applyTimeCorrection(medianCorrection);
-            } else {
-                applyTimeCorrection(correction);
-            }
+        uint64_t serverTime = be64toh(reply.serverTime);
+        ClockSample sample;
+        sample.delayMs = (receivedNs - request.stampNs) / 1e6;
+        sample.offsetMs = serverTime + sample.delayMs / 2 - receivedNs / 1e6;
+        sample.timeNs = monotonicNs();
+        clockFilter.add(sample);
+        lastSample = sample;
+        lastServerTime = serverTime;
+
+        if (trace.isOpen()) {
+            recordSample(request, serverTime, rxNs, llround(sample.offsetMs));
+        }
+        if (store.isOpen()) {
+            store.record(OffsetSample{serverKey, receivedNs, llround(sample.offsetMs * 1000),
+                                      llround(sample.delayMs * 1000)});
+        }
+    }
+}
 
-            int64_t timeDiff = Cc - getCurrentTimeMs();
-            timeDifferences.push_back(timeDiff);
+void run() {
+    if (!pollLoop.run(running)) {
+        cerr << "[ERROR] epoll_wait failed: " << strerror(errno) << endl;
+    }
 
-            syncCount++;
+    cout << "[CLIENT] " << syncCount << " syncs, " << pollLoop.timeouts() << " timeouts, "
+         << pollLoop.staleReplies() << " stale replies dropped" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " <server_ip> <sync_period_ms> [--trace <file>] [--burst K]"
+             << " [--timeout ms] [--retries N] [--step ms] [--store <file>]" << endl;
+        return -1;
+    }
 
-            cout << "[SYNC #" << syncCount << "]" << endl;
-            cout << "  Server time: " << serverTime << " ms" << endl;
-            cout << "  Local time: " << localAfter << " ms" << endl;
-            cout << "  Network delay: " << networkDelay << " ms" << endl;
-            cout << "  Correction: " << correction << " ms" << endl;
-            cout << "  Corrected OS time (OStime): " << OStime << " ms" << endl;
-            cout << "  Client corrected time (Cc): " << Cc << " ms" << endl;
-            cout << "  Difference (Cc - current): " << timeDiff << " ms" << endl;
+    const char *serverIP = argv[1];
+    int syncPeriod = atoi(argv[2]);
 
-            if (syncCount % 10 == 0) {
-                printStats(corrections, timeDifferences);
-                corrections.clear();
-                timeDifferences.clear();
+    if (syncPeriod <= 0) {
+        cerr << "[ERROR] Sync period must be positive" << endl;
+        return -1;
+    }
+
+    // A third of the period, so the default retry still fits before the next poll.
+    int timeoutMs = max(1, min(2000, syncPeriod / 3));
+
+    string tracePath;
+    string storePath;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--burst" && i + 1 < argc) {
+            pollParams.burst = atoi(argv[++i]);
+            if (pollParams.burst < 1 || pollParams.burst > MAX_BURST) {
+                cerr << "[ERROR] Burst size must be between 1 and " << MAX_BURST << endl;
+                return -1;
+            }
+        } else if (arg == "--timeout" && i + 1 < argc) {
+            timeoutMs = atoi(argv[++i]);
+            if (timeoutMs <= 0) {
+                cerr << "[ERROR] Timeout must be positive" << endl;
+                return -1;
             }
+        } else if (arg == "--retries" && i + 1 < argc) {
+            pollParams.retries = max(0, atoi(argv[++i]));
+        } else if (arg == "--step" && i + 1 < argc) {
+            disciplineParams.stepThresholdMs = atof(argv[++i]);
+        } else if (arg == "--store" && i + 1 < argc) {
+            storePath = argv[++i];
+        } else {
+            cerr << "Unknown option: " << arg << endl;
+            return -1;
+        }
+    }
+    pollParams.periodNs = syncPeriod * 1000000LL;
+    pollParams.timeoutNs = timeoutMs * 1000000LL;
+    disciplinedClock = DisciplinedClock(disciplineParams);
+
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+
+    if (!resolveAddress(serverIP, 8080, serverAddr, serverAddrLen)) {
+        cerr << "[ERROR] Invalid IP address" << endl;
+        return -1;
+    }
+
+    sockfd = socket(serverAddr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) {
+        cerr << "[ERROR] Socket creation failed" << endl;
+        return -1;
+    }
 
-        } catch (const exception &e) {
-            cerr << "[ERROR] Sync failed: " << e.what() << endl;
+    if (!pollLoop.open(sockfd, pollParams, sendTimeRequest, receiveReplies, finishPoll)) {
+        cerr << "[ERROR] Event loop setup failed" << endl;
+        cleanup();
+        return -1;
+    }
 
-            OStime = getCurrentTimeMs();
-            Cc = OStime;
+    if (!tracePath.empty()) {
+        if (!trace.open(tracePath)) {
+            cerr << "[ERROR] Cannot open trace file " << tracePath << endl;
+            cleanup();
+            return -1;
         }
+        enableKernelTimestamps(sockfd);
+    }
 
-        this_thread::sleep_for(chrono::milliseconds(syncPeriod));
+    serverKey = makeClientKey(serverAddr);
+    if (!storePath.empty() && !store.open(storePath, 1000, 1000)) {
+        cerr << "[ERROR] Cannot open offset store " << storePath << endl;
+        cleanup();
+        return -1;
     }
 
+    cout << "[CLIENT] Syncing with " << serverIP << " every " << syncPeriod << " ms" << endl;
+
+    OStime = getCurrentTimeMs();
+    Cc = OStime;
+
+    run();
+
     cleanup();
     return 0;
-}
\ No newline at end of file
+}
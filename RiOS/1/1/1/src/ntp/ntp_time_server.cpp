@@ -1,25 +1,47 @@
 #include <iostream>
-#include <thread>
 #include <chrono>
 #include <cstring>
+#include <cstddef>
 #include <csignal>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <atomic>
-#include <netdb.h>
 #include <vector>
 #include <cmath>
+#include <cerrno>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <algorithm>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <sys/eventfd.h>
+#include "sync_trace.h"
+#include "low_latency.h"
+#include "net_address.h"
+#include "correction_filter.h"
+#include "ntp_sync.h"
+#include "reactor.h"
 
 using namespace std;
 
+const int SYNC_INTERVAL_MS = 10000;
+const int NTP_TIMEOUT_MS = 5000;
+const int RESOLVE_INTERVAL_MS = 3600000;
+const size_t SOCKET_BUDGET = 64;
+const size_t CORRECTION_WINDOW = CorrectionHistory::CAPACITY; // the median is over the latest ones
+
 atomic<bool> running(true);
 int sockfd = -1;
 atomic<uint64_t> Cs(0);
 atomic<int64_t> totalCorrection(0);
 atomic<int> syncCount(0);
+TraceWriter trace;
+LowLatencyOptions lowLatency;
+LatencyHistogram replyLatency;
+Reactor reactor;
+thread resolver; // see startResolving()
 
 void cleanup() {
     running = false;
@@ -27,6 +49,14 @@ void cleanup() {
         close(sockfd);
         cout << "\n[SERVER] Socket closed, server stopped." << endl;
     }
+    if (trace.isOpen()) {
+        trace.close();
+    }
+    if (resolver.joinable()) {
+        resolver.join();
+    }
+    replyLatency.print(cout, lowLatency.enabled ? "[SERVER] Reply latency (low-latency mode)"
+                                                : "[SERVER] Reply latency (default mode)");
 }
 
 uint64_t getCurrentTimeMs() {
@@ -34,49 +64,121 @@ uint64_t getCurrentTimeMs() {
     return chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()).count();
 }
 
-uint64_t getNtpTime(const char *ntpServer = "pool.ntp.org") {
-    cout << "[NTP] Connecting to " << ntpServer << "..." << endl;
+struct Upstream {
+    const char *host;
+    sockaddr_storage addr;
+    socklen_t addrLen;
+};
+
+// One query in flight at a time, answered on the reactor or given up by
+// its timeout task.
+struct UpstreamQuery {
+    int fd = -1;
+    uint64_t timeoutTask = 0;
+};
+
+vector<Upstream> upstreams;
+size_t currentServer = 0;
+size_t failuresInRow = 0;
+UpstreamQuery query;
+vector<int64_t> corrections;
+vector<Upstream> nextUpstreams; // resolved while a query was in flight
+
+// getaddrinfo() blocks, so the names are resolved on a helper thread: at
+// start, hourly, when none resolved and when every upstream has failed in
+// a row. It hands the result over through resolvedFd.
+int resolvedFd = -1;
+mutex resolvedMutex;
+vector<Upstream> resolved;
+bool resolving = false;
+
+void syncWithGlobal();
+
+vector<Upstream> resolveUpstreams() {
+    const vector<const char *> ntpServers = {
+            "pool.ntp.org",
+            "time.google.com",
+            "time.cloudflare.com",
+            "0.pool.ntp.org",
+            "1.pool.ntp.org"
+    };
 
-    struct hostent *he = gethostbyname(ntpServer);
-    if (he == nullptr) {
-        throw runtime_error("Cannot resolve NTP server hostname");
+    vector<Upstream> found;
+    for (const char *host: ntpServers) {
+        Upstream upstream{host, {}, 0};
+        if (resolveAddress(host, 123, upstream.addr, upstream.addrLen)) {
+            found.push_back(upstream);
+        } else {
+            cerr << "[ERROR] " << host << ": Cannot resolve NTP server hostname" << endl;
+        }
     }
+    return found;
+}
 
-    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (fd < 0) {
-        throw runtime_error("NTP socket creation failed");
+void startResolving() {
+    if (resolving) {
+        return;
     }
+    if (resolver.joinable()) {
+        resolver.join();
+    }
+    resolving = true;
+    resolver = thread([]() {
+        vector<Upstream> found = resolveUpstreams();
+        {
+            lock_guard<mutex> lock(resolvedMutex);
+            resolved = move(found);
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(resolvedFd, &one, sizeof(one));
+        (void) ignored;
+    });
+}
 
-    struct timeval timeout;
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(123);
-    memcpy(&addr.sin_addr, he->h_addr, he->h_length);
-
-    uint8_t packet[48]{};
-    packet[0] = 0x1B; // LI=0, VN=3, Mode=3
-
-    if (sendto(fd, packet, sizeof(packet), 0, (sockaddr *) &addr, sizeof(addr)) < 0) {
-        close(fd);
-        throw runtime_error("NTP send failed");
+void useUpstreams(vector<Upstream> found) {
+    bool first = upstreams.empty();
+    upstreams = move(found);
+    currentServer = 0;
+    failuresInRow = 0;
+    cout << "[NTP] " << upstreams.size() << " servers resolved" << endl;
+    if (first) {
+        syncWithGlobal();
     }
+}
 
-    sockaddr_in recvAddr{};
-    socklen_t addrLen = sizeof(recvAddr);
-    ssize_t received = recvfrom(fd, packet, sizeof(packet), 0,
-                                (sockaddr *) &recvAddr, &addrLen);
+// The query in flight is reported against upstreams[currentServer], so a new
+// list waits until it has been answered or given up.
+void useNextUpstreams() {
+    if (!nextUpstreams.empty() && query.fd < 0) {
+        vector<Upstream> found;
+        found.swap(nextUpstreams);
+        useUpstreams(move(found));
+    }
+}
 
-    if (received < 48) {
-        close(fd);
-        throw runtime_error("Invalid NTP response");
+// A failed resolution keeps the upstreams there were. The first usable
+// list is synced with at once rather than at the next interval.
+void adoptUpstreams() {
+    uint64_t count;
+    ssize_t ignored = read(resolvedFd, &count, sizeof(count));
+    (void) ignored;
+    resolving = false;
+
+    vector<Upstream> found;
+    {
+        lock_guard<mutex> lock(resolvedMutex);
+        found.swap(resolved);
+    }
+    if (found.empty()) {
+        cerr << "[ERROR] No NTP server resolved, trying again at the next sync" << endl;
+        return;
     }
 
-    close(fd);
+    nextUpstreams = move(found);
+    useNextUpstreams();
+}
 
+uint64_t ntpReplyTimeMs(const uint8_t *packet) {
     uint32_t secs, fraction;
     memcpy(&secs, &packet[40], 4);
     memcpy(&fraction, &packet[44], 4);
@@ -90,113 +192,225 @@ uint64_t getNtpTime(const char *ntpServer = "pool.ntp.org") {
     return unixTimeSec * 1000ULL + fractionMs;
 }
 
-void syncWithGlobal() {
-    const vector<const char *> ntpServers = {
-            "pool.ntp.org",
-            "time.google.com",
-            "time.cloudflare.com",
-            "0.pool.ntp.org",
-            "1.pool.ntp.org"
-    };
+void finishQuery() {
+    reactor.unwatch(query.fd);
+    reactor.cancel(query.timeoutTask);
+    close(query.fd);
+    query = UpstreamQuery();
+}
 
-    vector<int64_t> corrections;
-    int currentServer = 0;
-    uint64_t lastSystemTime = getCurrentTimeMs();
+void queryFailed(const string &reason) {
+    cerr << "[ERROR] " << upstreams[currentServer].host << ": " << reason << endl;
+    currentServer = (currentServer + 1) % upstreams.size();
+    if (++failuresInRow >= upstreams.size()) {
+        failuresInRow = 0;
+        startResolving();
+    }
 
-    while (running) {
-        try {
-            uint64_t ntpTime = getNtpTime(ntpServers[currentServer]);
-            uint64_t systemTime = getCurrentTimeMs();
+    Cs = getCurrentTimeMs();
+    useNextUpstreams();
+}
 
-            int64_t correction = ntpTime - systemTime;
-            corrections.push_back(correction);
+void applyNtpTime(uint64_t ntpTime) {
+    uint64_t systemTime = getCurrentTimeMs();
 
-            if (corrections.size() >= 3) {
-                vector<int64_t> sorted = corrections;
-                sort(sorted.begin(), sorted.end());
-                int64_t medianCorrection = sorted[sorted.size() / 2];
+    int64_t correction = ntpTime - systemTime;
+    corrections.push_back(correction);
+    if (corrections.size() > CORRECTION_WINDOW) {
+        corrections.erase(corrections.begin());
+    }
 
-                Cs = systemTime + medianCorrection;
-                totalCorrection += medianCorrection;
-            } else {
-                Cs = ntpTime;
-            }
+    if (corrections.size() >= 3) {
+        int64_t medianCorrection = correctionMedian(corrections);
 
-            syncCount++;
-            cout << "[SYNC #" << syncCount << "] Cs = " << Cs
-                 << " | Correction: " << correction << " ms"
-                 << " | Server: " << ntpServers[currentServer] << endl;
+        Cs = systemTime + medianCorrection;
+        totalCorrection += medianCorrection;
+    } else {
+        Cs = ntpTime;
+    }
 
-            currentServer = 0;
+    syncCount++;
+    cout << "[SYNC #" << syncCount << "] Cs = " << Cs
+         << " | Correction: " << correction << " ms"
+         << " | Server: " << upstreams[currentServer].host << endl;
 
-        } catch (const exception &e) {
-            cerr << "[ERROR] " << ntpServers[currentServer] << ": " << e.what() << endl;
-            currentServer = (currentServer + 1) % ntpServers.size();
+    currentServer = 0;
+    failuresInRow = 0;
+    useNextUpstreams();
+}
 
-            Cs = getCurrentTimeMs();
-        }
+void receiveNtpReply() {
+    uint8_t packet[48]{};
+    ssize_t received = recv(query.fd, packet, sizeof(packet), MSG_DONTWAIT);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    finishQuery();
+    if (received < 48) {
+        queryFailed("Invalid NTP response");
+        return;
+    }
+    applyNtpTime(ntpReplyTimeMs(packet));
+}
 
-        for (int i = 0; i < 100 && running; i++) {
-            this_thread::sleep_for(chrono::milliseconds(100));
-        }
+// Sends the request and returns; the reply comes through the reactor. The
+// socket is connected, so only the upstream's datagrams reach it.
+void syncWithGlobal() {
+    if (query.fd >= 0) {
+        return;
+    }
+    if (upstreams.empty()) {
+        Cs = getCurrentTimeMs();
+        startResolving();
+        return;
+    }
+
+    const Upstream &upstream = upstreams[currentServer];
+    cout << "[NTP] Connecting to " << upstream.host << "..." << endl;
+
+    query.fd = socket(upstream.addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (query.fd < 0) {
+        queryFailed("NTP socket creation failed");
+        return;
+    }
+
+    uint8_t packet[48]{};
+    packet[0] = 0x1B; // LI=0, VN=3, Mode=3
+
+    if (connect(query.fd, (const sockaddr *) &upstream.addr, upstream.addrLen) < 0 ||
+        send(query.fd, packet, sizeof(packet), 0) < 0) {
+        close(query.fd);
+        query.fd = -1;
+        queryFailed("NTP send failed");
+        return;
     }
+
+    reactor.watch(query.fd, EPOLLIN, [](uint32_t) { receiveNtpReply(); });
+    query.timeoutTask = reactor.schedule(NTP_TIMEOUT_MS * 1000000LL, 0, []() {
+        finishQuery();
+        queryFailed("Invalid NTP response");
+    });
 }
 
-void signalHandler(int sig) {
-    cleanup();
-    exit(0);
+void handleRequest(const char *buffer, ssize_t n, const sockaddr_storage &clientAddr, socklen_t clientLen,
+                   int64_t rxNs) {
+    if (strncmp(buffer, "GET", 3) != 0) {
+        return;
+    }
+
+    uint64_t currentTime = Cs.load();
+    NtpSyncReply reply{};
+    reply.serverTime = htobe64(currentTime);
+
+    if (n == static_cast<ssize_t>(sizeof(NtpSyncRequest))) {
+        memcpy(&reply.sequence, buffer + offsetof(NtpSyncRequest, sequence), sizeof(reply.sequence));
+        sendto(sockfd, &reply, sizeof(reply), 0, (sockaddr *) &clientAddr, clientLen);
+    } else {
+        sendto(sockfd, &reply.serverTime, sizeof(reply.serverTime), 0,
+               (sockaddr *) &clientAddr, clientLen);
+    }
+
+    int64_t txNs = realtimeNs();
+    replyLatency.record(txNs - rxNs);
+
+    if (trace.isOpen()) {
+        TraceRecord rec{};
+        rec.rxNs = rxNs;
+        rec.txNs = txNs;
+        rec.replyValue = static_cast<int64_t>(currentTime);
+        traceAddress(clientAddr, rec);
+        rec.rawCorrection = static_cast<int32_t>(currentTime - rxNs / 1000000);
+        rec.correction = rec.rawCorrection;
+        rec.source = TRACE_SERVER;
+        rec.protocol = TRACE_NTP;
+        trace.record(rec);
+    }
+
+    cout << "[CLIENT] " << formatAddress(clientAddr) << " -> " << currentTime << " ms" << endl;
 }
 
-int main() {
-    signal(SIGINT, signalHandler);
-    signal(SIGTERM, signalHandler);
+// Up to SOCKET_BUDGET requests, then the upstream and the timers get a turn.
+void drainRequests() {
+    sockaddr_storage clientAddr{};
+    socklen_t clientLen;
+    char buffer[64];
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        cerr << "[ERROR] Socket creation failed" << endl;
-        return -1;
+    for (size_t i = 0; i < SOCKET_BUDGET; i++) {
+        int64_t rxNs = 0;
+        clientLen = sizeof(clientAddr);
+        ssize_t n = recvWithTimestamp(sockfd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT,
+                                      (sockaddr *) &clientAddr, &clientLen, rxNs);
+        if (n < 0) break;
+        if (n == 0) continue;
+
+        buffer[n] = '\0';
+        handleRequest(buffer, n, clientAddr, clientLen, rxNs);
     }
+}
 
-    sockaddr_in serverAddr{};
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(8080);
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
+int main(int argc, char *argv[]) {
+    string tracePath;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (!parseLowLatencyOption(i, argc, argv, lowLatency)) {
+            cerr << "Usage: " << argv[0] << " [--trace <file>] " << lowLatencyUsage() << endl;
+            return -1;
+        }
+    }
 
-    if (bind(sockfd, (sockaddr *) &serverAddr, sizeof(serverAddr)) < 0) {
-        cerr << "[ERROR] Bind failed" << endl;
-        close(sockfd);
+    // Signals come through the reactor, so shutdown runs cleanup() from the
+    // loop instead of from a handler.
+    if (!reactor.open() || !reactor.handleSignals({SIGINT, SIGTERM}, [](int) { running = false; })) {
+        cerr << "[ERROR] Cannot create the event loop: " << strerror(errno) << endl;
         return -1;
     }
 
-    cout << "[SERVER] Time sync server started on port 8080" << endl;
-    cout << "[SERVER] Synchronizing with global NTP servers every 10 seconds" << endl;
+    sockfd = openServerSocket(8080);
+    if (sockfd < 0) {
+        cerr << "[ERROR] Socket creation or bind failed" << endl;
+        return -1;
+    }
 
-    thread syncThread(syncWithGlobal);
-    syncThread.detach();
+    enableKernelTimestamps(sockfd);
 
-    sockaddr_in clientAddr{};
-    socklen_t clientLen = sizeof(clientAddr);
-    char buffer[64];
+    if (!tracePath.empty()) {
+        if (!trace.open(tracePath)) {
+            cerr << "[ERROR] Cannot open trace file " << tracePath << endl;
+            close(sockfd);
+            return -1;
+        }
+        cout << "[SERVER] Recording exchanges to " << tracePath << endl;
+    }
 
-    while (running) {
-        ssize_t n = recvfrom(sockfd, buffer, sizeof(buffer) - 1, 0,
-                             (sockaddr *) &clientAddr, &clientLen);
-        if (n <= 0) continue;
+    cout << "[SERVER] Time sync server started on port 8080" << endl;
+    cout << "[SERVER] Synchronizing with global NTP servers every 10 seconds" << endl;
 
-        buffer[n] = '\0';
+    applyLowLatency(sockfd, lowLatency);
+    if (lowLatency.enabled) {
+        reactor.setSpin(lowLatency.spinUs);
+    }
 
-        if (strncmp(buffer, "GET", 3) == 0) {
-            uint64_t currentTime = Cs.load();
-            uint64_t networkTime = htobe64(currentTime);
+    resolvedFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (resolvedFd < 0) {
+        cerr << "[ERROR] Cannot create the resolver event: " << strerror(errno) << endl;
+        close(sockfd);
+        return -1;
+    }
 
-            sendto(sockfd, &networkTime, sizeof(networkTime), 0,
-                   (sockaddr *) &clientAddr, clientLen);
+    reactor.watch(sockfd, EPOLLIN, [](uint32_t) { drainRequests(); });
+    reactor.watch(resolvedFd, EPOLLIN, [](uint32_t) { adoptUpstreams(); });
+    reactor.schedule(0, SYNC_INTERVAL_MS * 1000000LL, syncWithGlobal);
+    reactor.schedule(RESOLVE_INTERVAL_MS * 1000000LL, RESOLVE_INTERVAL_MS * 1000000LL, startResolving);
 
-            cout << "[CLIENT] " << inet_ntoa(clientAddr.sin_addr) << ":"
-                 << ntohs(clientAddr.sin_port) << " -> " << currentTime << " ms" << endl;
+    while (running) {
+        if (reactor.runOnce(-1) < 0) {
+            cerr << "[ERROR] epoll_wait: " << strerror(errno) << endl;
+            break;
         }
     }
 
     cleanup();
     return 0;
-}
\ No newline at end of file
+}
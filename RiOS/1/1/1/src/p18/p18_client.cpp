@@ -4,126 +4,351 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <cstring>
-#include <chrono>
-#include <thread>
+#include <cerrno>
+#include <ctime>
 #include <csignal>
-#include "get_sync.h"
-#include "set_sync.h"
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include "sync_trace.h"
+#include "net_address.h"
+#include "clock_filter.h"
+#include "disciplined_clock.h"
+#include "correction_filter.h"
+#include "sync_time.h"
+#include "sync_auth.h"
+#include "poll_loop.h"
 
 using namespace std;
 
+struct GetSync2 {
+    char cmd[4];
+    int currentValue;
+    uint32_t sequence;
+};
+
+struct SetSync2 {
+    char cmd[4];
+    int correction;
+    int serverTime;
+    uint32_t sequence;
+};
+
 int sockfd = -1;
-sockaddr_in serverAddr{};
-chrono::steady_clock::time_point startTime;
+sockaddr_storage serverAddr{};
+socklen_t serverAddrLen = 0;
+int64_t startNs = 0;
 int currentTime = 0;
-int requestCount = 0;
-bool running = true;
-
-int getElapsedTime() {
-    auto now = chrono::steady_clock::now();
-    return chrono::duration_cast<chrono::milliseconds>(now - startTime).count();
+volatile sig_atomic_t running = 1;
+TraceWriter trace;
+
+const int MAX_BURST = 8;
+PollLoop::Params pollParams;
+PollLoop pollLoop;
+ClockFilter clockFilter;
+DisciplineParams disciplineParams;
+DisciplinedClock disciplinedClock;
+
+// --timestamps: GETT instead of GET, and the filter ptp_server runs per
+// client runs here, on the offset against the disciplined clock in us.
+bool useTimestamps = false;
+const FilterParams filterParams;
+CorrectionHistory offsetHistory;
+int filteredCount = 0;
+int lastFilteredUs = 0;
+bool reportedServerClock = false;
+
+uint64_t forgedReplies = 0;
+
+// --key: requests are tagged with this pre-shared key and replies without a
+// good tag under it are dropped unread.
+bool useAuth = false;
+SipKey authKey;
+uint32_t authKeyId = 0;
+uint32_t authCounter = initialSyncAuthCounter();
+
+int64_t monotonicNs() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
 }
 
-bool sendSyncRequest() {
-    GetSync request{};
-    strncpy(request.cmd, "GET", 3);
-    request.currentValue = currentTime;
+// Local timebase: time since the client started.
+int64_t getElapsedNs() {
+    return monotonicNs() - startNs;
+}
 
-    ssize_t sent = sendto(sockfd, &request, sizeof(request), 0,
-                          (struct sockaddr *) &serverAddr, sizeof(serverAddr));
-    return sent == sizeof(request);
+// The client's time in ms: the local timebase disciplined towards the server.
+int readClockMs(int64_t elapsedNs) {
+    return static_cast<int>(disciplinedClock.read(elapsedNs) / 1000000);
 }
 
-bool receiveCorrection() {
-    SetSync response{};
-    ssize_t received = recv(sockfd, &response, sizeof(response), 0);
+// Sends a request, with the trailer under --key.
+bool sendRequest(const void *request, size_t length) {
+    char packet[sizeof(SyncTimeRequest) + SYNC_AUTH_BYTES];
+    memcpy(packet, request, length);
+    if (useAuth) {
+        length = signPacket(authKey, authKeyId, ++authCounter, packet, length);
+    }
+    return sendto(sockfd, packet, length, 0, (struct sockaddr *) &serverAddr, serverAddrLen) ==
+           static_cast<ssize_t>(length);
+}
 
-    if (received != sizeof(response) || strncmp(response.cmd, "SYNC", 4) != 0) {
+// The request carries the disciplined time at its own send; value keeps it
+// and stampNs the send on the trace's clock.
+bool sendSyncRequest(PollRequest &pollRequest) {
+    int64_t elapsedNs = pollRequest.sentNs - startNs;
+    currentTime = readClockMs(elapsedNs);
+
+    uint32_t sequence = pollRequest.sequence;
+    bool sent;
+    if (useTimestamps) {
+        SyncTimeRequest request{};
+        memcpy(request.cmd, "GETT", 4);
+        request.sequence = sequence;
+        request.originNs = disciplinedClock.read(elapsedNs);
+        sent = sendRequest(&request, sizeof(request));
+    } else {
+        GetSync2 request{};
+        strncpy(request.cmd, "GET", 3);
+        request.currentValue = currentTime;
+        request.sequence = sequence;
+        sent = sendRequest(&request, sizeof(request));
+    }
+    if (!sent) {
+        cerr << "Failed to send sync request #" << pollLoop.polls() << endl;
         return false;
     }
 
-    int correction = response.correction;
+    pollRequest.value = currentTime;
+    pollRequest.stampNs = realtimeNs();
+    return true;
+}
 
-    cout << "Request #" << requestCount;
-    cout << " - Applied correction: " << correction;
+void recordSample(const PollRequest &request, int64_t replyValue, int rawCorrection, int correction,
+                  int64_t rxNs) {
+    TraceRecord rec{};
+    rec.rxNs = rxNs;
+    rec.txNs = request.stampNs;
+    rec.replyValue = replyValue;
+    traceAddress(serverAddr, rec);
+    rec.requestValue = static_cast<int32_t>(request.value);
+    rec.rawCorrection = rawCorrection;
+    rec.correction = correction;
+    rec.source = TRACE_CLIENT;
+    rec.protocol = TRACE_SYNC2;
+    trace.record(rec);
+}
 
-    currentTime += correction;
+void resetOffsetFilter() {
+    offsetHistory.clear();
+    filteredCount = 0;
+    lastFilteredUs = 0;
+}
 
-    cout << " - New time: " << currentTime << endl;
+void finishPoll(int pollReplies) {
+    ClockSample best;
+    if (pollReplies == 0 || !clockFilter.select(monotonicNs(), best)) {
+        cerr << "Failed to receive correction for request #" << pollLoop.polls() << endl;
+        return;
+    }
 
-    return true;
+    // Samples hold the server's offset against the local timebase; the clock
+    // is steered by its offset against the disciplined time.
+    int64_t elapsedNs = getElapsedNs();
+    double offsetMs = best.offsetMs - (disciplinedClock.read(elapsedNs) - elapsedNs) / 1e6;
+    bool synchronized = disciplinedClock.synchronized();
+    uint64_t steps = disciplinedClock.steps();
+    disciplinedClock.update(llround(offsetMs * 1e6), elapsedNs);
+    if (!synchronized || disciplinedClock.steps() != steps) {
+        resetOffsetFilter(); // its history is against the clock before the jump
+    }
+
+    cout << "Request #" << pollLoop.polls();
+    if (pollParams.burst > 1) {
+        cout << " - Burst " << pollReplies << "/" << pollParams.burst << ", min delay " << best.delayMs << " ms";
+    }
+    cout << " - Offset: " << offsetMs << " ms";
+    if (!synchronized) {
+        cout << " (set)";
+    } else {
+        cout << (disciplinedClock.steps() != steps ? " (stepped)" : " (slewing)");
+    }
+    cout << " - Frequency: " << disciplinedClock.frequencyPpm() << " ppm";
+
+    currentTime = readClockMs(getElapsedNs());
+
+    cout << " - Time: " << currentTime << endl;
+}
+
+// Offset and delay from the four timestamps as NTP computes them, against
+// the local timebase; the reply's arrival is the kernel receive time. The
+// offset is filtered against the disciplined clock, where it stays near
+// zero, as ptp_server filters its corrections.
+ClockSample timestampSample(const PollRequest &request, const SyncTimeReply &reply, int64_t nowNs,
+                            int64_t rxNs, int &rawMs, int &filteredMs) {
+    int64_t sentNs = request.sentNs - startNs;
+    int64_t arrivedNs = nowNs - startNs - max<int64_t>(0, realtimeNs() - rxNs);
+    double offsetNs = ((reply.receiveNs - sentNs) + (reply.transmitNs - arrivedNs)) / 2.0;
+    double delayNs = (arrivedNs - sentNs) - (reply.transmitNs - reply.receiveNs);
+
+    // Offsets too large for the filter's int (the first one, a step) start
+    // it over.
+    int64_t disciplineNs = disciplinedClock.read(arrivedNs) - arrivedNs;
+    int64_t rawUs = llround((offsetNs - disciplineNs) / 1e3);
+    int64_t filteredUs = rawUs;
+    if (llabs(rawUs) < INT32_MAX / 2) {
+        filteredUs = advancedCorrection(static_cast<int>(rawUs), filteredCount, lastFilteredUs, offsetHistory,
+                                        filterParams);
+        filteredCount++;
+        lastFilteredUs = static_cast<int>(filteredUs);
+    } else {
+        resetOffsetFilter();
+    }
+    rawMs = static_cast<int>(rawUs / 1000);
+    filteredMs = static_cast<int>(filteredUs / 1000);
+
+    ClockSample sample;
+    sample.offsetMs = (filteredUs * 1e3 + disciplineNs) / 1e6;
+    sample.delayMs = max(0.0, delayNs) / 1e6;
+    sample.timeNs = nowNs;
+    return sample;
+}
+
+void reportServerClock(const SyncTimeReply &reply) {
+    reportedServerClock = true;
+    cout << "Server clock: " << (reply.clockSource == SYNC_TIME_SOURCE_TSC ? "TSC" : "clock_gettime()")
+         << ", last calibration error " << reply.clockErrorNs << " ns"
+         << ((reply.flags & SYNC_TIME_STATELESS) ? ", stateless server" : "") << endl;
+}
+
+void receiveReplies() {
+    while (true) {
+        char buffer[sizeof(SyncTimeReply) + SYNC_AUTH_BYTES];
+        int64_t rxNs = 0;
+        ssize_t received = recvWithTimestamp(sockfd, buffer, sizeof(buffer), MSG_DONTWAIT, nullptr, nullptr, rxNs);
+        if (received < 0) {
+            break;
+        }
+        if (useAuth) {
+            received = static_cast<ssize_t>(verifyPacket(authKey, authKeyId, buffer, received));
+            if (received == 0) {
+                forgedReplies++;
+                continue;
+            }
+        }
+        int64_t nowNs = monotonicNs();
+
+        SetSync2 response{};
+        SyncTimeReply timeReply{};
+        uint32_t sequence;
+        bool timestamps = received == sizeof(timeReply) && memcmp(buffer, "TIME", 4) == 0;
+        if (timestamps) {
+            memcpy(&timeReply, buffer, sizeof(timeReply));
+            sequence = timeReply.sequence;
+        } else if (received == sizeof(response) && strncmp(buffer, "SYNC", 4) == 0) {
+            memcpy(&response, buffer, sizeof(response));
+            sequence = response.sequence;
+        } else {
+            continue;
+        }
+
+        PollRequest request;
+        if (!pollLoop.take(sequence, request)) {
+            continue; // answer to a request that already timed out
+        }
+
+        ClockSample sample;
+        int rawMs = response.correction;
+        int filteredMs = response.correction;
+        if (timestamps) {
+            sample = timestampSample(request, timeReply, nowNs, rxNs, rawMs, filteredMs);
+            if (!reportedServerClock) {
+                reportServerClock(timeReply);
+            }
+        } else {
+            // requestValue + correction is the server's time in whole ms when
+            // the request arrived, half a round trip after the send; take the
+            // middle of that tick.
+            double sentMs = (request.sentNs - startNs) / 1e6;
+            sample.delayMs = (nowNs - request.sentNs) / 1e6;
+            sample.offsetMs = request.value + response.correction + 0.5 - (sentMs + sample.delayMs / 2);
+            sample.timeNs = nowNs;
+        }
+        clockFilter.add(sample);
+
+        if (trace.isOpen()) {
+            recordSample(request, timestamps ? timeReply.transmitNs : response.correction, rawMs, filteredMs, rxNs);
+        }
+    }
 }
 
 void sendDisconnect() {
-    GetSync request{};
+    GetSync2 request{};
     strncpy(request.cmd, "DISC", 4);
-    request.currentValue = currentTime;
-    sendto(sockfd, &request, sizeof(request), 0,
-           (struct sockaddr *) &serverAddr, sizeof(serverAddr));
+    request.currentValue = readClockMs(getElapsedNs());
+    sendRequest(&request, sizeof(request));
 }
 
 bool initialize(const char *serverIP) {
-    startTime = chrono::steady_clock::now();
+    startNs = monotonicNs();
+
+    if (!resolveAddress(serverIP, 8080, serverAddr, serverAddrLen)) {
+        cerr << "Invalid server address: " << serverIP << endl;
+        return false;
+    }
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockfd = socket(serverAddr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
     if (sockfd < 0) {
         cerr << "Socket creation failed" << endl;
         return false;
     }
 
-    struct timeval timeout{2, 0}; // 2 seconds
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(8080);
-    inet_pton(AF_INET, serverIP, &serverAddr.sin_addr);
+    if (!pollLoop.open(sockfd, pollParams, sendSyncRequest, receiveReplies, finishPoll)) {
+        cerr << "Event loop setup failed" << endl;
+        return false;
+    }
 
     cout << "Time sync client initialized" << endl;
     return true;
 }
 
-void run(int syncPeriodMs) {
-    while (running) {
-        int baseTime = getElapsedTime();
-        if (requestCount == 0) {
-            currentTime = baseTime;
-        }
-
-        requestCount++;
-
-        if (sendSyncRequest()) {
-            if (!receiveCorrection()) {
-                cerr << "Failed to receive correction for request #" << requestCount << endl;
-            }
-        } else {
-            cerr << "Failed to send sync request #" << requestCount << endl;
-        }
-
-        this_thread::sleep_for(chrono::milliseconds(syncPeriodMs));
-        currentTime += syncPeriodMs;
+void run() {
+    if (!pollLoop.run(running)) {
+        cerr << "epoll_wait failed: " << strerror(errno) << endl;
     }
 
+    cout << "\nShutting down..." << endl;
     sendDisconnect();
-    cout << "Client disconnected after " << requestCount << " requests" << endl;
+    cout << "Client disconnected after " << pollLoop.polls() << " requests" << endl;
+    cout << "Replies: " << pollLoop.replies() << ", timeouts: " << pollLoop.timeouts() << ", retries: "
+         << pollLoop.retries() << ", stale replies dropped: " << pollLoop.staleReplies();
+    if (useAuth) {
+        cout << ", unauthenticated replies dropped: " << forgedReplies;
+    }
+    cout << endl;
 }
 
-void stop() { running = false; }
+void stop() { running = 0; }
 
 void signalHandler(int sig) {
-    cout << "\nShutting down..." << endl;
     stop();
 }
 
 void cleanup() {
+    pollLoop.close();
     if (sockfd >= 0) {
         close(sockfd);
     }
+    if (trace.isOpen()) {
+        trace.close();
+    }
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        cout << "Usage: " << argv[0] << " <server_IP> <sync_period_ms>" << endl;
+    if (argc < 3) {
+        cout << "Usage: " << argv[0] << " <server_IP> <sync_period_ms> [--trace <file>] [--burst K]"
+             << " [--timeout ms] [--retries N] [--step ms] [--timestamps] [--key <id>:<32 hex digits>]" << endl;
         return -1;
     }
 
@@ -135,15 +360,68 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    // A third of the period, so the default retry still fits before the next poll.
+    int timeoutMs = max(1, min(2000, syncPeriod / 3));
+
+    string tracePath;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--burst" && i + 1 < argc) {
+            pollParams.burst = atoi(argv[++i]);
+            if (pollParams.burst < 1 || pollParams.burst > MAX_BURST) {
+                cerr << "Burst size must be between 1 and " << MAX_BURST << endl;
+                return -1;
+            }
+        } else if (arg == "--timeout" && i + 1 < argc) {
+            timeoutMs = atoi(argv[++i]);
+            if (timeoutMs <= 0) {
+                cerr << "Timeout must be positive" << endl;
+                return -1;
+            }
+        } else if (arg == "--retries" && i + 1 < argc) {
+            pollParams.retries = max(0, atoi(argv[++i]));
+        } else if (arg == "--step" && i + 1 < argc) {
+            disciplineParams.stepThresholdMs = atof(argv[++i]);
+        } else if (arg == "--timestamps") {
+            useTimestamps = true;
+        } else if (arg == "--key" && i + 1 < argc) {
+            if (!parseSyncKey(argv[++i], authKeyId, authKey)) {
+                cerr << "Key must be <id>:<32 hex digits>" << endl;
+                return -1;
+            }
+            useAuth = true;
+        } else {
+            cerr << "Unknown option: " << arg << endl;
+            return -1;
+        }
+    }
+    pollParams.periodNs = syncPeriod * 1000000LL;
+    pollParams.timeoutNs = timeoutMs * 1000000LL;
+    disciplinedClock = DisciplinedClock(disciplineParams);
+
     signal(SIGINT, signalHandler);
     signal(SIGTERM, signalHandler);
 
     if (!initialize(serverIP)) {
+        cleanup();
         return -1;
     }
 
+    if (!tracePath.empty()) {
+        if (!trace.open(tracePath)) {
+            cerr << "Cannot open trace file " << tracePath << endl;
+            cleanup();
+            return -1;
+        }
+    }
+    if (!tracePath.empty() || useTimestamps) {
+        enableKernelTimestamps(sockfd);
+    }
+
     cout << "Starting sync with period " << syncPeriod << "ms. Press Ctrl+C to stop." << endl;
-    run(syncPeriod);
+    run();
 
     cleanup();
     return 0;
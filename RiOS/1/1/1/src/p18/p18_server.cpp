@@ -5,277 +5,1458 @@
 #include <unistd.h>
 #include <cstring>
 #include <chrono>
-#include <map>
 #include <string>
-#include <sstream>
 #include <vector>
+#include <cstddef>
+#include <cstdlib>
+#include <csignal>
+#include <atomic>
 #include <algorithm>
-#include <cmath>
-#include <climits>
+#include <iomanip>
+#include <memory>
+#include <thread>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include "correction_filter.h"
+#include "sync_trace.h"
+#include "stage_trace.h"
+#include "low_latency.h"
+#include "net_address.h"
+#include "offset_store.h"
+#include "handoff.h"
+#include "client_table.h"
+#include "concurrent_client_table.h"
+#include "worker_stats.h"
+#include "xdp_backend.h"
+#include "sync_batch.h"
+#include "sync_time.h"
+#include "timebase.h"
+#include "reactor.h"
+#include "sync_auth.h"
 
 using namespace std;
 
 struct GetSync2 {
     char cmd[4];
     int currentValue;
+    uint32_t sequence;
 };
 
 struct SetSync2 {
     char cmd[4];
     int correction;
     int serverTime;
+    uint32_t sequence;
 };
 
-enum ConnectionState2 {
-    DISCONNECTED,
-    CONNECTED
+// Requests without a sequence number get the reply without one.
+const size_t GET_SYNC2_LEGACY_SIZE = offsetof(GetSync2, sequence);
+const size_t SET_SYNC2_LEGACY_SIZE = offsetof(SetSync2, sequence);
+
+const int HISTORY_WINDOW = 5;
+const double OUTLIER_THRESHOLD = 2.5;
+const FilterParams filterParams{HISTORY_WINDOW, OUTLIER_THRESHOLD, 0.3};
+const int CLIENT_IDLE_TIMEOUT_MS = 300000;
+const int WORKER_WAKE_MS = 100;   // idle workers still reach a checkpoint this often
+const int CLEANUP_SLICE_MS = 100;
+const size_t CLEANUP_SLICE_ROWS = 4096; // rows (buckets of the shared table) per slice of the idle sweep
+const size_t SOCKET_BUDGET = 64;        // datagrams per turn before the other events get theirs
+const size_t XDP_BUDGET = 4;            // XDP batches per turn
+const int SNAPSHOT_TIMEOUT_MS = 500;
+const int MAX_WORKERS = 64;
+const size_t XDP_BATCH = 64;
+const int XDP_SETTLE_MS = 10;
+
+// Probed stages of the request path, see --stages.
+enum Stage { STAGE_QUEUE, STAGE_KEY, STAGE_LOOKUP, STAGE_FILTER, STAGE_SEND, STAGE_RECORD, STAGE_COUNT };
+const char *const STAGE_NAMES[STAGE_COUNT] = {"queue", "key", "lookup", "filter", "send", "record"};
+
+// What is recorded about a reply once it has gone out.
+struct Exchange {
+    ClientKey key;
+    int64_t rxNs;
+    int requestValue;
+    int rawCorrection;
+    int correction;
+    int serverTime;
 };
 
-class ClientStats2 {
-public:
-    ConnectionState2 state;
-    int requestCount;
-    int totalCorrection;
-    double averageCorrection;
-    int minCorrection;
-    int maxCorrection;
-    int lastCorrection;
-
-    ClientStats2() : state(DISCONNECTED), requestCount(0), totalCorrection(0),
-                     averageCorrection(0), minCorrection(INT_MAX),
-                     maxCorrection(INT_MIN), lastCorrection(0) {}
+// One packet thread with its own SO_REUSEPORT socket. The kernel hashes a
+// client to the same socket every time, so each client lives in exactly one
+// worker's table and the packet path shares nothing with other workers.
+// With --shared-socket all workers read one socket and use sharedClients.
+struct Worker {
+    size_t index = 0;
+    int sockfd = -1;
+    ClientTable clients;
+    size_t tableThread = 0; // slot in sharedClients
+    WorkerStats stats;
+    LatencyHistogram replyLatency;
+    TraceWriter trace;
+    OffsetStore store;
+    LowLatencyOptions lowLatency;
+    XdpSocket xdp;
+    StageRecorder stages;
+    vector<Exchange> exchanges; // replies of the datagram or XDP batch being answered
+    Reactor reactor;
+    size_t cleanupCursor = 0;   // where the idle sweep goes on
+    const SipKey *replyKey = nullptr; // --keys: the key of the request being answered
+    uint32_t replyKeyId = 0;
+    uint32_t replyCounter = 0;
+    thread packetThread;
 };
 
-int sockfd = -1;
+atomic<bool> running(true);
+atomic<bool> paused(false); // workers stop while the state is handed over
 chrono::steady_clock::time_point serverStartTime;
-map<string, ClientStats2> clients;
-map<string, vector<int>> clientHistory;
+vector<unique_ptr<Worker>> workers;
+unique_ptr<StatsEpochs> epochs;
 
-const int HISTORY_WINDOW = 5;
-const double OUTLIER_THRESHOLD = 2.5;
+LowLatencyOptions lowLatency;
+int reportIntervalS = 10;
+string stagesPath;
+ArenaOptions clientMemory; // for all workers, --client-memory is split between them
+
+XdpOptions xdpOptions;
+XdpProgram xdpProgram; // shared by the workers, one queue each
 
-string getClientKey(const sockaddr_in &addr) {
-    stringstream ss;
-    ss << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port);
-    return ss.str();
+// --stateless: no client table at all. GET and GETB are answered with the
+// raw correction, DISC is only counted; clients that want better filter
+// GETT timestamps themselves.
+bool stateless = false;
+
+// --shared-socket: a client's packets may reach any worker, so its state
+// lives in one table for all of them.
+bool sharedSocket = false;
+unique_ptr<ConcurrentClientTable> sharedClients;
+size_t mainTableThread = 0; // the reporter's slot, also used for the handoff
+
+string handoffPath;
+int handoffListener = -1;
+int successorConn = -1; // accepted, not yet handed over
+int handoffConn = -1;   // handed over; closing it on exit lets the successor start
+
+// --keys: every request must carry a good tag under one of these keys and
+// is dropped before anything else looks at it otherwise. It then touches its
+// client's row only under the key the row is bound to and with a fresh
+// counter; a batch's entries share the datagram's. Replies are tagged with
+// the request's key.
+SyncKeyRing authKeys;
+
+// The main thread's: signals, reports and the handoff listener. Workers
+// wake it when they fail.
+Reactor mainReactor;
+
+// steady_clock is CLOCK_MONOTONIC, which the timebase reads from the TSC.
+int64_t getServerUptimeNs() {
+    int64_t startNs = chrono::duration_cast<chrono::nanoseconds>(serverStartTime.time_since_epoch()).count();
+    return timebase().monotonicNs() - startNs;
 }
 
 int getServerUptime() {
-    auto now = chrono::steady_clock::now();
-    return chrono::duration_cast<chrono::milliseconds>(now - serverStartTime).count();
+    return static_cast<int>(getServerUptimeNs() / 1000000);
+}
+
+int calculateAdvancedCorrection(ClientTable &clients, int rawCorrection, uint32_t row) {
+    return advancedCorrection(rawCorrection, clients.requestCount[row], clients.lastCorrection[row],
+                              *clients.history[row], filterParams);
+}
+
+// With --keys, whether the request being answered may change the client.
+// Without a client table (--stateless) there is nothing to bind.
+bool admitRequest(Worker &worker, SyncAuthBinding &binding) {
+    if (worker.replyKey == nullptr || binding.admit(worker.replyKeyId, worker.replyCounter)) {
+        return true;
+    }
+    worker.stats.rejected++;
+    return false;
 }
 
-int calculateAdvancedCorrection(int clientTime, const string &clientKey) {
+// prepareReply() without a client table: the raw correction, unfiltered.
+bool prepareStatelessReply(Worker &worker, const ClientKey &clientKey, const GetSync2 &request, int64_t rxNs,
+                           SetSync2 &response, Exchange &exchange) {
     int serverTime = getServerUptime();
-    int rawCorrection = serverTime - clientTime;
+    int correction = serverTime - request.currentValue;
 
-    ClientStats2 &stats = clients[clientKey];
+    strncpy(response.cmd, "SYNC", 4);
+    response.correction = correction;
+    response.serverTime = serverTime;
+    response.sequence = request.sequence;
+
+    worker.stats.recordCorrection(clientKey, correction);
+    exchange = Exchange{clientKey, rxNs, request.currentValue, correction, correction, serverTime};
+    return true;
+}
 
-    if (stats.requestCount < 2) {
-        return rawCorrection;
+// prepareReply() on the shared table: the same steps with the client's
+// entry locked, so two workers answering one client take turns.
+bool prepareSharedReply(Worker &worker, const ClientKey &clientKey, const GetSync2 &request, int64_t rxNs,
+                        SetSync2 &response, Exchange &exchange) {
+    ConcurrentClientTable::Guard guard(*sharedClients, worker.tableThread);
+    uint64_t probe = StageRecorder::begin();
+    bool inserted;
+    ConcurrentClientTable::Entry *entry = sharedClients->findOrInsert(worker.tableThread, clientKey, inserted);
+    entry->lock();
+    worker.stages.end(STAGE_LOOKUP, probe);
+    ClientRecord &record = entry->record;
+
+    if (!admitRequest(worker, record.auth)) {
+        entry->unlock();
+        return false;
     }
 
-    auto &history = clientHistory[clientKey];
-    history.push_back(rawCorrection);
+    if (record.requestCount == 0) {
+        record.state = CLIENT_CONNECTED;
+        worker.stats.newClients++;
+    }
+
+    if (record.state != CLIENT_CONNECTED) {
+        entry->unlock();
+        worker.stats.ignored++;
+        return false;
+    }
+
+    probe = StageRecorder::begin();
+    int rawCorrection = getServerUptime() - request.currentValue;
+    int correction = advancedCorrection(rawCorrection, record.requestCount, record.lastCorrection, entry->history,
+                                        filterParams);
+    worker.stages.end(STAGE_FILTER, probe);
+
+    strncpy(response.cmd, "SYNC", 4);
+    response.correction = correction;
+    response.serverTime = getServerUptime();
+    response.sequence = request.sequence;
+
+    record.lastSeenMs = response.serverTime;
+    record.requestCount++;
+    record.lastCorrection = correction;
+    record.totalCorrection += correction;
+    record.minCorrection = min(record.minCorrection, correction);
+    record.maxCorrection = max(record.maxCorrection, correction);
+    entry->unlock();
+
+    worker.stats.recordCorrection(clientKey, correction);
+    exchange = Exchange{clientKey, rxNs, request.currentValue, rawCorrection, correction, response.serverTime};
+    return true;
+}
 
-    if (history.size() > HISTORY_WINDOW) {
-        history.erase(history.begin());
+// Runs the filter, updates the client's row and fills in the reply. Returns
+// false if the client is ignored.
+bool prepareReply(Worker &worker, const ClientKey &clientKey, const GetSync2 &request, int64_t rxNs,
+                  SetSync2 &response, Exchange &exchange) {
+    if (stateless) {
+        return prepareStatelessReply(worker, clientKey, request, rxNs, response, exchange);
+    }
+    if (sharedClients) {
+        return prepareSharedReply(worker, clientKey, request, rxNs, response, exchange);
     }
 
-    if (history.size() < 3) {
-        return rawCorrection;
+    ClientTable &clients = worker.clients;
+    uint64_t probe = StageRecorder::begin();
+    bool inserted;
+    uint32_t row = clients.findOrInsert(clientKey, inserted);
+    worker.stages.end(STAGE_LOOKUP, probe);
+    if (row == ClientTable::FULL) {
+        worker.stats.refused++;
+        return false;
     }
 
-    double sum = 0;
-    for (int val: history) {
-        sum += val;
+    if (!admitRequest(worker, clients.auth[row])) {
+        return false;
     }
-    double mean = sum / history.size();
 
-    double variance = 0;
-    for (int val: history) {
-        variance += pow(val - mean, 2);
+    if (clients.requestCount[row] == 0) {
+        clients.state[row] = CLIENT_CONNECTED;
+        worker.stats.newClients++;
     }
-    double stddev = sqrt(variance / history.size());
 
-    if (stddev > 0 && abs(rawCorrection - mean) > OUTLIER_THRESHOLD * stddev) {
-        vector<int> sorted = history;
-        sort(sorted.begin(), sorted.end());
-        return sorted[sorted.size() / 2];
+    if (clients.state[row] != CLIENT_CONNECTED) {
+        worker.stats.ignored++;
+        return false;
     }
 
-    const double alpha = 0.3;
-    double smoothed = stats.lastCorrection;
+    probe = StageRecorder::begin();
+    int rawCorrection = getServerUptime() - request.currentValue;
+    int correction = calculateAdvancedCorrection(clients, rawCorrection, row);
+    worker.stages.end(STAGE_FILTER, probe);
 
-    if (stats.requestCount == 2) {
-        smoothed = rawCorrection;
-    } else {
-        smoothed = alpha * rawCorrection + (1 - alpha) * smoothed;
+    strncpy(response.cmd, "SYNC", 4);
+    response.correction = correction;
+    response.serverTime = getServerUptime();
+    response.sequence = request.sequence;
+
+    clients.lastSeenMs[row] = response.serverTime;
+    clients.requestCount[row]++;
+    clients.lastCorrection[row] = correction;
+    clients.totalCorrection[row] += correction;
+
+    if (correction < clients.minCorrection[row]) {
+        clients.minCorrection[row] = correction;
+    }
+    if (correction > clients.maxCorrection[row]) {
+        clients.maxCorrection[row] = correction;
     }
 
-    return static_cast<int>(smoothed);
+    worker.stats.recordCorrection(clientKey, correction);
+    exchange = Exchange{clientKey, rxNs, request.currentValue, rawCorrection, correction, response.serverTime};
+    return true;
 }
 
-void handleSyncRequest(const sockaddr_in &clientAddr, const GetSync2 &request) {
-    string clientKey = getClientKey(clientAddr);
-    ClientStats2 &stats = clients[clientKey];
+void recordExchange(Worker &worker, const Exchange &exchange, int64_t txNs) {
+    worker.replyLatency.record(txNs - exchange.rxNs);
 
-    if (stats.requestCount == 0) {
-        stats.state = CONNECTED;
-        cout << "New client connected: " << clientKey << endl;
+    // The trace format has no room for the logical id: gateway clients only
+    // go to the offset store.
+    if (worker.trace.isOpen() && exchange.key.logicalId == 0) {
+        TraceRecord rec{};
+        rec.rxNs = exchange.rxNs;
+        rec.txNs = txNs;
+        rec.replyValue = exchange.serverTime;
+        traceAddress(exchange.key, rec);
+        rec.requestValue = exchange.requestValue;
+        rec.rawCorrection = exchange.rawCorrection;
+        rec.correction = exchange.correction;
+        rec.source = TRACE_SERVER;
+        rec.protocol = TRACE_SYNC2;
+        worker.trace.record(rec);
     }
 
-    if (stats.state != CONNECTED) {
-        cout << "Ignoring request from disconnected client: " << clientKey << endl;
-        return;
+    if (worker.store.isOpen()) {
+        worker.store.record(OffsetSample{exchange.key, exchange.rxNs, exchange.correction,
+                                         (txNs - exchange.rxNs) / 1000});
     }
+}
 
-    int correction = calculateAdvancedCorrection(request.currentValue, clientKey);
+// Appends the trailer with --keys; reply buffers have SYNC_AUTH_BYTES of
+// room past the plain reply.
+size_t sealReply(const Worker &worker, void *reply, size_t length) {
+    return worker.replyKey != nullptr ? signPacket(*worker.replyKey, worker.replyKeyId, worker.replyCounter, reply, length) : length;
+}
 
+void handleSyncRequest(Worker &worker, const sockaddr_storage &clientAddr, socklen_t clientLen,
+                       const ClientKey &clientKey, const GetSync2 &request, bool sequenced, int64_t rxNs) {
     SetSync2 response{};
-    strncpy(response.cmd, "SYNC", 4);
-    response.correction = correction;
-    response.serverTime = getServerUptime();
+    Exchange exchange;
+    if (!prepareReply(worker, clientKey, request, rxNs, response, exchange)) {
+        return;
+    }
+
+    uint64_t probe = StageRecorder::begin();
+    char reply[sizeof(response) + SYNC_AUTH_BYTES];
+    memcpy(reply, &response, sizeof(response));
+    size_t length = sealReply(worker, reply, sequenced ? sizeof(response) : SET_SYNC2_LEGACY_SIZE);
+    sendto(worker.sockfd, reply, length, 0, (struct sockaddr *) &clientAddr, clientLen);
+    worker.stages.end(STAGE_SEND, probe);
+
+    probe = StageRecorder::begin();
+    recordExchange(worker, exchange, realtimeNs());
+    worker.stages.end(STAGE_RECORD, probe);
+}
+
+void handleDisconnect(Worker &worker, const ClientKey &clientKey);
 
-    sendto(sockfd, &response, sizeof(response), 0,
-           (struct sockaddr *) &clientAddr, sizeof(clientAddr));
+// Answers a GETT in place from the server clock alone, in any mode. The
+// kernel receive time is moved to the uptime clock through the current
+// CLOCK_REALTIME offset. The exchange is recorded with the one-way offset
+// as its correction, as GET's raw correction is.
+size_t prepareTimeReply(Worker &worker, const ClientKey &clientKey, char *payload, int64_t rxNs) {
+    SyncTimeRequest request;
+    memcpy(&request, payload, sizeof(request));
 
-    stats.requestCount++;
-    stats.lastCorrection = correction;
-    stats.totalCorrection += correction;
-    stats.averageCorrection = static_cast<double>(stats.totalCorrection) / stats.requestCount;
+    SyncTimeReply reply{};
+    int64_t uptimeNs = getServerUptimeNs();
+    memcpy(reply.cmd, "TIME", 4);
+    reply.sequence = request.sequence;
+    reply.originNs = request.originNs;
+    reply.realtimeOffsetNs = realtimeNs() - uptimeNs;
+    reply.receiveNs = rxNs - reply.realtimeOffsetNs;
+    TimebaseStats clock = timebase().stats();
+    reply.clockSource = clock.tsc ? SYNC_TIME_SOURCE_TSC : SYNC_TIME_SOURCE_KERNEL;
+    reply.clockErrorNs = static_cast<uint32_t>(min<int64_t>(llabs(clock.lastErrorNs), UINT32_MAX));
+    reply.flags = stateless ? SYNC_TIME_STATELESS : 0;
+    reply.transmitNs = getServerUptimeNs();
+    memcpy(payload, &reply, sizeof(reply));
 
-    if (correction < stats.minCorrection) {
-        stats.minCorrection = correction;
+    int correction = static_cast<int>((reply.receiveNs - reply.originNs) / 1000000);
+    worker.stats.recordCorrection(clientKey, correction);
+    worker.exchanges.push_back(Exchange{clientKey, rxNs, static_cast<int>(reply.originNs / 1000000), correction,
+                                        correction, static_cast<int>(reply.receiveNs / 1000000)});
+    return sizeof(reply);
+}
+
+void handleTimeRequest(Worker &worker, const sockaddr_storage &clientAddr, socklen_t clientLen,
+                       const ClientKey &clientKey, char *payload, int64_t rxNs) {
+    worker.exchanges.clear();
+    size_t length = sealReply(worker, payload, prepareTimeReply(worker, clientKey, payload, rxNs));
+
+    uint64_t probe = StageRecorder::begin();
+    sendto(worker.sockfd, payload, length, 0, (struct sockaddr *) &clientAddr, clientLen);
+    worker.stages.end(STAGE_SEND, probe);
+
+    probe = StageRecorder::begin();
+    recordExchange(worker, worker.exchanges.front(), realtimeNs());
+    worker.stages.end(STAGE_RECORD, probe);
+}
+
+// Answers a GETB in place: every entry goes through prepareReply() as the
+// request of its own logical client and is overwritten by its SYNB entry.
+// Exchanges of the answered entries are appended to worker.exchanges.
+// Returns the reply length, 0 for a malformed batch.
+size_t prepareBatchReply(Worker &worker, const ClientKey &gatewayKey, char *payload, size_t length, int64_t rxNs) {
+    SyncBatchHeader header;
+    if (length < sizeof(header)) {
+        return 0;
     }
-    if (correction > stats.maxCorrection) {
-        stats.maxCorrection = correction;
+    memcpy(&header, payload, sizeof(header));
+    if (header.count > SYNC_BATCH_MAX || length != syncBatchSize(header.count)) {
+        return 0;
     }
 
-    if (stats.requestCount % 10 == 0) {
-        cout << "[" << clientKey << "] Request #" << stats.requestCount
-             << " | Correction: " << correction
-             << " | Average: " << stats.averageCorrection
-             << " | Min: " << stats.minCorrection
-             << " | Max: " << stats.maxCorrection << endl;
-    } else {
-        cout << "[" << clientKey << "] #" << stats.requestCount
-             << " correction: " << correction << endl;
+    worker.stats.batches++;
+    for (size_t i = 0; i < header.count; i++) {
+        char *slot = payload + syncBatchSize(i);
+        SyncBatchRequest entry;
+        memcpy(&entry, slot, sizeof(entry));
+        ClientKey key = gatewayKey;
+        key.logicalId = entry.logicalId;
+
+        SyncBatchReply reply{entry.logicalId, SYNC_BATCH_IGNORED, 0};
+        if (entry.logicalId == 0) {
+            worker.stats.ignored++; // the gateway's own row, as a direct client
+        } else if (entry.flags & SYNC_BATCH_DISCONNECT) {
+            handleDisconnect(worker, key);
+            reply.status = SYNC_BATCH_DISCONNECTED;
+        } else {
+            GetSync2 request{{'G', 'E', 'T', 0}, entry.currentValue, header.sequence};
+            SetSync2 response{};
+            Exchange exchange;
+            if (prepareReply(worker, key, request, rxNs, response, exchange)) {
+                reply.status = SYNC_BATCH_OK;
+                reply.correction = response.correction;
+                worker.exchanges.push_back(exchange);
+            }
+        }
+        memcpy(slot, &reply, sizeof(reply));
+    }
+
+    memcpy(header.cmd, "SYNB", 4);
+    header.serverTime = getServerUptime();
+    memcpy(payload, &header, sizeof(header));
+    return length;
+}
+
+void handleBatchRequest(Worker &worker, const sockaddr_storage &clientAddr, socklen_t clientLen,
+                        const ClientKey &gatewayKey, char *payload, size_t length, int64_t rxNs) {
+    worker.exchanges.clear();
+    size_t replyLength = prepareBatchReply(worker, gatewayKey, payload, length, rxNs);
+    if (replyLength == 0) {
+        return;
+    }
+
+    replyLength = sealReply(worker, payload, replyLength);
+
+    uint64_t probe = StageRecorder::begin();
+    sendto(worker.sockfd, payload, replyLength, 0, (struct sockaddr *) &clientAddr, clientLen);
+    worker.stages.end(STAGE_SEND, probe);
+
+    int64_t txNs = realtimeNs();
+    for (const Exchange &exchange: worker.exchanges) {
+        probe = StageRecorder::begin();
+        recordExchange(worker, exchange, txNs);
+        worker.stages.end(STAGE_RECORD, probe);
+    }
+}
+
+void handleDisconnect(Worker &worker, const ClientKey &clientKey) {
+    if (stateless) {
+        worker.stats.disconnects++;
+        return;
+    }
+    if (sharedClients) {
+        ConcurrentClientTable::Guard guard(*sharedClients, worker.tableThread);
+        ConcurrentClientTable::Entry *entry = sharedClients->find(clientKey);
+        if (entry != nullptr) {
+            entry->lock();
+            if (admitRequest(worker, entry->record.auth)) {
+                entry->record.state = CLIENT_DISCONNECTED;
+                entry->history.clear();
+                worker.stats.disconnects++;
+            }
+            entry->unlock();
+        }
+        return;
+    }
+
+    int64_t found = worker.clients.find(clientKey);
+    if (found >= 0) {
+        uint32_t row = static_cast<uint32_t>(found);
+        if (!admitRequest(worker, worker.clients.auth[row])) {
+            return;
+        }
+        worker.clients.state[row] = CLIENT_DISCONNECTED;
+        worker.clients.history[row]->clear();
+        worker.stats.disconnects++;
+    }
+}
+
+// Disconnected clients keep their row, so a late packet from the same
+// address is still ignored. Clients idle for CLIENT_IDLE_TIMEOUT_MS are
+// dropped and their slots go back to the arena. Each call sweeps
+// CLEANUP_SLICE_ROWS rows from the worker's cursor, so a large table is
+// walked over many turns instead of holding up the packets behind it. A
+// row moved behind the cursor waits for the next round.
+void cleanupClientHistory(Worker &worker) {
+    ClientTable &clients = worker.clients;
+    if (worker.cleanupCursor >= clients.size()) {
+        worker.cleanupCursor = 0;
+    }
+    size_t end = worker.cleanupCursor + CLEANUP_SLICE_ROWS;
+    vector<uint32_t> rows;
+    clients.collectIdle(getServerUptime() - CLIENT_IDLE_TIMEOUT_MS, worker.cleanupCursor, end, rows);
+    // Removal moves the last row into the hole, so go from the back.
+    for (auto it = rows.rbegin(); it != rows.rend(); ++it) {
+        clients.remove(*it);
+    }
+    worker.cleanupCursor = end;
+}
+
+// cleanupClientHistory() for the shared table, run by worker 0 only, a
+// slice of buckets at a time. A client that sends again between the walk
+// and its removal is dropped all the same and starts over with its next
+// request.
+void cleanupSharedClients(Worker &worker) {
+    ConcurrentClientTable::Guard guard(*sharedClients, worker.tableThread);
+    int32_t cutoffMs = getServerUptime() - CLIENT_IDLE_TIMEOUT_MS;
+    vector<ClientKey> idle;
+    size_t begin = worker.cleanupCursor;
+    worker.cleanupCursor += CLEANUP_SLICE_ROWS;
+    size_t buckets = sharedClients->forEachBucket(begin, worker.cleanupCursor, [&](ConcurrentClientTable::Entry &entry) {
+        ClientRecord record = entry.read();
+        if (record.state == CLIENT_DISCONNECTED) {
+            entry.lock();
+            vector<int>().swap(entry.history);
+            entry.unlock();
+        }
+        if (record.lastSeenMs < cutoffMs) {
+            idle.push_back(entry.key);
+        }
+    });
+    for (const ClientKey &key: idle) {
+        sharedClients->remove(worker.tableThread, key);
+    }
+    if (worker.cleanupCursor >= buckets) {
+        worker.cleanupCursor = 0;
+    }
+}
+
+FleetStats aggregateSharedClients() {
+    FleetStats fleet;
+    ConcurrentClientTable::Guard guard(*sharedClients, mainTableThread);
+    sharedClients->forEach([&](const ConcurrentClientTable::Entry &entry) {
+        ClientRecord record = entry.read();
+        fleet.clients++;
+        fleet.connected += record.state == CLIENT_CONNECTED;
+        fleet.requests += record.requestCount;
+        fleet.totalCorrection += record.totalCorrection;
+        fleet.minCorrection = min(fleet.minCorrection, record.minCorrection);
+        fleet.maxCorrection = max(fleet.maxCorrection, record.maxCorrection);
+    });
+    return fleet;
+}
+
+void printFleetStats() {
+    FleetStats fleet;
+    if (sharedClients) {
+        fleet = aggregateSharedClients();
+    }
+    for (const auto &worker: workers) {
+        FleetStats part = worker->clients.aggregate();
+        fleet.clients += part.clients;
+        fleet.connected += part.connected;
+        fleet.requests += part.requests;
+        fleet.totalCorrection += part.totalCorrection;
+        fleet.minCorrection = min(fleet.minCorrection, part.minCorrection);
+        fleet.maxCorrection = max(fleet.maxCorrection, part.maxCorrection);
+    }
+
+    cout << "[FLEET] " << fleet.clients << " clients, " << fleet.connected << " connected, "
+         << fleet.requests << " requests";
+    if (fleet.requests > 0) {
+        cout << ", correction min " << fleet.minCorrection << " / max " << fleet.maxCorrection
+             << " / mean " << static_cast<double>(fleet.totalCorrection) / fleet.requests;
+    }
+    cout << endl;
+}
+
+// The workers' client arenas; only read once the workers have stopped.
+void printClientMemory() {
+    ArenaCounters memory;
+    for (const auto &worker: workers) {
+        memory.add(worker->clients.memory());
+    }
+
+    cout << "[MEMORY] Client slots: " << memory.slotsInUse << " in use, " << memory.slotsFree << " free, "
+         << memory.slabs << " slabs (" << memory.hugeSlabs << " on huge pages), " << fixed << setprecision(1)
+         << memory.mappedBytes / 1048576.0 << " MiB mapped, " << memory.columnBytes / 1048576.0 << " MiB columns"
+         << defaultfloat << setprecision(6);
+    if (clientMemory.ceilingBytes > 0) {
+        cout << " of " << (clientMemory.ceilingBytes >> 20) << " MiB, " << memory.refused << " refused";
+    }
+    cout << endl;
+}
+
+void printTimebase() {
+    TimebaseStats clock = timebase().stats();
+    if (clock.tsc) {
+        cout << "[CLOCK] TSC at " << fixed << setprecision(6) << clock.ticksPerNs << defaultfloat << setprecision(6)
+             << " ticks per ns, " << clock.calibrations << " calibrations, last error " << clock.lastErrorNs
+             << " ns, " << clock.steps << " steps" << endl;
+    } else if (clock.calibrations > 0) {
+        cout << "[CLOCK] Fell back to clock_gettime(): " << clock.reason << endl;
+    }
+}
+
+void printReport(const WorkerStats &stats, size_t published, double intervalS) {
+    cout << "[REPORT] " << fixed << setprecision(1) << intervalS << " s: " << stats.requests << " requests ("
+         << stats.requests / intervalS << "/s), " << stats.clients << " clients, " << stats.newClients
+         << " new, " << stats.disconnects << " disconnected, " << stats.ignored << " ignored";
+    if (stats.refused > 0) {
+        cout << ", " << stats.refused << " refused (client memory full)";
+    }
+    if (stats.batches > 0) {
+        cout << ", " << stats.batches << " gateway batches";
+    }
+    if (stats.unauthenticated > 0) {
+        cout << ", " << stats.unauthenticated << " unauthenticated";
+    }
+    if (stats.rejected > 0) {
+        cout << ", " << stats.rejected << " rejected (another key than the client's or a replay)";
+    }
+    if (published < workers.size()) {
+        cout << " (" << workers.size() - published << " of " << workers.size()
+             << " workers late, counted next time)";
+    }
+    cout << defaultfloat << setprecision(6) << endl;
+
+    if (stats.requests == 0) {
+        return;
+    }
+
+    cout << "[REPORT] correction mean " << fixed << setprecision(2)
+         << static_cast<double>(stats.correctionSum) / stats.requests << defaultfloat << setprecision(6)
+         << " ms, min " << stats.minCorrection << " / max " << stats.maxCorrection
+         << ", |correction| p50 <= " << stats.correctionPercentile(0.5)
+         << " / p90 <= " << stats.correctionPercentile(0.9)
+         << " / p99 <= " << stats.correctionPercentile(0.99) << " ms" << endl;
+
+    WorstClient worst[WorkerStats::TOP_CLIENTS];
+    int count = stats.sortedWorst(worst);
+    cout << "[REPORT] worst:";
+    for (int i = 0; i < count; i++) {
+        cout << (i == 0 ? " " : ", ") << worst[i].key << " " << showpos << worst[i].correction
+             << noshowpos << " ms";
+    }
+    cout << endl;
+}
+
+void handleDatagram(Worker &worker, char *payload, ssize_t received, const sockaddr_storage &clientAddr,
+                    socklen_t clientLen, int64_t rxNs) {
+    bool batch = received >= static_cast<ssize_t>(sizeof(SyncBatchHeader)) && memcmp(payload, "GETB", 4) == 0;
+    bool timestamps = received == sizeof(SyncTimeRequest) && memcmp(payload, "GETT", 4) == 0;
+    if (!batch && !timestamps && received != sizeof(GetSync2) &&
+        received != static_cast<ssize_t>(GET_SYNC2_LEGACY_SIZE)) {
+        return;
+    }
+
+    uint64_t probe = StageRecorder::begin();
+    ClientKey clientKey = makeClientKey(clientAddr);
+    worker.stages.end(STAGE_KEY, probe);
+
+    if (timestamps) {
+        handleTimeRequest(worker, clientAddr, clientLen, clientKey, payload, rxNs);
+        return;
+    }
+    if (batch) {
+        handleBatchRequest(worker, clientAddr, clientLen, clientKey, payload, received, rxNs);
+        return;
+    }
+
+    GetSync2 request{};
+    memcpy(&request, payload, received);
+    bool sequenced = received == sizeof(request);
+    if (strncmp(request.cmd, "DISC", 4) == 0) {
+        handleDisconnect(worker, clientKey);
+    } else if (strncmp(request.cmd, "GET", 3) == 0) {
+        handleSyncRequest(worker, clientAddr, clientLen, clientKey, request, sequenced, rxNs);
+    }
+}
+
+// Answers in the request's own frame. The exchanges of a queued reply are
+// appended to worker.exchanges.
+void handleXdpPacket(Worker &worker, const XdpPacket &packet) {
+    char *payload = reinterpret_cast<char *>(packet.payload);
+    size_t queued = worker.exchanges.size();
+    size_t length = 0;
+
+    if (packet.payloadLength >= sizeof(SyncBatchHeader) && memcmp(payload, "GETB", 4) == 0) {
+        length = prepareBatchReply(worker, packet.key, payload, packet.payloadLength, packet.rxNs);
+    } else if (packet.payloadLength == sizeof(SyncTimeRequest) && memcmp(payload, "GETT", 4) == 0) {
+        length = prepareTimeReply(worker, packet.key, payload, packet.rxNs);
+    } else if (packet.payloadLength == sizeof(GetSync2) || packet.payloadLength == GET_SYNC2_LEGACY_SIZE) {
+        GetSync2 request{};
+        memcpy(&request, payload, packet.payloadLength);
+        SetSync2 response{};
+        Exchange exchange;
+        if (strncmp(request.cmd, "DISC", 4) == 0) {
+            handleDisconnect(worker, packet.key);
+        } else if (strncmp(request.cmd, "GET", 3) == 0 &&
+                   prepareReply(worker, packet.key, request, packet.rxNs, response, exchange)) {
+            length = packet.payloadLength == sizeof(GetSync2) ? sizeof(response) : SET_SYNC2_LEGACY_SIZE;
+            memcpy(payload, &response, length);
+            worker.exchanges.push_back(exchange);
+        }
+    }
+
+    if (length == 0 || length + (worker.replyKey != nullptr ? SYNC_AUTH_BYTES : 0) > packet.capacity) {
+        worker.xdp.drop(packet);
+    } else if (!worker.xdp.reply(packet, sealReply(worker, payload, length))) {
+        worker.exchanges.resize(queued);
+    }
+}
+
+// Answers what is waiting on the XDP socket, a batch at a time and at most
+// XDP_BUDGET batches; the reactor calls again while the ring has more.
+// Returns the number of batches.
+size_t drainXdp(Worker &worker) {
+    XdpPacket packets[XDP_BATCH];
+
+    const uint8_t *payloads[XDP_BATCH];
+    size_t lengths[XDP_BATCH];
+    size_t verified[XDP_BATCH];
+    uint32_t keyIds[XDP_BATCH];
+
+    size_t count;
+    size_t batches = 0;
+    for (; batches < XDP_BUDGET && (count = worker.xdp.receive(packets, XDP_BATCH)) > 0; batches++) {
+        worker.exchanges.clear();
+        if (!authKeys.empty()) {
+            for (size_t i = 0; i < count; i++) {
+                payloads[i] = packets[i].payload;
+                lengths[i] = packets[i].payloadLength;
+            }
+            authKeys.verifyBatch(payloads, lengths, count, verified, keyIds);
+        }
+        for (size_t i = 0; i < count; i++) {
+            worker.stages.endSinceRealtime(STAGE_QUEUE, packets[i].rxNs);
+            if (!authKeys.empty()) {
+                if (verified[i] == 0) {
+                    worker.stats.unauthenticated++;
+                    worker.xdp.drop(packets[i]);
+                    continue;
+                }
+                packets[i].payloadLength = static_cast<uint32_t>(verified[i]);
+                worker.replyKeyId = keyIds[i];
+                worker.replyKey = authKeys.find(keyIds[i]);
+                worker.replyCounter = syncAuthCounter(packets[i].payload, verified[i]);
+            }
+            handleXdpPacket(worker, packets[i]);
+        }
+        uint64_t probe = StageRecorder::begin();
+        worker.xdp.flush();
+        worker.stages.end(STAGE_SEND, probe);
+
+        int64_t txNs = realtimeNs();
+        for (const Exchange &exchange: worker.exchanges) {
+            probe = StageRecorder::begin();
+            recordExchange(worker, exchange, txNs);
+            worker.stages.end(STAGE_RECORD, probe);
+        }
+    }
+    return batches;
+}
+
+// Answers what is queued on the UDP socket, up to SOCKET_BUDGET datagrams.
+// With XDP the socket gets what the program passes to the kernel (IP
+// options, other queues).
+void drainSocket(Worker &worker) {
+    sockaddr_storage clientAddr{};
+    socklen_t clientLen = sizeof(clientAddr);
+    char payload[SYNC_BATCH_BYTES + SYNC_AUTH_BYTES];
+    int64_t rxNs = 0;
+    ssize_t received;
+    for (size_t i = 0; i < SOCKET_BUDGET; i++) {
+        received = recvWithTimestamp(worker.sockfd, payload, sizeof(payload), MSG_DONTWAIT,
+                                     (struct sockaddr *) &clientAddr, &clientLen, rxNs);
+        if (received < 0) {
+            break;
+        }
+        worker.stages.endSinceRealtime(STAGE_QUEUE, rxNs);
+        if (!authKeys.empty()) {
+            received = static_cast<ssize_t>(authKeys.verify(payload, received, worker.replyKeyId));
+            if (received == 0) {
+                worker.stats.unauthenticated++;
+                clientLen = sizeof(clientAddr);
+                continue;
+            }
+            worker.replyKey = authKeys.find(worker.replyKeyId);
+            worker.replyCounter = syncAuthCounter(payload, received);
+        }
+        handleDatagram(worker, payload, received, clientAddr, clientLen, rxNs);
+        clientLen = sizeof(clientAddr);
     }
 }
 
-void handleDisconnect(const string &clientKey) {
-    auto it = clients.find(clientKey);
-    if (it != clients.end()) {
-        it->second.state = DISCONNECTED;
+void publishStats(Worker &worker) {
+    if (!sharedClients) {
+        worker.stats.clients = worker.clients.size();
+    } else if (worker.index == 0) {
+        worker.stats.clients = sharedClients->size();
+    }
+    epochs->checkpoint(worker.index, worker.stats);
+}
+
+// The worker's sockets, a checkpoint every WORKER_WAKE_MS so an idle worker
+// still answers the reporter, and the idle sweep, all on the worker's
+// reactor. A shared socket is watched with EPOLLEXCLUSIVE so a datagram
+// wakes one worker, not all. The main thread wakes the reactor to stop it.
+void runWorker(Worker &worker) {
+    applyLowLatency(worker.sockfd, worker.lowLatency);
+
+    Reactor &reactor = worker.reactor;
+    reactor.setSpin(worker.lowLatency.enabled ? worker.lowLatency.spinUs : 0);
+    uint32_t events = EPOLLIN | (sharedSocket ? static_cast<uint32_t>(EPOLLEXCLUSIVE) : static_cast<uint32_t>(0));
+    bool watched = reactor.watch(worker.sockfd, events, [&worker](uint32_t) {
+        drainSocket(worker);
+        publishStats(worker);
+    });
+    if (watched && worker.xdp.fd() >= 0) {
+        watched = reactor.watch(worker.xdp.fd(), EPOLLIN, [&worker](uint32_t) {
+            drainXdp(worker);
+            publishStats(worker);
+        });
+    }
+    if (!watched) {
+        throw runtime_error(string("epoll_ctl: ") + strerror(errno));
+    }
+
+    vector<uint64_t> tasks;
+    tasks.push_back(reactor.schedule(0, WORKER_WAKE_MS * 1000000LL, [&worker]() { publishStats(worker); }));
+    if (!stateless && !sharedClients) {
+        tasks.push_back(reactor.schedule(0, CLEANUP_SLICE_MS * 1000000LL, [&worker]() { cleanupClientHistory(worker); }));
+    } else if (!stateless && worker.index == 0) {
+        tasks.push_back(reactor.schedule(0, CLEANUP_SLICE_MS * 1000000LL, [&worker]() { cleanupSharedClients(worker); }));
+    }
 
-        auto historyIt = clientHistory.find(clientKey);
-        if (historyIt != clientHistory.end()) {
-            clientHistory.erase(historyIt);
+    while (running && !paused) {
+        if (reactor.runOnce(-1) < 0) {
+            throw runtime_error(string("epoll_wait: ") + strerror(errno));
         }
+    }
 
-        cout << "Client disconnected: " << clientKey
-             << " (Total requests: " << it->second.requestCount
-             << ", Avg correction: " << it->second.averageCorrection << ")" << endl;
+    reactor.unwatch(worker.sockfd);
+    reactor.unwatch(worker.xdp.fd());
+    for (uint64_t task: tasks) reactor.cancel(task);
+}
+
+// Worker i takes queue + i. Sockets that are already open (a handoff that
+// failed) are only registered with the new program.
+bool attachXdp() {
+    if (!xdpProgram.attach(xdpOptions, 8080)) {
+        return false;
+    }
+    for (auto &worker: workers) {
+        XdpSocket &xdp = worker->xdp;
+        bool ready = xdp.fd() >= 0 ? xdpProgram.addSocket(xdp.queue(), xdp.fd())
+                                   : xdp.open(xdpProgram, xdpOptions.queue + static_cast<uint32_t>(worker->index),
+                                              xdpOptions.native);
+        if (!ready) {
+            xdpProgram.detach();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sends port 8080 back to the kernel and answers what is already on the
+// rings, including packets that were past the program when it went. Only called while the workers are stopped.
+void detachXdp() {
+    xdpProgram.detach();
+    this_thread::sleep_for(chrono::milliseconds(XDP_SETTLE_MS));
+    for (auto &worker: workers) {
+        if (worker->xdp.fd() >= 0) {
+            while (drainXdp(*worker) == XDP_BUDGET) {
+            }
+        }
     }
 }
 
-void cleanupClientHistory() {
-    vector<string> toRemove;
+// The shared table goes out as a single table in the same row format.
+void serializeSharedClients(StateWriter &writer) {
+    ConcurrentClientTable::Guard guard(*sharedClients, mainTableThread);
+    vector<ConcurrentClientTable::Entry *> entries;
+    sharedClients->forEach([&](ConcurrentClientTable::Entry &entry) { entries.push_back(&entry); });
 
-    for (auto &[clientKey, history]: clientHistory) {
-        auto clientIt = clients.find(clientKey);
-        if (clientIt == clients.end() || clientIt->second.state == DISCONNECTED) {
-            toRemove.push_back(clientKey);
+    writer.put(static_cast<uint64_t>(entries.size()));
+    for (ConcurrentClientTable::Entry *entry: entries) {
+        entry->lock();
+        const ClientRecord &record = entry->record;
+        writer.put(entry->key);
+        writer.put(record.state);
+        writer.put(record.lastSeenMs);
+        writer.put(record.requestCount);
+        writer.put(record.minCorrection);
+        writer.put(record.maxCorrection);
+        writer.put(record.lastCorrection);
+        writer.put(record.totalCorrection);
+        writer.put(record.auth);
+        writer.putInts(entry->history);
+        entry->unlock();
+    }
+}
+
+bool restoreSharedClients(StateReader &reader) {
+    ConcurrentClientTable::Guard guard(*sharedClients, mainTableThread);
+    uint64_t count;
+    if (!reader.get(count)) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        ClientKey key;
+        if (!reader.get(key)) {
+            return false;
+        }
+        bool inserted;
+        ConcurrentClientTable::Entry *entry = sharedClients->findOrInsert(mainTableThread, key, inserted);
+        ClientRecord &record = entry->record;
+        if (!reader.get(record.state) || !reader.get(record.lastSeenMs) || !reader.get(record.requestCount) ||
+            !reader.get(record.minCorrection) || !reader.get(record.maxCorrection) ||
+            !reader.get(record.lastCorrection) || !reader.get(record.totalCorrection) || !reader.get(record.auth) ||
+            !reader.getInts(entry->history)) {
+            return false;
         }
     }
+    return true;
+}
 
-    for (const auto &key: toRemove) {
-        clientHistory.erase(key);
+// Rows in table order, each worker's table after the previous one. Clients
+// count in server uptime, so the start time travels with them; steady_clock
+// is CLOCK_MONOTONIC and the same in both processes.
+string serializeState() {
+    StateWriter writer;
+    writer.put(static_cast<int64_t>(serverStartTime.time_since_epoch().count()));
+    if (sharedClients) {
+        writer.put(static_cast<uint32_t>(1));
+        serializeSharedClients(writer);
+        return writer.data;
+    }
+    writer.put(static_cast<uint32_t>(workers.size()));
+    for (const auto &worker: workers) {
+        const ClientTable &clients = worker->clients;
+        writer.put(static_cast<uint64_t>(clients.size()));
+        for (size_t row = 0; row < clients.size(); row++) {
+            writer.put(clients.keys[row]);
+            writer.put(clients.state[row]);
+            writer.put(clients.lastSeenMs[row]);
+            writer.put(clients.requestCount[row]);
+            writer.put(clients.minCorrection[row]);
+            writer.put(clients.maxCorrection[row]);
+            writer.put(clients.lastCorrection[row]);
+            writer.put(clients.totalCorrection[row]);
+            writer.put(clients.auth[row]);
+            const CorrectionHistory &history = *clients.history[row];
+            writer.putInts(vector<int>(history.values, history.values + history.count));
+        }
     }
+    return writer.data;
 }
 
-bool initialize() {
-    serverStartTime = chrono::steady_clock::now();
+bool restoreWorkerTables(StateReader &reader) {
+    for (auto &worker: workers) {
+        ClientTable &clients = worker->clients;
+        uint64_t count;
+        if (!reader.get(count)) {
+            return false;
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            ClientKey key;
+            if (!reader.get(key)) {
+                return false;
+            }
+            bool inserted;
+            uint32_t row = clients.findOrInsert(key, inserted);
+            if (row == ClientTable::FULL) {
+                return false;
+            }
+            vector<int> values;
+            if (!reader.get(clients.state[row]) || !reader.get(clients.lastSeenMs[row]) ||
+                !reader.get(clients.requestCount[row]) || !reader.get(clients.minCorrection[row]) ||
+                !reader.get(clients.maxCorrection[row]) || !reader.get(clients.lastCorrection[row]) ||
+                !reader.get(clients.totalCorrection[row]) || !reader.get(clients.auth[row]) ||
+                !reader.getInts(values)) {
+                return false;
+            }
+            // Newest last: keep the tail if the window was longer.
+            CorrectionHistory &history = *clients.history[row];
+            size_t kept = min(values.size(), static_cast<size_t>(CorrectionHistory::CAPACITY));
+            copy(values.end() - kept, values.end(), history.values);
+            history.count = static_cast<int32_t>(kept);
+        }
+    }
+    return true;
+}
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        cerr << "Socket creation failed" << endl;
+bool restoreState(const string &state) {
+    StateReader reader(state);
+    int64_t startTicks;
+    uint32_t tableCount;
+    if (!reader.get(startTicks) || !reader.get(tableCount) ||
+        tableCount != (sharedClients ? 1 : workers.size())) {
         return false;
     }
+    if (!(sharedClients ? restoreSharedClients(reader) : restoreWorkerTables(reader))) {
+        return false;
+    }
+
+    serverStartTime = chrono::steady_clock::time_point(chrono::steady_clock::duration(startTicks));
+    return reader.done();
+}
+
+// With a shared socket every worker gets fds[0].
+bool addWorkers(const vector<int> &fds, size_t workerCount) {
+    for (size_t i = 0; i < workerCount; i++) {
+        unique_ptr<Worker> worker(new Worker());
+        worker->index = i;
+        worker->sockfd = sharedSocket ? fds[0] : fds[i];
+        if (sharedClients) {
+            worker->tableThread = sharedClients->registerThread();
+        }
+        if (!worker->reactor.open()) {
+            cerr << "Cannot create the event loop of worker " << i << ": " << strerror(errno) << endl;
+            return false;
+        }
 
-    int optval = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+        worker->lowLatency = lowLatency;
+        ArenaOptions memory = clientMemory;
+        memory.ceilingBytes /= workerCount;
+        worker->clients.setMemoryOptions(memory);
+        if (lowLatency.cpu >= 0) {
+            worker->lowLatency.cpu = lowLatency.cpu + static_cast<int>(i);
+        }
 
-    sockaddr_in serverAddr{};
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(8080);
+        workers.push_back(move(worker));
+    }
+    return true;
+}
 
-    if (bind(sockfd, (struct sockaddr *) &serverAddr, sizeof(serverAddr)) < 0) {
-        cerr << "Bind failed" << endl;
-        close(sockfd);
+// The successor gets one socket per worker and keeps the worker count: the
+// SO_REUSEPORT group hashes each client to the same socket as before, and
+// that socket's table already holds it. A shared socket comes alone and
+// may be read by any number of workers.
+bool takeOver(const string &path, size_t workerCount) {
+    vector<int> fds;
+    string state;
+    int conn;
+    if (!receiveHandoff(path, HANDOFF_SYNC2, fds, state, conn)) {
         return false;
     }
 
-    cout << "Time sync server started on port 8080" << endl;
-    cout << "Using advanced correction algorithm with:" << endl;
-    cout << "  - History window: " << HISTORY_WINDOW << " samples" << endl;
-    cout << "  - Outlier threshold: " << OUTLIER_THRESHOLD << " stddev" << endl;
-    cout << "  - Exponential smoothing" << endl;
+    if (sharedSocket && fds.size() != 1) {
+        cerr << "[UPGRADE] Predecessor has " << fds.size() << " sockets, --shared-socket needs one" << endl;
+        for (int fd: fds) close(fd);
+        close(conn);
+        return false;
+    }
+    if (!addWorkers(fds, sharedSocket ? workerCount : fds.size()) || !restoreState(state) ||
+        !acknowledgeHandoff(conn)) {
+        for (int fd: fds) close(fd);
+        close(conn);
+        return false;
+    }
+
+    awaitPredecessorExit(conn, 5000);
 
+    size_t clients = 0;
+    for (const auto &worker: workers) clients += worker->clients.size();
+    if (sharedClients) clients = sharedClients->size();
+    cout << "[UPGRADE] Took over port 8080 with " << fds.size() << " sockets and " << clients << " clients" << endl;
     return true;
 }
 
-void run() {
-    sockaddr_in clientAddr{};
-    socklen_t clientLen = sizeof(clientAddr);
-    GetSync2 request;
+// Called from the main thread once the workers have stopped: everything they
+// read has been answered, and what is still queued in the socket buffers
+// will be answered by the successor.
+bool handOff() {
+    int conn = successorConn;
+    successorConn = -1;
 
-    auto lastCleanup = chrono::steady_clock::now();
+    // The XDP sockets cannot be handed over; the successor attaches its own
+    // program and until then the kernel path answers.
+    bool xdp = xdpProgram.attached();
+    if (xdp) {
+        detachXdp();
+    }
 
-    while (true) {
-        memset(&request, 0, sizeof(request));
+    vector<int> fds;
+    for (const auto &worker: workers) fds.push_back(worker->sockfd);
+    if (sharedSocket) fds.resize(1);
+
+    if (sendHandoff(conn, HANDOFF_SYNC2, fds, serializeState(), 2000)) {
+        handoffConn = conn;
+        return true;
+    }
+
+    cerr << "[UPGRADE] Handoff failed, still serving" << endl;
+    close(conn);
+    if (xdp && !attachXdp()) {
+        cerr << "[XDP] Serving through the kernel only" << endl;
+    }
+    handoffListener = listenForHandoff(handoffPath);
+    return false;
+}
+
+void checkHandoff() {
+    int conn = acceptHandoff(handoffListener);
+    if (conn < 0) {
+        return;
+    }
+
+    cout << "[UPGRADE] Successor connected, stopping the workers" << endl;
+    mainReactor.unwatch(handoffListener);
+    close(handoffListener);
+    handoffListener = -1;
+    successorConn = conn;
+    paused = true;
+}
+
+// Reports every reportIntervalS and takes successors from the handoff
+// listener. Returns on shutdown, when a worker fails or when a successor
+// connects.
+void superviseWorkers() {
+    auto last = chrono::steady_clock::now();
+    int64_t intervalNs = reportIntervalS * 1000000000LL;
+    uint64_t report = mainReactor.schedule(intervalNs, intervalNs, [&last]() {
+        WorkerStats snapshot;
+        size_t published = epochs->snapshot(snapshot, SNAPSHOT_TIMEOUT_MS);
+        if (!running || paused) {
+            return; // the workers may have left without publishing
+        }
+        auto now = chrono::steady_clock::now();
+        double intervalS = chrono::duration<double>(now - last).count();
+        last = now;
+        printReport(snapshot, published, intervalS);
+    });
+    if (handoffListener >= 0) {
+        mainReactor.watch(handoffListener, EPOLLIN, [](uint32_t) { checkHandoff(); });
+    }
+
+    while (running && !paused) {
+        if (mainReactor.runOnce(-1) < 0) {
+            cerr << "Server error: epoll_wait: " << strerror(errno) << endl;
+            running = false;
+        }
+    }
+
+    mainReactor.cancel(report);
+    if (handoffListener >= 0) {
+        mainReactor.unwatch(handoffListener);
+    }
+}
+
+bool initialize(size_t workerCount, const string &tracePath, const string &storePath, const string &takeoverPath) {
+    if (sharedSocket && !stateless) {
+        sharedClients.reset(new ConcurrentClientTable());
+        mainTableThread = sharedClients->registerThread();
+    }
 
-        ssize_t received = recvfrom(sockfd, &request, sizeof(request), 0,
-                                    (struct sockaddr *) &clientAddr, &clientLen);
+    if (!takeoverPath.empty()) {
+        if (!takeOver(takeoverPath, workerCount)) {
+            cerr << "[UPGRADE] Cannot take over from " << takeoverPath << endl;
+            return false;
+        }
+        workerCount = workers.size();
+    } else {
+        serverStartTime = chrono::steady_clock::now();
 
-        if (received != sizeof(request)) {
-            continue;
+        vector<int> fds;
+        size_t socketCount = sharedSocket ? 1 : workerCount;
+        for (size_t i = 0; i < socketCount; i++) {
+            int fd = openServerSocket(8080, socketCount > 1);
+            if (fd < 0) {
+                cerr << "Socket creation or bind failed" << endl;
+                return false;
+            }
+            enableKernelTimestamps(fd);
+            fds.push_back(fd);
         }
+        if (!addWorkers(fds, workerCount)) {
+            return false;
+        }
+    }
 
-        string clientKey = getClientKey(clientAddr);
+    epochs.reset(new StatsEpochs(workerCount));
 
-        if (strncmp(request.cmd, "DISC", 4) == 0) {
-            handleDisconnect(clientKey);
-        } else if (strncmp(request.cmd, "GET", 3) == 0) {
-            handleSyncRequest(clientAddr, request);
+    for (auto &worker: workers) {
+        size_t i = worker->index;
+        if (!tracePath.empty()) {
+            string path = workerCount > 1 ? tracePath + "." + to_string(i) : tracePath;
+            if (!worker->trace.open(path)) {
+                cerr << "Cannot open trace file " << path << endl;
+                return false;
+            }
+            cout << "Recording exchanges to " << path << endl;
         }
 
-        auto now = chrono::steady_clock::now();
-        if (chrono::duration_cast<chrono::seconds>(now - lastCleanup).count() >= 30) {
-            cleanupClientHistory();
-            lastCleanup = now;
+        // Corrections in ms, residence time in us.
+        if (!storePath.empty()) {
+            string path = workerCount > 1 ? storePath + "." + to_string(i) : storePath;
+            if (!worker->store.open(path, 1000000, 1000)) {
+                cerr << "Cannot open offset store " << path << endl;
+                return false;
+            }
+            cout << "Storing corrections to " << path << endl;
         }
+
+        if (!stagesPath.empty()) {
+            worker->stages.open(static_cast<uint16_t>(i));
+        }
+    }
+
+    if (!stagesPath.empty()) {
+        stageTracing = true;
+        cout << "Probing request stages for " << stagesPath << " (SIGUSR2 toggles), " << fixed << setprecision(3)
+             << tscTicksPerNs() << defaultfloat << setprecision(6) << " TSC ticks per ns" << endl;
+    }
+
+    // After a takeover the sockets are already ours: serve without XDP rather
+    // than not at all.
+    if (!xdpOptions.interface.empty()) {
+        if (attachXdp()) {
+            cout << "[XDP] Port 8080 on " << xdpOptions.interface << ", queues " << xdpOptions.queue << ".."
+                 << xdpOptions.queue + workerCount - 1 << ", " << (xdpOptions.native ? "native" : "generic")
+                 << " mode" << endl;
+        } else if (takeoverPath.empty()) {
+            return false;
+        } else {
+            cerr << "[XDP] Serving through the kernel only" << endl;
+        }
+    }
+
+    if (timebase().start()) {
+        cout << "[CLOCK] Reading time from the TSC, calibrated against the kernel clocks" << endl;
+    } else {
+        cout << "[CLOCK] Reading time from clock_gettime(): " << timebase().stats().reason << endl;
+    }
+
+    if (!handoffPath.empty()) {
+        handoffListener = listenForHandoff(handoffPath);
+        if (handoffListener < 0) {
+            cerr << "Cannot listen for upgrades on " << handoffPath << endl;
+            return false;
+        }
+        cout << "Accepting upgrades on " << handoffPath << endl;
+    }
+
+    cout << "Time sync server started on port 8080 with " << workerCount << " worker"
+         << (workerCount > 1 ? "s" : "") << (sharedSocket ? " on one shared socket" : "") << ", reporting every " << reportIntervalS << " s" << endl;
+    if (stateless) {
+        cout << "Stateless: no client state, raw corrections; GETT clients filter the timestamps themselves" << endl;
+        cout << endl;
+        return true;
+    }
+    cout << "Using advanced correction algorithm with:" << endl;
+    cout << "  - History window: " << HISTORY_WINDOW << " samples" << endl;
+    cout << "  - Outlier threshold: " << OUTLIER_THRESHOLD << " stddev" << endl;
+    cout << "  - Exponential smoothing" << endl;
+
+    return true;
+}
+
+// Only once the workers have stopped: their rings are read without locks.
+void writeStages() {
+    vector<const StageRecorder *> recorders;
+    for (const auto &worker: workers) recorders.push_back(&worker->stages);
+    printStageHistograms(cout, recorders, STAGE_NAMES, STAGE_COUNT);
+    if (writeChromeTrace(stagesPath, recorders, STAGE_NAMES, STAGE_COUNT)) {
+        cout << "Stage timeline written to " << stagesPath << endl;
+    } else {
+        cerr << "Cannot write " << stagesPath << endl;
     }
 }
 
 void cleanup() {
-    if (sockfd >= 0) {
-        close(sockfd);
+    LatencyHistogram replyLatency;
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+    bool tracing = false;
+    uint64_t stored = 0;
+    uint64_t storeBlocks = 0;
+    uint64_t storeDropped = 0;
+    bool storing = false;
+    XdpCounters xdp;
+
+    xdpProgram.detach();
+    for (auto &worker: workers) {
+        xdp.received += worker->xdp.counters().received;
+        xdp.replied += worker->xdp.counters().replied;
+        xdp.dropped += worker->xdp.counters().dropped;
+        worker->xdp.close();
+        if (worker->sockfd >= 0 && (!sharedSocket || worker->index == 0)) {
+            close(worker->sockfd);
+        }
+        if (worker->trace.isOpen()) {
+            worker->trace.close();
+            written += worker->trace.written();
+            dropped += worker->trace.droppedCount();
+            tracing = true;
+        }
+        if (worker->store.isOpen()) {
+            worker->store.close();
+            stored += worker->store.samplesWritten();
+            storeBlocks += worker->store.blocksWritten();
+            storeDropped += worker->store.droppedCount();
+            storing = true;
+        }
+        replyLatency.merge(worker->replyLatency);
+    }
+
+    if (tracing) {
+        cout << "Trace: " << written << " records, " << dropped << " dropped" << endl;
+    }
+    if (storing) {
+        cout << "Store: " << stored << " samples in " << storeBlocks << " blocks, " << storeDropped
+             << " dropped" << endl;
+    }
+    if (!xdpOptions.interface.empty()) {
+        cout << "[XDP] " << xdp.received << " received, " << xdp.replied << " replied, " << xdp.dropped
+             << " dropped" << endl;
+    }
+    if (!stateless) {
+        printFleetStats();
+    }
+    if (!sharedClients && !stateless) {
+        printClientMemory();
+    }
+    printTimebase();
+    replyLatency.print(cout, lowLatency.enabled ? "Reply latency (low-latency mode)"
+                                                : "Reply latency (default mode)");
+    if (!stagesPath.empty()) {
+        writeStages();
+    }
+    if (handoffListener >= 0) {
+        close(handoffListener);
+        unlink(handoffPath.c_str());
+    }
+    if (successorConn >= 0) {
+        close(successorConn);
+    }
+    if (handoffConn >= 0) {
+        cout << "[UPGRADE] Handed over to the successor" << endl;
+        close(handoffConn);
     }
     cout << "Server shutdown complete" << endl;
 }
 
-int main() {
-    if (!initialize()) {
+void handleSignal(int sig) {
+    if (sig == SIGUSR2) {
+        stageTracing.store(!stageTracing.load());
+    } else {
+        running = false;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    string tracePath;
+    string storePath;
+    string takeoverPath;
+    string keysPath;
+    int workerCount = 1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--store" && i + 1 < argc) {
+            storePath = argv[++i];
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workerCount = max(1, min(MAX_WORKERS, atoi(argv[++i])));
+        } else if (arg == "--report" && i + 1 < argc) {
+            reportIntervalS = max(1, atoi(argv[++i]));
+        } else if (arg == "--handoff" && i + 1 < argc) {
+            handoffPath = argv[++i];
+        } else if (arg == "--takeover" && i + 1 < argc) {
+            takeoverPath = argv[++i];
+        } else if (arg == "--shared-socket") {
+            sharedSocket = true;
+        } else if (arg == "--stateless") {
+            stateless = true;
+        } else if (arg == "--client-memory" && i + 1 < argc) {
+            clientMemory.ceilingBytes = static_cast<size_t>(max(1, atoi(argv[++i]))) << 20;
+        } else if (arg == "--huge-pages") {
+            clientMemory.hugePages = true;
+        } else if (arg == "--stages" && i + 1 < argc) {
+            stagesPath = argv[++i];
+        } else if (arg == "--keys" && i + 1 < argc) {
+            keysPath = argv[++i];
+        } else if (!parseLowLatencyOption(i, argc, argv, lowLatency) &&
+                   !parseXdpOption(i, argc, argv, xdpOptions)) {
+            cout << "Usage: " << argv[0] << " [--trace <file>] [--store <file>] [--stages <file>] [--workers N]"
+                 << " [--shared-socket] [--stateless] [--client-memory MB] [--huge-pages] [--report S]"
+                 << " [--handoff <socket>] [--takeover <socket>] [--keys <file>] " << lowLatencyUsage() << " " << xdpUsage() << endl;
+            return -1;
+        }
+    }
+
+    if (!keysPath.empty()) {
+        string error;
+        if (!authKeys.load(keysPath, error)) {
+            cerr << "Cannot load the client keys: " << error << endl;
+            return -1;
+        }
+        if (authKeys.empty()) {
+            cerr << "No client keys in " << keysPath << endl;
+            return -1;
+        }
+        cout << "[AUTH] " << authKeys.size() << " client keys, unauthenticated packets are dropped" << endl;
+    }
+
+    // Signals go to the main thread's signalfd. The mask is set before
+    // initialize() starts the first thread, so every thread inherits it.
+    if (!mainReactor.open() || !mainReactor.handleSignals({SIGINT, SIGTERM, SIGUSR2}, handleSignal)) {
+        cerr << "Cannot create the event loop: " << strerror(errno) << endl;
         return -1;
     }
 
-    try {
-        run();
-    } catch (const exception &e) {
-        cerr << "Server error: " << e.what() << endl;
+    if (!initialize(static_cast<size_t>(workerCount), tracePath, storePath, takeoverPath)) {
+        return -1;
+    }
+
+    // A failed handoff resumes serving with the same workers and tables.
+    while (true) {
+        for (auto &worker: workers) {
+            Worker *w = worker.get();
+            w->packetThread = thread([w]() {
+                try {
+                    runWorker(*w);
+                } catch (const exception &e) {
+                    cerr << "Server error: " << e.what() << endl;
+                    running = false;
+                    mainReactor.wake();
+                }
+            });
+        }
+
+        superviseWorkers();
+
+        for (auto &worker: workers) {
+            worker->reactor.wake();
+        }
+        for (auto &worker: workers) {
+            worker->packetThread.join();
+        }
+
+        if (!running || successorConn < 0 || handOff()) {
+            break;
+        }
+        paused = false;
     }
 
     cleanup();
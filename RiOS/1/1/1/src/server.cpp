@@ -5,24 +5,68 @@
 #include <unistd.h>
 #include <cstring>
 #include <chrono>
-#include <map>
+#include <unordered_map>
 #include <string>
-#include <sstream>
+#include <csignal>
+#include <atomic>
+#include <thread>
+#include <cerrno>
+#include <algorithm>
+#include <sys/epoll.h>
 #include "get_sync.h"
 #include "set_sync.h"
 #include "client_stats.h"
+#include "sync_trace.h"
+#include "low_latency.h"
+#include "net_address.h"
+#include "offset_store.h"
+#include "handoff.h"
+#include "xdp_backend.h"
+#include "reactor.h"
+#include "sync_auth.h"
 
 using namespace std;
 
 int sockfd = -1;
+atomic<bool> running(true);
+TraceWriter trace;
+OffsetStore store;
+LowLatencyOptions lowLatency;
+LatencyHistogram replyLatency;
 chrono::steady_clock::time_point serverStartTime;
-map<string, ClientStats> clients;
+unordered_map<ClientKey, ClientStats, ClientKeyHash> clients;
+Reactor reactor; // the socket, the handoff listener and the signals
 
-string getClientKey(const sockaddr_in &addr) {
-    stringstream ss;
-    ss << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port);
-    return ss.str();
-}
+const size_t SOCKET_BUDGET = 64; // datagrams per turn before the other events get theirs
+string handoffPath;
+int handoffListener = -1;
+int handoffConn = -1; // to the successor; closing it on exit lets it start
+
+const size_t XDP_BATCH = 64;
+const size_t XDP_BUDGET = 4;  // batches per turn
+const int XDP_SETTLE_MS = 10;
+XdpOptions xdpOptions;
+XdpProgram xdpProgram;
+XdpSocket xdpSocket;
+
+// --keys: every request, DISC included, must carry a good tag under one of
+// these keys and is dropped before anything else looks at it otherwise.
+// It then touches its client only under the key the client is bound to and
+// with a fresh counter. Replies are tagged with the request's key.
+SyncKeyRing authKeys;
+const SipKey *replyKey = nullptr;
+uint32_t replyKeyId = 0;
+uint32_t replyCounter = 0;
+uint64_t unauthenticated = 0;
+uint64_t rejected = 0; // authenticated, but another key than the client's or a replay
+
+// What is recorded about a reply once it has gone out.
+struct Exchange {
+    ClientKey key;
+    int64_t rxNs;
+    int requestValue;
+    int correction;
+};
 
 int getServerUptime() {
     auto now = chrono::steady_clock::now();
@@ -34,9 +78,23 @@ int calculateCorrection(int clientTime) {
     return serverTime - clientTime;
 }
 
-void handleSyncRequest(const sockaddr_in &clientAddr, const GetSync &request) {
-    string clientKey = getClientKey(clientAddr);
+// With --keys, whether the request being answered may change the client.
+bool admitRequest(ClientStats &stats) {
+    if (replyKey == nullptr || stats.auth.admit(replyKeyId, replyCounter)) {
+        return true;
+    }
+    rejected++;
+    return false;
+}
+
+// Fills in the reply and counts the request. Returns false if the client is
+// ignored.
+bool prepareReply(const ClientKey &clientKey, const GetSync &request, int64_t rxNs, SetSync &response,
+                  Exchange &exchange) {
     ClientStats &stats = clients[clientKey];
+    if (!admitRequest(stats)) {
+        return false;
+    }
 
     if (stats.requestCount == 0) {
         stats.state = CONNECTED;
@@ -45,17 +103,14 @@ void handleSyncRequest(const sockaddr_in &clientAddr, const GetSync &request) {
 
     if (stats.state != CONNECTED) {
         cout << "Ignoring request from disconnected client: " << clientKey << endl;
-        return;
+        return false;
     }
 
     int correction = calculateCorrection(request.currentValue);
 
-    SetSync response{};
     strncpy(response.cmd, "SYNC", 4);
     response.correction = correction;
-
-    sendto(sockfd, &response, sizeof(response), 0,
-           (struct sockaddr *) &clientAddr, sizeof(clientAddr));
+    response.sequence = request.sequence;
 
     stats.requestCount++;
     if (stats.requestCount != 1) {
@@ -63,85 +118,480 @@ void handleSyncRequest(const sockaddr_in &clientAddr, const GetSync &request) {
     }
     stats.averageCorrection = (double) stats.totalCorrection / stats.requestCount;
 
+    exchange = Exchange{clientKey, rxNs, request.currentValue, correction};
+    return true;
+}
+
+void recordExchange(const Exchange &exchange, int64_t txNs) {
+    replyLatency.record(txNs - exchange.rxNs);
+
+    if (trace.isOpen()) {
+        TraceRecord rec{};
+        rec.rxNs = exchange.rxNs;
+        rec.txNs = txNs;
+        rec.replyValue = exchange.correction;
+        traceAddress(exchange.key, rec);
+        rec.requestValue = exchange.requestValue;
+        rec.rawCorrection = exchange.correction;
+        rec.correction = exchange.correction;
+        rec.source = TRACE_SERVER;
+        rec.protocol = TRACE_SYNC;
+        trace.record(rec);
+    }
+
+    if (store.isOpen()) {
+        store.record(OffsetSample{exchange.key, exchange.rxNs, exchange.correction, (txNs - exchange.rxNs) / 1000});
+    }
+
+    const ClientStats &stats = clients[exchange.key];
     if (stats.requestCount % 10 == 0) {
-        cout << "[" << clientKey << "] Request #" << stats.requestCount
-                << " | Correction: " << correction
+        cout << "[" << exchange.key << "] Request #" << stats.requestCount
+                << " | Correction: " << exchange.correction
                 << " | Average: " << stats.averageCorrection << endl;
     } else {
-        cout << "[" << clientKey << "] #" << stats.requestCount
-                << " correction: " << correction << endl;
+        cout << "[" << exchange.key << "] #" << stats.requestCount
+                << " correction: " << exchange.correction << endl;
     }
 }
 
-void handleDisconnect(const string &clientKey) {
+// Appends the trailer with --keys; reply buffers have SYNC_AUTH_BYTES of
+// room past the plain reply.
+size_t sealReply(void *reply, size_t length) {
+    return replyKey != nullptr ? signPacket(*replyKey, replyKeyId, replyCounter, reply, length) : length;
+}
+
+void handleSyncRequest(const sockaddr_storage &clientAddr, socklen_t clientLen, const ClientKey &clientKey,
+                       const GetSync &request, bool sequenced, int64_t rxNs) {
+    SetSync response{};
+    Exchange exchange;
+    if (!prepareReply(clientKey, request, rxNs, response, exchange)) {
+        return;
+    }
+
+    char reply[sizeof(response) + SYNC_AUTH_BYTES];
+    memcpy(reply, &response, sizeof(response));
+    size_t length = sealReply(reply, sequenced ? sizeof(response) : SET_SYNC_LEGACY_SIZE);
+    sendto(sockfd, reply, length, 0, (struct sockaddr *) &clientAddr, clientLen);
+
+    recordExchange(exchange, realtimeNs());
+}
+
+void handleDisconnect(const ClientKey &clientKey) {
     auto it = clients.find(clientKey);
-    if (it != clients.end()) {
+    if (it != clients.end() && admitRequest(it->second)) {
         it->second.state = DISCONNECTED;
         cout << "Client disconnected: " << clientKey
                 << " (Total requests: " << it->second.requestCount << ")" << endl;
     }
 }
 
-bool initialize() {
-    serverStartTime = chrono::steady_clock::now();
+void handleDatagram(const GetSync &request, ssize_t received, const sockaddr_storage &clientAddr,
+                    socklen_t clientLen, int64_t rxNs) {
+    if (received != sizeof(request) && received != static_cast<ssize_t>(GET_SYNC_LEGACY_SIZE)) {
+        return;
+    }
+    bool sequenced = received == sizeof(request);
+
+    ClientKey clientKey = makeClientKey(clientAddr);
+
+    if (strncmp(request.cmd, "DISC", 4) == 0) {
+        handleDisconnect(clientKey);
+    } else if (strncmp(request.cmd, "GET", 3) == 0) {
+        handleSyncRequest(clientAddr, clientLen, clientKey, request, sequenced, rxNs);
+    }
+}
+
+// Answers in the request's own frame. Returns true if a reply was queued.
+bool handleXdpPacket(const XdpPacket &packet, Exchange &exchange) {
+    GetSync request{};
+    bool sequenced = packet.payloadLength == sizeof(request);
+    if (!sequenced && packet.payloadLength != GET_SYNC_LEGACY_SIZE) {
+        xdpSocket.drop(packet);
+        return false;
+    }
+    memcpy(&request, packet.payload, packet.payloadLength);
+
+    SetSync response{};
+    if (strncmp(request.cmd, "DISC", 4) == 0) {
+        handleDisconnect(packet.key);
+    } else if (strncmp(request.cmd, "GET", 3) == 0 &&
+               prepareReply(packet.key, request, packet.rxNs, response, exchange)) {
+        size_t length = sequenced ? sizeof(response) : SET_SYNC_LEGACY_SIZE;
+        if (length + (replyKey != nullptr ? SYNC_AUTH_BYTES : 0) <= packet.capacity) {
+            memcpy(packet.payload, &response, length);
+            return xdpSocket.reply(packet, sealReply(packet.payload, length));
+        }
+    }
+    xdpSocket.drop(packet);
+    return false;
+}
+
+// At most XDP_BUDGET batches; the reactor calls again while the ring has
+// more. detachXdp() calls it until the rings are empty.
+size_t drainXdp() {
+    XdpPacket packets[XDP_BATCH];
+    Exchange exchanges[XDP_BATCH];
+
+    const uint8_t *payloads[XDP_BATCH];
+    size_t lengths[XDP_BATCH];
+    size_t verified[XDP_BATCH];
+    uint32_t keyIds[XDP_BATCH];
+
+    size_t count;
+    size_t batches = 0;
+    for (; batches < XDP_BUDGET && (count = xdpSocket.receive(packets, XDP_BATCH)) > 0; batches++) {
+        if (!authKeys.empty()) {
+            for (size_t i = 0; i < count; i++) {
+                payloads[i] = packets[i].payload;
+                lengths[i] = packets[i].payloadLength;
+            }
+            authKeys.verifyBatch(payloads, lengths, count, verified, keyIds);
+        }
+        size_t replies = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!authKeys.empty()) {
+                if (verified[i] == 0) {
+                    unauthenticated++;
+                    xdpSocket.drop(packets[i]);
+                    continue;
+                }
+                packets[i].payloadLength = static_cast<uint32_t>(verified[i]);
+                replyKeyId = keyIds[i];
+                replyKey = authKeys.find(keyIds[i]);
+                replyCounter = syncAuthCounter(packets[i].payload, verified[i]);
+            }
+            if (handleXdpPacket(packets[i], exchanges[replies])) {
+                replies++;
+            }
+        }
+        xdpSocket.flush();
+
+        int64_t txNs = realtimeNs();
+        for (size_t i = 0; i < replies; i++) {
+            recordExchange(exchanges[i], txNs);
+        }
+    }
+    return batches;
+}
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        cerr << "Socket creation failed" << endl;
+bool attachXdp() {
+    if (!xdpProgram.attach(xdpOptions, 8080)) {
         return false;
     }
+    bool ready = xdpSocket.fd() >= 0 ? xdpProgram.addSocket(xdpSocket.queue(), xdpSocket.fd())
+                                     : xdpSocket.open(xdpProgram, xdpOptions.queue, xdpOptions.native);
+    if (!ready) {
+        xdpProgram.detach();
+    }
+    return ready;
+}
 
-    int optval = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+// Sends port 8080 back to the kernel and answers what is already on the
+// rings, including packets that were past the program when it went.
+void detachXdp() {
+    xdpProgram.detach();
+    this_thread::sleep_for(chrono::milliseconds(XDP_SETTLE_MS));
+    while (drainXdp() == XDP_BUDGET) {
+    }
+}
 
-    sockaddr_in serverAddr{};
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(8080);
+// Clients count in server uptime, so the start time travels with the table.
+// steady_clock is CLOCK_MONOTONIC and the same in both processes.
+string serializeState() {
+    StateWriter writer;
+    writer.put(static_cast<int64_t>(serverStartTime.time_since_epoch().count()));
+    writer.put(static_cast<uint64_t>(clients.size()));
+    for (const auto &entry: clients) {
+        writer.put(entry.first);
+        writer.put(entry.second);
+    }
+    return writer.data;
+}
 
-    if (bind(sockfd, (struct sockaddr *) &serverAddr, sizeof(serverAddr)) < 0) {
-        cerr << "Bind failed" << endl;
-        close(sockfd);
+bool restoreState(const string &state) {
+    StateReader reader(state);
+    int64_t startTicks;
+    uint64_t count;
+    if (!reader.get(startTicks) || !reader.get(count)) {
         return false;
     }
 
+    clients.clear();
+    for (uint64_t i = 0; i < count; i++) {
+        ClientKey key;
+        ClientStats stats;
+        if (!reader.get(key) || !reader.get(stats)) {
+            return false;
+        }
+        clients[key] = stats;
+    }
+
+    serverStartTime = chrono::steady_clock::time_point(chrono::steady_clock::duration(startTicks));
+    return reader.done();
+}
+
+bool takeOver(const string &path) {
+    vector<int> fds;
+    string state;
+    int conn;
+    if (!receiveHandoff(path, HANDOFF_SERVER, fds, state, conn)) {
+        return false;
+    }
+    if (fds.size() != 1 || !restoreState(state) || !acknowledgeHandoff(conn)) {
+        for (int fd: fds) close(fd);
+        close(conn);
+        return false;
+    }
+
+    sockfd = fds[0];
+    awaitPredecessorExit(conn, 5000);
+    cout << "[UPGRADE] Took over port 8080 with " << clients.size() << " clients" << endl;
+    return true;
+}
+
+// Runs between packets: everything read so far has been answered, and what
+// is still queued in the socket buffer will be answered by the successor.
+void checkHandoff() {
+    int conn = acceptHandoff(handoffListener);
+    if (conn < 0) {
+        return;
+    }
+
+    cout << "[UPGRADE] Successor connected, handing over " << clients.size() << " clients" << endl;
+    reactor.unwatch(handoffListener);
+    close(handoffListener);
+    handoffListener = -1;
+
+    // The XDP socket cannot be handed over; the successor attaches its own
+    // program and until then the kernel path answers.
+    bool xdp = xdpProgram.attached();
+    if (xdp) {
+        detachXdp();
+    }
+
+    if (sendHandoff(conn, HANDOFF_SERVER, {sockfd}, serializeState(), 2000)) {
+        handoffConn = conn;
+        running = false;
+        return;
+    }
+
+    cerr << "[UPGRADE] Handoff failed, still serving" << endl;
+    close(conn);
+    handoffListener = listenForHandoff(handoffPath);
+    if (handoffListener >= 0) {
+        reactor.watch(handoffListener, EPOLLIN, [](uint32_t) { checkHandoff(); });
+    }
+    if (xdp && !attachXdp()) {
+        cerr << "[XDP] Serving through the kernel only" << endl;
+    }
+}
+
+bool initialize(const string &tracePath, const string &storePath, const string &takeoverPath) {
+    if (!takeoverPath.empty()) {
+        if (!takeOver(takeoverPath)) {
+            cerr << "[UPGRADE] Cannot take over from " << takeoverPath << endl;
+            return false;
+        }
+    } else {
+        serverStartTime = chrono::steady_clock::now();
+
+        sockfd = openServerSocket(8080);
+        if (sockfd < 0) {
+            cerr << "Socket creation or bind failed" << endl;
+            return false;
+        }
+
+        enableKernelTimestamps(sockfd);
+    }
+
+    if (!handoffPath.empty()) {
+        handoffListener = listenForHandoff(handoffPath);
+        if (handoffListener < 0) {
+            cerr << "Cannot listen for upgrades on " << handoffPath << endl;
+            close(sockfd);
+            return false;
+        }
+        cout << "Accepting upgrades on " << handoffPath << endl;
+    }
+
+    // After a takeover the socket is already ours: serve without XDP rather
+    // than not at all.
+    if (!xdpOptions.interface.empty()) {
+        if (attachXdp()) {
+            cout << "[XDP] Port 8080 on " << xdpOptions.interface << ", queue " << xdpOptions.queue << ", "
+                 << (xdpOptions.native ? "native" : "generic") << " mode" << endl;
+        } else if (takeoverPath.empty()) {
+            close(sockfd);
+            return false;
+        } else {
+            cerr << "[XDP] Serving through the kernel only" << endl;
+        }
+    }
+
+    if (!tracePath.empty()) {
+        if (!trace.open(tracePath)) {
+            cerr << "Cannot open trace file " << tracePath << endl;
+            close(sockfd);
+            return false;
+        }
+        cout << "Recording exchanges to " << tracePath << endl;
+    }
+
+    // Corrections in ms, residence time in us.
+    if (!storePath.empty()) {
+        if (!store.open(storePath, 1000000, 1000)) {
+            cerr << "Cannot open offset store " << storePath << endl;
+            close(sockfd);
+            return false;
+        }
+        cout << "Storing corrections to " << storePath << endl;
+    }
+
     cout << "Time sync server started on port 8080" << endl;
     return true;
 }
 
-void run() {
-    sockaddr_in clientAddr{};
-    socklen_t clientLen = sizeof(clientAddr);
+// Up to SOCKET_BUDGET datagrams. With XDP the socket still gets what the
+// program passes to the kernel, such as packets with IP options.
+void drainSocket() {
+    sockaddr_storage clientAddr{};
+    socklen_t clientLen;
+    char payload[sizeof(GetSync) + SYNC_AUTH_BYTES];
     GetSync request;
 
-    while (true) {
+    for (size_t i = 0; i < SOCKET_BUDGET; i++) {
+        int64_t rxNs = 0;
+        clientLen = sizeof(clientAddr);
+        ssize_t received = recvWithTimestamp(sockfd, payload, sizeof(payload), MSG_DONTWAIT,
+                                             (struct sockaddr *) &clientAddr, &clientLen, rxNs);
+        if (received < 0) {
+            break;
+        }
+        if (!authKeys.empty()) {
+            received = static_cast<ssize_t>(authKeys.verify(payload, received, replyKeyId));
+            if (received == 0) {
+                unauthenticated++;
+                continue;
+            }
+            replyKey = authKeys.find(replyKeyId);
+            replyCounter = syncAuthCounter(payload, received);
+        }
         memset(&request, 0, sizeof(request));
+        memcpy(&request, payload, min(static_cast<size_t>(received), sizeof(request)));
+        handleDatagram(request, received, clientAddr, clientLen, rxNs);
+    }
+}
 
-        ssize_t received = recvfrom(sockfd, &request, sizeof(request), 0,
-                                    (struct sockaddr *) &clientAddr, &clientLen);
-
-        if (received != sizeof(request)) {
-            continue;
-        }
+// Returns on a signal or once the socket has been handed over.
+void run() {
+    applyLowLatency(sockfd, lowLatency);
+    if (lowLatency.enabled) {
+        reactor.setSpin(lowLatency.spinUs);
+    }
 
-        string clientKey = getClientKey(clientAddr);
+    bool watched = reactor.watch(sockfd, EPOLLIN, [](uint32_t) { drainSocket(); });
+    if (watched && xdpSocket.fd() >= 0) {
+        watched = reactor.watch(xdpSocket.fd(), EPOLLIN, [](uint32_t) { drainXdp(); });
+    }
+    if (watched && handoffListener >= 0) {
+        watched = reactor.watch(handoffListener, EPOLLIN, [](uint32_t) { checkHandoff(); });
+    }
+    if (!watched) {
+        cerr << "Server error: epoll_ctl: " << strerror(errno) << endl;
+        return;
+    }
 
-        if (strncmp(request.cmd, "DISC", 4) == 0) {
-            handleDisconnect(clientKey);
-        } else if (strncmp(request.cmd, "GET", 3) == 0) {
-            handleSyncRequest(clientAddr, request);
+    while (running) {
+        if (reactor.runOnce(-1) < 0) {
+            cerr << "Server error: epoll_wait: " << strerror(errno) << endl;
+            return;
         }
     }
 }
 
 void cleanup() {
+    if (!xdpOptions.interface.empty()) {
+        xdpProgram.detach();
+        const XdpCounters &counters = xdpSocket.counters();
+        cout << "[XDP] " << counters.received << " received, " << counters.replied << " replied, "
+             << counters.dropped << " dropped" << endl;
+        xdpSocket.close();
+    }
     if (sockfd >= 0) {
         close(sockfd);
     }
+    if (trace.isOpen()) {
+        trace.close();
+        cout << "Trace: " << trace.written() << " records, " << trace.droppedCount() << " dropped" << endl;
+    }
+    if (store.isOpen()) {
+        store.close();
+        cout << "Store: " << store.samplesWritten() << " samples in " << store.blocksWritten() << " blocks, "
+             << store.droppedCount() << " dropped" << endl;
+    }
+    if (!authKeys.empty()) {
+        cout << "[AUTH] " << unauthenticated << " unauthenticated packets dropped, " << rejected
+             << " rejected for another key than the client's or a replayed counter" << endl;
+    }
+    replyLatency.print(cout, lowLatency.enabled ? "Reply latency (low-latency mode)"
+                                                : "Reply latency (default mode)");
+
+    if (handoffListener >= 0) {
+        close(handoffListener);
+        unlink(handoffPath.c_str());
+    }
+    if (handoffConn >= 0) {
+        cout << "[UPGRADE] Handed over to the successor" << endl;
+        close(handoffConn);
+    }
 }
 
-int main() {
-    if (!initialize()) {
+int main(int argc, char *argv[]) {
+    string tracePath;
+    string storePath;
+    string takeoverPath;
+    string keysPath;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--store" && i + 1 < argc) {
+            storePath = argv[++i];
+        } else if (arg == "--handoff" && i + 1 < argc) {
+            handoffPath = argv[++i];
+        } else if (arg == "--takeover" && i + 1 < argc) {
+            takeoverPath = argv[++i];
+        } else if (arg == "--keys" && i + 1 < argc) {
+            keysPath = argv[++i];
+        } else if (!parseLowLatencyOption(i, argc, argv, lowLatency) &&
+                   !parseXdpOption(i, argc, argv, xdpOptions)) {
+            cout << "Usage: " << argv[0] << " [--trace <file>] [--store <file>] [--handoff <socket>]"
+                 << " [--takeover <socket>] [--keys <file>] " << lowLatencyUsage() << " " << xdpUsage() << endl;
+            return -1;
+        }
+    }
+
+    if (!keysPath.empty()) {
+        string error;
+        if (!authKeys.load(keysPath, error)) {
+            cerr << "Cannot load the client keys: " << error << endl;
+            return -1;
+        }
+        if (authKeys.empty()) {
+            cerr << "No client keys in " << keysPath << endl;
+            return -1;
+        }
+        cout << "[AUTH] " << authKeys.size() << " client keys, unauthenticated packets are dropped" << endl;
+    }
+
+    // Signals are read from a signalfd in run(). The mask is set before the
+    // trace and store threads start, so they inherit it.
+    if (!reactor.open() || !reactor.handleSignals({SIGINT, SIGTERM}, [](int) { running = false; })) {
+        cerr << "Cannot create the event loop: " << strerror(errno) << endl;
+        return -1;
+    }
+
+    if (!initialize(tracePath, storePath, takeoverPath)) {
         return -1;
     }
     run();
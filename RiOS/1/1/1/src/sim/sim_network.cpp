@@ -0,0 +1,49 @@
+#include "sim_network.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+bool later(const SimEvent &a, const SimEvent &b) {
+    if (a.timeNs != b.timeNs) return a.timeNs > b.timeNs;
+    return a.order > b.order;
+}
+
+}
+
+bool SimLink::transit(bool toServer, int64_t &delayNs) {
+    if (model.lossRate > 0 && uniform(0, 1) < model.lossRate) {
+        return false;
+    }
+
+    double delayMs = model.delayMs;
+    if (toServer) {
+        delayMs += model.asymmetryMs;
+    }
+    if (model.jitterMs > 0) {
+        delayMs += exponential_distribution<double>(1.0 / model.jitterMs)(rng);
+    }
+    if (model.reorderRate > 0 && uniform(0, 1) < model.reorderRate) {
+        delayMs += uniform(0, model.reorderDelayMs);
+    }
+
+    delayNs = static_cast<int64_t>(delayMs * 1e6);
+    return true;
+}
+
+void SimEventQueue::push(int64_t timeNs, uint32_t client, SimEventType type, int64_t value, int64_t extra) {
+    heap.push_back(SimEvent{timeNs, nextOrder++, client, type, value, extra});
+    push_heap(heap.begin(), heap.end(), later);
+}
+
+bool SimEventQueue::pop(SimEvent &event) {
+    if (heap.empty()) {
+        return false;
+    }
+    pop_heap(heap.begin(), heap.end(), later);
+    event = heap.back();
+    heap.pop_back();
+    return true;
+}
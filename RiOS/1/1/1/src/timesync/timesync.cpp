@@ -0,0 +1,383 @@
+#include "timesync.h"
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <poll.h>
+#include <ctime>
+#include <climits>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include "get_sync.h"
+#include "set_sync.h"
+#include "net_address.h"
+#include "disciplined_clock.h"
+
+using namespace std;
+
+namespace timesync {
+namespace {
+
+const int MIN_POLL_PERIOD_MS = 10;
+
+// The disciplined clock as published to now(). The sync thread fills the slot
+// after the current one and then moves current to it, so a reader copies a
+// slot that is no longer written and never retries. A slot is reused
+// PARAM_SLOTS - 1 publications later, at least that many poll periods, which
+// is far longer than a reader holds it.
+const size_t PARAM_SLOTS = 8;
+
+struct ClockParams {
+    atomic<bool> synchronized{false};
+    atomic<uint64_t> generation{0}; // one per start(), whose server may have another timebase
+    atomic<clockid_t> localClock{CLOCK_MONOTONIC};
+    atomic<int64_t> baseLocalNs{0};
+    atomic<int64_t> baseValueNs{0};
+    atomic<int64_t> slewEndNs{0};
+    atomic<double> slewingRate{0};
+    atomic<double> rate{0};
+    atomic<int64_t> floorNs{0};
+};
+
+struct Server {
+    string name;
+    sockaddr_storage addr{};
+    socklen_t addrLen = 0;
+    int fd = -1;
+};
+
+ClockParams params[PARAM_SLOTS];
+atomic<size_t> currentParams(0);
+uint64_t generation = 0; // written by start() only, before the sync thread runs
+
+// The sync thread's clock, set by start() before the thread is created.
+clockid_t syncClock = CLOCK_MONOTONIC;
+
+Policy activePolicy;
+vector<Server> servers;
+int wakeFd = -1;
+thread syncThread;
+atomic<bool> active(false);
+
+mutex statsMutex;
+Stats currentStats;
+
+int64_t readClockNs(clockid_t clock) {
+    timespec ts{};
+    clock_gettime(clock, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+bool parseServer(const string &spec, Server &server) {
+    string host;
+    uint16_t port = 0;
+    if (!splitHostPort(spec, host, port, 8080)) {
+        return false;
+    }
+
+    server.name = spec;
+    return resolveAddress(host, port, server.addr, server.addrLen);
+}
+
+// What now() last returned on this thread, so that it never goes backwards
+// there, not even when a publication lands between two reads.
+thread_local uint64_t lastGeneration = 0;
+thread_local int64_t lastNowNs = INT64_MIN;
+
+// Only one thread publishes at a time: start() before the sync thread exists,
+// then the sync thread until stop() joins it.
+void publish(bool synchronized, clockid_t clock, const DisciplinedSegment &segment) {
+    size_t slot = (currentParams.load(memory_order_relaxed) + 1) % PARAM_SLOTS;
+    ClockParams &next = params[slot];
+    next.synchronized.store(synchronized, memory_order_relaxed);
+    next.generation.store(generation, memory_order_relaxed);
+    next.localClock.store(clock, memory_order_relaxed);
+    next.baseLocalNs.store(segment.baseLocalNs, memory_order_relaxed);
+    next.baseValueNs.store(segment.baseValueNs, memory_order_relaxed);
+    next.slewEndNs.store(segment.slewEndNs, memory_order_relaxed);
+    next.slewingRate.store(segment.slewingRate, memory_order_relaxed);
+    next.rate.store(segment.rate, memory_order_relaxed);
+    next.floorNs.store(segment.floorNs, memory_order_relaxed);
+    currentParams.store(slot, memory_order_release);
+}
+
+// False before the first successful exchange.
+bool readParams(DisciplinedSegment &segment, uint64_t &paramsGeneration, clockid_t &clock) {
+    const ClockParams &current = params[currentParams.load(memory_order_acquire)];
+    paramsGeneration = current.generation.load(memory_order_relaxed);
+    clock = current.localClock.load(memory_order_relaxed);
+    segment.baseLocalNs = current.baseLocalNs.load(memory_order_relaxed);
+    segment.baseValueNs = current.baseValueNs.load(memory_order_relaxed);
+    segment.slewEndNs = current.slewEndNs.load(memory_order_relaxed);
+    segment.slewingRate = current.slewingRate.load(memory_order_relaxed);
+    segment.rate = current.rate.load(memory_order_relaxed);
+    segment.floorNs = current.floorNs.load(memory_order_relaxed);
+    return current.synchronized.load(memory_order_relaxed);
+}
+
+void drainSocket(const Server &server) {
+    char buffer[64];
+    while (recv(server.fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+    }
+}
+
+// Waits for a datagram from the server until the deadline. Returns false on
+// timeout or when stop() wakes the thread.
+bool waitReply(const Server &server, void *buffer, size_t size, ssize_t &received, int64_t deadlineNs) {
+    while (active) {
+        int64_t remainingNs = deadlineNs - readClockNs(syncClock);
+        if (remainingNs <= 0) {
+            return false;
+        }
+
+        pollfd fds[2] = {{server.fd, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+        int ready = poll(fds, 2, static_cast<int>((remainingNs + 999999) / 1000000));
+        if (ready <= 0 || (fds[1].revents & POLLIN)) {
+            continue;
+        }
+
+        sockaddr_storage fromAddr{};
+        socklen_t fromLen = sizeof(fromAddr);
+        received = recvfrom(server.fd, buffer, size, MSG_DONTWAIT, (sockaddr *) &fromAddr, &fromLen);
+        if (received > 0 && sameAddress(fromAddr, server.addr)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// One request/reply exchange. On success fills the offset of the server clock
+// against the local clock at the midpoint of the exchange, and the round trip.
+bool exchange(const Server &server, int64_t &offsetNs, int64_t &delayNs) {
+    drainSocket(server);
+
+    int64_t t1 = readClockNs(syncClock);
+    int64_t serverNs = 0;
+    ssize_t received = 0;
+
+    if (activePolicy.protocol == Protocol::Sync) {
+        // currentValue is an int of ms, 24.8 days. Past that the request
+        // carries 0, the server answers with its uptime as the correction
+        // and value + correction stays the server's time.
+        int64_t clientMs = nowMs();
+        GetSync request{};
+        strncpy(request.cmd, "GET", 3);
+        request.currentValue = clientMs >= 0 && clientMs <= INT_MAX ? static_cast<int>(clientMs) : 0;
+
+        if (sendto(server.fd, &request, sizeof(request), 0,
+                   (sockaddr *) &server.addr, server.addrLen) != sizeof(request)) {
+            return false;
+        }
+
+        SetSync response{};
+        if (!waitReply(server, &response, sizeof(response), received,
+                       t1 + activePolicy.timeoutMs * 1000000LL)) {
+            return false;
+        }
+        if (received != sizeof(response) || strncmp(response.cmd, "SYNC", 4) != 0) {
+            return false;
+        }
+
+        // The server answers in whole milliseconds; take the middle of the tick.
+        int64_t serverMs = static_cast<int64_t>(request.currentValue) + response.correction;
+        serverNs = serverMs * 1000000LL + 500000LL;
+    } else {
+        const char *request = "GET";
+        if (sendto(server.fd, request, strlen(request), 0,
+                   (sockaddr *) &server.addr, server.addrLen) < 0) {
+            return false;
+        }
+
+        uint64_t serverTime = 0;
+        if (!waitReply(server, &serverTime, sizeof(serverTime), received,
+                       t1 + activePolicy.timeoutMs * 1000000LL)) {
+            return false;
+        }
+        if (received != sizeof(serverTime)) {
+            return false;
+        }
+        serverNs = static_cast<int64_t>(be64toh(serverTime)) * 1000000LL + 500000LL;
+    }
+
+    int64_t t4 = readClockNs(syncClock);
+    delayNs = t4 - t1;
+    offsetNs = serverNs - (t1 + delayNs / 2);
+    return true;
+}
+
+// The median offset of a poll steers a DisciplinedClock, which slews towards
+// it instead of jumping, and the clock is published for now().
+void syncLoop() {
+    DisciplineParams discipline;
+    discipline.maxSlewPpm = activePolicy.maxRatePpm;
+    discipline.maxFreqPpm = activePolicy.maxRatePpm;
+    discipline.timeConstantS = max(discipline.timeConstantS, activePolicy.pollPeriodMs / 1000.0);
+    DisciplinedClock clock(discipline);
+
+    int64_t nextPollNs = readClockNs(syncClock);
+
+    while (active) {
+        vector<int64_t> offsets;
+        int64_t bestDelayNs = 0;
+        uint64_t requests = 0;
+        uint64_t timeouts = 0;
+
+        for (const Server &server: servers) {
+            if (!active) break;
+
+            int64_t offsetNs = 0;
+            int64_t delayNs = 0;
+            requests++;
+            if (exchange(server, offsetNs, delayNs)) {
+                offsets.push_back(offsetNs);
+                if (offsets.size() == 1 || delayNs < bestDelayNs) {
+                    bestDelayNs = delayNs;
+                }
+            } else {
+                timeouts++;
+            }
+        }
+
+        int64_t localNs = readClockNs(syncClock);
+
+        if (!offsets.empty()) {
+            sort(offsets.begin(), offsets.end());
+            int64_t offsetNs = offsets[offsets.size() / 2];
+
+            // Not read before the first update, which sets the clock: that
+            // read would leave the local clock behind as the floor.
+            int64_t clockNs = clock.synchronized() ? clock.read(localNs) : localNs;
+            clock.update(localNs + offsetNs - clockNs, localNs);
+            publish(true, syncClock, clock.segment());
+
+            lock_guard<mutex> lock(statsMutex);
+            currentStats.lastOffsetNs = offsetNs;
+            currentStats.lastDelayNs = bestDelayNs;
+            currentStats.ratePpm = clock.frequencyPpm();
+            currentStats.synchronized = true;
+        }
+
+        {
+            lock_guard<mutex> lock(statsMutex);
+            currentStats.polls++;
+            currentStats.requests += requests;
+            currentStats.replies += offsets.size();
+            currentStats.timeouts += timeouts;
+        }
+
+        nextPollNs += activePolicy.pollPeriodMs * 1000000LL;
+        if (nextPollNs < localNs) {
+            nextPollNs = localNs + activePolicy.pollPeriodMs * 1000000LL;
+        }
+
+        while (active) {
+            int64_t remainingNs = nextPollNs - readClockNs(syncClock);
+            if (remainingNs <= 0) break;
+
+            pollfd wake{wakeFd, POLLIN, 0};
+            poll(&wake, 1, static_cast<int>((remainingNs + 999999) / 1000000));
+        }
+    }
+}
+
+}
+
+bool start(const vector<string> &serverSpecs, const Policy &policy) {
+    if (active) {
+        return false;
+    }
+
+    vector<Server> parsed;
+    for (const string &spec: serverSpecs) {
+        Server server;
+        if (parseServer(spec, server)) {
+            server.fd = socket(server.addr.ss_family, SOCK_DGRAM, 0);
+            if (server.fd >= 0) {
+                parsed.push_back(server);
+            }
+        }
+    }
+    if (parsed.empty()) {
+        return false;
+    }
+
+    wakeFd = eventfd(0, EFD_NONBLOCK);
+    if (wakeFd < 0) {
+        for (Server &server: parsed) {
+            close(server.fd);
+        }
+        return false;
+    }
+
+    servers = parsed;
+    activePolicy = policy;
+    activePolicy.pollPeriodMs = max(activePolicy.pollPeriodMs, MIN_POLL_PERIOD_MS);
+    syncClock = policy.protocol == Protocol::Ntp ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+    generation++;
+    publish(false, syncClock, DisciplinedSegment());
+    {
+        lock_guard<mutex> lock(statsMutex);
+        currentStats = Stats();
+    }
+
+    active = true;
+    syncThread = thread(syncLoop);
+    return true;
+}
+
+void stop() {
+    if (!active.exchange(false)) {
+        return;
+    }
+
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+        // The loop still notices the flag within one poll timeout.
+    }
+    if (syncThread.joinable()) {
+        syncThread.join();
+    }
+
+    for (Server &server: servers) {
+        close(server.fd);
+    }
+    servers.clear();
+    close(wakeFd);
+    wakeFd = -1;
+}
+
+bool running() {
+    return active;
+}
+
+int64_t now() {
+    DisciplinedSegment segment;
+    uint64_t paramsGeneration;
+    clockid_t clock;
+    bool synchronized = readParams(segment, paramsGeneration, clock);
+    int64_t localNs = readClockNs(clock);
+    if (!synchronized) {
+        return localNs;
+    }
+    if (paramsGeneration != lastGeneration) {
+        lastGeneration = paramsGeneration;
+        lastNowNs = INT64_MIN;
+    }
+    lastNowNs = max(lastNowNs, segment.value(localNs));
+    return lastNowNs;
+}
+
+int64_t nowMs() {
+    return now() / 1000000LL;
+}
+
+Stats stats() {
+    lock_guard<mutex> lock(statsMutex);
+    return currentStats;
+}
+
+}
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include "timesync.h"
+
+using namespace std;
+
+// Embeds the library the way an application would: start it against a
+// server, read timesync::now() from a busy thread, report once a second.
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        cout << "Usage: " << argv[0] << " <server[:port]> [--ntp] [--period ms] [--seconds S]" << endl;
+        return -1;
+    }
+
+    vector<string> servers{argv[1]};
+    timesync::Policy policy;
+    int seconds = 10;
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--ntp") {
+            policy.protocol = timesync::Protocol::Ntp;
+        } else if (arg == "--period" && i + 1 < argc) {
+            policy.pollPeriodMs = atoi(argv[++i]);
+        } else if (arg == "--seconds" && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else {
+            cerr << "Unknown option: " << arg << endl;
+            return -1;
+        }
+    }
+
+    if (!timesync::start(servers, policy)) {
+        cerr << "Cannot start timesync against " << argv[1] << endl;
+        return -1;
+    }
+
+    // Only counted once synchronized: the first exchange moves now() from
+    // the local clock to the server's timebase.
+    atomic<bool> reading(true);
+    atomic<uint64_t> reads(0);
+    atomic<uint64_t> backwards(0);
+    thread reader([&]() {
+        bool synchronized = false;
+        int64_t last = 0;
+        while (reading) {
+            if (!synchronized) {
+                synchronized = timesync::stats().synchronized;
+                last = timesync::now();
+                continue;
+            }
+            int64_t value = timesync::now();
+            if (value < last) {
+                backwards++;
+            }
+            last = value;
+            reads++;
+        }
+    });
+
+    for (int s = 0; s < seconds; s++) {
+        this_thread::sleep_for(chrono::seconds(1));
+        timesync::Stats stats = timesync::stats();
+        cout << "now " << timesync::nowMs() << " ms, " << (stats.synchronized ? "synchronized" : "not synchronized")
+             << ", offset " << fixed << setprecision(3) << stats.lastOffsetNs / 1e6 << " ms, delay "
+             << stats.lastDelayNs / 1e6 << " ms, rate " << stats.ratePpm << " ppm, " << stats.replies << "/"
+             << stats.requests << " replies" << defaultfloat << setprecision(6) << endl;
+    }
+
+    reading = false;
+    reader.join();
+    timesync::stop();
+    cout << reads << " reads of now(), " << backwards << " went backwards" << endl;
+    return backwards == 0 ? 0 : 1;
+}
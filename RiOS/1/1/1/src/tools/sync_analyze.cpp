@@ -0,0 +1,339 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
+#include <arpa/inet.h>
+#include "offset_store.h"
+#include "sync_trace.h"
+#include "clock_stability.h"
+
+using namespace std;
+
+// A grid this much larger than the sample count means tau0 does not fit the
+// client's polling; such clients are skipped rather than interpolated.
+const size_t MAX_GRID_PER_SAMPLE = 16;
+
+// One client's time error samples, in seconds, as read from the files.
+struct ClientSeries {
+    string name;
+    vector<pair<int64_t, double>> samples; // CLOCK_REALTIME ns, phase s
+    double tau0 = 0;
+    uint64_t filled = 0;                   // grid points interpolated over gaps
+    bool irregular = false;                // too many gaps for the grid
+    unique_ptr<PhaseSeries> phase;
+    vector<uint32_t> factors;
+    vector<StabilityPoint> points;
+};
+
+struct Options {
+    string clientName;
+    int64_t fromNs = INT64_MIN;
+    int64_t toNs = INT64_MAX;
+    double tau0 = 0;     // 0: the median sample interval of each client
+    int perDecade = 10;  // 0: every averaging factor
+    size_t minSamples = 16;
+    int threads = static_cast<int>(thread::hardware_concurrency());
+    bool json = false;
+    string outPath;
+};
+
+uint32_t fileMagic(const string &path) {
+    ifstream in(path, ios::binary);
+    uint32_t magic = 0;
+    in.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    return in ? magic : 0;
+}
+
+ClientSeries &seriesFor(map<string, ClientSeries> &clients, const string &name) {
+    ClientSeries &series = clients[name];
+    series.name = name;
+    return series;
+}
+
+bool loadStore(const string &path, const Options &options, map<string, ClientSeries> &clients) {
+    OffsetStoreReader store;
+    if (!store.open(path)) {
+        return false;
+    }
+    double unitS = store.header().offsetUnitNs / 1e9;
+    vector<OffsetSample> samples;
+    store.query(nullptr, options.fromNs, options.toNs, samples);
+
+    // Keys are formatted once per client, not per sample; null for clients
+    // left out by --client.
+    unordered_map<ClientKey, ClientSeries *, ClientKeyHash> byKey;
+    for (const OffsetSample &sample: samples) {
+        auto it = byKey.find(sample.key);
+        if (it == byKey.end()) {
+            string name = formatClientKey(sample.key);
+            bool wanted = options.clientName.empty() || name == options.clientName;
+            it = byKey.emplace(sample.key, wanted ? &seriesFor(clients, name) : nullptr).first;
+        }
+        if (it->second != nullptr) {
+            it->second->samples.emplace_back(sample.timeNs, sample.offset * unitS);
+        }
+    }
+    return true;
+}
+
+// Server records give the client's offset as the raw correction referred to
+// the kernel receive time; client records the correction the client applied,
+// kept apart under the server's address with a "/client" suffix.
+bool loadTrace(const string &path, const Options &options, map<string, ClientSeries> &clients) {
+    vector<TraceRecord> records;
+    if (!readTrace(path, records)) {
+        return false;
+    }
+    unordered_map<ClientKey, ClientSeries *, ClientKeyHash> byKey;
+    for (const TraceRecord &rec: records) {
+        if (rec.rxNs < options.fromNs || rec.rxNs >= options.toNs) continue;
+        bool server = rec.source == TRACE_SERVER;
+        ClientKey key{};
+        memcpy(key.addr, rec.address, 16);
+        key.port = htons(rec.port);
+        key.logicalId = server ? 0 : 1; // only tells the two views apart here
+
+        auto it = byKey.find(key);
+        if (it == byKey.end()) {
+            key.logicalId = 0;
+            string name = formatClientKey(key);
+            bool wanted = options.clientName.empty() || name == options.clientName;
+            key.logicalId = server ? 0 : 1;
+            it = byKey.emplace(key, wanted ? &seriesFor(clients, server ? name : name + "/client") : nullptr).first;
+        }
+        if (it->second == nullptr) continue;
+
+        double ms = server ? rec.rawCorrection - (rec.txNs - rec.rxNs) / 1e6 : rec.correction;
+        it->second->samples.emplace_back(rec.rxNs, ms / 1e3);
+    }
+    return true;
+}
+
+// Places the samples on a regular grid of tau0, the median interval unless
+// given, interpolating linearly across missed polls; the statistics assume
+// evenly spaced phase.
+void buildPhase(ClientSeries &series, const Options &options) {
+    auto &samples = series.samples;
+    sort(samples.begin(), samples.end());
+    if (samples.size() < options.minSamples) {
+        return;
+    }
+
+    double tau0Ns = options.tau0 * 1e9;
+    if (tau0Ns <= 0) {
+        vector<int64_t> intervals;
+        for (size_t i = 1; i < samples.size(); i++) {
+            intervals.push_back(samples[i].first - samples[i - 1].first);
+        }
+        nth_element(intervals.begin(), intervals.begin() + intervals.size() / 2, intervals.end());
+        tau0Ns = max<int64_t>(1, intervals[intervals.size() / 2]);
+    }
+
+    int64_t firstNs = samples.front().first;
+    size_t points = static_cast<size_t>(llround((samples.back().first - firstNs) / tau0Ns)) + 1;
+    if (points > MAX_GRID_PER_SAMPLE * samples.size()) {
+        series.irregular = true;
+        return;
+    }
+    vector<double> phase(points, NAN);
+    for (const auto &sample: samples) {
+        phase[static_cast<size_t>(llround((sample.first - firstNs) / tau0Ns))] = sample.second;
+    }
+
+    size_t last = 0;
+    for (size_t i = 1; i < points; i++) {
+        if (isnan(phase[i])) continue;
+        for (size_t k = last + 1; k < i; k++) {
+            phase[k] = phase[last] + (phase[i] - phase[last]) * (k - last) / (i - last);
+            series.filled++;
+        }
+        last = i;
+    }
+
+    series.tau0 = tau0Ns / 1e9;
+    series.factors = averagingFactors(points, options.perDecade);
+    series.points.resize(series.factors.size());
+    series.phase.reset(new PhaseSeries(move(phase), series.tau0));
+    samples.clear();
+    samples.shrink_to_fit();
+}
+
+template<typename F>
+void parallelFor(size_t count, int threads, F body) {
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            for (size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) {
+                body(i);
+            }
+        });
+    }
+    for (thread &worker: workers) {
+        worker.join();
+    }
+}
+
+string jsonNumber(double value) {
+    if (!isfinite(value)) return "null";
+    ostringstream out;
+    out << setprecision(6) << value;
+    return out.str();
+}
+
+void writeCsv(ostream &out, const vector<ClientSeries *> &series) {
+    out << "client,tau_s,m,adev,tdev_s,mtie_s\n" << setprecision(6);
+    for (const ClientSeries *client: series) {
+        for (const StabilityPoint &point: client->points) {
+            out << client->name << "," << point.tau << "," << point.m << "," << point.adev << ","
+                << point.tdev << "," << point.mtie << "\n";
+        }
+    }
+}
+
+void writeJson(ostream &out, const vector<ClientSeries *> &series) {
+    out << "[";
+    for (size_t c = 0; c < series.size(); c++) {
+        const ClientSeries &client = *series[c];
+        out << (c > 0 ? ",\n" : "\n") << " {\"client\": \"" << client.name << "\", \"tau0_s\": "
+            << jsonNumber(client.tau0) << ", \"samples\": " << client.phase->size() << ", \"filled\": "
+            << client.filled << ", \"points\": [";
+        for (size_t i = 0; i < client.points.size(); i++) {
+            const StabilityPoint &point = client.points[i];
+            out << (i > 0 ? ", " : "") << "{\"tau_s\": " << jsonNumber(point.tau) << ", \"m\": " << point.m
+                << ", \"adev\": " << jsonNumber(point.adev) << ", \"tdev_s\": " << jsonNumber(point.tdev)
+                << ", \"mtie_s\": " << jsonNumber(point.mtie) << "}";
+        }
+        out << "]}";
+    }
+    out << "\n]\n";
+}
+
+void printUsage(const char *name) {
+    cout << "Usage: " << name << " <store_or_trace>... [--client ADDR:PORT] [--from UNIX_S] [--to UNIX_S]"
+         << " [--tau0 S] [--per-decade K | --all-tau] [--min-samples N] [--threads N] [--json] [--out <file>]"
+         << endl;
+    cout << "  Overlapping Allan deviation, TDEV and MTIE of each client's time error, as CSV rows" << endl;
+    cout << "  client,tau_s,m,adev,tdev_s,mtie_s or, with --json, one object per client." << endl;
+}
+
+int main(int argc, char *argv[]) {
+    vector<string> paths;
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--client" && hasValue) {
+            options.clientName = argv[++i];
+        } else if (arg == "--from" && hasValue) {
+            options.fromNs = static_cast<int64_t>(atof(argv[++i]) * 1e9);
+        } else if (arg == "--to" && hasValue) {
+            options.toNs = static_cast<int64_t>(atof(argv[++i]) * 1e9);
+        } else if (arg == "--tau0" && hasValue) {
+            options.tau0 = atof(argv[++i]);
+        } else if (arg == "--per-decade" && hasValue) {
+            options.perDecade = max(1, atoi(argv[++i]));
+        } else if (arg == "--all-tau") {
+            options.perDecade = 0;
+        } else if (arg == "--min-samples" && hasValue) {
+            options.minSamples = max(4, atoi(argv[++i]));
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = atoi(argv[++i]);
+        } else if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "--out" && hasValue) {
+            options.outPath = argv[++i];
+        } else if (arg.compare(0, 2, "--") != 0) {
+            paths.push_back(arg);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (paths.empty()) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    options.threads = max(1, options.threads);
+
+    auto wallStart = chrono::steady_clock::now();
+    map<string, ClientSeries> clients;
+    for (const string &path: paths) {
+        uint32_t magic = fileMagic(path);
+        bool loaded = magic == OFFSET_STORE_MAGIC ? loadStore(path, options, clients)
+                      : magic == TRACE_MAGIC ? loadTrace(path, options, clients) : false;
+        if (!loaded) {
+            cerr << "Cannot read " << path << " as an offset store or trace" << endl;
+            return 1;
+        }
+    }
+
+    vector<ClientSeries *> series;
+    for (auto &entry: clients) {
+        series.push_back(&entry.second);
+    }
+    parallelFor(series.size(), options.threads, [&](size_t i) { buildPhase(*series[i], options); });
+    size_t irregular = count_if(series.begin(), series.end(), [](ClientSeries *client) { return client->irregular; });
+    series.erase(remove_if(series.begin(), series.end(), [](ClientSeries *client) { return !client->phase; }),
+                 series.end());
+
+    // One task per client and averaging time, so a single long series is
+    // spread over the threads as well.
+    using Task = pair<ClientSeries *, size_t>;
+    vector<Task> tasks;
+    uint64_t samples = 0;
+    for (ClientSeries *client: series) {
+        samples += client->phase->size();
+        for (size_t i = 0; i < client->factors.size(); i++) {
+            tasks.emplace_back(client, i);
+        }
+    }
+    // Longest series first, so a big client is not the last thing running.
+    stable_sort(tasks.begin(), tasks.end(), [](const Task &a, const Task &b) {
+        return a.first->phase->size() > b.first->phase->size();
+    });
+    parallelFor(tasks.size(), options.threads, [&](size_t i) {
+        ClientSeries &client = *tasks[i].first;
+        client.points[tasks[i].second] = client.phase->at(client.factors[tasks[i].second]);
+    });
+    double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+
+    ofstream file;
+    if (!options.outPath.empty()) {
+        file.open(options.outPath);
+        if (!file) {
+            cerr << "Cannot write " << options.outPath << endl;
+            return 1;
+        }
+    }
+    ostream &out = options.outPath.empty() ? cout : file;
+    if (options.json) {
+        writeJson(out, series);
+    } else {
+        writeCsv(out, series);
+    }
+    out << flush;
+
+    if (irregular > 0) {
+        cerr << "[ANALYZE] " << irregular << " clients skipped: polls too irregular for a common tau0, try --tau0"
+             << endl;
+    }
+    cerr << "[ANALYZE] " << series.size() << " clients (" << clients.size() - series.size() - irregular
+         << " with under " << options.minSamples << " samples skipped), " << samples << " points, " << tasks.size()
+         << " averaging times in " << fixed << setprecision(2) << wallSeconds << " s on " << options.threads
+         << " threads" << endl;
+    return 0;
+}
@@ -0,0 +1,274 @@
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include "get_sync.h"
+#include "set_sync.h"
+#include "low_latency.h"
+#include "net_address.h"
+#include "sync_batch.h"
+#include "sync_auth.h"
+
+using namespace std;
+
+struct LoadSocket {
+    int fd = -1;
+    int64_t sentNs = 0;
+    bool outstanding = false;
+    uint32_t authCounter = 0; // --key: each socket is its own client to the server
+};
+
+// --key: requests carry the trailer and only replies with a good tag count.
+bool useAuth = false;
+SipKey authKey;
+uint32_t authKeyId = 0;
+
+int64_t monotonicNs() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// A gateway's GETB for logical clients 1..batch.
+size_t buildBatch(char *buffer, size_t batch) {
+    SyncBatchHeader header{};
+    memcpy(header.cmd, "GETB", 4);
+    header.count = static_cast<uint16_t>(batch);
+    memcpy(buffer, &header, sizeof(header));
+    for (size_t i = 0; i < batch; i++) {
+        SyncBatchRequest entry{static_cast<uint16_t>(i + 1), 0, 0};
+        memcpy(buffer + syncBatchSize(i), &entry, sizeof(entry));
+    }
+    return syncBatchSize(batch);
+}
+
+bool sendRequest(LoadSocket &sock, const sockaddr_storage &serverAddr, socklen_t serverLen, bool ntp,
+                 size_t batch) {
+    char buffer[SYNC_BATCH_BYTES + SYNC_AUTH_BYTES];
+    size_t length;
+    sock.sentNs = monotonicNs();
+    if (batch > 0) {
+        length = buildBatch(buffer, batch);
+    } else if (ntp) {
+        length = strlen("GET");
+        memcpy(buffer, "GET", length);
+    } else {
+        GetSync request{};
+        strncpy(request.cmd, "GET", 3);
+        request.currentValue = 0;
+        length = sizeof(request);
+        memcpy(buffer, &request, length);
+    }
+    if (useAuth) {
+        length = signPacket(authKey, authKeyId, ++sock.authCounter, buffer, length);
+    }
+    sock.outstanding = sendto(sock.fd, buffer, length, 0, (sockaddr *) &serverAddr, serverLen) > 0;
+    return sock.outstanding;
+}
+
+// What a run is compared on: --save writes it, --baseline reads it back.
+struct RunSummary {
+    double throughput = 0; // client requests answered per second, each batch entry counted
+    int64_t p50Ns = 0;
+    int64_t p99Ns = 0;
+};
+
+bool saveSummary(const string &path, const RunSummary &summary) {
+    ofstream out(path);
+    out << summary.throughput << " " << summary.p50Ns << " " << summary.p99Ns << endl;
+    return static_cast<bool>(out);
+}
+
+bool loadSummary(const string &path, RunSummary &summary) {
+    ifstream in(path);
+    return static_cast<bool>(in >> summary.throughput >> summary.p50Ns >> summary.p99Ns);
+}
+
+double percentChange(double before, double after) {
+    return before != 0 ? (after - before) / before * 100 : 0;
+}
+
+void printGain(const RunSummary &baseline, const RunSummary &run) {
+    cout << "[GAIN] throughput " << fixed << setprecision(2)
+         << (baseline.throughput > 0 ? run.throughput / baseline.throughput : 0) << "x ("
+         << setprecision(0) << baseline.throughput << " -> " << run.throughput << " requests/s), p50 "
+         << showpos << setprecision(1) << percentChange(baseline.p50Ns, run.p50Ns) << "%, p99 "
+         << percentChange(baseline.p99Ns, run.p99Ns) << "%" << noshowpos << defaultfloat << setprecision(6)
+         << endl;
+}
+
+void printUsage(const char *name) {
+    cout << "Usage: " << name << " <server_IP> [--port N] [--protocol sync|ntp] [--sockets K]"
+         << " [--seconds S] [--timeout ms] [--batch N] [--key <id>:<32 hex digits>] [--save <file>]"
+         << " [--baseline <file>]" << endl;
+    cout << "  --batch sends ptp_server GETB datagrams for N logical clients per socket, as a gateway does."
+         << endl;
+    cout << "  --save keeps throughput and p50/p99 of this run; --baseline compares against a saved run,"
+         << endl;
+    cout << "  e.g. the same load against the server without --xdp." << endl;
+    cout << "  --key signs the requests for a ptp_server with --keys and counts only authenticated replies."
+         << endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    const char *serverIP = argv[1];
+    int port = 8080;
+    bool ntp = false;
+    int socketCount = 16;
+    double seconds = 10;
+    int timeoutMs = 1000;
+    string savePath;
+    string baselinePath;
+    size_t batch = 0;
+
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            printUsage(argv[0]);
+            return -1;
+        }
+        const char *value = argv[++i];
+        if (arg == "--port") {
+            port = atoi(value);
+        } else if (arg == "--protocol") {
+            ntp = string(value) == "ntp";
+        } else if (arg == "--sockets") {
+            socketCount = atoi(value);
+        } else if (arg == "--seconds") {
+            seconds = atof(value);
+        } else if (arg == "--timeout") {
+            timeoutMs = atoi(value);
+        } else if (arg == "--batch") {
+            batch = min(static_cast<size_t>(max(0, atoi(value))), SYNC_BATCH_MAX);
+        } else if (arg == "--key") {
+            if (!parseSyncKey(value, authKeyId, authKey)) {
+                cerr << "Key must be <id>:<32 hex digits>" << endl;
+                return -1;
+            }
+            useAuth = true;
+        } else if (arg == "--save") {
+            savePath = value;
+        } else if (arg == "--baseline") {
+            baselinePath = value;
+        } else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    RunSummary baseline;
+    if (!baselinePath.empty() && !loadSummary(baselinePath, baseline)) {
+        cerr << "Cannot read baseline " << baselinePath << endl;
+        return -1;
+    }
+
+    sockaddr_storage serverAddr{};
+    socklen_t serverLen = 0;
+    if (!resolveAddress(serverIP, static_cast<uint16_t>(port), serverAddr, serverLen)) {
+        cerr << "Invalid IP address" << endl;
+        return -1;
+    }
+
+    int epfd = epoll_create1(0);
+    vector<LoadSocket> sockets(socketCount);
+    for (int i = 0; i < socketCount; i++) {
+        sockets[i].fd = socket(serverAddr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        sockets[i].authCounter = initialSyncAuthCounter();
+        if (sockets[i].fd < 0) {
+            cerr << "Socket creation failed" << endl;
+            return -1;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u32 = static_cast<uint32_t>(i);
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sockets[i].fd, &ev);
+    }
+
+    cout << "Load: " << socketCount << " sockets, one " << (batch > 0 ? "batch" : "request") << " in flight each";
+    if (batch > 0) {
+        cout << " (" << batch << " logical clients)";
+    }
+    cout << ", " << seconds << " s against " << serverIP << ":" << port << endl;
+
+    LatencyHistogram rtt;
+    uint64_t sent = 0;
+    uint64_t forged = 0;
+    uint64_t timeouts = 0;
+    int64_t startNs = monotonicNs();
+    int64_t endNs = startNs + static_cast<int64_t>(seconds * 1e9);
+
+    for (LoadSocket &sock: sockets) {
+        if (sendRequest(sock, serverAddr, serverLen, ntp, batch)) sent++;
+    }
+
+    epoll_event events[64];
+    char buffer[SYNC_BATCH_BYTES + SYNC_AUTH_BYTES];
+    while (monotonicNs() < endNs) {
+        int n = epoll_wait(epfd, events, 64, 10);
+        int64_t nowNs = monotonicNs();
+
+        for (int i = 0; i < n; i++) {
+            LoadSocket &sock = sockets[events[i].data.u32];
+            ssize_t received;
+            while ((received = recv(sock.fd, buffer, sizeof(buffer), 0)) > 0) {
+                if (useAuth && verifyPacket(authKey, authKeyId, buffer, received) == 0) {
+                    forged++;
+                    continue;
+                }
+                if (sock.outstanding) {
+                    rtt.record(monotonicNs() - sock.sentNs);
+                    sock.outstanding = false;
+                }
+            }
+            if (!sock.outstanding && sendRequest(sock, serverAddr, serverLen, ntp, batch)) sent++;
+        }
+
+        for (LoadSocket &sock: sockets) {
+            if (sock.outstanding && nowNs - sock.sentNs > timeoutMs * 1000000LL) {
+                timeouts++;
+                if (sendRequest(sock, serverAddr, serverLen, ntp, batch)) sent++;
+            }
+        }
+    }
+
+    double elapsed = (monotonicNs() - startNs) / 1e9;
+    cout << "Sent " << sent << " requests, " << rtt.count() << " replies, " << timeouts << " timeouts";
+    if (useAuth) {
+        cout << ", " << forged << " unauthenticated replies dropped";
+    }
+    cout << endl;
+    size_t perReply = batch > 0 ? batch : 1;
+    cout << "Throughput: " << rtt.count() / elapsed << " replies/s";
+    if (batch > 0) {
+        cout << ", " << rtt.count() * perReply / elapsed << " client requests/s";
+    }
+    cout << endl;
+    rtt.print(cout, "Round-trip time");
+
+    RunSummary summary{rtt.count() * perReply / elapsed, rtt.percentile(0.5), rtt.percentile(0.99)};
+    if (!baselinePath.empty()) {
+        printGain(baseline, summary);
+    }
+    if (!savePath.empty() && !saveSummary(savePath, summary)) {
+        cerr << "Cannot write " << savePath << endl;
+    }
+
+    for (LoadSocket &sock: sockets) {
+        close(sock.fd);
+    }
+    close(epfd);
+    return 0;
+}
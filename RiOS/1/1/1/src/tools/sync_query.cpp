@@ -0,0 +1,135 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <climits>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "offset_store.h"
+
+using namespace std;
+
+struct ClientSummary {
+    uint64_t samples = 0;
+    int64_t firstNs = INT64_MAX;
+    int64_t lastNs = INT64_MIN;
+    double offsetSum = 0;
+    int64_t minOffset = INT64_MAX;
+    int64_t maxOffset = INT64_MIN;
+    double delaySum = 0;
+};
+
+string formatTime(int64_t ns) {
+    time_t seconds = static_cast<time_t>(ns / 1000000000LL);
+    tm utc{};
+    gmtime_r(&seconds, &utc);
+    char buffer[32];
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &utc);
+    return buffer;
+}
+
+void printUsage(const char *name) {
+    cout << "Usage: " << name << " <store_file> [--client ADDR:PORT] [--from UNIX_S] [--to UNIX_S]"
+         << " [--samples]" << endl;
+    cout << "  Without --samples prints one summary line per client; --samples prints CSV rows" << endl;
+    cout << "  time_ns,client,offset_ms,delay_ms." << endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    string storePath = argv[1];
+    string clientName;
+    int64_t fromNs = INT64_MIN;
+    int64_t toNs = INT64_MAX;
+    bool dumpSamples = false;
+
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--client" && i + 1 < argc) {
+            clientName = argv[++i];
+        } else if (arg == "--from" && i + 1 < argc) {
+            fromNs = static_cast<int64_t>(atof(argv[++i]) * 1e9);
+        } else if (arg == "--to" && i + 1 < argc) {
+            toNs = static_cast<int64_t>(atof(argv[++i]) * 1e9);
+        } else if (arg == "--samples") {
+            dumpSamples = true;
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    OffsetStoreReader store;
+    if (!store.open(storePath)) {
+        cerr << "Cannot read offset store " << storePath << endl;
+        return 1;
+    }
+
+    const OffsetStoreHeader &header = store.header();
+    double offsetScale = header.offsetUnitNs / 1e6;
+    double delayScale = header.delayUnitNs / 1e6;
+
+    // The key is found by its printed form among the block headers, so the
+    // query itself compares fixed-size keys only.
+    ClientKey key{};
+    bool haveKey = false;
+    uint64_t storedSamples = 0;
+    for (size_t i = 0; i < store.blockCount(); i++) {
+        storedSamples += store.block(i).count;
+        if (!haveKey && !clientName.empty() && formatClientKey(store.block(i).key) == clientName) {
+            key = store.block(i).key;
+            haveKey = true;
+        }
+    }
+    if (!clientName.empty() && !haveKey) {
+        cerr << "No samples for client " << clientName << endl;
+        return 1;
+    }
+
+    cout << "[QUERY] " << store.blockCount() << " blocks, " << storedSamples << " samples, " << fixed
+         << setprecision(2) << (storedSamples > 0 ? static_cast<double>(store.fileSize()) / storedSamples : 0)
+         << " bytes/sample" << defaultfloat << setprecision(6) << endl;
+
+    vector<OffsetSample> samples;
+    store.query(haveKey ? &key : nullptr, fromNs, toNs, samples);
+
+    if (dumpSamples) {
+        cout << "time_ns,client,offset_ms,delay_ms" << endl;
+        for (const OffsetSample &sample: samples) {
+            cout << sample.timeNs << "," << sample.key << "," << sample.offset * offsetScale << ","
+                 << sample.delay * delayScale << "\n";
+        }
+        cout << flush;
+        return 0;
+    }
+
+    map<string, ClientSummary> clients;
+    for (const OffsetSample &sample: samples) {
+        ClientSummary &summary = clients[formatClientKey(sample.key)];
+        summary.samples++;
+        summary.firstNs = min(summary.firstNs, sample.timeNs);
+        summary.lastNs = max(summary.lastNs, sample.timeNs);
+        summary.offsetSum += sample.offset;
+        summary.minOffset = min(summary.minOffset, sample.offset);
+        summary.maxOffset = max(summary.maxOffset, sample.offset);
+        summary.delaySum += sample.delay;
+    }
+
+    cout << fixed << setprecision(3);
+    for (const auto &entry: clients) {
+        const ClientSummary &summary = entry.second;
+        cout << entry.first << ": " << summary.samples << " samples, " << formatTime(summary.firstNs)
+             << " .. " << formatTime(summary.lastNs) << " UTC, offset mean "
+             << summary.offsetSum / summary.samples * offsetScale << " ms (min "
+             << summary.minOffset * offsetScale << " / max " << summary.maxOffset * offsetScale
+             << "), delay mean " << summary.delaySum / summary.samples * delayScale << " ms" << endl;
+    }
+    cout << "[QUERY] " << samples.size() << " samples from " << clients.size() << " clients" << endl;
+    return 0;
+}
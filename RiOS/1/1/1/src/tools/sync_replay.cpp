@@ -0,0 +1,236 @@
+#include <iostream>
+#include <cstring>
+#include <ctime>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "sync_trace.h"
+#include "correction_filter.h"
+
+using namespace std;
+
+struct ClientTrace {
+    vector<const TraceRecord *> records;
+};
+
+struct ReplayResult {
+    uint64_t samples = 0;
+    uint64_t mismatches = 0;
+    double errorSum = 0;
+    double errorSquares = 0;
+    double maxError = 0;
+    int64_t cpuNs = 0;
+    vector<double> absErrors;
+};
+
+int64_t threadCpuNs() {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// Raw correction referred to the kernel receive time of the request instead of
+// the moment the server got around to computing it.
+double kernelCorrection(const TraceRecord &rec) {
+    return rec.rawCorrection - (rec.txNs - rec.rxNs) / 1e6;
+}
+
+// Non-causal reference: centered median of the kernel-referenced corrections.
+// A live filter cannot see the future, so this is the best it could do.
+vector<double> referenceCorrections(const ClientTrace &client, int halfWindow) {
+    size_t n = client.records.size();
+    vector<double> kernel(n);
+    for (size_t i = 0; i < n; i++) {
+        kernel[i] = kernelCorrection(*client.records[i]);
+    }
+
+    vector<double> reference(n);
+    vector<double> window;
+    for (size_t i = 0; i < n; i++) {
+        size_t from = i >= static_cast<size_t>(halfWindow) ? i - halfWindow : 0;
+        size_t to = min(n, i + halfWindow + 1);
+        window.assign(kernel.begin() + from, kernel.begin() + to);
+        nth_element(window.begin(), window.begin() + window.size() / 2, window.end());
+        reference[i] = window[window.size() / 2];
+    }
+    return reference;
+}
+
+void replayClients(const vector<ClientTrace> &clients, atomic<size_t> &nextClient,
+                   const string &filterName, const FilterParams &params, int halfWindow,
+                   ReplayResult &result) {
+    vector<int> outputs;
+
+    while (true) {
+        size_t index = nextClient.fetch_add(1);
+        if (index >= clients.size()) break;
+
+        const ClientTrace &client = clients[index];
+        unique_ptr<CorrectionFilter> filter = makeCorrectionFilter(filterName, params);
+
+        outputs.resize(client.records.size());
+        int64_t cpuStart = threadCpuNs();
+        for (size_t i = 0; i < client.records.size(); i++) {
+            outputs[i] = filter->apply(client.records[i]->rawCorrection);
+        }
+        result.cpuNs += threadCpuNs() - cpuStart;
+
+        vector<double> reference = referenceCorrections(client, halfWindow);
+        for (size_t i = 0; i < outputs.size(); i++) {
+            double error = outputs[i] - reference[i];
+            result.samples++;
+            result.errorSum += error;
+            result.errorSquares += error * error;
+            result.maxError = max(result.maxError, fabs(error));
+            result.absErrors.push_back(fabs(error));
+            if (outputs[i] != client.records[i]->correction) {
+                result.mismatches++;
+            }
+        }
+    }
+}
+
+void printUsage(const char *name) {
+    cout << "Usage: " << name << " <trace_file> [--filter raw|advanced] [--window N]"
+         << " [--threshold X] [--alpha A] [--threads N] [--reference N]" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    string tracePath = argv[1];
+    string filterName = "advanced";
+    FilterParams params;
+    int threads = static_cast<int>(thread::hardware_concurrency());
+    int halfWindow = 5;
+
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            printUsage(argv[0]);
+            return -1;
+        }
+        if (arg == "--filter") {
+            filterName = argv[++i];
+        } else if (arg == "--window") {
+            params.historyWindow = atoi(argv[++i]);
+        } else if (arg == "--threshold") {
+            params.outlierThreshold = atof(argv[++i]);
+        } else if (arg == "--alpha") {
+            params.alpha = atof(argv[++i]);
+        } else if (arg == "--threads") {
+            threads = atoi(argv[++i]);
+        } else if (arg == "--reference") {
+            halfWindow = atoi(argv[++i]);
+        } else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (!makeCorrectionFilter(filterName, params)) {
+        cerr << "Unknown filter: " << filterName << endl;
+        return -1;
+    }
+    threads = max(1, threads);
+
+    vector<TraceRecord> records;
+    if (!readTrace(tracePath, records)) {
+        cerr << "Cannot read trace " << tracePath << endl;
+        return -1;
+    }
+
+    // Server records carry the filter input; a client-only trace is replayed
+    // from the corrections the client received.
+    bool haveServer = any_of(records.begin(), records.end(),
+                             [](const TraceRecord &rec) { return rec.source == TRACE_SERVER; });
+    uint8_t source = haveServer ? TRACE_SERVER : TRACE_CLIENT;
+
+    map<pair<string, uint16_t>, size_t> index;
+    vector<ClientTrace> clients;
+    int64_t firstNs = INT64_MAX;
+    int64_t lastNs = INT64_MIN;
+
+    for (const TraceRecord &rec: records) {
+        if (rec.source != source) continue;
+
+        auto key = make_pair(string(reinterpret_cast<const char *>(rec.address), 16), rec.port);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            it = index.emplace(key, clients.size()).first;
+            clients.emplace_back();
+        }
+        clients[it->second].records.push_back(&rec);
+        firstNs = min(firstNs, rec.rxNs);
+        lastNs = max(lastNs, rec.rxNs);
+    }
+
+    for (ClientTrace &client: clients) {
+        stable_sort(client.records.begin(), client.records.end(),
+                    [](const TraceRecord *a, const TraceRecord *b) { return a->rxNs < b->rxNs; });
+    }
+
+    cout << "[REPLAY] " << records.size() << " records, " << clients.size() << " clients, filter "
+         << filterName << " (window " << params.historyWindow << ", threshold "
+         << params.outlierThreshold << ", alpha " << params.alpha << "), " << threads << " threads" << endl;
+
+    vector<ReplayResult> results(threads);
+    vector<thread> workers;
+    atomic<size_t> nextClient(0);
+
+    auto wallStart = chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back(replayClients, cref(clients), ref(nextClient), cref(filterName),
+                             cref(params), halfWindow, ref(results[t]));
+    }
+    for (thread &worker: workers) {
+        worker.join();
+    }
+    double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+
+    ReplayResult total;
+    for (ReplayResult &result: results) {
+        total.samples += result.samples;
+        total.mismatches += result.mismatches;
+        total.errorSum += result.errorSum;
+        total.errorSquares += result.errorSquares;
+        total.maxError = max(total.maxError, result.maxError);
+        total.cpuNs += result.cpuNs;
+        total.absErrors.insert(total.absErrors.end(), result.absErrors.begin(), result.absErrors.end());
+    }
+
+    if (total.samples == 0) {
+        cout << "[REPLAY] No samples" << endl;
+        return 0;
+    }
+
+    sort(total.absErrors.begin(), total.absErrors.end());
+    double p50 = total.absErrors[total.absErrors.size() / 2];
+    double p99 = total.absErrors[min(total.absErrors.size() - 1, total.absErrors.size() * 99 / 100)];
+    double spanSeconds = (lastNs - firstNs) / 1e9;
+
+    cout << "========================================" << endl;
+    cout << "OFFSET ERROR vs. reference (ms):" << endl;
+    cout << "  Mean: " << total.errorSum / total.samples << endl;
+    cout << "  RMS: " << sqrt(total.errorSquares / total.samples) << endl;
+    cout << "  |err| p50: " << p50 << "  p99: " << p99 << "  max: " << total.maxError << endl;
+    cout << "  Differs from recorded correction: " << total.mismatches << " of " << total.samples << endl;
+    cout << "----------------------------------------" << endl;
+    cout << "COST:" << endl;
+    cout << "  Filter CPU per sample: " << static_cast<double>(total.cpuNs) / total.samples << " ns" << endl;
+    cout << "  Wall time: " << wallSeconds << " s for " << spanSeconds << " s of traffic";
+    if (wallSeconds > 0) {
+        cout << " (" << spanSeconds / wallSeconds << "x real time)";
+    }
+    cout << endl;
+    cout << "========================================" << endl;
+    return 0;
+}
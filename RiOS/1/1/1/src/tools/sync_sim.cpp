@@ -0,0 +1,432 @@
+#include <iostream>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include "sim_network.h"
+#include "correction_filter.h"
+
+using namespace std;
+
+enum class SimMode {
+    Client, // client/ptp_client against server/ptp_server
+    Ntp     // ntp_time_client against an ideal ntp_time_server
+};
+
+struct SimConfig {
+    SimMode mode = SimMode::Client;
+    string filter = "advanced";
+    FilterParams params;
+    int clients = 1000;
+    double hours = 24;
+    int periodMs = 10000;
+    int timeoutMs = 2000;
+    LinkModel link;
+    double clientDriftPpm = 20;
+    double serverDriftPpm = 0;
+    double initialOffsetMs = 500;
+    double toleranceMs = 1;
+    int warmupPolls = 10;
+    uint64_t seed = 1;
+    int threads = 1;
+};
+
+struct SimClient {
+    SimClock clock;
+    SimLink link;
+    unique_ptr<CorrectionFilter> serverFilter;
+
+    bool waiting = false;
+    uint64_t pollId = 0;
+    deque<int64_t> socketQueue;
+    int64_t pollLocalMs = 0;
+
+    // client.cpp
+    int currentTime = 0;
+    int requestCount = 0;
+
+    // ntp_time_client.cpp
+    vector<int64_t> corrections;
+    int64_t appliedCorrection = 0;
+    int syncCount = 0;
+
+    int64_t lastOutOfToleranceNs = 0;
+    double lastError = 0;
+
+    SimClient(const SimClock &clock, const SimLink &link) : clock(clock), link(link) {}
+};
+
+// |error| histogram with 10 us buckets up to 10 s.
+const int HISTOGRAM_BUCKETS = 1000000;
+const double BUCKET_MS = 0.01;
+
+struct SimResult {
+    uint64_t samples = 0;
+    uint64_t requests = 0;
+    uint64_t lost = 0;
+    uint64_t timeouts = 0;
+    uint64_t staleReplies = 0;
+    uint64_t events = 0;
+    double errorSum = 0;
+    double errorSquares = 0;
+    double maxError = 0;
+    vector<uint32_t> histogram;
+    int converged = 0;
+    double convergenceSum = 0;
+    double convergenceMax = 0;
+};
+
+class SimWorker {
+public:
+    SimWorker(const SimConfig &config, int index, SimResult &result)
+            : config(config), index(index), result(result),
+              serverClock(config.serverDriftPpm, 0) {}
+
+    void run() {
+        result.histogram.assign(HISTOGRAM_BUCKETS + 1, 0);
+        endNs = static_cast<int64_t>(config.hours * 3600e9);
+
+        for (int id = index; id < config.clients; id += config.threads) {
+            uint64_t seed = config.seed * 0x9E3779B97F4A7C15ULL + static_cast<uint64_t>(id);
+            SimLink link(config.link, seed);
+            double drift = link.uniform(-config.clientDriftPpm, config.clientDriftPpm);
+            double offsetMs = link.uniform(-config.initialOffsetMs, config.initialOffsetMs);
+            int64_t startNs = static_cast<int64_t>(link.uniform(0, config.periodMs * 1e6));
+
+            clients.emplace_back(SimClock(drift, static_cast<int64_t>(offsetMs * 1e6)), link);
+            clients.back().serverFilter = makeCorrectionFilter(config.filter, config.params);
+            queue.push(startNs, static_cast<uint32_t>(clients.size() - 1), SIM_POLL);
+        }
+
+        SimEvent event{};
+        while (queue.pop(event) && event.timeNs <= endNs) {
+            result.events++;
+            SimClient &client = clients[event.client];
+            switch (event.type) {
+                case SIM_POLL:
+                    poll(client, event);
+                    break;
+                case SIM_REQUEST_ARRIVE:
+                    serve(client, event);
+                    break;
+                case SIM_REPLY_ARRIVE:
+                    if (client.waiting) {
+                        client.waiting = false;
+                        complete(client, event.timeNs, event.value);
+                    } else {
+                        client.socketQueue.push_back(event.value);
+                    }
+                    break;
+                case SIM_TIMEOUT:
+                    if (client.waiting && static_cast<uint64_t>(event.value) == client.pollId) {
+                        client.waiting = false;
+                        result.timeouts++;
+                        fail(client, event.timeNs);
+                    }
+                    break;
+            }
+        }
+
+        for (SimClient &client: clients) {
+            if (fabs(client.lastError) <= config.toleranceMs) {
+                double seconds = client.lastOutOfToleranceNs / 1e9;
+                result.converged++;
+                result.convergenceSum += seconds;
+                result.convergenceMax = max(result.convergenceMax, seconds);
+            }
+        }
+    }
+
+private:
+    int64_t serverMs(int64_t trueNs) const {
+        return serverClock.localNs(trueNs) / 1000000;
+    }
+
+    int64_t localMs(const SimClient &client, int64_t trueNs) const {
+        return client.clock.localNs(trueNs) / 1000000;
+    }
+
+    void sample(SimClient &client, int64_t trueNs) {
+        double error;
+        if (config.mode == SimMode::Client) {
+            error = client.currentTime - serverClock.localNs(trueNs) / 1e6;
+        } else {
+            error = (client.clock.localNs(trueNs) / 1e6 + client.appliedCorrection) -
+                    serverClock.localNs(trueNs) / 1e6;
+        }
+
+        client.lastError = error;
+        if (fabs(error) > config.toleranceMs) {
+            client.lastOutOfToleranceNs = trueNs;
+        }
+
+        int polls = config.mode == SimMode::Client ? client.requestCount : client.syncCount;
+        if (polls < config.warmupPolls) {
+            return;
+        }
+
+        double absError = fabs(error);
+        result.samples++;
+        result.errorSum += error;
+        result.errorSquares += error * error;
+        result.maxError = max(result.maxError, absError);
+        result.histogram[static_cast<int>(min<double>(HISTOGRAM_BUCKETS, absError / BUCKET_MS))]++;
+    }
+
+    void poll(SimClient &client, const SimEvent &event) {
+        if (config.mode == SimMode::Client && client.requestCount > 0) {
+            client.currentTime += config.periodMs;
+        }
+        sample(client, event.timeNs);
+
+        if (config.mode == SimMode::Client) {
+            client.requestCount++;
+        }
+        client.pollId++;
+        client.pollLocalMs = localMs(client, event.timeNs);
+        result.requests++;
+
+        int64_t uplinkNs = 0;
+        if (client.link.transit(true, uplinkNs)) {
+            queue.push(event.timeNs + uplinkNs, event.client, SIM_REQUEST_ARRIVE, client.currentTime);
+        } else {
+            result.lost++;
+        }
+
+        // No sequence numbers on the wire: a reply that arrived after an
+        // earlier timeout is read as the answer to this request.
+        if (!client.socketQueue.empty()) {
+            int64_t stale = client.socketQueue.front();
+            client.socketQueue.pop_front();
+            result.staleReplies++;
+            complete(client, event.timeNs, stale);
+            return;
+        }
+
+        client.waiting = true;
+        queue.push(event.timeNs + client.clock.trueDurationNs(config.timeoutMs * 1000000LL),
+                   event.client, SIM_TIMEOUT, static_cast<int64_t>(client.pollId));
+    }
+
+    void serve(SimClient &client, const SimEvent &event) {
+        int64_t reply;
+        if (config.mode == SimMode::Client) {
+            int rawCorrection = static_cast<int>(serverMs(event.timeNs) - event.value);
+            reply = client.serverFilter->apply(rawCorrection);
+        } else {
+            reply = serverMs(event.timeNs);
+        }
+
+        int64_t downlinkNs = 0;
+        if (client.link.transit(false, downlinkNs)) {
+            queue.push(event.timeNs + downlinkNs, event.client, SIM_REPLY_ARRIVE, reply);
+        } else {
+            result.lost++;
+        }
+    }
+
+    void complete(SimClient &client, int64_t trueNs, int64_t reply) {
+        if (config.mode == SimMode::Client) {
+            client.currentTime += static_cast<int>(reply);
+        } else {
+            int64_t localAfter = localMs(client, trueNs);
+            int64_t networkDelay = (localAfter - client.pollLocalMs) / 2;
+            int64_t correction = (reply + networkDelay) - localAfter;
+            client.corrections.push_back(correction);
+
+            client.appliedCorrection = client.corrections.size() >= 3
+                                       ? correctionMedian(client.corrections) : correction;
+            client.syncCount++;
+            if (client.syncCount % 10 == 0) {
+                client.corrections.clear();
+            }
+        }
+        scheduleNext(client, trueNs);
+    }
+
+    void fail(SimClient &client, int64_t trueNs) {
+        if (config.mode == SimMode::Ntp) {
+            client.appliedCorrection = 0;
+        }
+        scheduleNext(client, trueNs);
+    }
+
+    void scheduleNext(SimClient &client, int64_t trueNs) {
+        uint32_t id = static_cast<uint32_t>(&client - clients.data());
+        queue.push(trueNs + client.clock.trueDurationNs(config.periodMs * 1000000LL), id, SIM_POLL);
+    }
+
+    const SimConfig &config;
+    int index;
+    SimResult &result;
+    SimClock serverClock;
+    SimEventQueue queue;
+    vector<SimClient> clients;
+    int64_t endNs = 0;
+};
+
+double percentile(const vector<uint32_t> &histogram, uint64_t samples, double fraction) {
+    uint64_t target = static_cast<uint64_t>(samples * fraction);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < histogram.size(); i++) {
+        seen += histogram[i];
+        if (seen > target) {
+            return (i + 1) * BUCKET_MS;
+        }
+    }
+    return histogram.size() * BUCKET_MS;
+}
+
+void printUsage(const char *name) {
+    cout << "Usage: " << name << " [--mode client|ntp] [--filter raw|advanced] [--clients N]"
+         << " [--hours H] [--period ms] [--timeout ms] [--delay ms] [--jitter ms] [--asymmetry ms]"
+         << " [--loss p] [--reorder p] [--drift ppm] [--server-drift ppm] [--offset ms]"
+         << " [--window N] [--threshold X] [--alpha A] [--tolerance ms] [--warmup polls]"
+         << " [--seed S] [--threads N]" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    SimConfig config;
+    config.threads = max(1, static_cast<int>(thread::hardware_concurrency()));
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            printUsage(argv[0]);
+            return -1;
+        }
+        const char *value = argv[++i];
+
+        if (arg == "--mode") {
+            string mode = value;
+            if (mode != "client" && mode != "ntp") {
+                printUsage(argv[0]);
+                return -1;
+            }
+            config.mode = mode == "ntp" ? SimMode::Ntp : SimMode::Client;
+        } else if (arg == "--filter") {
+            config.filter = value;
+        } else if (arg == "--clients") {
+            config.clients = atoi(value);
+        } else if (arg == "--hours") {
+            config.hours = atof(value);
+        } else if (arg == "--period") {
+            config.periodMs = atoi(value);
+        } else if (arg == "--timeout") {
+            config.timeoutMs = atoi(value);
+        } else if (arg == "--delay") {
+            config.link.delayMs = atof(value);
+        } else if (arg == "--jitter") {
+            config.link.jitterMs = atof(value);
+        } else if (arg == "--asymmetry") {
+            config.link.asymmetryMs = atof(value);
+        } else if (arg == "--loss") {
+            config.link.lossRate = atof(value);
+        } else if (arg == "--reorder") {
+            config.link.reorderRate = atof(value);
+        } else if (arg == "--drift") {
+            config.clientDriftPpm = atof(value);
+        } else if (arg == "--server-drift") {
+            config.serverDriftPpm = atof(value);
+        } else if (arg == "--offset") {
+            config.initialOffsetMs = atof(value);
+        } else if (arg == "--window") {
+            config.params.historyWindow = atoi(value);
+        } else if (arg == "--threshold") {
+            config.params.outlierThreshold = atof(value);
+        } else if (arg == "--alpha") {
+            config.params.alpha = atof(value);
+        } else if (arg == "--tolerance") {
+            config.toleranceMs = atof(value);
+        } else if (arg == "--warmup") {
+            config.warmupPolls = atoi(value);
+        } else if (arg == "--seed") {
+            config.seed = strtoull(value, nullptr, 10);
+        } else if (arg == "--threads") {
+            config.threads = max(1, atoi(value));
+        } else {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (config.clients <= 0 || config.periodMs <= 0 || config.hours <= 0 ||
+        !makeCorrectionFilter(config.filter, config.params)) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    config.threads = min(config.threads, config.clients);
+
+    cout << "[SIM] " << config.clients << " clients, " << config.hours << " h, period "
+         << config.periodMs << " ms, mode " << (config.mode == SimMode::Client ? "client" : "ntp")
+         << ", server filter " << config.filter << ", " << config.threads << " threads" << endl;
+    cout << "[SIM] link: delay " << config.link.delayMs << " ms, jitter " << config.link.jitterMs
+         << " ms, asymmetry " << config.link.asymmetryMs << " ms, loss " << config.link.lossRate
+         << ", reorder " << config.link.reorderRate << ", drift +-" << config.clientDriftPpm << " ppm" << endl;
+
+    vector<SimResult> results(config.threads);
+    vector<thread> workers;
+
+    auto wallStart = chrono::steady_clock::now();
+    for (int t = 0; t < config.threads; t++) {
+        workers.emplace_back([&config, &results, t]() {
+            SimWorker worker(config, t, results[t]);
+            worker.run();
+        });
+    }
+    for (thread &worker: workers) {
+        worker.join();
+    }
+    double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+
+    SimResult total;
+    total.histogram.assign(HISTOGRAM_BUCKETS + 1, 0);
+    for (const SimResult &result: results) {
+        total.samples += result.samples;
+        total.requests += result.requests;
+        total.lost += result.lost;
+        total.timeouts += result.timeouts;
+        total.staleReplies += result.staleReplies;
+        total.events += result.events;
+        total.errorSum += result.errorSum;
+        total.errorSquares += result.errorSquares;
+        total.maxError = max(total.maxError, result.maxError);
+        total.converged += result.converged;
+        total.convergenceSum += result.convergenceSum;
+        total.convergenceMax = max(total.convergenceMax, result.convergenceMax);
+        for (size_t i = 0; i < total.histogram.size(); i++) {
+            total.histogram[i] += result.histogram[i];
+        }
+    }
+
+    cout << "========================================" << endl;
+    cout << "[SIM] Events: " << total.events << " in " << wallSeconds << " s ("
+         << config.hours * 3600 / wallSeconds << "x real time)" << endl;
+    cout << "  Requests: " << total.requests << " | Lost packets: " << total.lost
+         << " | Timeouts: " << total.timeouts << " | Stale replies used: " << total.staleReplies << endl;
+    cout << "----------------------------------------" << endl;
+    if (total.samples == 0) {
+        cout << "OFFSET ERROR: no samples after warm-up" << endl;
+    } else {
+        cout << "OFFSET ERROR (ms), " << total.samples << " samples after warm-up:" << endl;
+        cout << "  Mean: " << total.errorSum / total.samples << endl;
+        cout << "  RMS: " << sqrt(total.errorSquares / total.samples) << endl;
+        cout << "  |err| p50: " << percentile(total.histogram, total.samples, 0.5)
+             << "  p99: " << percentile(total.histogram, total.samples, 0.99)
+             << "  p99.9: " << percentile(total.histogram, total.samples, 0.999)
+             << "  max: " << total.maxError << endl;
+    }
+    cout << "  Within +-" << config.toleranceMs << " ms at end: " << total.converged << " of "
+         << config.clients << " clients";
+    if (total.converged > 0) {
+        cout << " (settled after " << total.convergenceSum / total.converged << " s on average, "
+             << total.convergenceMax << " s worst)";
+    }
+    cout << endl;
+    cout << "========================================" << endl;
+    return 0;
+}
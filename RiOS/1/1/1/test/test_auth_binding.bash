@@ -0,0 +1,97 @@
+#!/bin/bash
+
+# Two clients with their own keys, 7 (A) and 8 (B). B sends from A's address,
+# as a spoofer would, and A's own packets are replayed; the server must keep
+# answering A and nobody else on that address. Runs against server and
+# ptp_server, the latter with per-worker and shared client tables.
+
+KEYS=/tmp/auth_binding_keys.txt
+SCRIPT=/tmp/auth_binding.py
+
+cat > $KEYS <<EOF
+7 000102030405060708090a0b0c0d0e0f
+8 0f0e0d0c0b0a09080706050403020100
+EOF
+
+cat > $SCRIPT <<'EOF'
+import socket, struct, sys
+
+MASK = (1 << 64) - 1
+
+def rotl(x, b):
+    return ((x << b) | (x >> (64 - b))) & MASK
+
+def siphash24(key, data):
+    k0, k1 = struct.unpack('<QQ', key)
+    v = [k0 ^ 0x736f6d6570736575, k1 ^ 0x646f72616e646f6d, k0 ^ 0x6c7967656e657261, k1 ^ 0x7465646279746573]
+
+    def rounds(n):
+        for _ in range(n):
+            v[0] = (v[0] + v[1]) & MASK; v[1] = rotl(v[1], 13) ^ v[0]; v[0] = rotl(v[0], 32)
+            v[2] = (v[2] + v[3]) & MASK; v[3] = rotl(v[3], 16) ^ v[2]
+            v[0] = (v[0] + v[3]) & MASK; v[3] = rotl(v[3], 21) ^ v[0]
+            v[2] = (v[2] + v[1]) & MASK; v[1] = rotl(v[1], 17) ^ v[2]; v[2] = rotl(v[2], 32)
+
+    tail = len(data) & ~7
+    words = [struct.unpack_from('<Q', data, i)[0] for i in range(0, tail, 8)]
+    words.append(int.from_bytes(data[tail:], 'little') | (len(data) & 0xff) << 56)
+    for m in words:
+        v[3] ^= m
+        rounds(2)
+        v[0] ^= m
+    v[2] ^= 0xff
+    rounds(4)
+    return v[0] ^ v[1] ^ v[2] ^ v[3]
+
+KEYS = {7: bytes(range(16)), 8: bytes(reversed(range(16)))}
+
+def packet(cmd, sequence, keyId, counter):
+    plain = struct.pack('<4siI', cmd, 0, sequence) + struct.pack('<II', keyId, counter)
+    return plain + struct.pack('<Q', siphash24(KEYS[keyId], plain))
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.bind(('127.0.0.1', 0))
+sock.settimeout(0.3)
+failures = 0
+
+def expect(name, data, answered):
+    global failures
+    sock.sendto(data, ('127.0.0.1', 8080))
+    try:
+        got = sock.recv(64)[:4] == b'SYNC'
+    except socket.timeout:
+        got = False
+    ok = got == answered
+    failures += not ok
+    print('  %-44s %s' % (name, 'ok' if ok else 'FAILED (%s)' % ('answered' if got else 'no reply')))
+
+first = packet(b'GET\0', 1, 7, 1000)
+disc = packet(b'DISC', 0, 7, 1003)
+expect('A: GET', first, True)
+expect('B from A\'s address: GET', packet(b'GET\0', 2, 8, 5000), False)
+expect('B from A\'s address: DISC', packet(b'DISC', 0, 8, 5001), False)
+expect('A: GET after B\'s DISC', packet(b'GET\0', 3, 7, 1001), True)
+expect('A: first GET replayed', first, False)
+expect('A: GET with a fresh counter', packet(b'GET\0', 4, 7, 1004), True)
+expect('A: older DISC replayed', disc, False)
+expect('A: GET after the DISC replay', packet(b'GET\0', 5, 7, 1005), True)
+sys.exit(1 if failures else 0)
+EOF
+
+status=0
+run() {
+    echo "--- $* ---"
+    "$@" > /tmp/auth_binding_server.log &
+    sleep 0.5
+    python3 $SCRIPT || status=1
+    kill -INT $!
+    wait
+    grep -h "AUTH\] [0-9]\|rejected" /tmp/auth_binding_server.log
+}
+
+run ./bin/server --keys $KEYS
+run ./bin/ptp_server --report 1 --keys $KEYS
+run ./bin/ptp_server --report 1 --keys $KEYS --shared-socket --workers 2
+
+rm -f $KEYS $SCRIPT /tmp/auth_binding_server.log
+exit $status
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+# Runs the same load against ptp_server without and with --keys, singly and
+# as 32-entry gateway batches, and prints what authentication costs.
+
+KEYS=/tmp/auth_keys.txt
+KEY=7:000102030405060708090a0b0c0d0e0f
+
+echo "7 000102030405060708090a0b0c0d0e0f" > $KEYS
+
+./bin/auth_bench 1000 || exit 1
+
+for batch in 0 32; do
+    echo "--- plain, batch $batch ---"
+    ./bin/ptp_server --report 60 > /dev/null &
+    sleep 0.5
+    ./bin/sync_load 127.0.0.1 --batch $batch --seconds 5 --save /tmp/auth_baseline.txt
+    kill -INT $!
+    wait
+
+    echo "--- authenticated, batch $batch ---"
+    ./bin/ptp_server --report 60 --keys $KEYS > /dev/null &
+    sleep 0.5
+    ./bin/sync_load 127.0.0.1 --batch $batch --seconds 5 --key $KEY --baseline /tmp/auth_baseline.txt
+    kill -INT $!
+    wait
+done
+
+rm -f $KEYS /tmp/auth_baseline.txt
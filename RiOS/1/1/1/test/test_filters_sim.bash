@@ -0,0 +1,13 @@
+#!/bin/bash
+
+echo "Comparing server filters on a simulated network..."
+
+for filter in raw advanced; do
+    echo "--- filter: $filter ---"
+    ./bin/sync_sim --filter $filter --clients 1000 --hours 24 --period 10000 \
+        --delay 2 --jitter 1 --asymmetry 0.5 --loss 0.01 --reorder 0.01 --drift 50
+done
+
+echo "--- ntp_time_client median logic ---"
+./bin/sync_sim --mode ntp --clients 1000 --hours 24 --period 10000 \
+    --delay 2 --jitter 1 --loss 0.01 --drift 50
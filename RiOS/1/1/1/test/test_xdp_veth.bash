@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# Needs root: puts the load generator in a network namespace behind a veth
+# pair and runs ptp_server on the host end, first through the kernel, then
+# with --xdp in generic mode.
+
+NS=xdp_load
+HOST_IF=xdp_host
+PEER_IF=xdp_peer
+
+ip netns add $NS
+ip link add $HOST_IF type veth peer name $PEER_IF
+ip link set $PEER_IF netns $NS
+ip addr add 10.77.0.1/24 dev $HOST_IF
+ip link set $HOST_IF up
+ip netns exec $NS ip addr add 10.77.0.2/24 dev $PEER_IF
+ip netns exec $NS ip link set $PEER_IF up
+
+echo "--- kernel UDP path ---"
+./bin/ptp_server --report 60 > /dev/null &
+sleep 0.5
+ip netns exec $NS ./bin/sync_load 10.77.0.1 --sockets 16 --seconds 5 --save /tmp/xdp_baseline.txt
+kill -INT $!
+wait
+
+echo "--- AF_XDP, generic mode ---"
+./bin/ptp_server --report 60 --xdp $HOST_IF &
+sleep 0.5
+ip netns exec $NS ./bin/sync_load 10.77.0.1 --sockets 16 --seconds 5 --baseline /tmp/xdp_baseline.txt
+kill -INT $!
+wait
+
+ip link del $HOST_IF
+ip netns del $NS